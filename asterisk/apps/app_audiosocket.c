@@ -38,12 +38,12 @@
 #include "asterisk/module.h"
 #include "asterisk/channel.h"
 #include "asterisk/app.h"
+#include "asterisk/dsp.h"
 #include "asterisk/res_audiosocket.h"
 #include "asterisk/utils.h"
 #include "asterisk/format_cache.h"
 
 #define AST_MODULE "app_audiosocket"
-#define AUDIOSOCKET_CONFIG "audiosocket.conf"
 #define MAX_CONNECT_TIMEOUT_MSEC 2000
 
 /*** DOCUMENTATION
@@ -57,10 +57,54 @@
 			</parameter>
 			<parameter name="service" required="true">
 				<para>Service is the name or IP address and port number of the audio socket service to which this call should be connected.  This should be in the form host:port, such as myserver:9019 </para>
+				<para>Up to 9 services may be given, separated by <literal>&amp;</literal>, such as <literal>asr:9019&amp;recorder:9019</literal>.  The channel's audio is sent to all of them, prepared once and written to each socket, but only the first service sends audio back to the channel; whatever the others send is discarded.  The call ends with the first service, while another which can not be reached, fails or hangs up is dropped and the call continues.</para>
+			</parameter>
+			<parameter name="options">
+				<optionlist>
+					<option name="c">
+						<argument name="codec" required="true" />
+						<para>Exchange audio with the service in the given codec instead of 8kHz signed linear.  The supported codecs are <literal>slin</literal>, <literal>slin16</literal>, <literal>slin24</literal>, <literal>slin48</literal>, <literal>ulaw</literal>, <literal>alaw</literal> and <literal>opus</literal>.</para>
+					</option>
+					<option name="n">
+						<para>Exchange audio with the service as signed linear at the sample rate of the channel's native format, or the closest lower rate which is supported, so that audio is not resampled.</para>
+					</option>
+					<option name="b">
+						<argument name="frames" required="true" />
+						<argument name="delay" />
+						<para>Combine this many voice frames from the channel into each message sent to the service, for services which prefer fewer, larger messages over low latency.  A partial batch is sent once its oldest frame has waited <replaceable>delay</replaceable> milliseconds, which defaults to 20 milliseconds per frame, and when the call ends.</para>
+					</option>
+					<option name="p">
+						<para>Pass the channel's native format through to the service without transcoding if it is one of the supported codecs.  Otherwise, signed linear is used as if this option was not given.</para>
+					</option>
+					<option name="m">
+						<para>Carry the call as one stream of a persistent connection to the service which is shared with other calls using this option, instead of opening a connection for this call alone.  The service must support multiplexed connections.</para>
+					</option>
+					<option name="j">
+						<argument name="min" required="true" />
+						<argument name="max" />
+						<para>Play the audio received from the service out of an adaptive jitter buffer, at the rate of the audio, rather than as it arrives.  Playout starts once <replaceable>min</replaceable> milliseconds are buffered, and more is buffered after each underrun.  The buffer holds at most <replaceable>max</replaceable> milliseconds, which defaults to 1000; while it is full, the service is not read from, so a service may send faster than real time.</para>
+					</option>
+					<option name="s">
+						<argument name="threshold" />
+						<para>Send silence messages, which carry only a duration, in place of the audio of each pause in the channel's speech after its first 200 milliseconds.  Audio is silent when its RMS level is below <replaceable>threshold</replaceable>, which defaults to <literal>silencethreshold</literal> in <filename>dsp.conf</filename>.  Opus audio is always sent as it is.</para>
+					</option>
+					<option name="d">
+						<para>Send both directions of the call to the service in one stream of 8kHz signed linear stereo messages: each frame read from the channel is sent on the first channel, alongside as much of the audio most recently written to the channel on the second, so that the two line up in time.  Gaps in the audio written to the channel are filled with silence.  The service still sends mono audio back.  This can not be combined with <literal>c</literal>, <literal>n</literal> or <literal>p</literal>, and frames sent this way are not batched or replaced by silence messages.</para>
+					</option>
+					<option name="e">
+						<para>Send the DTMF digits pressed on the channel to the service, and when the channel is put on or taken off hold, as messages of their own, so that the service need not detect digits in the audio.  The service must support these messages.  Digits and hold events which the service sends are passed to the channel whether or not this option is given.</para>
+					</option>
+					<option name="t">
+						<para>Offer the service an extended header, carrying a sequence number and a timestamp, so that it can spot lost or reordered messages and measure latency.  The offer is a second ID message after the UUID, and messages are only extended once the service accepts it.  If the service extends its own messages' headers and echoes the newest timestamp it received, the round trip is shown by <literal>audiosocket show stats</literal>.</para>
+					</option>
+					<option name="u">
+						<para>Exchange audio with the service as UDP datagrams, one message per datagram with a sequence number and timestamp, instead of over TCP.  Audio which arrives late is dropped rather than delaying what follows it.  This can not be combined with <literal>m</literal>.</para>
+					</option>
+				</optionlist>
 			</parameter>
 		</syntax>
 		<description>
-			<para>Connects to the given TCP service, then transmits channel audio over that socket.  In turn, audio is received from the socket and sent to the channel.  Only audio frames will be transmitted.</para>
+			<para>Connects to the given TCP (or, with the <literal>u</literal> option, UDP) service, then transmits channel audio over that socket.  In turn, audio is received from the socket and sent to the channel.  Only audio frames will be transmitted.</para>
 			<para>Protocol is specified at https://wiki.asterisk.org/wiki/display/AST/AudioSocket</para>
 			<para>This application does not automatically answer and should generally be preceeded by an application such as Answer() or Progress().</para>
 		</description>
@@ -69,21 +113,192 @@
 
 static const char app[] = "AudioSocket";
 
-static int audiosocket_run(struct ast_channel *chan, const char *id, const int svc);
+enum audiosocket_option_flags {
+	OPT_CODEC = (1 << 0),
+	OPT_NATIVE_RATE = (1 << 1),
+	OPT_PASSTHROUGH = (1 << 2),
+	OPT_BATCH = (1 << 3),
+	OPT_MULTIPLEX = (1 << 4),
+	OPT_DATAGRAM = (1 << 5),
+	OPT_JITTER = (1 << 6),
+	OPT_SILENCE = (1 << 7),
+	OPT_STEREO = (1 << 8),
+	OPT_EXTENDED = (1 << 9),
+	OPT_EVENTS = (1 << 10),
+};
+
+enum audiosocket_option_args {
+	OPT_ARG_CODEC,
+	OPT_ARG_BATCH,
+	OPT_ARG_JITTER,
+	OPT_ARG_SILENCE,
+	/* This MUST be the last value in this enum! */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(audiosocket_app_options, BEGIN_OPTIONS
+	AST_APP_OPTION_ARG('c', OPT_CODEC, OPT_ARG_CODEC),
+	AST_APP_OPTION('n', OPT_NATIVE_RATE),
+	AST_APP_OPTION('p', OPT_PASSTHROUGH),
+	AST_APP_OPTION_ARG('b', OPT_BATCH, OPT_ARG_BATCH),
+	AST_APP_OPTION('m', OPT_MULTIPLEX),
+	AST_APP_OPTION('u', OPT_DATAGRAM),
+	AST_APP_OPTION_ARG('j', OPT_JITTER, OPT_ARG_JITTER),
+	AST_APP_OPTION_ARG('s', OPT_SILENCE, OPT_ARG_SILENCE),
+	AST_APP_OPTION('d', OPT_STEREO),
+	AST_APP_OPTION('t', OPT_EXTENDED),
+	AST_APP_OPTION('e', OPT_EVENTS),
+END_OPTIONS );
+
+/*! \brief Time covered by one voice frame, for the default batch delay */
+#define BATCH_FRAME_MSEC 20
+
+/*! \brief Deepest the jitter buffer becomes, unless given */
+#define JITTER_DEFAULT_MAX_MSEC 1000
+
+/*! \brief Most audio written to the channel which is held to pair with the
+ * audio read from it: a second of 8kHz signed linear */
+#define STEREO_BUFFER_SAMPLES 8000
+
+/*! \brief The audio written to the channel, waiting to be sent alongside the
+ * audio read from it */
+struct audiosocket_stereo {
+	int16_t ring[STEREO_BUFFER_SAMPLES];	/* Samples written to the channel */
+	size_t head;	/* Index of the oldest sample in ring */
+	size_t count;	/* Number of samples in ring */
+	int16_t paired[STEREO_BUFFER_SAMPLES];	/* The samples sent with a frame read from the channel */
+};
+
+/*! \brief Most services, after the first, which are sent copies of the audio */
+#define MAX_TEE_SERVICES 8
+
+/*! \brief The services sent copies of the channel's audio */
+struct audiosocket_tees {
+	struct ast_audiosocket_conn *conns[MAX_TEE_SERVICES];
+	unsigned int count;
+};
+
+static int audiosocket_run(struct ast_channel *chan, const char *id,
+	struct ast_audiosocket_conn *conn, struct ast_audiosocket_jb *jb,
+	struct audiosocket_tees *tees, struct audiosocket_stereo *stereo, const int events);
+
+/*!
+ * \internal
+ * \brief Determine the format in which audio is exchanged with the service
+ *
+ * \retval The format, with a reference which the caller must release
+ * \retval NULL if the requested codec can not be used
+ */
+static struct ast_format *audiosocket_format(struct ast_channel *chan,
+	struct ast_flags *opts, char **opt_args)
+{
+	struct ast_format *format;
+
+	if (ast_test_flag(opts, OPT_CODEC)) {
+		format = ast_format_cache_get(opt_args[OPT_ARG_CODEC]);
+		if (!format || ast_audiosocket_kind_from_format(format) < 0) {
+			ast_log(LOG_ERROR, "Codec '%s' is not supported by AudioSocket\n",
+				opt_args[OPT_ARG_CODEC]);
+			ao2_cleanup(format);
+			return NULL;
+		}
+		return format;
+	}
+
+	if (ast_test_flag(opts, OPT_PASSTHROUGH)
+		&& ast_audiosocket_kind_from_format(ast_channel_rawreadformat(chan)) >= 0) {
+		return ao2_bump(ast_channel_rawreadformat(chan));
+	}
+
+	if (ast_test_flag(opts, OPT_NATIVE_RATE)) {
+		format = ast_audiosocket_slin_format(
+			ast_format_get_sample_rate(ast_channel_rawreadformat(chan)));
+		return ao2_bump(format);
+	}
+
+	return ao2_bump(ast_format_slin);
+}
+
+/*!
+ * \internal
+ * \brief Count the services in a list separated by '&'
+ */
+static unsigned int audiosocket_count_services(const char *services)
+{
+	unsigned int count = 1;
+
+	for (; *services; services++) {
+		count += *services == '&';
+	}
+
+	return count;
+}
+
+/*!
+ * \internal
+ * \brief Connect to the services which are sent copies of the channel's audio
+ *
+ * A service which can not be reached is left out.
+ *
+ * \param services The addresses of the services, separated by '&'.
+ */
+static void audiosocket_tees_connect(struct ast_channel *chan, struct ast_audiosocket_conn *conn,
+	char *services, const unsigned int flags, struct audiosocket_tees *tees)
+{
+	struct ast_audiosocket_conn *tee;
+	char *service;
+
+	while ((service = strsep(&services, "&"))) {
+		if (!(tee = ast_audiosocket_conn_connect(service, chan, flags))) {
+			ast_log(LOG_WARNING, "Not sending the audio of %s to AudioSocket service %s\n",
+				ast_channel_name(chan), service);
+			continue;
+		}
+		if (ast_audiosocket_conn_tee(conn, tee)) {
+			ao2_ref(tee, -1);
+			continue;
+		}
+		tees->conns[tees->count++] = tee;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Stop sending the channel's audio to one of the services sent copies of it
+ */
+static void audiosocket_tee_drop(struct ast_audiosocket_conn *conn,
+	struct audiosocket_tees *tees, const unsigned int i)
+{
+	ast_audiosocket_conn_untee(conn, tees->conns[i]);
+	ao2_ref(tees->conns[i], -1);
+	tees->conns[i] = tees->conns[--tees->count];
+}
 
 static int audiosocket_exec(struct ast_channel *chan, const char *data)
 {
 	char *parse;
-	struct ast_format *readFormat, *writeFormat;
+	struct ast_format *readFormat, *writeFormat, *format;
 	const char *chanName;
 	int res;
+	struct ast_flags opts = { 0, };
+	char *opt_args[OPT_ARG_ARRAY_SIZE];
 
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(idStr);
 		AST_APP_ARG(server);
+		AST_APP_ARG(options);
 	);
 
-	int s = 0;
+	struct ast_audiosocket_conn *conn;
+	struct ast_audiosocket_jb *jb = NULL;
+	struct ast_audiosocket_jb_stats stats;
+	struct audiosocket_tees tees = { .count = 0, };
+	struct audiosocket_stereo *stereo = NULL;
+	unsigned int conn_flags;
+	char *services;
+	unsigned int batch_frames = 0, batch_delay = 0;
+	unsigned int jitter_min = 0, jitter_max = JITTER_DEFAULT_MAX_MSEC;
+	unsigned int silence_threshold = 0;
 	uuid_t uu;
 
 
@@ -100,22 +315,80 @@ static int audiosocket_exec(struct ast_channel *chan, const char *data)
 		ast_log(LOG_ERROR, "Failed to parse UUID '%s'\n", args.idStr);
 		return -1;
 	}
-	if ((s = ast_audiosocket_connect(args.server, chan)) < 0) {
+	/* The first service exchanges audio with the channel; the rest are sent copies */
+	services = args.server;
+	args.server = strsep(&services, "&");
+	if (services && audiosocket_count_services(services) > MAX_TEE_SERVICES) {
+		ast_log(LOG_ERROR, "At most %d services may be sent copies of the audio\n",
+			MAX_TEE_SERVICES);
+		return -1;
+	}
+	if (!ast_strlen_zero(args.options)
+		&& ast_app_parse_options(audiosocket_app_options, &opts, opt_args, args.options)) {
+		ast_log(LOG_ERROR, "Failed to parse options '%s'\n", args.options);
+		return -1;
+	}
+	if (ast_test_flag(&opts, OPT_BATCH)) {
+		if (ast_strlen_zero(opt_args[OPT_ARG_BATCH])
+			|| sscanf(opt_args[OPT_ARG_BATCH], "%30u:%30u", &batch_frames, &batch_delay) < 1) {
+			ast_log(LOG_ERROR, "Invalid batch '%s'; expected frames[:delay]\n",
+				S_OR(opt_args[OPT_ARG_BATCH], ""));
+			return -1;
+		}
+		if (!batch_delay) {
+			batch_delay = batch_frames * BATCH_FRAME_MSEC;
+		}
+	}
+	if (ast_test_flag(&opts, OPT_JITTER)
+		&& (ast_strlen_zero(opt_args[OPT_ARG_JITTER])
+			|| sscanf(opt_args[OPT_ARG_JITTER], "%30u:%30u", &jitter_min, &jitter_max) < 1)) {
+		ast_log(LOG_ERROR, "Invalid jitter buffer '%s'; expected min[:max]\n",
+			S_OR(opt_args[OPT_ARG_JITTER], ""));
+		return -1;
+	}
+	if (ast_test_flag(&opts, OPT_SILENCE)) {
+		if (ast_strlen_zero(opt_args[OPT_ARG_SILENCE])) {
+			silence_threshold = ast_dsp_get_threshold_from_settings(THRESHOLD_SILENCE);
+		} else if (sscanf(opt_args[OPT_ARG_SILENCE], "%30u", &silence_threshold) != 1
+			|| !silence_threshold) {
+			ast_log(LOG_ERROR, "Invalid silence threshold '%s'\n", opt_args[OPT_ARG_SILENCE]);
+			return -1;
+		}
+	}
+	if (ast_test_flag(&opts, OPT_STEREO)
+		&& ast_test_flag(&opts, OPT_CODEC | OPT_NATIVE_RATE | OPT_PASSTHROUGH)) {
+		ast_log(LOG_ERROR, "Stereo audio is always 8kHz signed linear\n");
+		return -1;
+	}
+	if (!(format = audiosocket_format(chan, &opts, opt_args))) {
+		return -1;
+	}
+	conn_flags = (ast_test_flag(&opts, OPT_MULTIPLEX) ? AST_AUDIOSOCKET_CONN_MULTIPLEX : 0)
+		| (ast_test_flag(&opts, OPT_DATAGRAM) ? AST_AUDIOSOCKET_CONN_DATAGRAM : 0);
+	if (!(conn = ast_audiosocket_conn_connect(args.server, chan, conn_flags))) {
 		/* The res module will already output a log message, so another is not needed */
+		ao2_ref(format, -1);
 		return -1;
 	}
+	ast_audiosocket_conn_set_batch(conn, batch_frames, batch_delay);
+	ast_audiosocket_conn_set_silence(conn, silence_threshold);
+	ast_audiosocket_conn_set_extended(conn, ast_test_flag(&opts, OPT_EXTENDED));
 
 	writeFormat = ao2_bump(ast_channel_writeformat(chan));
 	readFormat = ao2_bump(ast_channel_readformat(chan));
 
-	if (ast_set_write_format(chan, ast_format_slin)) {
-		ast_log(LOG_ERROR, "Failed to set write format to SLINEAR for channel %s\n", chanName);
+	if (ast_set_write_format(chan, format)) {
+		ast_log(LOG_ERROR, "Failed to set write format to %s for channel %s\n",
+			ast_format_get_name(format), chanName);
 		ao2_ref(writeFormat, -1);
 		ao2_ref(readFormat, -1);
+		ao2_ref(format, -1);
+		ao2_ref(conn, -1);
 		return -1;
 	}
-	if (ast_set_read_format(chan, ast_format_slin)) {
-		ast_log(LOG_ERROR, "Failed to set read format to SLINEAR for channel %s\n", chanName);
+	if (ast_set_read_format(chan, format)) {
+		ast_log(LOG_ERROR, "Failed to set read format to %s for channel %s\n",
+			ast_format_get_name(format), chanName);
 
 		/* Attempt to restore previous write format even though it is likely to
 		 * fail, since setting the read format did.
@@ -125,10 +398,37 @@ static int audiosocket_exec(struct ast_channel *chan, const char *data)
 		}
 		ao2_ref(writeFormat, -1);
 		ao2_ref(readFormat, -1);
+		ao2_ref(format, -1);
+		ao2_ref(conn, -1);
 		return -1;
 	}
+	ao2_ref(format, -1);
 
-	res = audiosocket_run(chan, args.idStr, s);
+	if (ast_test_flag(&opts, OPT_JITTER)) {
+		/* Without the buffer, the audio is still played as it arrives */
+		jb = ast_audiosocket_jb_alloc(jitter_min, jitter_max);
+	}
+	if (services) {
+		audiosocket_tees_connect(chan, conn, services, conn_flags, &tees);
+	}
+	if (ast_test_flag(&opts, OPT_STEREO) && !(stereo = ast_calloc(1, sizeof(*stereo)))) {
+		res = -1;
+	} else {
+		res = audiosocket_run(chan, args.idStr, conn, jb, &tees, stereo,
+			ast_test_flag(&opts, OPT_EVENTS));
+	}
+	ast_free(stereo);
+	ast_audiosocket_conn_detach(conn);
+	while (tees.count) {
+		audiosocket_tee_drop(conn, &tees, tees.count - 1);
+	}
+	if (jb) {
+		ast_audiosocket_jb_stats(jb, &stats);
+		ast_debug(1, "AudioSocket jitter buffer of %s: %u frames in, %u out, %u dropped, "
+			"%u underruns, peak %u ms, target %u ms\n", chanName, stats.frames_in,
+			stats.frames_out, stats.dropped, stats.underruns, stats.peak, stats.target);
+		ao2_ref(jb, -1);
+	}
 	/* On non-zero return, report failure */
 	if (res) {
 		/* Restore previous formats and close the connection */
@@ -140,10 +440,10 @@ static int audiosocket_exec(struct ast_channel *chan, const char *data)
 		}
 		ao2_ref(writeFormat, -1);
 		ao2_ref(readFormat, -1);
-		close(s);
+		ao2_ref(conn, -1);
 		return res;
 	}
-	close(s);
+	ao2_ref(conn, -1);
 
 	if (ast_set_write_format(chan, writeFormat)) {
 		ast_log(LOG_ERROR, "Failed to restore write format for channel %s\n", chanName);
@@ -157,58 +457,272 @@ static int audiosocket_exec(struct ast_channel *chan, const char *data)
 	return 0;
 }
 
-static int audiosocket_run(struct ast_channel *chan, const char *id, int svc)
+/*!
+ * \internal
+ * \brief Hold the audio of a frame written to the channel, to send alongside
+ * the audio read from it
+ *
+ * When more is written than is read, the oldest audio is dropped.
+ */
+static void audiosocket_stereo_put(struct audiosocket_stereo *stereo, const struct ast_frame *f)
+{
+	const int16_t *samples = f->data.ptr;
+	size_t count = f->datalen / sizeof(int16_t);
+	size_t i;
+
+	if (f->frametype != AST_FRAME_VOICE
+		|| ast_format_cmp(f->subclass.format, ast_format_slin) != AST_FORMAT_CMP_EQUAL) {
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (stereo->count == STEREO_BUFFER_SAMPLES) {
+			stereo->head = (stereo->head + 1) % STEREO_BUFFER_SAMPLES;
+			stereo->count--;
+		}
+		stereo->ring[(stereo->head + stereo->count++) % STEREO_BUFFER_SAMPLES] = samples[i];
+	}
+}
+
+/*!
+ * \internal
+ * \brief Send a frame read from the channel with the audio written to the
+ * channel meanwhile, as one stereo message
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_stereo_send(struct ast_audiosocket_conn *conn,
+	struct audiosocket_stereo *stereo, const struct ast_frame *f)
+{
+	size_t count = MIN(f->datalen / sizeof(int16_t), STEREO_BUFFER_SAMPLES);
+	size_t i;
+
+	/* What was not written to the channel in time was silence on the line */
+	for (i = 0; i < count; i++) {
+		if (stereo->count) {
+			stereo->paired[i] = stereo->ring[stereo->head];
+			stereo->head = (stereo->head + 1) % STEREO_BUFFER_SAMPLES;
+			stereo->count--;
+		} else {
+			stereo->paired[i] = 0;
+		}
+	}
+
+	return ast_audiosocket_conn_send_stereo(conn, f->data.ptr, stereo->paired, count);
+}
+
+/*!
+ * \internal
+ * \brief Write frames received from the service to the channel
+ *
+ * \param chan The channel.
+ * \param f The frames, which are freed.
+ * \param stereo Where the audio written is held for stereo messages, or NULL.
+ *
+ * \retval 0 on success
+ * \retval -1 if the service hung up or the channel failed
+ */
+static int audiosocket_forward(struct ast_channel *chan, struct ast_frame *f,
+	struct audiosocket_stereo *stereo)
+{
+	struct ast_frame *cur;
+
+	for (cur = f; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+		if (cur->frametype == AST_FRAME_CONTROL
+			&& cur->subclass.integer == AST_CONTROL_HANGUP) {
+			/* AudioSocket ended by remote after sending its last audio */
+			ast_frfree(f);
+			return -1;
+		}
+		if (cur->frametype == AST_FRAME_CONTROL
+			&& cur->subclass.integer == AST_CONTROL_ANSWER) {
+			/* The channel was answered before the application started */
+			continue;
+		}
+		if (ast_write(chan, cur)) {
+			ast_log(LOG_WARNING, "Failed to forward frame to channel %s\n",
+				ast_channel_name(chan));
+			ast_frfree(f);
+			return -1;
+		}
+		if (stereo) {
+			audiosocket_stereo_put(stereo, cur);
+		}
+	}
+	ast_frfree(f);
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Send a DTMF or control frame read from the channel to the services
+ *
+ * \retval 0 on success, including for frames which are not sent
+ * \retval -1 on error
+ */
+static int audiosocket_send_event(struct ast_audiosocket_conn *conn, const struct ast_frame *f)
+{
+	switch (f->frametype) {
+	case AST_FRAME_DTMF_BEGIN:
+		return ast_audiosocket_conn_send_dtmf(conn, f->subclass.integer, 0);
+	case AST_FRAME_DTMF_END:
+		return ast_audiosocket_conn_send_dtmf(conn, f->subclass.integer, 1);
+	case AST_FRAME_CONTROL:
+		return ast_audiosocket_conn_send_control(conn, f->subclass.integer) < 0 ? -1 : 0;
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Read from a service which is sent copies of the channel's audio,
+ * discarding what it sends
+ *
+ * \retval 0 on success
+ * \retval -1 if the service hung up or the connection failed
+ */
+static int audiosocket_tee_receive(struct ast_audiosocket_conn *tee)
+{
+	struct ast_frame *f, *cur;
+	int res = 0;
+
+	if (!(f = ast_audiosocket_conn_receive_frame(tee))) {
+		return -1;
+	}
+	for (cur = f; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+		if (cur->frametype == AST_FRAME_CONTROL
+			&& cur->subclass.integer == AST_CONTROL_HANGUP) {
+			res = -1;
+		}
+	}
+	ast_frfree(f);
+
+	return res;
+}
+
+static int audiosocket_run(struct ast_channel *chan, const char *id,
+	struct ast_audiosocket_conn *conn, struct ast_audiosocket_jb *jb,
+	struct audiosocket_tees *tees, struct audiosocket_stereo *stereo, const int events)
 {
 	const char *chanName;
+	int fds[1 + MAX_TEE_SERVICES];
+	int svc = ast_audiosocket_conn_fd(conn);
+	int nfds = 1;
+	unsigned int i;
 
 	if (!chan || ast_channel_state(chan) != AST_STATE_UP) {
 		return -1;
 	}
 
-	if (ast_audiosocket_init(svc, id)) {
+	if (ast_audiosocket_conn_init(conn, id)) {
 		return -1;
 	}
 
+	/* If a reactor thread takes over receiving, only the channel is waited on.
+	 * Audio played out of a jitter buffer is timed by this thread instead, and
+	 * the audio of stereo messages must be seen by this thread on its way. */
+	if (!jb && !stereo && !ast_audiosocket_conn_attach(conn, chan, AST_AUDIOSOCKET_ATTACH_WRITE)) {
+		nfds = 0;
+	}
+
 	chanName = ast_channel_name(chan);
 
 	while (1) {
 		struct ast_channel *targetChan;
-		int ms = 0;
+		int ms, wait;
 		int outfd = 0;
 		struct ast_frame *f;
 
-		targetChan = ast_waitfor_nandfds(&chan, 1, &svc, 1, NULL, &outfd, &ms);
+		/* Wake up in time to send a partial batch of frames, and to offer the
+		 * socket again what it could not take */
+		ms = ast_audiosocket_conn_flush_timeout(conn);
+		if (!ms && ast_audiosocket_conn_flush(conn)) {
+			ast_log(LOG_ERROR, "Failed to forward channel frames from %s to AudioSocket\n",
+				chanName);
+			return -1;
+		}
+		if (!ms) {
+			ms = ast_audiosocket_conn_flush_timeout(conn);
+		}
+		if (jb) {
+			/* Wake up in time to play the next buffered frame, and leave the
+			 * socket unread while the buffer is full so that the service waits */
+			wait = ast_audiosocket_jb_wait(jb);
+			if (wait >= 0 && (ms < 0 || wait < ms)) {
+				ms = wait;
+			}
+			nfds = !ast_audiosocket_jb_full(jb);
+		}
+
+		/* The services sent copies are read too, after the first if it is read */
+		fds[0] = svc;
+		for (i = 0; i < tees->count; i++) {
+			fds[1 + i] = ast_audiosocket_conn_fd(tees->conns[i]);
+		}
+
+		targetChan = ast_waitfor_nandfds(&chan, 1, fds + !nfds, nfds + tees->count, NULL,
+			&outfd, &ms);
 		if (targetChan) {
 			f = ast_read(chan);
 			if (!f) {
+				/* The channel hung up, so send what is left of the batch */
+				ast_audiosocket_conn_flush(conn);
 				return -1;
 			}
 
 			if (f->frametype == AST_FRAME_VOICE) {
 				/* Send audio frame to audiosocket */
-				if (ast_audiosocket_send_frame(svc, f)) {
+				if (stereo ? audiosocket_stereo_send(conn, stereo, f)
+					: ast_audiosocket_conn_send_frame(conn, f)) {
 					ast_log(LOG_ERROR, "Failed to forward channel frame from %s to AudioSocket\n",
 						chanName);
 					ast_frfree(f);
 					return -1;
 				}
+			} else if (events && audiosocket_send_event(conn, f)) {
+				ast_log(LOG_ERROR, "Failed to forward channel event from %s to AudioSocket\n",
+					chanName);
+				ast_frfree(f);
+				return -1;
 			}
 			ast_frfree(f);
 		}
 
-		if (outfd >= 0) {
-			f = ast_audiosocket_receive_frame(svc);
+		for (i = 0; outfd >= 0 && outfd != svc && i < tees->count; i++) {
+			if (fds[1 + i] != outfd) {
+				continue;
+			}
+			if (audiosocket_tee_receive(tees->conns[i])) {
+				ast_log(LOG_WARNING, "AudioSocket service sent copies of the audio of %s "
+					"has hung up\n", chanName);
+				audiosocket_tee_drop(conn, tees, i);
+			}
+			break;
+		}
+
+		if (outfd >= 0 && outfd == svc) {
+			f = ast_audiosocket_conn_receive_frame(conn);
 			if (!f) {
 				ast_log(LOG_ERROR, "Failed to receive frame from AudioSocket message for"
 					"channel %s\n", chanName);
 				return -1;
 			}
-			if (ast_write(chan, f)) {
-				ast_log(LOG_WARNING, "Failed to forward frame to channel %s\n", chanName);
+			if (jb) {
+				ast_audiosocket_jb_put(jb, f);
 				ast_frfree(f);
+			} else if (audiosocket_forward(chan, f, stereo)) {
+				return -1;
+			}
+			ast_audiosocket_conn_written(conn);
+		}
+
+		while (jb && (f = ast_audiosocket_jb_get(jb))) {
+			if (audiosocket_forward(chan, f, stereo)) {
 				return -1;
 			}
-			ast_frfree(f);
 		}
 	}
 	return 0;
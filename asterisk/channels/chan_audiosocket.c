@@ -40,12 +40,64 @@
 #include "asterisk/acl.h"
 #include "asterisk/app.h"
 #include "asterisk/causes.h"
+#include "asterisk/dsp.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/timing.h"
 
 #define FD_OUTPUT 1	/* A fd of -1 means an error, 0 is stdin */
+#define FD_TIMER 1	/* The channel fd which paces the jitter buffer */
+
+enum audiosocket_option_flags {
+	OPT_CODEC = (1 << 0),
+	OPT_NATIVE_RATE = (1 << 1),
+	OPT_PASSTHROUGH = (1 << 2),
+	OPT_BATCH = (1 << 3),
+	OPT_MULTIPLEX = (1 << 4),
+	OPT_DATAGRAM = (1 << 5),
+	OPT_JITTER = (1 << 6),
+	OPT_SILENCE = (1 << 7),
+	OPT_EXTENDED = (1 << 8),
+	OPT_EVENTS = (1 << 9),
+};
+
+enum audiosocket_option_args {
+	OPT_ARG_CODEC,
+	OPT_ARG_BATCH,
+	OPT_ARG_JITTER,
+	OPT_ARG_SILENCE,
+	/* This MUST be the last value in this enum! */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(audiosocket_dial_options, BEGIN_OPTIONS
+	AST_APP_OPTION_ARG('c', OPT_CODEC, OPT_ARG_CODEC),
+	AST_APP_OPTION('n', OPT_NATIVE_RATE),
+	AST_APP_OPTION('p', OPT_PASSTHROUGH),
+	AST_APP_OPTION_ARG('b', OPT_BATCH, OPT_ARG_BATCH),
+	AST_APP_OPTION('m', OPT_MULTIPLEX),
+	AST_APP_OPTION('u', OPT_DATAGRAM),
+	AST_APP_OPTION_ARG('j', OPT_JITTER, OPT_ARG_JITTER),
+	AST_APP_OPTION_ARG('s', OPT_SILENCE, OPT_ARG_SILENCE),
+	AST_APP_OPTION('t', OPT_EXTENDED),
+	AST_APP_OPTION('e', OPT_EVENTS),
+END_OPTIONS );
+
+/*! \brief Time covered by one voice frame, for the default batch delay */
+#define BATCH_FRAME_MSEC 20
+
+/*! \brief Deepest the jitter buffer becomes, unless given */
+#define JITTER_DEFAULT_MAX_MSEC 1000
+
+/*! \brief How often the jitter buffer is checked for frames which are due, per second */
+#define JITTER_TIMER_RATE 100
 
 struct audiosocket_instance {
-	int svc;	/* The file descriptor for the AudioSocket instance */
+	int svc;	/* The file descriptor which signals that the AudioSocket is readable */
+	struct ast_audiosocket_conn *conn;	/* The connection state, which owns svc */
+	int attached;	/* Set if a reactor thread queues the received frames */
+	int events;	/* Set if DTMF digits and hold events are sent to the server */
+	struct ast_audiosocket_jb *jb;	/* Paces the received frames, if enabled */
+	struct ast_timer *timer;	/* Wakes the channel to play out of jb */
 	char id[38];	/* The UUID identifying this AudioSocket instance */
 } audiosocket_instance;
 
@@ -57,6 +109,10 @@ static int audiosocket_call(struct ast_channel *ast, const char *dest, int timeo
 static int audiosocket_hangup(struct ast_channel *ast);
 static struct ast_frame *audiosocket_read(struct ast_channel *ast);
 static int audiosocket_write(struct ast_channel *ast, struct ast_frame *f);
+static int audiosocket_digit_begin(struct ast_channel *ast, char digit);
+static int audiosocket_digit_end(struct ast_channel *ast, char digit, unsigned int duration);
+static int audiosocket_indicate(struct ast_channel *ast, int condition, const void *data,
+	size_t datalen);
 
 /* AudioSocket channel driver declaration */
 static struct ast_channel_tech audiosocket_channel_tech = {
@@ -67,19 +123,78 @@ static struct ast_channel_tech audiosocket_channel_tech = {
 	.hangup = audiosocket_hangup,
 	.read = audiosocket_read,
 	.write = audiosocket_write,
+	.send_digit_begin = audiosocket_digit_begin,
+	.send_digit_end = audiosocket_digit_end,
+	.indicate = audiosocket_indicate,
 };
 
+/*!
+ * \internal
+ * \brief Read through the jitter buffer
+ *
+ * The socket fills the buffer, and the timer plays out of it.
+ */
+static struct ast_frame *audiosocket_jb_read(struct ast_channel *ast,
+	struct audiosocket_instance *instance)
+{
+	struct ast_frame *head = NULL, *tail = NULL, *f;
+
+	if (ast_channel_fdno(ast) == FD_TIMER) {
+		ast_timer_ack(instance->timer, 1);
+	} else {
+		f = ast_audiosocket_conn_receive_frame(instance->conn);
+		if (!f) {
+			return NULL;
+		}
+		ast_audiosocket_jb_put(instance->jb, f);
+		ast_frfree(f);
+		ast_audiosocket_conn_written(instance->conn);
+	}
+
+	while ((f = ast_audiosocket_jb_get(instance->jb))) {
+		if (tail) {
+			AST_LIST_NEXT(tail, frame_list) = f;
+		} else {
+			head = f;
+		}
+		tail = f;
+	}
+
+	/* Leave the socket unread while the buffer is full, so that the server waits */
+	ast_channel_set_fd(ast, 0, ast_audiosocket_jb_full(instance->jb) ? -1 : instance->svc);
+
+	return head ? head : &ast_null_frame;
+}
+
 /*! \brief Function called when we should read a frame from the channel */
 static struct ast_frame *audiosocket_read(struct ast_channel *ast)
 {
 	struct audiosocket_instance *instance;
+	struct ast_frame *f;
 
 	/* The channel should always be present from the API */
 	instance = ast_channel_tech_pvt(ast);
 	if (instance == NULL || instance->svc < FD_OUTPUT) {
 		return NULL;
 	}
-	return ast_audiosocket_receive_frame(instance->svc);
+	/* Whenever the channel wakes, offer the socket what it could not take before */
+	if (!ast_audiosocket_conn_flush_timeout(instance->conn)
+		&& ast_audiosocket_conn_flush(instance->conn)) {
+		return NULL;
+	}
+	if (instance->attached) {
+		/* Received frames are already queued on the channel */
+		return &ast_null_frame;
+	}
+	if (instance->jb) {
+		return audiosocket_jb_read(ast, instance);
+	}
+
+	/* The core takes the frames from here */
+	f = ast_audiosocket_conn_receive_frame(instance->conn);
+	ast_audiosocket_conn_written(instance->conn);
+
+	return f;
 }
 
 /*! \brief Function called when we should write a frame to the channel */
@@ -92,7 +207,43 @@ static int audiosocket_write(struct ast_channel *ast, struct ast_frame *f)
 	if (instance == NULL || instance->svc < 1) {
 		return -1;
 	}
-	return ast_audiosocket_send_frame(instance->svc, f);
+	return ast_audiosocket_conn_send_frame(instance->conn, f);
+}
+
+/*! \brief Function called when a DTMF digit starts on the channel */
+static int audiosocket_digit_begin(struct ast_channel *ast, char digit)
+{
+	struct audiosocket_instance *instance = ast_channel_tech_pvt(ast);
+
+	if (instance == NULL || !instance->events) {
+		/* Let the core send the digit in band */
+		return -1;
+	}
+	return ast_audiosocket_conn_send_dtmf(instance->conn, digit, 0);
+}
+
+/*! \brief Function called when a DTMF digit ends on the channel */
+static int audiosocket_digit_end(struct ast_channel *ast, char digit, unsigned int duration)
+{
+	struct audiosocket_instance *instance = ast_channel_tech_pvt(ast);
+
+	if (instance == NULL || !instance->events) {
+		return -1;
+	}
+	return ast_audiosocket_conn_send_dtmf(instance->conn, digit, 1);
+}
+
+/*! \brief Function called when the channel is asked to indicate a condition */
+static int audiosocket_indicate(struct ast_channel *ast, int condition, const void *data,
+	size_t datalen)
+{
+	struct audiosocket_instance *instance = ast_channel_tech_pvt(ast);
+
+	if (instance == NULL || !instance->events) {
+		return -1;
+	}
+	/* Conditions which AudioSocket does not carry are left to the core */
+	return ast_audiosocket_conn_send_control(instance->conn, condition) ? -1 : 0;
 }
 
 /*! \brief Function called when we should actually call the destination */
@@ -102,7 +253,18 @@ static int audiosocket_call(struct ast_channel *ast, const char *dest, int timeo
 
 	ast_queue_control(ast, AST_CONTROL_ANSWER);
 
-	return ast_audiosocket_init(instance->svc, instance->id);
+	if (ast_audiosocket_conn_init(instance->conn, instance->id)) {
+		return -1;
+	}
+
+	/* If a reactor thread takes over receiving, the channel need not wait on the
+	 * socket.  Audio played out of a jitter buffer is timed by the channel instead. */
+	if (!instance->jb && !ast_audiosocket_conn_attach(instance->conn, ast, 0)) {
+		instance->attached = 1;
+		ast_channel_set_fd(ast, 0, -1);
+	}
+
+	return 0;
 }
 
 /*! \brief Function called when we should hang the channel up */
@@ -112,8 +274,23 @@ static int audiosocket_hangup(struct ast_channel *ast)
 
 	/* The channel should always be present from the API */
 	instance = ast_channel_tech_pvt(ast);
-	if (instance != NULL && instance->svc > 0) {
-		close(instance->svc);
+	if (instance != NULL && instance->conn) {
+		/* Send what is left of any batch; releasing the connection closes the socket */
+		ast_audiosocket_conn_detach(instance->conn);
+		ast_audiosocket_conn_flush(instance->conn);
+		ao2_ref(instance->conn, -1);
+	}
+	if (instance != NULL && instance->jb) {
+		struct ast_audiosocket_jb_stats stats;
+
+		ast_audiosocket_jb_stats(instance->jb, &stats);
+		ast_debug(1, "AudioSocket jitter buffer of %s: %u frames in, %u out, %u dropped, "
+			"%u underruns, peak %u ms, target %u ms\n", ast_channel_name(ast), stats.frames_in,
+			stats.frames_out, stats.dropped, stats.underruns, stats.peak, stats.target);
+		ao2_ref(instance->jb, -1);
+	}
+	if (instance != NULL && instance->timer) {
+		ast_timer_close(instance->timer);
 	}
 
 	ast_channel_tech_pvt_set(ast, NULL);
@@ -122,6 +299,57 @@ static int audiosocket_hangup(struct ast_channel *ast)
 	return 0;
 }
 
+/*!
+ * \internal
+ * \brief Determine the format in which audio is exchanged with the service
+ *
+ * \param cap The formats requested for the channel.
+ *
+ * \retval The format, with a reference which the caller must release
+ * \retval NULL if the requested codec can not be used
+ */
+static struct ast_format *audiosocket_format(struct ast_format_cap *cap,
+	struct ast_flags *opts, char **opt_args)
+{
+	struct ast_format *format;
+	unsigned int rate;
+	int i;
+
+	if (ast_test_flag(opts, OPT_CODEC)) {
+		format = ast_format_cache_get(opt_args[OPT_ARG_CODEC]);
+		if (!format || ast_audiosocket_kind_from_format(format) < 0) {
+			ast_log(LOG_ERROR, "Codec '%s' is not supported by AudioSocket\n",
+				opt_args[OPT_ARG_CODEC]);
+			ao2_cleanup(format);
+			return NULL;
+		}
+		return format;
+	}
+
+	if (ast_test_flag(opts, OPT_PASSTHROUGH) && cap) {
+		/* Use the most preferred requested format which can be carried as is */
+		for (i = 0; i < ast_format_cap_count(cap); i++) {
+			format = ast_format_cap_get_format(cap, i);
+			if (ast_audiosocket_kind_from_format(format) >= 0) {
+				return format;
+			}
+			ao2_ref(format, -1);
+		}
+	}
+
+	if (ast_test_flag(opts, OPT_NATIVE_RATE) && cap) {
+		/* Match the rate of the best audio format which was requested */
+		format = ast_format_cap_get_best_by_type(cap, AST_MEDIA_TYPE_AUDIO);
+		if (format) {
+			rate = ast_format_get_sample_rate(format);
+			ao2_ref(format, -1);
+			return ao2_bump(ast_audiosocket_slin_format(rate));
+		}
+	}
+
+	return ao2_bump(ast_format_slin);
+}
+
 /*! \brief Function called when we should prepare to call the unicast destination */
 static struct ast_channel *audiosocket_request(const char *type,
 	struct ast_format_cap *cap, const struct ast_assigned_ids *assignedids,
@@ -129,13 +357,20 @@ static struct ast_channel *audiosocket_request(const char *type,
 {
 	char *parse;
 	struct audiosocket_instance *instance = NULL;
-	struct ast_sockaddr address;
+	char *hostport, *host, *port;
 	struct ast_channel *chan;
+	struct ast_format_cap *caps = NULL;
+	struct ast_format *format = NULL;
+	struct ast_flags opts = { 0, };
+	char *opt_args[OPT_ARG_ARRAY_SIZE];
+	unsigned int batch_frames = 0, batch_delay = 0;
+	unsigned int jitter_min = 0, jitter_max = JITTER_DEFAULT_MAX_MSEC;
+	unsigned int silence_threshold = 0;
     uuid_t uu;
-	int fd;
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(destination);
 		AST_APP_ARG(idStr);
+		AST_APP_ARG(options);
 	);
 
 	if (ast_strlen_zero(data)) {
@@ -149,8 +384,11 @@ static struct ast_channel *audiosocket_request(const char *type,
 		ast_log(LOG_ERROR, "Destination is required for the 'AudioSocket' channel\n");
 		goto failure;
 	}
-	if (ast_sockaddr_resolve_first_af
-		(&address, args.destination, PARSE_PORT_REQUIRE, AST_AF_UNSPEC)) {
+	/* Only the syntax is checked here; the name is resolved, through the
+	 * cache, when the call is placed */
+	hostport = ast_strdupa(args.destination);
+	if (!ast_sockaddr_split_hostport(hostport, &host, &port, PARSE_PORT_REQUIRE)
+		|| ast_strlen_zero(host)) {
 		ast_log(LOG_ERROR, "Destination '%s' could not be parsed\n", args.destination);
 		goto failure;
 	}
@@ -164,32 +402,95 @@ static struct ast_channel *audiosocket_request(const char *type,
 		goto failure;
 	}
 
+	if (!ast_strlen_zero(args.options)
+		&& ast_app_parse_options(audiosocket_dial_options, &opts, opt_args, args.options)) {
+		ast_log(LOG_ERROR, "Failed to parse options '%s' for the 'AudioSocket' channel\n",
+			args.options);
+		goto failure;
+	}
+	if (ast_test_flag(&opts, OPT_BATCH)) {
+		if (ast_strlen_zero(opt_args[OPT_ARG_BATCH])
+			|| sscanf(opt_args[OPT_ARG_BATCH], "%30u:%30u", &batch_frames, &batch_delay) < 1) {
+			ast_log(LOG_ERROR, "Invalid batch '%s' for the 'AudioSocket' channel; expected frames[:delay]\n",
+				S_OR(opt_args[OPT_ARG_BATCH], ""));
+			goto failure;
+		}
+		if (!batch_delay) {
+			batch_delay = batch_frames * BATCH_FRAME_MSEC;
+		}
+	}
+	if (ast_test_flag(&opts, OPT_JITTER)
+		&& (ast_strlen_zero(opt_args[OPT_ARG_JITTER])
+			|| sscanf(opt_args[OPT_ARG_JITTER], "%30u:%30u", &jitter_min, &jitter_max) < 1)) {
+		ast_log(LOG_ERROR, "Invalid jitter buffer '%s' for the 'AudioSocket' channel; expected min[:max]\n",
+			S_OR(opt_args[OPT_ARG_JITTER], ""));
+		goto failure;
+	}
+	if (ast_test_flag(&opts, OPT_SILENCE)) {
+		if (ast_strlen_zero(opt_args[OPT_ARG_SILENCE])) {
+			silence_threshold = ast_dsp_get_threshold_from_settings(THRESHOLD_SILENCE);
+		} else if (sscanf(opt_args[OPT_ARG_SILENCE], "%30u", &silence_threshold) != 1
+			|| !silence_threshold) {
+			ast_log(LOG_ERROR, "Invalid silence threshold '%s' for the 'AudioSocket' channel\n",
+				opt_args[OPT_ARG_SILENCE]);
+			goto failure;
+		}
+	}
+	if (!(format = audiosocket_format(cap, &opts, opt_args))) {
+		goto failure;
+	}
+	if (!(caps = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT))) {
+		goto failure;
+	}
+	ast_format_cap_append(caps, format, 0);
+
 	instance = ast_calloc(1, sizeof(*instance));
 	if (!instance) {
 		ast_log(LOG_ERROR, "Failed to allocate AudioSocket channel pvt\n");
 		goto failure;
 	}
 	ast_copy_string(instance->id, args.idStr, sizeof(instance->id));
+	instance->events = ast_test_flag(&opts, OPT_EVENTS) ? 1 : 0;
 
-	if ((fd = ast_audiosocket_connect(args.destination, NULL)) < 0) {
+	if (!(instance->conn = ast_audiosocket_conn_connect(args.destination, NULL,
+		(ast_test_flag(&opts, OPT_MULTIPLEX) ? AST_AUDIOSOCKET_CONN_MULTIPLEX : 0)
+		| (ast_test_flag(&opts, OPT_DATAGRAM) ? AST_AUDIOSOCKET_CONN_DATAGRAM : 0)))) {
 		goto failure;
 	}
-	instance->svc = fd;
+	instance->svc = ast_audiosocket_conn_fd(instance->conn);
+	ast_audiosocket_conn_set_batch(instance->conn, batch_frames, batch_delay);
+	ast_audiosocket_conn_set_silence(instance->conn, silence_threshold);
+	ast_audiosocket_conn_set_extended(instance->conn, ast_test_flag(&opts, OPT_EXTENDED));
+	if (ast_test_flag(&opts, OPT_JITTER)) {
+		if (!(instance->timer = ast_timer_open())) {
+			ast_log(LOG_ERROR, "Failed to open timer for the 'AudioSocket' channel jitter buffer\n");
+			goto failure;
+		}
+		if (ast_timer_set_rate(instance->timer, JITTER_TIMER_RATE)
+			|| !(instance->jb = ast_audiosocket_jb_alloc(jitter_min, jitter_max))) {
+			goto failure;
+		}
+	}
 
 	chan = ast_channel_alloc(1, AST_STATE_DOWN, "", "", "", "", "", assignedids,
 		requestor, 0, "AudioSocket/%s-%s", args.destination, args.idStr);
 	if (!chan) {
 		goto failure;
 	}
-	ast_channel_set_fd(chan, 0, fd);
+	ast_channel_set_fd(chan, 0, instance->svc);
+	if (instance->timer) {
+		ast_channel_set_fd(chan, FD_TIMER, ast_timer_fd(instance->timer));
+	}
 
 	ast_channel_tech_set(chan, &audiosocket_channel_tech);
 
-	ast_channel_nativeformats_set(chan, audiosocket_channel_tech.capabilities);
-	ast_channel_set_writeformat(chan, ast_format_slin);
-	ast_channel_set_rawwriteformat(chan, ast_format_slin);
-	ast_channel_set_readformat(chan, ast_format_slin);
-	ast_channel_set_rawreadformat(chan, ast_format_slin);
+	ast_channel_nativeformats_set(chan, caps);
+	ast_channel_set_writeformat(chan, format);
+	ast_channel_set_rawwriteformat(chan, format);
+	ast_channel_set_readformat(chan, format);
+	ast_channel_set_rawreadformat(chan, format);
+	ao2_ref(caps, -1);
+	ao2_ref(format, -1);
 
 	ast_channel_tech_pvt_set(chan, instance);
 
@@ -202,11 +503,15 @@ static struct ast_channel *audiosocket_request(const char *type,
 
 failure:
 	*cause = AST_CAUSE_FAILURE;
+	ao2_cleanup(caps);
+	ao2_cleanup(format);
 	if (instance != NULL) {
-		ast_free(instance);
-		if (fd >= 0) {
-			close(fd);
+		ao2_cleanup(instance->conn);
+		ao2_cleanup(instance->jb);
+		if (instance->timer) {
+			ast_timer_close(instance->timer);
 		}
+		ast_free(instance);
 	}
 	return NULL;
 }
@@ -228,6 +533,12 @@ static int load_module(void)
 		return AST_MODULE_LOAD_DECLINE;
 	}
 	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_slin, 0);
+	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_slin16, 0);
+	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_slin24, 0);
+	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_slin48, 0);
+	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_ulaw, 0);
+	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_alaw, 0);
+	ast_format_cap_append(audiosocket_channel_tech.capabilities, ast_format_opus, 0);
 
 	if (ast_channel_register(&audiosocket_channel_tech)) {
 		ast_log(LOG_ERROR, "Unable to register channel class AudioSocket");
@@ -37,7 +37,101 @@ extern "C" {
 #include "asterisk/uuid.h"
 
 /*!
- * \brief Send the initial message to an AudioSocket server
+ * \brief AudioSocket message kinds
+ */
+enum ast_audiosocket_msg_kind {
+	/*! The session is terminated */
+	AST_AUDIOSOCKET_KIND_HANGUP = 0x00,
+	/*! The payload is the 16-byte binary UUID of the session */
+	AST_AUDIOSOCKET_KIND_UUID = 0x01,
+	/*! The line is silent */
+	AST_AUDIOSOCKET_KIND_SILENCE = 0x02,
+	/*! The payload is a DTMF digit as its ASCII character, sent at the end of
+	 * the digit */
+	AST_AUDIOSOCKET_KIND_DTMF = 0x03,
+	/*! The payload is a one-byte \ref ast_audiosocket_control */
+	AST_AUDIOSOCKET_KIND_CONTROL = 0x04,
+	/*! The payload is a DTMF digit as its ASCII character, sent at the start
+	 * of the digit */
+	AST_AUDIOSOCKET_KIND_DTMF_BEGIN = 0x05,
+	/*! The payload is 16-bit, 8kHz signed linear mono audio */
+	AST_AUDIOSOCKET_KIND_AUDIO = 0x10,
+	/*! The payload is 16-bit, 16kHz signed linear mono audio */
+	AST_AUDIOSOCKET_KIND_AUDIO_SLIN16 = 0x12,
+	/*! The payload is 16-bit, 24kHz signed linear mono audio */
+	AST_AUDIOSOCKET_KIND_AUDIO_SLIN24 = 0x13,
+	/*! The payload is 16-bit, 48kHz signed linear mono audio */
+	AST_AUDIOSOCKET_KIND_AUDIO_SLIN48 = 0x16,
+	/*! The payload is 8kHz G.711 mu-law audio */
+	AST_AUDIOSOCKET_KIND_AUDIO_ULAW = 0x20,
+	/*! The payload is 8kHz G.711 A-law audio */
+	AST_AUDIOSOCKET_KIND_AUDIO_ALAW = 0x21,
+	/*! The payload is a single Opus packet */
+	AST_AUDIOSOCKET_KIND_AUDIO_OPUS = 0x22,
+	/*! The payload is a 16-bit stream ID followed by a complete message of
+	 * that stream, on a connection shared by several sessions */
+	AST_AUDIOSOCKET_KIND_MUX = 0x30,
+	/*! The payload is 16-bit, 8kHz signed linear audio of two channels, with
+	 * their samples alternating and the first channel's first */
+	AST_AUDIOSOCKET_KIND_AUDIO_STEREO = 0x40,
+	/*! Set in the kind of a message whose header is extended by a 16-bit
+	 * sequence number and a 32-bit timestamp; see
+	 * \ref ast_audiosocket_conn_set_extended.  Never set in an error. */
+	AST_AUDIOSOCKET_KIND_EXTENDED = 0x80,
+	/*! An error has occurred; the payload is the optional error code */
+	AST_AUDIOSOCKET_KIND_ERROR = 0xff,
+};
+
+/*!
+ * \brief Events carried by \ref AST_AUDIOSOCKET_KIND_CONTROL messages
+ */
+enum ast_audiosocket_control {
+	/*! The call was answered */
+	AST_AUDIOSOCKET_CONTROL_ANSWER = 0x01,
+	/*! The call was put on hold */
+	AST_AUDIOSOCKET_CONTROL_HOLD = 0x02,
+	/*! The call was taken off hold */
+	AST_AUDIOSOCKET_CONTROL_UNHOLD = 0x03,
+};
+
+/*!
+ * \brief Get the AudioSocket message kind which carries a format
+ *
+ * \param format The Asterisk format of the audio.
+ *
+ * \retval The \ref ast_audiosocket_msg_kind for the format
+ * \retval -1 if the format can not be carried by AudioSocket
+ */
+const int ast_audiosocket_kind_from_format(const struct ast_format *format);
+
+/*!
+ * \brief Get the Asterisk format of the audio carried by a message kind
+ *
+ * \param kind The AudioSocket message kind.
+ *
+ * \retval The \ref ast_format of the audio
+ * \retval NULL if the kind does not carry audio
+ */
+struct ast_format *ast_audiosocket_format_from_kind(const uint8_t kind);
+
+/*!
+ * \brief Get the signed linear format best suited to a sample rate
+ *
+ * This is the highest rate signed linear format which AudioSocket carries and
+ * which does not exceed the given rate, or 8kHz signed linear if there is
+ * none.
+ *
+ * \param rate The sample rate, in Hz.
+ *
+ * \retval The \ref ast_format to use
+ */
+struct ast_format *ast_audiosocket_slin_format(const unsigned int rate);
+
+/*!
+ * \brief Connect to an AudioSocket server
+ *
+ * If audiosocket.conf keeps a pool of idle connections to the server, one of
+ * them is returned at once and replaced in the background.
  *
  * \param server The server address, including port.
  * \param chan An optional channel which will be put into autoservice during
@@ -63,6 +157,10 @@ const int ast_audiosocket_init(const int svc, const char *id);
 /*!
  * \brief Send an Asterisk audio frame to an AudioSocket server
  *
+ * The payload is written directly from the frame.  If the socket can not take
+ * the whole message at once, this waits for it to drain so that a message is
+ * never left partially written.
+ *
  * \param svc The file descriptor of the network socket to the AudioSocket server.
  * \param f The Asterisk audio frame to send.
  *
@@ -77,6 +175,10 @@ const int ast_audiosocket_send_frame(const int svc, const struct ast_frame *f);
  * This returned object is a pointer to an Asterisk frame which must be
  * manually freed by the caller.
  *
+ * This function keeps no state between calls, so once it has started reading
+ * a message it waits for the rest of it.  Use
+ * \ref ast_audiosocket_conn_receive_frame, which never blocks, instead.
+ *
  * \param svc The file descriptor of the network socket to the AudioSocket server.
  *
  * \retval A \ref ast_frame on success
@@ -84,4 +186,548 @@ const int ast_audiosocket_send_frame(const int svc, const struct ast_frame *f);
  */
 struct ast_frame *ast_audiosocket_receive_frame(const int svc);
 
+/*!
+ * \brief Per-connection AudioSocket state
+ *
+ * This holds the receive buffer for a connection, so that a single read from
+ * the socket may produce any number of messages and an incomplete message may
+ * be completed by a later read.
+ */
+struct ast_audiosocket_conn;
+
+/*!
+ * \brief Create the per-connection state for an AudioSocket
+ *
+ * The returned object is an ao2 object.  It takes ownership of the socket,
+ * which is closed when the last reference is released.
+ *
+ * \param svc The file descriptor of the network socket to the AudioSocket server.
+ *
+ * \retval An \ref ast_audiosocket_conn on success
+ * \retval NULL on error
+ */
+struct ast_audiosocket_conn *ast_audiosocket_conn_alloc(const int svc);
+
+/*!
+ * \brief Flags for \ref ast_audiosocket_conn_connect
+ */
+enum ast_audiosocket_conn_flags {
+	/*! Carry the session as a stream of a connection shared with other
+	 * sessions to the same server */
+	AST_AUDIOSOCKET_CONN_MULTIPLEX = (1 << 0),
+	/*! Exchange messages as UDP datagrams, each with a sequence number and
+	 * timestamp, instead of over a TCP connection */
+	AST_AUDIOSOCKET_CONN_DATAGRAM = (1 << 1),
+};
+
+/*!
+ * \brief Connect to an AudioSocket server and create the per-connection state
+ *
+ * Without \ref AST_AUDIOSOCKET_CONN_MULTIPLEX, this is
+ * \ref ast_audiosocket_connect followed by \ref ast_audiosocket_conn_alloc.
+ *
+ * With it, the session becomes a stream of a persistent connection to the
+ * server which is opened by the first such session and shared by up to a few
+ * hundred of them.  Every message of the stream travels in an
+ * \ref AST_AUDIOSOCKET_KIND_MUX envelope, and releasing the returned object
+ * sends a hangup for the stream without closing the shared connection.
+ *
+ * With \ref AST_AUDIOSOCKET_CONN_DATAGRAM, each message is sent to the server
+ * in a UDP datagram of its own, after a two-byte sequence number and a
+ * four-byte timestamp in milliseconds (both big endian).  A datagram which
+ * arrives after a newer one is dropped instead of being delivered late, and
+ * received frames carry the sequence number and timestamp for a jitter buffer.
+ * Releasing the returned object sends a hangup.  This can not be combined with
+ * \ref AST_AUDIOSOCKET_CONN_MULTIPLEX.
+ *
+ * \param server The server address, including port.
+ * \param chan An optional channel which will be put into autoservice during
+ * the connection period.  If there is no channel to be autoserviced, pass NULL
+ * instead.
+ * \param flags A combination of \ref ast_audiosocket_conn_flags.
+ *
+ * \retval An \ref ast_audiosocket_conn on success
+ * \retval NULL on error
+ */
+struct ast_audiosocket_conn *ast_audiosocket_conn_connect(const char *server,
+	struct ast_channel *chan, const unsigned int flags);
+
+/*!
+ * \brief Send the initial message over an AudioSocket connection
+ *
+ * This is \ref ast_audiosocket_init for a connection which may be
+ * multiplexed.
+ *
+ * \param conn The AudioSocket connection.
+ * \param id The UUID to send to the AudioSocket server to uniquely identify this connection.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_init(struct ast_audiosocket_conn *conn, const char *id);
+
+/*!
+ * \brief Offer the extended message header to the server of a connection
+ *
+ * Once set, \ref ast_audiosocket_conn_init follows the UUID with a second ID
+ * message whose one byte of flags offers the extended header.  Messages are
+ * sent plain until the server accepts, by sending back an ID message with the
+ * same flag or a message whose header is itself extended.  From then on, every
+ * message from Asterisk but an ID or an error has the
+ * \ref AST_AUDIOSOCKET_KIND_EXTENDED bit set in its kind, and its 3-byte
+ * header followed by a 16-bit sequence number and a 32-bit timestamp, both big
+ * endian.  The sequence number counts the extended messages of the
+ * connection, so that lost and reordered ones can be spotted.  The timestamp
+ * is the number of milliseconds since the first of them was sent.
+ *
+ * A server may extend the headers of its own messages in the same way, with
+ * its own sequence number and, as the timestamp, that of the newest message it
+ * had received when it sent the message, or 0 if none.  Asterisk then hands
+ * the server's sequence numbers on in the \c seqno of the frames it receives
+ * and, unless the connection is multiplexed, measures the round trip from
+ * each message it sends to the first reply which echoes it.
+ *
+ * This must be called before \ref ast_audiosocket_conn_init.
+ *
+ * \param conn The AudioSocket connection.
+ * \param enabled Non-zero to offer the extended header.
+ */
+void ast_audiosocket_conn_set_extended(struct ast_audiosocket_conn *conn, const int enabled);
+
+/*!
+ * \brief Send a copy of every message sent over an AudioSocket connection to
+ * another connection
+ *
+ * Each message, from the UUID message on, is prepared once, with any batching,
+ * silence detection and byte swapping applied, and its payload is written to
+ * the connection and then to each copy over the copy's own transport.  A copy
+ * which can not be written to is dropped without failing the write.  Nothing
+ * received on a copy reaches the channel; the caller should still read it, if
+ * only to notice when its server hangs up.
+ *
+ * \param conn The AudioSocket connection.
+ * \param tee The connection to send copies to, which takes a reference.  It
+ * must not be sent copies of its own.  Up to 8 copies may be added.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_tee(struct ast_audiosocket_conn *conn,
+	struct ast_audiosocket_conn *tee);
+
+/*!
+ * \brief Stop sending copies of the messages of an AudioSocket connection to
+ * another connection
+ *
+ * Calling this for a connection which is not sent copies, or has already been
+ * dropped, does nothing.
+ *
+ * \param conn The AudioSocket connection.
+ * \param tee The connection which was passed to \ref ast_audiosocket_conn_tee.
+ */
+void ast_audiosocket_conn_untee(struct ast_audiosocket_conn *conn,
+	struct ast_audiosocket_conn *tee);
+
+/*!
+ * \brief Get the file descriptor which signals that an AudioSocket is readable
+ *
+ * \param conn The AudioSocket connection.
+ *
+ * \retval The file descriptor of the network socket, or of an alert pipe
+ * for a multiplexed stream
+ */
+const int ast_audiosocket_conn_fd(const struct ast_audiosocket_conn *conn);
+
+/*!
+ * \brief Receive Asterisk frames from an AudioSocket server
+ *
+ * A single read is made from the socket, and every complete message which has
+ * been received is returned as a list of frames linked through their
+ * frame_list entries.  A partial message is kept for the next call, which
+ * resumes parsing where this one stopped, so this function never waits for
+ * the socket.  If the server ends the session after sending audio, the audio
+ * is returned followed by an \ref AST_CONTROL_HANGUP control frame.
+ *
+ * The returned list must be freed by the caller with ast_frfree.  Frames of
+ * the usual sizes come from a pool owned by the connection and are only valid
+ * until the next call; use ast_frdup to keep one for longer.
+ *
+ * \param conn The AudioSocket connection.
+ *
+ * \retval A list of \ref ast_frame on success
+ * \retval &ast_null_frame if no complete message is available yet
+ * \retval NULL on error or hangup
+ */
+struct ast_frame *ast_audiosocket_conn_receive_frame(struct ast_audiosocket_conn *conn);
+
+/*!
+ * \brief Note that the audio received from an AudioSocket connection has been
+ * handed to the channel
+ *
+ * This ends the time measured from the socket becoming readable, which
+ * `audiosocket show stats` and the AudioSocketStats manager action report.
+ * Call it once the frames returned by \ref ast_audiosocket_conn_receive_frame
+ * have been written or queued to the channel, or put into a jitter buffer.
+ * Connections attached to a reactor are measured by the reactor.
+ *
+ * \param conn The AudioSocket connection.
+ */
+void ast_audiosocket_conn_written(struct ast_audiosocket_conn *conn);
+
+/*!
+ * \brief Flags for \ref ast_audiosocket_conn_attach
+ */
+enum ast_audiosocket_attach_flags {
+	/*! Write received frames to the channel, as an application does, instead
+	 * of queueing them as frames read from it, as a channel driver does */
+	AST_AUDIOSOCKET_ATTACH_WRITE = (1 << 0),
+};
+
+/*!
+ * \brief Hand the receive side of an AudioSocket connection to a reactor thread
+ *
+ * Instead of the channel's thread waiting on \ref ast_audiosocket_conn_fd,
+ * one of a small pool of threads shared by all attached connections receives
+ * the messages and delivers them to the channel, either queued with
+ * ast_queue_frame or, with \ref AST_AUDIOSOCKET_ATTACH_WRITE, written with
+ * ast_write.  When the server hangs up or the connection fails, a hangup is
+ * queued on the channel.  Sending is unaffected.
+ *
+ * The reactor is enabled with the reactor option of audiosocket.conf.  The
+ * connection must be passed to \ref ast_audiosocket_conn_detach before it is
+ * released.
+ *
+ * \param conn The AudioSocket connection.
+ * \param chan The channel to deliver the received frames to.
+ * \param flags A combination of \ref ast_audiosocket_attach_flags.
+ *
+ * \retval 0 on success
+ * \retval -1 if the reactor is disabled or on error, in which case the caller
+ * should receive on the connection itself
+ */
+const int ast_audiosocket_conn_attach(struct ast_audiosocket_conn *conn,
+	struct ast_channel *chan, const unsigned int flags);
+
+/*!
+ * \brief Take the receive side of an AudioSocket connection back from the reactor
+ *
+ * A frame being delivered at the time of the call may still reach the
+ * channel.  Calling this for a connection which is not attached does nothing.
+ * A detached connection may still be sent on, but is not received on again.
+ *
+ * \param conn The AudioSocket connection.
+ */
+void ast_audiosocket_conn_detach(struct ast_audiosocket_conn *conn);
+
+/*!
+ * \brief A buffer which plays out the audio received from a server in real time
+ */
+struct ast_audiosocket_jb;
+
+/*!
+ * \brief Statistics of an AudioSocket jitter buffer
+ */
+struct ast_audiosocket_jb_stats {
+	unsigned int depth;	/*!< Audio currently buffered, in ms */
+	unsigned int target;	/*!< Depth buffered before playout starts, in ms */
+	unsigned int peak;	/*!< Deepest the buffer has been, in ms */
+	unsigned int frames_in;	/*!< Voice frames put into the buffer */
+	unsigned int frames_out;	/*!< Voice frames played out of the buffer */
+	unsigned int underruns;	/*!< Times a frame was due and none was buffered */
+	unsigned int dropped;	/*!< Voice frames dropped because the buffer was too deep */
+};
+
+/*!
+ * \brief Create a jitter buffer for the audio received from a server
+ *
+ * Frames put into the buffer are played out at the rate of the audio they
+ * carry, whether the server sends them in bursts or faster than real time.
+ * Playout starts once a target depth is buffered.  The target starts at the
+ * minimum depth, grows by a frame at each underrun and shrinks back towards
+ * the minimum while the server keeps up.  A caller stops receiving while the
+ * buffer is full, so that the server is slowed by its connection rather than
+ * losing audio.
+ *
+ * \param min_ms The depth to buffer before playout starts, in ms.
+ * \param max_ms The deepest the buffer may become, in ms.
+ *
+ * \retval An ao2 object which the caller must release
+ * \retval NULL on error
+ */
+struct ast_audiosocket_jb *ast_audiosocket_jb_alloc(const unsigned int min_ms,
+	const unsigned int max_ms);
+
+/*!
+ * \brief Add received frames to a jitter buffer
+ *
+ * The voice, DTMF and control frames are copied, and are played out in the
+ * order they were received, ending with any hangup.  Other frames are
+ * ignored.  A voice frame longer than the maximum depth is split into
+ * pieces, or dropped if its codec can not be split.  If the buffer becomes
+ * deeper than its maximum, the oldest frames are dropped.
+ *
+ * \param jb The jitter buffer.
+ * \param f The frames, as returned by \ref ast_audiosocket_conn_receive_frame,
+ * which the caller still frees.
+ */
+void ast_audiosocket_jb_put(struct ast_audiosocket_jb *jb, const struct ast_frame *f);
+
+/*!
+ * \brief Determine whether a jitter buffer has no room for another receive
+ *
+ * A buffer is only ever full while it plays out, so it is never full once
+ * it has drained.
+ *
+ * \param jb The jitter buffer.
+ *
+ * \retval 1 if the caller should not receive from the server
+ * \retval 0 otherwise
+ */
+const int ast_audiosocket_jb_full(const struct ast_audiosocket_jb *jb);
+
+/*!
+ * \brief Take the next frame which is due to be played out of a jitter buffer
+ *
+ * \param jb The jitter buffer.
+ *
+ * \retval A frame, which the caller must free
+ * \retval NULL if no frame is due yet
+ */
+struct ast_frame *ast_audiosocket_jb_get(struct ast_audiosocket_jb *jb);
+
+/*!
+ * \brief Get the time until the next frame is due to be played out of a jitter buffer
+ *
+ * \param jb The jitter buffer.
+ *
+ * \retval The time to wait in ms, which is 0 if a frame is due now
+ * \retval -1 if playout is waiting for more audio to be received
+ */
+const int ast_audiosocket_jb_wait(struct ast_audiosocket_jb *jb);
+
+/*!
+ * \brief Get the statistics of a jitter buffer
+ *
+ * \param jb The jitter buffer.
+ * \param stats Set to the statistics.
+ */
+void ast_audiosocket_jb_stats(const struct ast_audiosocket_jb *jb,
+	struct ast_audiosocket_jb_stats *stats);
+
+/*!
+ * \brief Combine outgoing voice frames into larger AudioSocket messages
+ *
+ * Once set, \ref ast_audiosocket_conn_send_frame holds voice frames until the
+ * given number of them can be sent as a single message, for consumers which
+ * prefer fewer, larger messages over low latency.  A partial batch is sent
+ * once its first frame has waited for the maximum delay, which the caller
+ * enforces with \ref ast_audiosocket_conn_flush_timeout, and whenever
+ * \ref ast_audiosocket_conn_flush is called.
+ *
+ * \param conn The AudioSocket connection.
+ * \param frames The number of frames per message.  0 or 1 disables batching.
+ * \param max_delay_ms The longest time, in milliseconds, that a frame may be
+ * held before it is sent.
+ */
+void ast_audiosocket_conn_set_batch(struct ast_audiosocket_conn *conn,
+	const unsigned int frames, const unsigned int max_delay_ms);
+
+/*!
+ * \brief Send silent voice frames as compact silence messages
+ *
+ * Once set, \ref ast_audiosocket_conn_send_frame measures the RMS level of
+ * signed linear and G.711 voice frames with \ref ast_audiosocket_slin_energy.
+ * After the first 200 milliseconds of a pause, frames below the threshold are
+ * replaced by an
+ * \ref AST_AUDIOSOCKET_KIND_SILENCE message whose payload is the 16-bit
+ * duration of the silence in milliseconds.  When batching, the silent frames
+ * of a batch are combined into one such message.
+ *
+ * \param conn The AudioSocket connection.
+ * \param threshold The RMS level below which a frame is silent, on the scale
+ * of the silence threshold of dsp.conf.  0 disables silence suppression.
+ */
+void ast_audiosocket_conn_set_silence(struct ast_audiosocket_conn *conn,
+	const unsigned int threshold);
+
+/*!
+ * \brief Send an Asterisk audio frame over an AudioSocket connection
+ *
+ * This is \ref ast_audiosocket_send_frame, subject to the batching set with
+ * \ref ast_audiosocket_conn_set_batch and the silence suppression set with
+ * \ref ast_audiosocket_conn_set_silence.
+ *
+ * \param conn The AudioSocket connection.
+ * \param f The Asterisk audio frame to send.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_send_frame(struct ast_audiosocket_conn *conn,
+	const struct ast_frame *f);
+
+/*!
+ * \brief Send any partial batch of frames held by an AudioSocket connection
+ *
+ * Without a batch, this writes whatever the socket will now take of the
+ * messages queued because it could not take them when they were sent, and
+ * fails once the oldest has waited too long if the write queue is set to.
+ * This should be called before the connection is released at hangup.
+ *
+ * \param conn The AudioSocket connection.
+ *
+ * \retval 0 on success, or if nothing was pending
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_flush(struct ast_audiosocket_conn *conn);
+
+/*!
+ * \brief Send two channels of 8kHz signed linear audio over an AudioSocket
+ * connection as one \ref AST_AUDIOSOCKET_KIND_AUDIO_STEREO message
+ *
+ * The samples are interleaved with \ref ast_audiosocket_slin_interleave.  Any
+ * pending batch is sent first; stereo audio is neither batched nor replaced
+ * by silence messages.
+ *
+ * \param conn The AudioSocket connection.
+ * \param left The samples of the first channel, in host byte order.
+ * \param right The samples of the second channel, in host byte order.
+ * \param samples The number of samples of each channel.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_send_stereo(struct ast_audiosocket_conn *conn,
+	const int16_t *left, const int16_t *right, const size_t samples);
+
+/*!
+ * \brief Send the start or end of a DTMF digit over an AudioSocket connection
+ *
+ * The start is sent as an \ref AST_AUDIOSOCKET_KIND_DTMF_BEGIN message and the
+ * end as an \ref AST_AUDIOSOCKET_KIND_DTMF message, so that a server which
+ * only knows the latter still gets each digit once.  Any pending batch is sent
+ * first, so that the digit follows the audio before it.  Digits received from
+ * the server become \c AST_FRAME_DTMF_BEGIN and \c AST_FRAME_DTMF_END frames,
+ * whose duration is left to the core to measure.
+ *
+ * \param conn The AudioSocket connection.
+ * \param digit The digit.
+ * \param end Non-zero at the end of the digit, 0 at its start.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_send_dtmf(struct ast_audiosocket_conn *conn, const char digit,
+	const int end);
+
+/*!
+ * \brief Send a control event over an AudioSocket connection as an
+ * \ref AST_AUDIOSOCKET_KIND_CONTROL message
+ *
+ * Any pending batch is sent first.  Only \c AST_CONTROL_ANSWER,
+ * \c AST_CONTROL_HOLD and \c AST_CONTROL_UNHOLD are carried; those received
+ * from the server become \c AST_FRAME_CONTROL frames.
+ *
+ * \param conn The AudioSocket connection.
+ * \param control The \c ast_control_frame_type of the event.
+ *
+ * \retval 0 on success
+ * \retval 1 if the event is not one which AudioSocket carries
+ * \retval -1 on error
+ */
+const int ast_audiosocket_conn_send_control(struct ast_audiosocket_conn *conn, const int control);
+
+/*!
+ * \brief Get the time until a partial batch of frames must be sent, or queued
+ * messages offered to the socket again
+ *
+ * A thread which waits on the connection should wait no longer than this, and
+ * call \ref ast_audiosocket_conn_flush when it reaches 0.  While messages are
+ * queued, it is never more than a few milliseconds.
+ *
+ * \param conn The AudioSocket connection.
+ *
+ * \retval The number of milliseconds until \ref ast_audiosocket_conn_flush
+ * must be called
+ * \retval 0 if it is due now
+ * \retval -1 if nothing is pending
+ */
+const int ast_audiosocket_conn_flush_timeout(const struct ast_audiosocket_conn *conn);
+
+/*!
+ * \brief The gain of \ref ast_audiosocket_slin_gain which leaves samples unchanged
+ *
+ * Gain is a fixed-point fraction of this, so 512 doubles the level and 128
+ * halves it.
+ */
+#define AST_AUDIOSOCKET_GAIN_UNITY 256
+
+/*! \brief The energy of a run of signed linear samples */
+struct ast_audiosocket_energy {
+	uint64_t sum_squares;	/*!< Sum of the squares of the samples */
+	size_t samples;	/*!< Number of samples measured */
+	unsigned int peak;	/*!< Largest absolute sample value, at most 32767 */
+};
+
+/*!
+ * \brief Scale signed linear samples, saturating those which overflow
+ *
+ * This and the other sample kernels use the processor's vector unit (SSE2 or
+ * AVX2 on x86, NEON on ARM) when it has one, chosen when the module loads.
+ * Samples are in host byte order.
+ *
+ * \param samples The samples, which are scaled in place.
+ * \param count The number of samples.
+ * \param gain The gain, relative to \ref AST_AUDIOSOCKET_GAIN_UNITY.  At most
+ * 32767.
+ */
+void ast_audiosocket_slin_gain(int16_t *samples, const size_t count, const unsigned int gain);
+
+/*!
+ * \brief Add the energy of signed linear samples to a running total
+ *
+ * \param samples The samples.
+ * \param count The number of samples.
+ * \param energy The total, which should be zeroed before the first call.
+ */
+void ast_audiosocket_slin_energy(const int16_t *samples, const size_t count,
+	struct ast_audiosocket_energy *energy);
+
+/*!
+ * \brief Get the RMS level of the samples measured by \ref ast_audiosocket_slin_energy
+ *
+ * \retval The RMS level, or 0 if nothing has been measured
+ */
+const unsigned int ast_audiosocket_energy_rms(const struct ast_audiosocket_energy *energy);
+
+/*!
+ * \brief Mix one stream of signed linear samples into another, saturating
+ *
+ * \param dst The samples mixed into, which receive the result.
+ * \param src The samples mixed in.
+ * \param count The number of samples in each.
+ */
+void ast_audiosocket_slin_mix(int16_t *dst, const int16_t *src, const size_t count);
+
+/*!
+ * \brief Swap the byte order of signed linear samples
+ *
+ * \param dst Where the swapped samples are stored.  This may be the same as src.
+ * \param src The samples.
+ * \param count The number of samples.
+ */
+void ast_audiosocket_slin_swap(int16_t *dst, const int16_t *src, const size_t count);
+
+/*!
+ * \brief Interleave two channels of signed linear samples
+ *
+ * \param dst Where the interleaved samples are stored, 2 * count of them,
+ * starting with the first of left.
+ * \param left The samples of the first channel.
+ * \param right The samples of the second channel.
+ * \param count The number of samples of each channel.
+ */
+void ast_audiosocket_slin_interleave(int16_t *dst, const int16_t *left, const int16_t *right,
+	const size_t count);
+
 #endif /* _ASTERISK_RES_AUDIOSOCKET_H */
@@ -28,9 +28,93 @@
 	<support_level>extended</support_level>
  ***/
 
+/*** DOCUMENTATION
+	<manager name="AudioSocketStats" language="en_US">
+		<synopsis>
+			Show the traffic and latency counters of AudioSocket.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Lists the counters of all AudioSocket connections since the module
+			loaded in an <literal>AudioSocketStats</literal> event, followed by an
+			<literal>AudioSocketConnectionStats</literal> event for each open connection,
+			and ends with <literal>AudioSocketStatsComplete</literal>. Times are given as
+			the upper bounds of their percentiles.</para>
+		</description>
+	</manager>
+	<managerEvent language="en_US" name="AudioSocketConnectionEnd">
+		<managerEventInstance class="EVENT_FLAG_REPORTING">
+			<synopsis>Raised when an AudioSocket connection closes, with its counters.</synopsis>
+			<syntax>
+				<parameter name="Server">
+					<para>The server, if the connection was made to one.</para>
+				</parameter>
+				<parameter name="Channel">
+					<para>The channel which the connection was made for.</para>
+				</parameter>
+				<parameter name="Duration">
+					<para>How long the connection was open, in seconds.</para>
+				</parameter>
+				<parameter name="FramesIn">
+					<para>Voice frames received from the server.</para>
+				</parameter>
+				<parameter name="FramesOut">
+					<para>Voice frames sent to the server.</para>
+				</parameter>
+				<parameter name="BytesIn">
+					<para>Payload bytes of the voice frames received.</para>
+				</parameter>
+				<parameter name="BytesOut">
+					<para>Payload bytes of the messages sent.</para>
+				</parameter>
+				<parameter name="ShortReads">
+					<para>Reads which ended part of the way through a message.</para>
+				</parameter>
+				<parameter name="WriteWaits">
+					<para>Writes which had to wait for the socket to drain.</para>
+				</parameter>
+				<parameter name="WriteQueued">
+					<para>Messages held in the write queue because the socket could not
+					take them at once.</para>
+				</parameter>
+				<parameter name="WriteDropped">
+					<para>Messages of audio dropped because the write queue was full.</para>
+				</parameter>
+				<parameter name="SequenceGaps">
+					<para>Messages with an extended header whose sequence number did not
+					follow that of the one before.</para>
+				</parameter>
+				<parameter name="ConnectSamples">
+					<para>Number of connect times measured. <literal>ConnectMeanUsec</literal>,
+					<literal>ConnectP50Usec</literal>, <literal>ConnectP90Usec</literal> and
+					<literal>ConnectP99Usec</literal> follow it.</para>
+				</parameter>
+				<parameter name="JitterSamples">
+					<para>Number of arrivals measured against the pace of the audio before
+					them, followed by <literal>JitterMeanUsec</literal> and its percentiles
+					as for <literal>ConnectSamples</literal>.</para>
+				</parameter>
+				<parameter name="LatencySamples">
+					<para>Number of times measured from the socket becoming readable to the
+					audio reaching the channel, or the jitter buffer if there is one,
+					followed by <literal>LatencyMeanUsec</literal> and its percentiles.</para>
+				</parameter>
+				<parameter name="RoundTripSamples">
+					<para>Number of round trips measured from a message sent with an
+					extended header to the first reply which echoed its timestamp,
+					followed by <literal>RoundTripMeanUsec</literal> and its percentiles.</para>
+				</parameter>
+			</syntax>
+		</managerEventInstance>
+	</managerEvent>
+ ***/
+
 #include "asterisk.h"
 #include "errno.h"
 #include <uuid/uuid.h>
+#include <sys/uio.h>
 
 #include "asterisk/file.h"
 #include "asterisk/res_audiosocket.h"
@@ -38,307 +122,6321 @@
 #include "asterisk/module.h"
 #include "asterisk/uuid.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/codec.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/utils.h"
+#include "asterisk/lock.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/alertpipe.h"
+#include "asterisk/config.h"
+#include "asterisk/dns_core.h"
+#include "asterisk/endian.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+
+#include <math.h>
+#include <arpa/nameser.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+/* io_uring is used through its system calls, so liburing is not needed */
+#if defined(IORING_OFF_SQ_RING) && defined(IORING_FEAT_NODROP) \
+	&& defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define AUDIOSOCKET_HAVE_URING
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUDIOSOCKET_KERNELS_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIOSOCKET_KERNELS_NEON
+#endif
+
+#define	MODULE_DESCRIPTION	"AudioSocket support functions for Asterisk"
+
+/*! \brief Time allowed for a connection attempt, unless configured otherwise */
+#define MAX_CONNECT_TIMEOUT_MSEC 2000
+
+/*! \brief Delay before racing the next address against those still connecting (RFC 8305) */
+#define AUDIOSOCKET_CONNECT_ATTEMPT_DELAY_MSEC 250
+
+/*! \brief Most addresses of a server which are tried */
+#define AUDIOSOCKET_CONNECT_MAX_ATTEMPTS 16
+
+/*! \brief The configuration file, which names the servers to keep connections to */
+#define AUDIOSOCKET_CONFIG "audiosocket.conf"
+
+/*! \brief Most idle connections kept for one server */
+#define AUDIOSOCKET_POOL_MAX_IDLE 64
+
+/*! \brief How often the idle connections are checked and the pools topped up */
+#define AUDIOSOCKET_POOL_CHECK_MSEC 5000
+
+/*! \brief TTL of addresses found by the system resolver, which does not report one */
+#define AUDIOSOCKET_DNS_DEFAULT_TTL 30
+
+/*! \brief Shortest TTL honored, so a zero TTL does not mean a lookup per call */
+#define AUDIOSOCKET_DNS_MIN_TTL 1
+
+/*! \brief Seconds past their TTL for which addresses are used while being refreshed */
+#define AUDIOSOCKET_DNS_STALE_SEC 30
+
+/*! \brief Seconds without a call after which a server is no longer kept resolved */
+#define AUDIOSOCKET_DNS_IDLE_SEC 300
+
+/*!
+ * \brief Maximum time to wait for the socket to accept the rest of a message
+ * which the kernel could not take in one write
+ */
+#define MAX_WRITE_TIMEOUT_MSEC 500
+
+/*!
+ * \brief Maximum time ast_audiosocket_receive_frame waits in all for the
+ * remainder of a payload before giving up
+ */
+#define LEGACY_PAYLOAD_TIMEOUT_MSEC 15
+
+/*! \brief Length of the AudioSocket message header (kind and 16-bit payload length) */
+#define AUDIOSOCKET_HEADER_LEN 3
+
+/*! \brief Length of the sequence number and timestamp which extend a message header */
+#define AUDIOSOCKET_EXTENDED_LEN 6
+
+/*! \brief Flag of the ID message which offers the extended header, or accepts it */
+#define AUDIOSOCKET_ID_FLAG_EXTENDED 0x01
+
+/*! \brief Length of the payload of an ID message which carries flags rather than a UUID */
+#define AUDIOSOCKET_ID_FLAGS_LEN 1
+
+/*! \brief Size of the per-connection receive buffer */
+#define AUDIOSOCKET_RX_BUFFER_SIZE 4096
+
+/*! \brief Largest payload held by a pooled frame: 20ms of 16kHz signed linear */
+#define AUDIOSOCKET_POOL_PAYLOAD_SIZE 640
+
+/*!
+ * \brief Number of pooled frames per connection, enough for a receive buffer
+ * full of 20ms 8kHz signed linear messages
+ */
+#define AUDIOSOCKET_POOL_SIZE (AUDIOSOCKET_RX_BUFFER_SIZE / (AUDIOSOCKET_HEADER_LEN + 320))
+
+/*! \brief Length of the stream ID which starts a multiplexed envelope */
+#define AUDIOSOCKET_MUX_ID_LEN 2
+
+/*! \brief Length of the envelope header and stream ID of a multiplexed message */
+#define AUDIOSOCKET_MUX_PREFIX_LEN (AUDIOSOCKET_HEADER_LEN + AUDIOSOCKET_MUX_ID_LEN)
+
+/*! \brief Largest payload of a message carried in a multiplexed envelope */
+#define AUDIOSOCKET_MUX_MAX_PAYLOAD (UINT16_MAX - AUDIOSOCKET_MUX_ID_LEN - AUDIOSOCKET_HEADER_LEN)
+
+/*! \brief Most streams carried by one multiplexed connection */
+#define AUDIOSOCKET_MUX_MAX_STREAMS 256
+
+/*!
+ * \brief Most frames held for a multiplexed stream which is not being read,
+ * beyond which further frames for it are dropped
+ */
+#define AUDIOSOCKET_MUX_MAX_QUEUE 50
+
+/*! \brief How often the reader of a multiplexed connection checks for shutdown */
+#define AUDIOSOCKET_MUX_POLL_MSEC 500
+
+/*! \brief Length of the sequence number and timestamp which start every datagram */
+#define AUDIOSOCKET_DATAGRAM_PREFIX_LEN 6
+
+/*! \brief Largest datagram sent or received, including its prefix */
+#define AUDIOSOCKET_DATAGRAM_MAX AUDIOSOCKET_RX_BUFFER_SIZE
+
+/*! \brief Most datagrams read by one receive */
+#define AUDIOSOCKET_DATAGRAM_BURST 16
+
+/*!
+ * \brief How far behind the newest datagram one may be and still be taken as
+ * late rather than as the server having started its sequence again
+ */
+#define AUDIOSOCKET_DATAGRAM_LATE_WINDOW 1000
+
+/*!
+ * \brief Number of datagrams sent after the ID, each preceded by the ID again,
+ * before the server is assumed to have it without having sent anything back
+ */
+#define AUDIOSOCKET_DATAGRAM_ID_REPEATS 50
+
+/*! \brief Length of the payload of a silence message: its 16-bit duration in milliseconds */
+#define AUDIOSOCKET_SILENCE_LEN 2
+
+/*!
+ * \brief Silence sent as audio at the start of each pause, so that the ends of
+ * words are not cut off
+ */
+#define AUDIOSOCKET_SILENCE_HANGOVER_MSEC 200
+
+/*! \brief Number of power-of-two microsecond buckets in a latency histogram */
+#define AUDIOSOCKET_HISTOGRAM_BUCKETS 24
+
+/*! \brief Longest server name kept with the counters of a connection */
+#define AUDIOSOCKET_STATS_NAME_LEN 256
+
+/*! \brief Number of G.711 samples decoded at a time to measure their energy */
+#define AUDIOSOCKET_G711_CHUNK 160
+
+/*! \brief Fractional bits of the fixed-point gain of the sample kernels */
+#define AUDIOSOCKET_GAIN_SHIFT 8
+
+/*! \brief Half of the smallest step of gain, added so that products are rounded */
+#define AUDIOSOCKET_GAIN_ROUND (1 << (AUDIOSOCKET_GAIN_SHIFT - 1))
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+/*! \brief Signed linear payloads are little-endian, so this host swaps them */
+#define AUDIOSOCKET_SLIN_SWAP 1
+#else
+#define AUDIOSOCKET_SLIN_SWAP 0
+#endif
+
+/*! \brief Time assumed for a frame whose length can not be determined */
+#define AUDIOSOCKET_JB_DEFAULT_FRAME_MSEC 20
+
+/*! \brief Time without an underrun after which a jitter buffer aims shallower */
+#define AUDIOSOCKET_JB_SHRINK_MSEC 10000
+
+/*! \brief Most reactor threads started, whatever the number of processors */
+#define AUDIOSOCKET_REACTOR_MAX_THREADS 16
+
+/*! \brief Most readiness events handled by a reactor thread per wait */
+#define AUDIOSOCKET_REACTOR_EVENTS 64
+
+/*! \brief Submission queue entries of a reactor thread's io_uring */
+#define AUDIOSOCKET_URING_ENTRIES 1024
+
+/*! \brief Marks the io_uring poll which waits for a socket to take more */
+#define AUDIOSOCKET_URING_OUT 1
+
+/*! \brief The user data of io_uring requests whose completions are ignored */
+#define AUDIOSOCKET_URING_IGNORE 2
+
+/*!
+ * \brief Default number of messages held for a connection whose server is not
+ * taking them as fast as they are sent: a second of 20ms frames
+ */
+#define AUDIOSOCKET_TXQ_DEFAULT_SIZE 50
+
+/*! \brief Most connections which may be sent a copy of what a connection sends */
+#define AUDIOSOCKET_MAX_TEES 8
+
+/*! \brief Most messages which the write queue of a connection may be set to hold */
+#define AUDIOSOCKET_TXQ_MAX_SIZE 1024
+
+/*! \brief Most queued messages handed to the socket in one write */
+#define AUDIOSOCKET_TXQ_IOV 16
+
+/*! \brief How often a thread which waits on a connection retries its write queue */
+#define AUDIOSOCKET_TXQ_RETRY_MSEC 10
+
+/*! \brief A preallocated frame and the storage for its payload */
+struct audiosocket_pooled_frame {
+	struct ast_frame fr;
+	uint8_t buf[AST_FRIENDLY_OFFSET + AUDIOSOCKET_POOL_PAYLOAD_SIZE];
+};
+
+/*! \brief Receive parser state of an AudioSocket connection */
+enum audiosocket_rx_state {
+	/*! Waiting for the header of the next message */
+	AUDIOSOCKET_RX_HEADER,
+	/*! The header has been parsed; waiting for the rest of the payload */
+	AUDIOSOCKET_RX_PAYLOAD,
+};
+
+/*! \brief What a connection does with audio its server is not keeping up with */
+enum audiosocket_txq_policy {
+	/*! Drop the oldest audio waiting to be sent to make room */
+	AUDIOSOCKET_TXQ_DROP_OLDEST,
+	/*! Drop the audio being sent while the queue is full */
+	AUDIOSOCKET_TXQ_DROP_NEWEST,
+	/*! Drop nothing; fail once the oldest message has waited too long */
+	AUDIOSOCKET_TXQ_FAIL,
+};
+
+/*! \brief A message waiting in the write queue of a connection */
+struct audiosocket_txq_msg {
+	uint8_t *data;	/* Storage for the message, reused by later messages */
+	size_t size;	/* Allocated size of data */
+	size_t len;	/* Length of the message */
+	struct timeval queued;	/* When the message was queued */
+	int droppable;	/* Set if the message is audio which may be dropped */
+};
+
+/*!
+ * \brief Messages which the socket of a connection could not take when they
+ * were sent, held in order until it can
+ */
+struct audiosocket_txq {
+	struct audiosocket_txq_msg *msgs;	/* The ring of messages, allocated when first needed */
+	unsigned int size;	/* Number of messages the ring holds, or 0 to wait for the socket instead */
+	unsigned int head;	/* Index of the oldest message */
+	unsigned int count;	/* Number of messages queued */
+	size_t sent;	/* Bytes of the oldest message already written */
+	struct timeval tried;	/* When the socket was last offered the queue */
+	enum audiosocket_txq_policy policy;	/* What to do when the server falls behind */
+	unsigned int fail_ms;	/* How long the oldest message may wait under AUDIOSOCKET_TXQ_FAIL */
+};
+
+struct audiosocket_mux;
+struct audiosocket_mux_stream;
+struct audiosocket_attachment;
+struct audiosocket_conn_stats;
+
+/*! \brief A set of sample kernels for one instruction set */
+struct audiosocket_kernels {
+	const char *name;	/* The instruction set, for logging */
+	void (*gain)(int16_t *samples, size_t count, const int16_t gain);
+	void (*energy)(const int16_t *samples, size_t count, struct ast_audiosocket_energy *energy);
+	void (*mix)(int16_t *dst, const int16_t *src, size_t count);
+	void (*swap)(int16_t *dst, const int16_t *src, size_t count);
+	void (*interleave)(int16_t *dst, const int16_t *left, const int16_t *right, size_t count);
+};
+
+/*! \brief Per-connection AudioSocket state */
+struct ast_audiosocket_conn {
+	int svc;	/* The file descriptor of the network socket */
+	uint8_t *rxbuf;	/* Bytes received from the socket which have not yet been parsed */
+	size_t rxlen;	/* Number of bytes currently held in rxbuf */
+	enum audiosocket_rx_state rx_state;	/* Where the parser stopped on the previous call */
+	uint8_t rx_kind;	/* Kind of the message in progress */
+	uint16_t rx_len;	/* Payload length of the message in progress */
+	uint8_t *rx_large;	/* Payload buffer for a message which does not fit in rxbuf */
+	size_t rx_have;	/* Number of payload bytes already read into rx_large */
+	struct audiosocket_pooled_frame *pool;	/* Frames handed out by the receive path */
+	unsigned int pool_used;	/* Number of pooled frames handed out by the current receive */
+	struct ast_frame hangup_frame;	/* Hangup frame which ends a list of received frames */
+	unsigned int batch_frames;	/* Number of voice frames to combine into one message */
+	unsigned int batch_max_ms;	/* Longest time a frame may wait in a partial batch */
+	unsigned int batch_count;	/* Number of frames in the pending batch */
+	uint8_t batch_kind;	/* Message kind of the pending batch */
+	struct timeval batch_start;	/* When the first frame of the pending batch was added */
+	unsigned int silence_ms;	/* Duration of the pending batch, if it is of silence */
+	unsigned int silence_threshold;	/* RMS level below which voice frames are sent as silence, or 0 */
+	unsigned int silence_run_ms;	/* Duration of the current pause in the outgoing audio */
+	uint8_t *txbuf;	/* The payload of the pending batch */
+	size_t txlen;	/* Number of bytes held in txbuf */
+	size_t txsize;	/* Allocated size of txbuf */
+	struct audiosocket_txq txq;	/* Messages waiting for the socket to take them */
+	struct ast_audiosocket_conn **tees;	/* Connections sent a copy of every message */
+	unsigned int tee_count;	/* Number of connections in tees */
+	struct audiosocket_mux *mux;	/* The shared connection carrying this stream, if multiplexed */
+	struct audiosocket_mux_stream *stream;	/* The receive queue of this stream, if multiplexed */
+	struct audiosocket_mux *demux;	/* The shared connection whose envelopes this connection reads */
+	struct audiosocket_attachment *attachment;	/* The reactor's hold on the connection, if attached */
+	int datagram;	/* Set if every message travels in its own UDP datagram */
+	uint16_t tx_seq;	/* Sequence number of the next datagram sent */
+	struct timeval tx_start;	/* When the first datagram was sent, for timestamps */
+	uint16_t rx_seq;	/* Sequence number of the newest datagram received */
+	int rx_started;	/* Set once a datagram has been received, atomically */
+	uuid_t id;	/* The ID of the call, repeated over the datagram transport */
+	unsigned int id_repeats;	/* Datagrams left which are preceded by the ID again */
+	unsigned int rx_late;	/* Datagrams dropped for arriving after a newer one */
+	int extended;	/* Set if the extended header is offered after the ID */
+	int ext_accepted;	/* Set once the server has accepted the extended header */
+	uint16_t ext_seq;	/* Sequence number of the next message sent with the extended header */
+	struct timeval ext_start;	/* When the first message with the extended header was sent */
+	int rx_ext;	/* Set if the message in progress has the extended header */
+	int rx_ext_started;	/* Set once a message with the extended header has been received */
+	uint16_t rx_ext_seq;	/* Sequence number of the newest extended header received */
+	uint32_t rx_echo;	/* Timestamp echoed by the newest extended header received */
+	struct audiosocket_conn_stats *stats;	/* The connection's counters, if they could be allocated */
+	struct timeval rx_ready;	/* When the audio not yet written to the channel was found readable */
+	struct timeval rx_arrival;	/* When the previous voice frame was received */
+	int64_t rx_pace_us;	/* Duration of the previous voice frame */
+};
+
+/*! \brief The receive side of one stream of a multiplexed connection */
+struct audiosocket_mux_stream {
+	uint16_t id;	/* The stream ID */
+	int alert_pipe[2];	/* Readable while frames or a hangup are waiting */
+	int alerted;	/* Non-zero if the alert pipe has been written */
+	int hangup;	/* Non-zero once the stream has ended */
+	unsigned int queued;	/* Number of frames waiting */
+	int ext_accepted;	/* Set once the server has accepted the extended header */
+	AST_LIST_HEAD_NOLOCK(, ast_frame) frames;	/* Frames waiting to be read */
+};
+
+/*! \brief A connection to a server which is shared by many streams */
+struct audiosocket_mux {
+	struct ast_audiosocket_conn *conn;	/* The connection carrying the envelopes */
+	ast_mutex_t lock;	/* Keeps the messages of different streams from interleaving */
+	struct ao2_container *streams;	/* The open streams, by stream ID */
+	uint16_t next_id;	/* The stream ID to try next */
+	pthread_t thread;	/* Reads the connection and dispatches the envelopes */
+	int stop;	/* Set to make the reader thread exit */
+	int dead;	/* Set once the connection has failed */
+	AST_LIST_ENTRY(audiosocket_mux) list;
+	char server[0];	/* The server address, including port */
+};
+
+/*! \brief The multiplexed connections, which are kept open until unload */
+static AST_LIST_HEAD_STATIC(audiosocket_muxes, audiosocket_mux);
+
+#ifdef __linux__
+#ifdef AUDIOSOCKET_HAVE_URING
+/*! \brief An io_uring instance and its mapped rings */
+struct audiosocket_uring {
+	int fd;
+	unsigned int sq_entries;	/* Number of entries of the submission queue */
+	unsigned int *sq_head;	/* Advanced by the kernel as it takes entries */
+	unsigned int *sq_tail;	/* Advanced under the reactor's lock as entries are added */
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;	/* Advanced by the reactor thread as it handles completions */
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;	/* The mapped submission ring, which may hold the completion ring too */
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+};
+#endif
+
+/*! \brief A thread which receives on many connections and delivers to their channels */
+struct audiosocket_reactor {
+	pthread_t thread;
+	ast_mutex_t lock;
+	unsigned int attached;	/* Number of connections attached, for balancing */
+	int uring;	/* Set if the thread waits with io_uring rather than epoll */
+	int epfd;	/* The epoll instance watching the attached connections */
+	int alert_pipe[2];	/* Wakes the thread to release detached connections or to stop */
+	AST_LIST_HEAD_NOLOCK(, audiosocket_attachment) detached;	/* Waiting to be released */
+#ifdef AUDIOSOCKET_HAVE_URING
+	struct audiosocket_uring ring;	/* Entries are added under lock; completions are the thread's own */
+	int waiting;	/* Set while the thread waits, so that others submit what they add */
+#endif
+};
+
+/*! \brief A connection attached to a reactor thread, and the channel it feeds */
+struct audiosocket_attachment {
+	struct ast_audiosocket_conn *conn;	/* Released once nothing more is received */
+	struct ast_channel *chan;	/* Released with conn */
+	struct audiosocket_reactor *reactor;
+	unsigned int flags;	/* A combination of ast_audiosocket_attach_flags */
+	int fd;	/* The file descriptor watched for the connection */
+	int detached;	/* Set once the channel no longer takes frames from the connection */
+	int ended;	/* Set once the connection has hung up or failed */
+	unsigned int polls;	/* Polls of an io_uring in flight for the connection, under the reactor's lock */
+	unsigned int polling_out;	/* Set while one of them waits for the socket to take more */
+	AST_LIST_ENTRY(audiosocket_attachment) list;
+};
+
+/*! \brief The reactor threads, which are started by the first attachment */
+static struct audiosocket_reactor audiosocket_reactors[AUDIOSOCKET_REACTOR_MAX_THREADS];
+static int audiosocket_reactor_count;	/* Number of reactor threads running */
+AST_MUTEX_DEFINE_STATIC(audiosocket_reactor_lock);
+static int audiosocket_reactor_stop;	/* Set to make the reactor threads exit */
+#endif /* __linux__ */
+
+/*! \brief How the reactor threads wait on their connections */
+enum audiosocket_reactor_backend {
+	/*! io_uring if the kernel supports it, otherwise epoll */
+	AUDIOSOCKET_REACTOR_AUTO,
+	AUDIOSOCKET_REACTOR_EPOLL,
+	AUDIOSOCKET_REACTOR_URING,
+};
+
+static int audiosocket_reactor_enabled;	/* Set if connections may be attached */
+static unsigned int audiosocket_reactor_threads;	/* Threads to start, or 0 for one per processor */
+static enum audiosocket_reactor_backend audiosocket_reactor_backend;	/* Used by the threads started next */
+
+/*! \brief Idle connections to one server, ready to be handed out */
+struct audiosocket_pool {
+	unsigned int size;	/* Number of idle connections to keep */
+	unsigned int count;	/* Number of idle connections held */
+	unsigned int connect_timeout;	/* Time allowed for a connection attempt, in ms */
+	int *idle;	/* The file descriptors of the idle connections */
+	char server[0];	/* The server address, including port */
+};
+
+/*! \brief The connection pools, by server address */
+static AO2_GLOBAL_OBJ_STATIC(audiosocket_pools);
+
+/*! \brief Time allowed for a connection attempt to a server without a section */
+static unsigned int audiosocket_connect_timeout_default = MAX_CONNECT_TIMEOUT_MSEC;
+
+/*! \brief Size of the write queue given to new connections */
+static unsigned int audiosocket_txq_size = AUDIOSOCKET_TXQ_DEFAULT_SIZE;
+
+/*! \brief What new connections do when their server falls behind */
+static enum audiosocket_txq_policy audiosocket_txq_policy = AUDIOSOCKET_TXQ_DROP_OLDEST;
+
+/*! \brief How long a message may wait under AUDIOSOCKET_TXQ_FAIL */
+static unsigned int audiosocket_txq_fail_ms = MAX_WRITE_TIMEOUT_MSEC;
+
+/*! \brief Thread which keeps the pools filled and the DNS cache fresh */
+static pthread_t audiosocket_pool_thread = AST_PTHREADT_NULL;
+AST_MUTEX_DEFINE_STATIC(audiosocket_pool_lock);
+static ast_cond_t audiosocket_pool_cond;
+static int audiosocket_pool_wake;	/* Set to have the pools topped up now */
+static int audiosocket_pool_stop;	/* Set to make the pool thread exit */
+
+AO2_STRING_FIELD_HASH_FN(audiosocket_pool, server);
+AO2_STRING_FIELD_CMP_FN(audiosocket_pool, server);
+
+/*! \brief The resolved addresses of a server */
+struct audiosocket_dns_entry {
+	struct ast_sockaddr *addrs;	/* Every address, so connecting can fall back */
+	int num_addrs;
+	struct timeval expires;	/* When the TTL of the addresses runs out */
+	struct timeval last_used;	/* When a call last connected to the server */
+	int refresh;	/* Set to have the pool thread refresh the addresses */
+	char server[0];	/* The server address, including port */
+};
+
+/*! \brief The DNS cache, by server address */
+static AO2_GLOBAL_OBJ_STATIC(audiosocket_dns_cache);
+
+AO2_STRING_FIELD_HASH_FN(audiosocket_dns_entry, server);
+AO2_STRING_FIELD_CMP_FN(audiosocket_dns_entry, server);
+
+static void audiosocket_pool_kick(void);
+
+/*!
+ * \internal
+ * \brief Order addresses for connecting, alternating between address families
+ *
+ * The first address keeps its place, so the preference of the resolver (IPv6
+ * first) is kept, but a family which is unreachable only delays the other by
+ * one attempt (RFC 8305 section 4).
+ *
+ * \param addrs The addresses of the server.
+ * \param num_addrs The number of addresses, at most AUDIOSOCKET_CONNECT_MAX_ATTEMPTS.
+ * \param order Set to the indexes of the addresses, in the order to try them.
+ */
+static void audiosocket_connect_order(const struct ast_sockaddr *addrs,
+	const int num_addrs, int *order)
+{
+	char used[AUDIOSOCKET_CONNECT_MAX_ATTEMPTS] = { 0 };
+	int i, n, pick, last_family = AF_UNSPEC;
+
+	for (n = 0; n < num_addrs; n++) {
+		pick = -1;
+		for (i = 0; i < num_addrs; i++) {
+			if (used[i]) {
+				continue;
+			}
+			if (pick < 0) {
+				pick = i;
+			}
+			if (addrs[i].ss.ss_family != last_family) {
+				pick = i;
+				break;
+			}
+		}
+		used[pick] = 1;
+		order[n] = pick;
+		last_family = addrs[pick].ss.ss_family;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Connect to the first of a server's addresses which answers
+ *
+ * Addresses are tried in turn, but a new attempt is started whenever the
+ * earlier ones have not completed within AUDIOSOCKET_CONNECT_ATTEMPT_DELAY_MSEC,
+ * so that an unreachable address does not hold up the others, and as soon as
+ * one fails, as RFC 8305 section 5 has it.  The first attempt to succeed is
+ * kept and the rest are abandoned.
+ *
+ * \param server The server address, including port, for logging.
+ * \param addrs The addresses of the server.
+ * \param num_addrs The number of addresses.
+ * \param timeout The time allowed for each attempt, in milliseconds.
+ *
+ * \retval socket file descriptor on success
+ * \retval -1 if no address could be connected to
+ */
+static int audiosocket_connect_race(const char *server, const struct ast_sockaddr *addrs,
+	int num_addrs, const unsigned int timeout)
+{
+	struct pollfd pfds[AUDIOSOCKET_CONNECT_MAX_ATTEMPTS];
+	struct timeval deadlines[AUDIOSOCKET_CONNECT_MAX_ATTEMPTS], next_start, now;
+	int order[AUDIOSOCKET_CONNECT_MAX_ATTEMPTS], which[AUDIOSOCKET_CONNECT_MAX_ATTEMPTS];
+	int next = 0, pending = 0, s = -1, i, res, conresult;
+	int64_t wait;
+	socklen_t reslen;
+
+	num_addrs = MIN(num_addrs, AUDIOSOCKET_CONNECT_MAX_ATTEMPTS);
+	audiosocket_connect_order(addrs, num_addrs, order);
+	next_start = ast_tvnow();
+
+	while (s < 0 && (pending || next < num_addrs)) {
+		now = ast_tvnow();
+
+		if (next < num_addrs && (!pending || ast_tvdiff_ms(next_start, now) <= 0)) {
+			const struct ast_sockaddr *addr = &addrs[order[next++]];
+
+			if (!ast_sockaddr_port(addr)) {
+				/* If there's no port, other addresses should have the
+				 * same problem. Stop here.
+				 */
+				ast_log(LOG_ERROR, "No port provided for %s\n",
+					ast_sockaddr_stringify(addr));
+				break;
+			}
+
+			if ((s = ast_socket_nonblock(addr->ss.ss_family, SOCK_STREAM,
+				IPPROTO_TCP)) < 0) {
+				ast_log(LOG_WARNING, "Unable to create socket: %s\n", strerror(errno));
+				next_start = now;
+				continue;
+			}
+
+			if (!ast_connect(s, addr)) {
+				/* Connected at once */
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				ast_log(LOG_WARNING, "Connection to %s failed with unexpected error: %s\n",
+					ast_sockaddr_stringify(addr), strerror(errno));
+				close(s);
+				s = -1;
+				next_start = now;
+				continue;
+			}
+
+			pfds[pending].fd = s;
+			pfds[pending].events = POLLOUT;
+			pfds[pending].revents = 0;
+			deadlines[pending] = ast_tvadd(now, ast_samp2tv(timeout, 1000));
+			which[pending++] = order[next - 1];
+			next_start = ast_tvadd(now, ast_samp2tv(AUDIOSOCKET_CONNECT_ATTEMPT_DELAY_MSEC, 1000));
+			s = -1;
+			continue;
+		}
+
+		/* Wait for an attempt to complete, to time out, or for the next to start */
+		wait = next < num_addrs ? ast_tvdiff_ms(next_start, now) : INT_MAX;
+		for (i = 0; i < pending; i++) {
+			wait = MIN(wait, ast_tvdiff_ms(deadlines[i], now));
+		}
+		if ((res = ast_poll(pfds, pending, MAX(wait, 0))) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ast_log(LOG_WARNING, "Connect to '%s' failed: %s\n", server, strerror(errno));
+			break;
+		}
+
+		now = ast_tvnow();
+		for (i = pending - 1; i >= 0; i--) {
+			if (pfds[i].revents) {
+				reslen = sizeof(conresult);
+				if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &conresult, &reslen) < 0) {
+					conresult = errno;
+				}
+				if (conresult) {
+					ast_log(LOG_WARNING, "Connecting to '%s' failed for url '%s': %s\n",
+						ast_sockaddr_stringify(&addrs[which[i]]), server, strerror(conresult));
+					close(pfds[i].fd);
+					/* Try the next address now rather than after the delay */
+					next_start = now;
+				} else if (s < 0) {
+					s = pfds[i].fd;
+				} else {
+					/* Another attempt completed at the same time */
+					close(pfds[i].fd);
+				}
+			} else if (ast_tvdiff_ms(deadlines[i], now) <= 0) {
+				ast_log(LOG_WARNING, "AudioSocket connection to '%s' for url '%s' timed "
+					"out after %u milliseconds.\n", ast_sockaddr_stringify(&addrs[which[i]]),
+					server, timeout);
+				close(pfds[i].fd);
+				next_start = now;
+			} else {
+				continue;
+			}
+
+			pfds[i] = pfds[--pending];
+			deadlines[i] = deadlines[pending];
+			which[i] = which[pending];
+		}
+	}
+
+	/* Abandon the attempts which lost the race */
+	for (i = 0; i < pending; i++) {
+		close(pfds[i].fd);
+	}
+
+	return s;
+}
+
+/*!
+ * \internal
+ * \brief Find the time allowed for a connection attempt to a server
+ */
+static unsigned int audiosocket_connect_timeout(const char *server)
+{
+	struct ao2_container *pools;
+	struct audiosocket_pool *pool = NULL;
+	unsigned int timeout = audiosocket_connect_timeout_default;
+
+	if ((pools = ao2_global_obj_ref(audiosocket_pools))) {
+		pool = ao2_find(pools, server, OBJ_SEARCH_KEY);
+		ao2_ref(pools, -1);
+	}
+	if (pool) {
+		timeout = pool->connect_timeout;
+		ao2_ref(pool, -1);
+	}
+
+	return timeout;
+}
+
+/*!
+ * \internal
+ * \brief Add the addresses of one record type to a list of resolved addresses
+ *
+ * \param host The name to look up.
+ * \param rr_type ns_t_a or ns_t_aaaa.
+ * \param port The port of the addresses.
+ * \param addrs The list of addresses, which is grown as needed.
+ * \param num The number of addresses in the list.
+ * \param ttl Lowered to the smallest TTL of the records found.
+ */
+static void audiosocket_dns_query(const char *host, const int rr_type, const uint16_t port,
+	struct ast_sockaddr **addrs, int *num, unsigned int *ttl)
+{
+	struct ast_dns_result *result;
+	const struct ast_dns_record *record;
+	struct ast_sockaddr *grown;
+	struct ast_sockaddr addr;
+	size_t len = rr_type == ns_t_a ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+	if (ast_dns_resolve(host, rr_type, ns_c_in, &result) || !result) {
+		return;
+	}
+
+	for (record = ast_dns_result_get_records(result); record;
+		record = ast_dns_record_get_next(record)) {
+		if (ast_dns_record_get_rr_type(record) != rr_type
+			|| ast_dns_record_get_data_size(record) != len) {
+			continue;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		if (rr_type == ns_t_a) {
+			struct sockaddr_in *sin = (struct sockaddr_in *) &addr.ss;
+
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, ast_dns_record_get_data(record), len);
+			addr.len = sizeof(*sin);
+		} else {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &addr.ss;
+
+			sin6->sin6_family = AF_INET6;
+			memcpy(&sin6->sin6_addr, ast_dns_record_get_data(record), len);
+			addr.len = sizeof(*sin6);
+		}
+		ast_sockaddr_set_port(&addr, port);
+
+		if (!(grown = ast_realloc(*addrs, (*num + 1) * sizeof(*grown)))) {
+			break;
+		}
+		*addrs = grown;
+		ast_sockaddr_copy(&(*addrs)[(*num)++], &addr);
+		*ttl = MIN(*ttl, ast_dns_record_get_ttl(record));
+	}
+
+	ast_dns_result_free(result);
+}
+
+/*!
+ * \internal
+ * \brief Look up the addresses of a server
+ *
+ * \param server The server address, including port.
+ * \param addrs Set to the allocated list of addresses.
+ * \param ttl Set to the number of seconds for which the addresses are valid.
+ *
+ * \retval The number of addresses
+ * \retval 0 on error
+ */
+static int audiosocket_dns_lookup(const char *server, struct ast_sockaddr **addrs,
+	unsigned int *ttl)
+{
+	char *buf, *host, *port;
+	unsigned int portnum;
+	int num = 0;
+
+	*addrs = NULL;
+	*ttl = UINT_MAX;
+
+	buf = ast_strdupa(server);
+	if (ast_sockaddr_split_hostport(buf, &host, &port, PARSE_PORT_REQUIRE)
+		&& sscanf(port, "%30u", &portnum) == 1 && portnum <= UINT16_MAX) {
+		audiosocket_dns_query(host, ns_t_aaaa, portnum, addrs, &num, ttl);
+		audiosocket_dns_query(host, ns_t_a, portnum, addrs, &num, ttl);
+	}
+	if (num) {
+		*ttl = MAX(*ttl, AUDIOSOCKET_DNS_MIN_TTL);
+		return num;
+	}
+	ast_free(*addrs);
+
+	/* No DNS resolver is loaded, or the name is only known to the system */
+	*ttl = AUDIOSOCKET_DNS_DEFAULT_TTL;
+	return ast_sockaddr_resolve(addrs, server, PARSE_PORT_REQUIRE, AST_AF_UNSPEC);
+}
+
+/*!
+ * \internal
+ * \brief Determine whether a server is given by address rather than by name
+ */
+static int audiosocket_is_literal(const char *server)
+{
+	struct ast_sockaddr addr;
+
+	return ast_sockaddr_parse(&addr, server, PARSE_PORT_REQUIRE);
+}
+
+/*!
+ * \internal
+ * \brief Copy the addresses of a cache entry for the caller
+ *
+ * The entry must be locked.
+ */
+static int audiosocket_dns_copy(const struct audiosocket_dns_entry *entry,
+	struct ast_sockaddr **addrs)
+{
+	if (!(*addrs = ast_malloc(entry->num_addrs * sizeof(**addrs)))) {
+		return 0;
+	}
+	memcpy(*addrs, entry->addrs, entry->num_addrs * sizeof(**addrs));
+
+	return entry->num_addrs;
+}
+
+/*!
+ * \internal
+ * \brief Replace the addresses of a cache entry with those just looked up
+ *
+ * The entry must be locked.  It takes ownership of the addresses.
+ */
+static void audiosocket_dns_store(struct audiosocket_dns_entry *entry,
+	struct ast_sockaddr *addrs, const int num, const unsigned int ttl)
+{
+	ast_free(entry->addrs);
+	entry->addrs = addrs;
+	entry->num_addrs = num;
+	entry->expires = ast_tvadd(ast_tvnow(), ast_tv(ttl, 0));
+	entry->refresh = 0;
+}
+
+static void audiosocket_dns_entry_destructor(void *obj)
+{
+	struct audiosocket_dns_entry *entry = obj;
+
+	ast_free(entry->addrs);
+}
+
+/*!
+ * \internal
+ * \brief Resolve a server, using the cache where possible
+ *
+ * Addresses are handed out until their TTL has passed by more than
+ * AUDIOSOCKET_DNS_STALE_SEC; once the TTL has passed, they are refreshed in
+ * the background.  Only a server which is not cached, or whose addresses are
+ * too old, is looked up while the caller waits.
+ *
+ * \param addrs Set to the allocated list of addresses, which the caller frees.
+ * \param server The server address, including port.
+ *
+ * \retval The number of addresses
+ * \retval 0 on error
+ */
+static int audiosocket_resolve(struct ast_sockaddr **addrs, const char *server)
+{
+	struct ao2_container *cache;
+	struct audiosocket_dns_entry *entry;
+	struct ast_sockaddr *found;
+	struct timeval now = ast_tvnow();
+	unsigned int ttl;
+	int num = 0, kick = 0;
+
+	*addrs = NULL;
+	if (audiosocket_is_literal(server)
+		|| !(cache = ao2_global_obj_ref(audiosocket_dns_cache))) {
+		return ast_sockaddr_resolve(addrs, server, PARSE_PORT_REQUIRE, AST_AF_UNSPEC);
+	}
+
+	if ((entry = ao2_find(cache, server, OBJ_SEARCH_KEY))) {
+		ao2_lock(entry);
+		entry->last_used = now;
+		if (entry->num_addrs && ast_tvdiff_ms(now, entry->expires)
+			< AUDIOSOCKET_DNS_STALE_SEC * 1000) {
+			num = audiosocket_dns_copy(entry, addrs);
+			if (ast_tvdiff_ms(now, entry->expires) >= 0 && !entry->refresh) {
+				entry->refresh = 1;
+				kick = 1;
+			}
+		}
+		ao2_unlock(entry);
+	}
+
+	if (kick) {
+		audiosocket_pool_kick();
+	}
+	if (num) {
+		ao2_cleanup(entry);
+		ao2_ref(cache, -1);
+		return num;
+	}
+
+	/* Nothing usable is cached, so the lookup is made now */
+	if (!(num = audiosocket_dns_lookup(server, &found, &ttl))) {
+		if (entry) {
+			/* Better to try addresses which may have moved than none at all */
+			ao2_lock(entry);
+			num = entry->num_addrs ? audiosocket_dns_copy(entry, addrs) : 0;
+			ao2_unlock(entry);
+		}
+		ao2_cleanup(entry);
+		ao2_ref(cache, -1);
+		return num;
+	}
+
+	if (!entry) {
+		/* Another call may have added the server while this one looked it up */
+		ao2_lock(cache);
+		if (!(entry = ao2_find(cache, server, OBJ_SEARCH_KEY | OBJ_NOLOCK))
+			&& (entry = ao2_alloc(sizeof(*entry) + strlen(server) + 1,
+				audiosocket_dns_entry_destructor))) {
+			strcpy(entry->server, server); /* Safe */
+			entry->last_used = now;
+			ao2_link_flags(cache, entry, OBJ_NOLOCK);
+		}
+		ao2_unlock(cache);
+	}
+	if (!entry) {
+		/* Still usable, just not cached */
+		*addrs = found;
+		ao2_ref(cache, -1);
+		return num;
+	}
+
+	ao2_lock(entry);
+	audiosocket_dns_store(entry, found, num, ttl);
+	num = audiosocket_dns_copy(entry, addrs);
+	ao2_unlock(entry);
+
+	ao2_ref(entry, -1);
+	ao2_ref(cache, -1);
+
+	return num;
+}
+
+/*!
+ * \internal
+ * \brief Refresh the cached addresses which are due, and forget those no
+ * longer used
+ *
+ * Called from the pool thread, so that calls rarely wait for a lookup.  A
+ * failed refresh keeps the previous addresses.
+ */
+static void audiosocket_dns_refresh(void)
+{
+	struct ao2_container *cache;
+	struct ao2_iterator it;
+	struct audiosocket_dns_entry *entry;
+	struct ast_sockaddr *found;
+	struct timeval now;
+	unsigned int ttl;
+	int num, idle, due;
+
+	if (!(cache = ao2_global_obj_ref(audiosocket_dns_cache))) {
+		return;
+	}
+
+	it = ao2_iterator_init(cache, 0);
+	while (!audiosocket_pool_stop && (entry = ao2_iterator_next(&it))) {
+		now = ast_tvnow();
+		ao2_lock(entry);
+		idle = ast_tvdiff_ms(now, entry->last_used) > AUDIOSOCKET_DNS_IDLE_SEC * 1000;
+		due = entry->refresh
+			|| ast_tvdiff_ms(entry->expires, now) < AUDIOSOCKET_POOL_CHECK_MSEC;
+		ao2_unlock(entry);
+
+		if (idle && ast_tvdiff_ms(now, entry->expires) >= 0) {
+			ao2_unlink(cache, entry);
+		} else if (due && !idle) {
+			/* The lookup is made without holding the entry */
+			num = audiosocket_dns_lookup(entry->server, &found, &ttl);
+			ao2_lock(entry);
+			if (num) {
+				audiosocket_dns_store(entry, found, num, ttl);
+			} else {
+				entry->refresh = 0;
+				ast_debug(1, "Failed to refresh addresses of AudioSocket server %s\n",
+					entry->server);
+			}
+			ao2_unlock(entry);
+		}
+		ao2_ref(entry, -1);
+	}
+	ao2_iterator_destroy(&it);
+	ao2_ref(cache, -1);
+}
+
+/*!
+ * \internal
+ * \brief Open a new connection to an AudioSocket server
+ *
+ * \param server The server address, including port.
+ * \param chan An optional channel to autoservice while connecting.
+ *
+ * \retval socket file descriptor for AudioSocket on success
+ * \retval -1 on error
+ */
+static int audiosocket_connect_new(const char *server, struct ast_channel *chan)
+{
+	int s = -1;
+	struct ast_sockaddr *addrs = NULL;
+	int num_addrs = 0;
+
+	if (chan && ast_autoservice_start(chan) < 0) {
+		ast_log(LOG_WARNING, "Failed to start autoservice for channel "
+			"%s\n", ast_channel_name(chan));
+		goto end;
+	}
+
+	if (ast_strlen_zero(server)) {
+		ast_log(LOG_ERROR, "No AudioSocket server provided\n");
+		goto end;
+	}
+
+	if (!(num_addrs = audiosocket_resolve(&addrs, server))) {
+		ast_log(LOG_ERROR, "Failed to resolve AudioSocket service using %s - "
+			"requires a valid hostname and port\n", server);
+		goto end;
+	}
+
+	s = audiosocket_connect_race(server, addrs, num_addrs, audiosocket_connect_timeout(server));
+
+end:
+	if (addrs) {
+		ast_free(addrs);
+	}
+
+	if (chan && ast_autoservice_stop(chan) < 0) {
+		ast_log(LOG_WARNING, "Failed to stop autoservice for channel %s\n",
+		ast_channel_name(chan));
+		if (s >= 0) {
+			close(s);
+		}
+		return -1;
+	}
+
+	if (s < 0) {
+		ast_log(LOG_ERROR, "Failed to connect to AudioSocket service\n");
+		return -1;
+	}
+
+	return s;
+}
+
+/*!
+ * \internal
+ * \brief Open a UDP socket to a server for the datagram transport
+ *
+ * The socket is connected, so that only datagrams from the server are
+ * received on it.
+ *
+ * \retval socket file descriptor on success
+ * \retval -1 on error
+ */
+static int audiosocket_datagram_connect(const char *server, struct ast_channel *chan)
+{
+	int s = -1;
+	struct ast_sockaddr *addrs = NULL;
+	int i, num_addrs = 0;
+
+	if (chan && ast_autoservice_start(chan) < 0) {
+		ast_log(LOG_WARNING, "Failed to start autoservice for channel "
+			"%s\n", ast_channel_name(chan));
+		goto end;
+	}
+
+	if (ast_strlen_zero(server)) {
+		ast_log(LOG_ERROR, "No AudioSocket server provided\n");
+		goto end;
+	}
+
+	if (!(num_addrs = audiosocket_resolve(&addrs, server))) {
+		ast_log(LOG_ERROR, "Failed to resolve AudioSocket service using %s - "
+			"requires a valid hostname and port\n", server);
+		goto end;
+	}
+
+	/* Nothing is exchanged to connect, so the first usable address is taken */
+	for (i = 0; i < num_addrs && s < 0; i++) {
+		if ((s = ast_socket_nonblock(addrs[i].ss.ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+			ast_log(LOG_WARNING, "Unable to create socket: %s\n", strerror(errno));
+			continue;
+		}
+		if (ast_connect(s, &addrs[i])) {
+			ast_log(LOG_WARNING, "Connection to %s failed with unexpected error: %s\n",
+				ast_sockaddr_stringify(&addrs[i]), strerror(errno));
+			close(s);
+			s = -1;
+		}
+	}
+
+end:
+	if (addrs) {
+		ast_free(addrs);
+	}
+
+	if (chan && ast_autoservice_stop(chan) < 0) {
+		ast_log(LOG_WARNING, "Failed to stop autoservice for channel %s\n",
+		ast_channel_name(chan));
+		if (s >= 0) {
+			close(s);
+		}
+		return -1;
+	}
+
+	if (s < 0) {
+		ast_log(LOG_ERROR, "Failed to connect to AudioSocket service\n");
+		return -1;
+	}
+
+	return s;
+}
+
+/*!
+ * \internal
+ * \brief Determine whether an idle connection is still usable
+ *
+ * A server sends nothing before it has received the UUID, so an idle
+ * connection which has become readable has been closed or reset.
+ */
+static int audiosocket_idle_usable(const int svc)
+{
+	struct pollfd pfd = {
+		.fd = svc,
+		.events = POLLIN,
+	};
+
+	return ast_poll(&pfd, 1, 0) == 0;
+}
+
+/*!
+ * \internal
+ * \brief Have the pool thread top up the pools now
+ */
+static void audiosocket_pool_kick(void)
+{
+	ast_mutex_lock(&audiosocket_pool_lock);
+	audiosocket_pool_wake = 1;
+	ast_cond_signal(&audiosocket_pool_cond);
+	ast_mutex_unlock(&audiosocket_pool_lock);
+}
+
+/*!
+ * \internal
+ * \brief Take an idle connection to a server from its pool
+ *
+ * \retval socket file descriptor on success
+ * \retval -1 if the server has no pool or its pool is empty
+ */
+static int audiosocket_pool_take(const char *server)
+{
+	struct ao2_container *pools;
+	struct audiosocket_pool *pool;
+	int svc = -1;
+
+	if (!(pools = ao2_global_obj_ref(audiosocket_pools))) {
+		return -1;
+	}
+	pool = ao2_find(pools, server, OBJ_SEARCH_KEY);
+	ao2_ref(pools, -1);
+	if (!pool) {
+		return -1;
+	}
+
+	ao2_lock(pool);
+	while (svc < 0 && pool->count) {
+		svc = pool->idle[--pool->count];
+		if (!audiosocket_idle_usable(svc)) {
+			close(svc);
+			svc = -1;
+		}
+	}
+	ao2_unlock(pool);
+
+	if (pool->size) {
+		/* Replace whatever was taken or found to be closed */
+		audiosocket_pool_kick();
+	}
+	ao2_ref(pool, -1);
+
+	return svc;
+}
+
+/*!
+ * \internal
+ * \brief Replace the idle connections of a pool which are missing or closed
+ */
+static void audiosocket_pool_fill(struct audiosocket_pool *pool)
+{
+	unsigned int i, missing;
+	int svc;
+
+	ao2_lock(pool);
+	for (i = 0; i < pool->count;) {
+		if (audiosocket_idle_usable(pool->idle[i])) {
+			i++;
+			continue;
+		}
+		close(pool->idle[i]);
+		pool->idle[i] = pool->idle[--pool->count];
+	}
+	missing = pool->size - pool->count;
+	ao2_unlock(pool);
+
+	/* Connect without holding the pool, so that calls taking from it never wait */
+	while (missing-- && !audiosocket_pool_stop) {
+		if ((svc = audiosocket_connect_new(pool->server, NULL)) < 0) {
+			/* Try again at the next check */
+			break;
+		}
+
+		ao2_lock(pool);
+		if (pool->count < pool->size) {
+			pool->idle[pool->count++] = svc;
+			svc = -1;
+		}
+		ao2_unlock(pool);
+
+		if (svc >= 0) {
+			close(svc);
+		}
+	}
+}
+
+static void *audiosocket_pool_run(void *data)
+{
+	struct ao2_container *pools;
+	struct ao2_iterator it;
+	struct audiosocket_pool *pool;
+	struct timeval tv;
+	struct timespec ts;
+
+	while (!audiosocket_pool_stop) {
+		audiosocket_dns_refresh();
+
+		if ((pools = ao2_global_obj_ref(audiosocket_pools))) {
+			it = ao2_iterator_init(pools, 0);
+			while ((pool = ao2_iterator_next(&it))) {
+				audiosocket_pool_fill(pool);
+				ao2_ref(pool, -1);
+			}
+			ao2_iterator_destroy(&it);
+			ao2_ref(pools, -1);
+		}
+
+		ast_mutex_lock(&audiosocket_pool_lock);
+		if (!audiosocket_pool_wake && !audiosocket_pool_stop) {
+			tv = ast_tvadd(ast_tvnow(), ast_samp2tv(AUDIOSOCKET_POOL_CHECK_MSEC, 1000));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			ast_cond_timedwait(&audiosocket_pool_cond, &audiosocket_pool_lock, &ts);
+		}
+		audiosocket_pool_wake = 0;
+		ast_mutex_unlock(&audiosocket_pool_lock);
+	}
+
+	return NULL;
+}
+
+static void audiosocket_pool_destructor(void *obj)
+{
+	struct audiosocket_pool *pool = obj;
+
+	while (pool->count) {
+		close(pool->idle[--pool->count]);
+	}
+	ast_free(pool->idle);
+}
+
+/*!
+ * \internal
+ * \brief Create the pool for a server, adopting the idle connections of its
+ * previous pool
+ */
+static struct audiosocket_pool *audiosocket_pool_alloc(const char *server,
+	const unsigned int size, struct audiosocket_pool *old)
+{
+	struct audiosocket_pool *pool;
+
+	pool = ao2_alloc(sizeof(*pool) + strlen(server) + 1, audiosocket_pool_destructor);
+	if (!pool) {
+		return NULL;
+	}
+	strcpy(pool->server, server); /* Safe */
+
+	if (size && !(pool->idle = ast_calloc(size, sizeof(*pool->idle)))) {
+		ao2_ref(pool, -1);
+		return NULL;
+	}
+	pool->size = size;
+
+	if (old) {
+		ao2_lock(old);
+		while (old->count && pool->count < pool->size) {
+			pool->idle[pool->count++] = old->idle[--old->count];
+		}
+		ao2_unlock(old);
+	}
+
+	return pool;
+}
+
+/*!
+ * \internal
+ * \brief Parse a pool size from the configuration
+ */
+static unsigned int audiosocket_pool_size(const char *value, const char *cat,
+	const unsigned int def)
+{
+	unsigned int size;
+
+	if (ast_strlen_zero(value)) {
+		return def;
+	}
+	if (sscanf(value, "%30u", &size) != 1) {
+		ast_log(LOG_WARNING, "Invalid pool_size '%s' in [%s] of %s\n", value, cat,
+			AUDIOSOCKET_CONFIG);
+		return def;
+	}
+	if (size > AUDIOSOCKET_POOL_MAX_IDLE) {
+		ast_log(LOG_WARNING, "pool_size %u in [%s] of %s is too large; using %d\n",
+			size, cat, AUDIOSOCKET_CONFIG, AUDIOSOCKET_POOL_MAX_IDLE);
+		size = AUDIOSOCKET_POOL_MAX_IDLE;
+	}
+
+	return size;
+}
+
+/*!
+ * \internal
+ * \brief Parse a timeout, in milliseconds, from the configuration
+ */
+static unsigned int audiosocket_timeout_parse(const char *value, const char *name,
+	const char *cat, const unsigned int def)
+{
+	unsigned int timeout;
+
+	if (ast_strlen_zero(value)) {
+		return def;
+	}
+	if (sscanf(value, "%30u", &timeout) != 1 || !timeout) {
+		ast_log(LOG_WARNING, "Invalid %s '%s' in [%s] of %s\n", name, value, cat,
+			AUDIOSOCKET_CONFIG);
+		return def;
+	}
+
+	return timeout;
+}
+
+/*!
+ * \internal
+ * \brief Parse the number of reactor threads from the configuration
+ */
+static unsigned int audiosocket_reactor_threads_parse(const char *value)
+{
+	unsigned int threads;
+
+	if (ast_strlen_zero(value)) {
+		return 0;
+	}
+	if (sscanf(value, "%30u", &threads) != 1) {
+		ast_log(LOG_WARNING, "Invalid reactor_threads '%s' in [general] of %s\n", value,
+			AUDIOSOCKET_CONFIG);
+		return 0;
+	}
+	if (threads > AUDIOSOCKET_REACTOR_MAX_THREADS) {
+		ast_log(LOG_WARNING, "reactor_threads %u in [general] of %s is too large; using %d\n",
+			threads, AUDIOSOCKET_CONFIG, AUDIOSOCKET_REACTOR_MAX_THREADS);
+		threads = AUDIOSOCKET_REACTOR_MAX_THREADS;
+	}
+
+	return threads;
+}
+
+/*!
+ * \internal
+ * \brief Parse how the reactor threads wait from the configuration
+ */
+static enum audiosocket_reactor_backend audiosocket_reactor_backend_parse(const char *value)
+{
+	if (ast_strlen_zero(value) || !strcasecmp(value, "auto")) {
+		return AUDIOSOCKET_REACTOR_AUTO;
+	}
+	if (!strcasecmp(value, "epoll")) {
+		return AUDIOSOCKET_REACTOR_EPOLL;
+	}
+	if (!strcasecmp(value, "io_uring")) {
+		return AUDIOSOCKET_REACTOR_URING;
+	}
+	ast_log(LOG_WARNING, "Invalid reactor_backend '%s' in [general] of %s\n", value,
+		AUDIOSOCKET_CONFIG);
+
+	return AUDIOSOCKET_REACTOR_AUTO;
+}
+
+/*!
+ * \internal
+ * \brief Parse the size of the write queue from the configuration
+ */
+static unsigned int audiosocket_txq_size_parse(const char *value)
+{
+	unsigned int size;
+
+	if (ast_strlen_zero(value)) {
+		return AUDIOSOCKET_TXQ_DEFAULT_SIZE;
+	}
+	if (sscanf(value, "%30u", &size) != 1) {
+		ast_log(LOG_WARNING, "Invalid write_queue '%s' in [general] of %s\n", value,
+			AUDIOSOCKET_CONFIG);
+		return AUDIOSOCKET_TXQ_DEFAULT_SIZE;
+	}
+	if (size > AUDIOSOCKET_TXQ_MAX_SIZE) {
+		ast_log(LOG_WARNING, "write_queue %u in [general] of %s is too large; using %d\n",
+			size, AUDIOSOCKET_CONFIG, AUDIOSOCKET_TXQ_MAX_SIZE);
+		size = AUDIOSOCKET_TXQ_MAX_SIZE;
+	}
+
+	return size;
+}
+
+/*!
+ * \internal
+ * \brief Parse the write queue policy from the configuration
+ */
+static enum audiosocket_txq_policy audiosocket_txq_policy_parse(const char *value)
+{
+	if (ast_strlen_zero(value) || !strcasecmp(value, "drop_oldest")) {
+		return AUDIOSOCKET_TXQ_DROP_OLDEST;
+	}
+	if (!strcasecmp(value, "drop_newest")) {
+		return AUDIOSOCKET_TXQ_DROP_NEWEST;
+	}
+	if (!strcasecmp(value, "fail")) {
+		return AUDIOSOCKET_TXQ_FAIL;
+	}
+	ast_log(LOG_WARNING, "Invalid write_queue_policy '%s' in [general] of %s\n", value,
+		AUDIOSOCKET_CONFIG);
+
+	return AUDIOSOCKET_TXQ_DROP_OLDEST;
+}
+
+/*!
+ * \internal
+ * \brief Load the connection pools, timeouts, write queue and reactor settings
+ * from the configuration file
+ *
+ * \param reload Non-zero if this is a reload, in which case an unchanged
+ * file is not read again.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_load_config(const int reload)
+{
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct ast_config *cfg;
+	struct ao2_container *pools, *old_pools;
+	struct audiosocket_pool *pool, *old;
+	const char *cat = NULL, *server;
+	unsigned int default_size = 0, default_timeout = MAX_CONNECT_TIMEOUT_MSEC;
+
+	cfg = ast_config_load(AUDIOSOCKET_CONFIG, config_flags);
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		return 0;
+	}
+	if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Config file %s is in an invalid format\n", AUDIOSOCKET_CONFIG);
+		return -1;
+	}
+	/* The file is optional; without it, no connections are pooled */
+
+	pools = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 7,
+		audiosocket_pool_hash_fn, NULL, audiosocket_pool_cmp_fn);
+	if (!pools) {
+		ast_config_destroy(cfg);
+		return -1;
+	}
+	old_pools = ao2_global_obj_ref(audiosocket_pools);
+
+	if (cfg) {
+		default_size = audiosocket_pool_size(ast_variable_retrieve(cfg, "general", "pool_size"),
+			"general", 0);
+		default_timeout = audiosocket_timeout_parse(ast_variable_retrieve(cfg, "general",
+			"connect_timeout"), "connect_timeout", "general", MAX_CONNECT_TIMEOUT_MSEC);
+	}
+	audiosocket_connect_timeout_default = default_timeout;
+	audiosocket_txq_size = cfg ? audiosocket_txq_size_parse(
+		ast_variable_retrieve(cfg, "general", "write_queue")) : AUDIOSOCKET_TXQ_DEFAULT_SIZE;
+	audiosocket_txq_policy = cfg ? audiosocket_txq_policy_parse(
+		ast_variable_retrieve(cfg, "general", "write_queue_policy")) : AUDIOSOCKET_TXQ_DROP_OLDEST;
+	audiosocket_txq_fail_ms = cfg ? audiosocket_timeout_parse(ast_variable_retrieve(cfg,
+		"general", "write_queue_timeout"), "write_queue_timeout", "general",
+		MAX_WRITE_TIMEOUT_MSEC) : MAX_WRITE_TIMEOUT_MSEC;
+	audiosocket_reactor_enabled = cfg && ast_true(ast_variable_retrieve(cfg, "general", "reactor"));
+	audiosocket_reactor_threads = cfg ? audiosocket_reactor_threads_parse(
+		ast_variable_retrieve(cfg, "general", "reactor_threads")) : 0;
+	audiosocket_reactor_backend = cfg ? audiosocket_reactor_backend_parse(
+		ast_variable_retrieve(cfg, "general", "reactor_backend")) : AUDIOSOCKET_REACTOR_AUTO;
+	while (cfg && (cat = ast_category_browse(cfg, cat))) {
+		if (!strcasecmp(cat, "general")) {
+			continue;
+		}
+		server = ast_variable_retrieve(cfg, cat, "server");
+		if (ast_strlen_zero(server)) {
+			ast_log(LOG_WARNING, "No server in [%s] of %s\n", cat, AUDIOSOCKET_CONFIG);
+			continue;
+		}
+
+		old = old_pools ? ao2_find(old_pools, server, OBJ_SEARCH_KEY) : NULL;
+		pool = audiosocket_pool_alloc(server, audiosocket_pool_size(
+			ast_variable_retrieve(cfg, cat, "pool_size"), cat, default_size), old);
+		ao2_cleanup(old);
+		if (!pool) {
+			ast_log(LOG_ERROR, "Failed to allocate AudioSocket connection pool for %s\n", server);
+			continue;
+		}
+		pool->connect_timeout = audiosocket_timeout_parse(ast_variable_retrieve(cfg, cat,
+			"connect_timeout"), "connect_timeout", cat, default_timeout);
+		ao2_link(pools, pool);
+		ao2_ref(pool, -1);
+	}
+	ast_config_destroy(cfg);
+
+	ao2_global_obj_replace_unref(audiosocket_pools, pools);
+	ao2_ref(pools, -1);
+	ao2_cleanup(old_pools);
+
+	audiosocket_pool_kick();
+
+	return 0;
+}
+
+const int ast_audiosocket_connect(const char *server, struct ast_channel *chan)
+{
+	int s;
+
+	if (!ast_strlen_zero(server) && (s = audiosocket_pool_take(server)) >= 0) {
+		return s;
+	}
+
+	return audiosocket_connect_new(server, chan);
+}
+
+/*! \brief Time spent in some part of the handling of AudioSocket traffic */
+struct audiosocket_histogram {
+	/* Samples of at least 2^i and less than 2^(i+1) microseconds, with
+	 * anything shorter in the first bucket and anything longer in the last */
+	unsigned int buckets[AUDIOSOCKET_HISTOGRAM_BUCKETS];
+	unsigned int count;	/* Number of samples */
+	uint64_t total_us;	/* Sum of the samples, in microseconds */
+};
+
+/*! \brief Counters of AudioSocket traffic, for one connection or all of them */
+struct audiosocket_stats {
+	uint64_t frames_in;	/* Voice frames received */
+	uint64_t frames_out;	/* Voice frames sent */
+	uint64_t bytes_in;	/* Payload bytes of the voice frames received */
+	uint64_t bytes_out;	/* Payload bytes of the messages sent */
+	unsigned int short_reads;	/* Reads which ended part of the way through a message */
+	unsigned int write_waits;	/* Writes which waited for the socket to drain */
+	unsigned int write_queued;	/* Messages queued because the socket could not take them */
+	unsigned int write_dropped;	/* Messages of audio dropped because the write queue was full */
+	unsigned int seq_gaps;	/* Extended headers whose sequence number did not follow the one before */
+	struct audiosocket_histogram connect;	/* Time taken to connect to the server */
+	struct audiosocket_histogram jitter;	/* Deviation of arrivals from the pace of the audio */
+	struct audiosocket_histogram latency;	/* Time from socket readiness to the audio reaching the channel */
+	struct audiosocket_histogram rtt;	/* Time from a message being sent to a reply echoing it */
+};
+
+/*! \brief The counters of one connection, listed while the connection is open */
+struct audiosocket_conn_stats {
+	struct audiosocket_stats stats;
+	struct timeval created;	/* When the connection was opened */
+	char server[AUDIOSOCKET_STATS_NAME_LEN];	/* The server, if the connection was made to one */
+	char channel[AST_CHANNEL_NAME];	/* The channel which the connection was made for */
+};
+
+/*!
+ * \brief The counters of the connections which have closed since the module
+ * loaded, and of the calls made on a bare socket
+ */
+static struct audiosocket_stats audiosocket_stats;
+
+/*! \brief Connections opened to servers since the module loaded */
+static unsigned int audiosocket_stats_connects;
+
+/*! \brief Connections to servers which failed since the module loaded */
+static unsigned int audiosocket_stats_connect_failures;
+
+/*! \brief The counters of the open connections */
+static AO2_GLOBAL_OBJ_STATIC(audiosocket_conn_stats);
+
+/*!
+ * \brief Count something in the counters of a connection, if it has them
+ *
+ * The CLI and AMI read the counters while the threads which send and receive
+ * update them, so they are added to atomically, relaxed as nothing else is
+ * ordered by them.  A connection's counters are shared by few threads, so they
+ * do not contend as the totals would, which are only added to once the
+ * connection closes.
+ */
+#define AUDIOSOCKET_STATS_ADD(cs, field, n) do { \
+		if (cs) { \
+			ast_atomic_fetch_add(&(cs)->stats.field, (n), __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+
+/*! \brief Add a time to a histogram of a connection, if it has them */
+#define AUDIOSOCKET_STATS_TIME(cs, field, us) do { \
+		if (cs) { \
+			audiosocket_histogram_add(&(cs)->stats.field, (us)); \
+		} \
+	} while (0)
+
+static void audiosocket_histogram_add(struct audiosocket_histogram *h, int64_t us)
+{
+	int bucket = 0;
+
+	us = MAX(us, 0);
+	while (bucket < AUDIOSOCKET_HISTOGRAM_BUCKETS - 1 && us >= (2LL << bucket)) {
+		bucket++;
+	}
+
+	ast_atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&h->total_us, us, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \internal
+ * \brief Get an upper bound of a percentile of a histogram, in microseconds
+ *
+ * \param h The histogram.
+ * \param percent The percentile, from 1 to 100.
+ *
+ * \return The upper edge of the bucket holding the percentile, or 0 if the
+ * histogram is empty
+ */
+static uint64_t audiosocket_histogram_percentile(const struct audiosocket_histogram *h,
+	const unsigned int percent)
+{
+	uint64_t want, seen = 0;
+	int i;
+
+	if (!h->count) {
+		return 0;
+	}
+
+	want = ((uint64_t) h->count * percent + 99) / 100;
+	for (i = 0; i < AUDIOSOCKET_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) {
+			break;
+		}
+	}
+
+	return 2ULL << i;
+}
+
+/*!
+ * \internal
+ * \brief Take a consistent enough copy of counters which are still being updated
+ */
+static void audiosocket_stats_copy(struct audiosocket_stats *dst, struct audiosocket_stats *src)
+{
+	struct audiosocket_histogram *from[] = { &src->connect, &src->jitter, &src->latency, &src->rtt };
+	struct audiosocket_histogram *to[] = { &dst->connect, &dst->jitter, &dst->latency, &dst->rtt };
+	int i, j;
+
+	dst->frames_in = ast_atomic_fetch_add(&src->frames_in, 0, __ATOMIC_RELAXED);
+	dst->frames_out = ast_atomic_fetch_add(&src->frames_out, 0, __ATOMIC_RELAXED);
+	dst->bytes_in = ast_atomic_fetch_add(&src->bytes_in, 0, __ATOMIC_RELAXED);
+	dst->bytes_out = ast_atomic_fetch_add(&src->bytes_out, 0, __ATOMIC_RELAXED);
+	dst->short_reads = ast_atomic_fetch_add(&src->short_reads, 0, __ATOMIC_RELAXED);
+	dst->write_waits = ast_atomic_fetch_add(&src->write_waits, 0, __ATOMIC_RELAXED);
+	dst->write_queued = ast_atomic_fetch_add(&src->write_queued, 0, __ATOMIC_RELAXED);
+	dst->write_dropped = ast_atomic_fetch_add(&src->write_dropped, 0, __ATOMIC_RELAXED);
+	dst->seq_gaps = ast_atomic_fetch_add(&src->seq_gaps, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < ARRAY_LEN(from); i++) {
+		for (j = 0; j < AUDIOSOCKET_HISTOGRAM_BUCKETS; j++) {
+			to[i]->buckets[j] = ast_atomic_fetch_add(&from[i]->buckets[j], 0, __ATOMIC_RELAXED);
+		}
+		to[i]->count = ast_atomic_fetch_add(&from[i]->count, 0, __ATOMIC_RELAXED);
+		to[i]->total_us = ast_atomic_fetch_add(&from[i]->total_us, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Add a copy of some counters to others
+ *
+ * The sums are atomic, as the calls made on a bare socket count straight
+ * into the totals.
+ */
+static void audiosocket_stats_add(struct audiosocket_stats *dst, const struct audiosocket_stats *src)
+{
+	const struct audiosocket_histogram *from[] = { &src->connect, &src->jitter, &src->latency, &src->rtt };
+	struct audiosocket_histogram *to[] = { &dst->connect, &dst->jitter, &dst->latency, &dst->rtt };
+	int i, j;
+
+	ast_atomic_fetch_add(&dst->frames_in, src->frames_in, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->frames_out, src->frames_out, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->bytes_in, src->bytes_in, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->bytes_out, src->bytes_out, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->short_reads, src->short_reads, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->write_waits, src->write_waits, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->write_queued, src->write_queued, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->write_dropped, src->write_dropped, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&dst->seq_gaps, src->seq_gaps, __ATOMIC_RELAXED);
+	for (i = 0; i < ARRAY_LEN(from); i++) {
+		for (j = 0; j < AUDIOSOCKET_HISTOGRAM_BUCKETS; j++) {
+			ast_atomic_fetch_add(&to[i]->buckets[j], from[i]->buckets[j], __ATOMIC_RELAXED);
+		}
+		ast_atomic_fetch_add(&to[i]->count, from[i]->count, __ATOMIC_RELAXED);
+		ast_atomic_fetch_add(&to[i]->total_us, from[i]->total_us, __ATOMIC_RELAXED);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Total the counters of the open connections and those which have closed
+ *
+ * \param total Set to the totals.
+ * \param conns The counters of the open connections, if there are any.
+ */
+static void audiosocket_stats_total(struct audiosocket_stats *total, struct ao2_container *conns)
+{
+	struct ao2_iterator it;
+	struct audiosocket_conn_stats *cs;
+	struct audiosocket_stats stats;
+
+	if (!conns) {
+		audiosocket_stats_copy(total, &audiosocket_stats);
+		return;
+	}
+
+	/* A connection which closes meanwhile is counted either as open or as closed */
+	ao2_lock(conns);
+	audiosocket_stats_copy(total, &audiosocket_stats);
+	it = ao2_iterator_init(conns, AO2_ITERATOR_DONTLOCK);
+	while ((cs = ao2_iterator_next(&it))) {
+		audiosocket_stats_copy(&stats, &cs->stats);
+		audiosocket_stats_add(total, &stats);
+		ao2_ref(cs, -1);
+	}
+	ao2_iterator_destroy(&it);
+	ao2_unlock(conns);
+}
+
+/*!
+ * \internal
+ * \brief Start counting the traffic of a new connection
+ *
+ * \retval The connection's counters, which are listed until they are released
+ * with \ref audiosocket_conn_stats_release
+ * \retval NULL if they could not be allocated
+ */
+static struct audiosocket_conn_stats *audiosocket_conn_stats_alloc(void)
+{
+	struct ao2_container *conns = ao2_global_obj_ref(audiosocket_conn_stats);
+	struct audiosocket_conn_stats *cs;
+
+	cs = ao2_alloc(sizeof(*cs), NULL);
+	if (!cs) {
+		ao2_cleanup(conns);
+		return NULL;
+	}
+	cs->created = ast_tvnow();
+	if (conns) {
+		ao2_link(conns, cs);
+		ao2_ref(conns, -1);
+	}
+
+	return cs;
+}
+
+static void audiosocket_conn_stats_release(struct audiosocket_conn_stats *cs)
+{
+	struct ao2_container *conns;
+
+	if (!cs) {
+		return;
+	}
+	if ((conns = ao2_global_obj_ref(audiosocket_conn_stats))) {
+		/* Under the lock, so that the totals never count the connection twice */
+		ao2_lock(conns);
+		audiosocket_stats_add(&audiosocket_stats, &cs->stats);
+		ao2_unlink_flags(conns, cs, OBJ_NOLOCK);
+		ao2_unlock(conns);
+		ao2_ref(conns, -1);
+	} else {
+		audiosocket_stats_add(&audiosocket_stats, &cs->stats);
+	}
+	ao2_ref(cs, -1);
+}
+
+/*!
+ * \internal
+ * \brief Count a connection attempt to a server
+ *
+ * \param conn The connection, or NULL if the attempt failed.
+ * \param server The server.
+ * \param chan The channel the connection is for, if any.
+ * \param start When the attempt began.
+ */
+static void audiosocket_stats_connected(struct ast_audiosocket_conn *conn, const char *server,
+	struct ast_channel *chan, const struct timeval start)
+{
+	int64_t us = ast_tvdiff_us(ast_tvnow(), start);
+
+	if (!conn) {
+		ast_atomic_fetch_add(&audiosocket_stats_connect_failures, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ast_atomic_fetch_add(&audiosocket_stats_connects, 1, __ATOMIC_RELAXED);
+	AUDIOSOCKET_STATS_TIME(conn->stats, connect, us);
+	if (conn->stats) {
+		ao2_lock(conn->stats);
+		ast_copy_string(conn->stats->server, S_OR(server, ""), sizeof(conn->stats->server));
+		ast_copy_string(conn->stats->channel, chan ? ast_channel_name(chan) : "",
+			sizeof(conn->stats->channel));
+		ao2_unlock(conn->stats);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Count the frames received from a connection
+ *
+ * This also starts the time to the frames reaching the channel, which
+ * \ref ast_audiosocket_conn_written ends, and measures how far their arrival
+ * strays from the pace of their audio.
+ *
+ * \param conn The connection.
+ * \param f The frames received.
+ * \param now When the socket was found to be readable.
+ */
+static void audiosocket_stats_received(struct ast_audiosocket_conn *conn, struct ast_frame *f,
+	const struct timeval now)
+{
+	int64_t gap;
+
+	for (; f && f != &ast_null_frame; f = AST_LIST_NEXT(f, frame_list)) {
+		if (f->frametype != AST_FRAME_VOICE) {
+			continue;
+		}
+		if (ast_tvzero(conn->rx_ready)) {
+			conn->rx_ready = now;
+		}
+
+		AUDIOSOCKET_STATS_ADD(conn->stats, frames_in, 1);
+		AUDIOSOCKET_STATS_ADD(conn->stats, bytes_in, f->datalen);
+		if (!ast_tvzero(conn->rx_arrival)) {
+			gap = ast_tvdiff_us(now, conn->rx_arrival);
+			AUDIOSOCKET_STATS_TIME(conn->stats, jitter, gap > conn->rx_pace_us
+				? gap - conn->rx_pace_us : conn->rx_pace_us - gap);
+		}
+		conn->rx_arrival = now;
+		conn->rx_pace_us = f->samples > 0
+			? (int64_t) f->samples * 1000000 / ast_format_get_sample_rate(f->subclass.format) : 0;
+	}
+}
+
+void ast_audiosocket_conn_written(struct ast_audiosocket_conn *conn)
+{
+	if (ast_tvzero(conn->rx_ready)) {
+		return;
+	}
+
+	AUDIOSOCKET_STATS_TIME(conn->stats, latency, ast_tvdiff_us(ast_tvnow(), conn->rx_ready));
+	conn->rx_ready = ast_tv(0, 0);
+}
+
+/*! \brief The histograms of a set of counters, with the names they are shown under */
+#define AUDIOSOCKET_STATS_HISTOGRAMS(stats) { \
+		{ "Connect", "Connect", &(stats)->connect }, \
+		{ "Arrival jitter", "Jitter", &(stats)->jitter }, \
+		{ "Readiness to channel", "Latency", &(stats)->latency }, \
+		{ "Round trip", "RoundTrip", &(stats)->rtt }, \
+	}
+
+/*!
+ * \internal
+ * \brief Format a set of counters as the fields of a manager event
+ */
+static void audiosocket_stats_fields(struct ast_str **buf, struct audiosocket_stats *stats)
+{
+	const struct {
+		const char *title;
+		const char *field;
+		const struct audiosocket_histogram *h;
+	} histograms[] = AUDIOSOCKET_STATS_HISTOGRAMS(stats);
+	int i;
+
+	ast_str_append(buf, 0,
+		"FramesIn: %" PRIu64 "\r\n"
+		"FramesOut: %" PRIu64 "\r\n"
+		"BytesIn: %" PRIu64 "\r\n"
+		"BytesOut: %" PRIu64 "\r\n"
+		"ShortReads: %u\r\n"
+		"WriteWaits: %u\r\n"
+		"WriteQueued: %u\r\n"
+		"WriteDropped: %u\r\n"
+		"SequenceGaps: %u\r\n",
+		stats->frames_in, stats->frames_out, stats->bytes_in, stats->bytes_out,
+		stats->short_reads, stats->write_waits, stats->write_queued, stats->write_dropped,
+		stats->seq_gaps);
+	for (i = 0; i < ARRAY_LEN(histograms); i++) {
+		const struct audiosocket_histogram *h = histograms[i].h;
+
+		ast_str_append(buf, 0,
+			"%sSamples: %u\r\n"
+			"%sMeanUsec: %" PRIu64 "\r\n"
+			"%sP50Usec: %" PRIu64 "\r\n"
+			"%sP90Usec: %" PRIu64 "\r\n"
+			"%sP99Usec: %" PRIu64 "\r\n",
+			histograms[i].field, h->count,
+			histograms[i].field, h->count ? h->total_us / h->count : 0,
+			histograms[i].field, audiosocket_histogram_percentile(h, 50),
+			histograms[i].field, audiosocket_histogram_percentile(h, 90),
+			histograms[i].field, audiosocket_histogram_percentile(h, 99));
+	}
+}
+
+/*!
+ * \internal
+ * \brief Report the counters of a connection which is closing
+ */
+static void audiosocket_stats_closed(struct audiosocket_conn_stats *cs)
+{
+	struct audiosocket_stats stats;
+	struct ast_str *buf;
+
+	if (!cs || !(buf = ast_str_create(512))) {
+		return;
+	}
+
+	audiosocket_stats_copy(&stats, &cs->stats);
+	audiosocket_stats_fields(&buf, &stats);
+	manager_event(EVENT_FLAG_REPORTING, "AudioSocketConnectionEnd",
+		"Server: %s\r\n"
+		"Channel: %s\r\n"
+		"Duration: %" PRId64 "\r\n"
+		"%s",
+		cs->server, cs->channel, ast_tvdiff_ms(ast_tvnow(), cs->created) / 1000,
+		ast_str_buffer(buf));
+	ast_free(buf);
+}
+
+
+/*! \brief Scalar sample kernels, used where no vector unit is available */
+static void audiosocket_gain_scalar(int16_t *samples, size_t count, const int16_t gain)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		int32_t v = ((int32_t) samples[i] * gain + AUDIOSOCKET_GAIN_ROUND) >> AUDIOSOCKET_GAIN_SHIFT;
+
+		samples[i] = MIN(MAX(v, INT16_MIN), INT16_MAX);
+	}
+}
+
+static void audiosocket_energy_scalar(const int16_t *samples, size_t count,
+	struct ast_audiosocket_energy *energy)
+{
+	unsigned int peak = energy->peak;
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		int32_t v = samples[i];
+
+		sum += (uint32_t) (v * v);
+		peak = MAX(peak, (unsigned int) MIN(abs(v), INT16_MAX));
+	}
+
+	energy->sum_squares += sum;
+	energy->samples += count;
+	energy->peak = peak;
+}
+
+static void audiosocket_mix_scalar(int16_t *dst, const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		int32_t v = (int32_t) dst[i] + src[i];
+
+		dst[i] = MIN(MAX(v, INT16_MIN), INT16_MAX);
+	}
+}
+
+static void audiosocket_swap_scalar(int16_t *dst, const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		uint16_t v = src[i];
+
+		dst[i] = (int16_t) ((v << 8) | (v >> 8));
+	}
+}
+
+static void audiosocket_interleave_scalar(int16_t *dst, const int16_t *left,
+	const int16_t *right, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		dst[2 * i] = left[i];
+		dst[2 * i + 1] = right[i];
+	}
+}
+
+static const struct audiosocket_kernels audiosocket_kernels_scalar = {
+	.name = "scalar",
+	.gain = audiosocket_gain_scalar,
+	.energy = audiosocket_energy_scalar,
+	.mix = audiosocket_mix_scalar,
+	.swap = audiosocket_swap_scalar,
+	.interleave = audiosocket_interleave_scalar,
+};
+
+#ifdef AUDIOSOCKET_KERNELS_X86
+/* The x86 kernels are built for their instruction set whatever the compiler
+ * flags, and are only used once the processor is known to support it. */
+
+static __attribute__((target("sse2"))) void audiosocket_gain_sse2(int16_t *samples,
+	size_t count, const int16_t gain)
+{
+	const __m128i g = _mm_set1_epi16(gain);
+	const __m128i round = _mm_set1_epi32(AUDIOSOCKET_GAIN_ROUND);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (samples + i));
+		__m128i lo = _mm_mullo_epi16(x, g), hi = _mm_mulhi_epi16(x, g);
+		__m128i p0 = _mm_unpacklo_epi16(lo, hi), p1 = _mm_unpackhi_epi16(lo, hi);
+
+		p0 = _mm_srai_epi32(_mm_add_epi32(p0, round), AUDIOSOCKET_GAIN_SHIFT);
+		p1 = _mm_srai_epi32(_mm_add_epi32(p1, round), AUDIOSOCKET_GAIN_SHIFT);
+		_mm_storeu_si128((__m128i *) (samples + i), _mm_packs_epi32(p0, p1));
+	}
+	audiosocket_gain_scalar(samples + i, count - i, gain);
+}
+
+static __attribute__((target("sse2"))) void audiosocket_energy_sse2(const int16_t *samples,
+	size_t count, struct ast_audiosocket_energy *energy)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero, peak = zero;
+	uint64_t sums[2];
+	int16_t peaks[8];
+	size_t i;
+	int j;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (samples + i));
+		/* Each pair of squares fits in 32 bits when taken as unsigned */
+		__m128i sq = _mm_madd_epi16(x, x);
+
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(sq, zero));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(sq, zero));
+		peak = _mm_max_epi16(peak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+	}
+
+	_mm_storeu_si128((__m128i *) sums, sum);
+	_mm_storeu_si128((__m128i *) peaks, peak);
+	energy->sum_squares += sums[0] + sums[1];
+	energy->samples += i;
+	for (j = 0; j < 8; j++) {
+		energy->peak = MAX(energy->peak, (unsigned int) peaks[j]);
+	}
+	audiosocket_energy_scalar(samples + i, count - i, energy);
+}
+
+static __attribute__((target("sse2"))) void audiosocket_mix_sse2(int16_t *dst,
+	const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epi16(a, b));
+	}
+	audiosocket_mix_scalar(dst + i, src + i, count - i);
+}
+
+static __attribute__((target("sse2"))) void audiosocket_swap_sse2(int16_t *dst,
+	const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i *) (dst + i), x);
+	}
+	audiosocket_swap_scalar(dst + i, src + i, count - i);
+}
+
+static __attribute__((target("sse2"))) void audiosocket_interleave_sse2(int16_t *dst,
+	const int16_t *left, const int16_t *right, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i l = _mm_loadu_si128((const __m128i *) (left + i));
+		__m128i r = _mm_loadu_si128((const __m128i *) (right + i));
+
+		_mm_storeu_si128((__m128i *) (dst + 2 * i), _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i *) (dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+	}
+	audiosocket_interleave_scalar(dst + 2 * i, left + i, right + i, count - i);
+}
+
+static const struct audiosocket_kernels audiosocket_kernels_sse2 = {
+	.name = "SSE2",
+	.gain = audiosocket_gain_sse2,
+	.energy = audiosocket_energy_sse2,
+	.mix = audiosocket_mix_sse2,
+	.swap = audiosocket_swap_sse2,
+	.interleave = audiosocket_interleave_sse2,
+};
+
+static __attribute__((target("avx2"))) void audiosocket_gain_avx2(int16_t *samples,
+	size_t count, const int16_t gain)
+{
+	const __m256i g = _mm256_set1_epi16(gain);
+	const __m256i round = _mm256_set1_epi32(AUDIOSOCKET_GAIN_ROUND);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (samples + i));
+		__m256i lo = _mm256_mullo_epi16(x, g), hi = _mm256_mulhi_epi16(x, g);
+		/* Unpacking and packing both work within each 128-bit lane, so the
+		 * samples come back in order */
+		__m256i p0 = _mm256_unpacklo_epi16(lo, hi), p1 = _mm256_unpackhi_epi16(lo, hi);
+
+		p0 = _mm256_srai_epi32(_mm256_add_epi32(p0, round), AUDIOSOCKET_GAIN_SHIFT);
+		p1 = _mm256_srai_epi32(_mm256_add_epi32(p1, round), AUDIOSOCKET_GAIN_SHIFT);
+		_mm256_storeu_si256((__m256i *) (samples + i), _mm256_packs_epi32(p0, p1));
+	}
+	audiosocket_gain_sse2(samples + i, count - i, gain);
+}
+
+static __attribute__((target("avx2"))) void audiosocket_energy_avx2(const int16_t *samples,
+	size_t count, struct ast_audiosocket_energy *energy)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum = zero, peak = zero;
+	uint64_t sums[4];
+	int16_t peaks[16];
+	size_t i;
+	int j;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (samples + i));
+		__m256i sq = _mm256_madd_epi16(x, x);
+
+		sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(sq, zero));
+		sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(sq, zero));
+		peak = _mm256_max_epi16(peak, _mm256_max_epi16(x, _mm256_subs_epi16(zero, x)));
+	}
+
+	_mm256_storeu_si256((__m256i *) sums, sum);
+	_mm256_storeu_si256((__m256i *) peaks, peak);
+	energy->sum_squares += sums[0] + sums[1] + sums[2] + sums[3];
+	energy->samples += i;
+	for (j = 0; j < 16; j++) {
+		energy->peak = MAX(energy->peak, (unsigned int) peaks[j]);
+	}
+	audiosocket_energy_sse2(samples + i, count - i, energy);
+}
+
+static __attribute__((target("avx2"))) void audiosocket_mix_avx2(int16_t *dst,
+	const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (src + i));
+
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_adds_epi16(a, b));
+	}
+	audiosocket_mix_sse2(dst + i, src + i, count - i);
+}
+
+static __attribute__((target("avx2"))) void audiosocket_swap_avx2(int16_t *dst,
+	const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (src + i));
+
+		x = _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+		_mm256_storeu_si256((__m256i *) (dst + i), x);
+	}
+	audiosocket_swap_sse2(dst + i, src + i, count - i);
+}
+
+static __attribute__((target("avx2"))) void audiosocket_interleave_avx2(int16_t *dst,
+	const int16_t *left, const int16_t *right, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i l = _mm256_loadu_si256((const __m256i *) (left + i));
+		__m256i r = _mm256_loadu_si256((const __m256i *) (right + i));
+		/* Unpacking works within each 128-bit lane, so the lanes are put back
+		 * in order afterwards */
+		__m256i lo = _mm256_unpacklo_epi16(l, r), hi = _mm256_unpackhi_epi16(l, r);
+
+		_mm256_storeu_si256((__m256i *) (dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) (dst + 2 * i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	audiosocket_interleave_sse2(dst + 2 * i, left + i, right + i, count - i);
+}
+
+static const struct audiosocket_kernels audiosocket_kernels_avx2 = {
+	.name = "AVX2",
+	.gain = audiosocket_gain_avx2,
+	.energy = audiosocket_energy_avx2,
+	.mix = audiosocket_mix_avx2,
+	.swap = audiosocket_swap_avx2,
+	.interleave = audiosocket_interleave_avx2,
+};
+#endif /* AUDIOSOCKET_KERNELS_X86 */
+
+#ifdef AUDIOSOCKET_KERNELS_NEON
+static void audiosocket_gain_neon(int16_t *samples, size_t count, const int16_t gain)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		int16x8_t x = vld1q_s16(samples + i);
+		/* A rounding shift adds the same half as the scalar kernel */
+		int32x4_t lo = vrshrq_n_s32(vmull_n_s16(vget_low_s16(x), gain), AUDIOSOCKET_GAIN_SHIFT);
+		int32x4_t hi = vrshrq_n_s32(vmull_n_s16(vget_high_s16(x), gain), AUDIOSOCKET_GAIN_SHIFT);
+
+		vst1q_s16(samples + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+	}
+	audiosocket_gain_scalar(samples + i, count - i, gain);
+}
+
+static void audiosocket_energy_neon(const int16_t *samples, size_t count,
+	struct ast_audiosocket_energy *energy)
+{
+	uint64x2_t sum = vdupq_n_u64(0);
+	int16x8_t peak = vdupq_n_s16(0);
+	int16_t peaks[8];
+	size_t i;
+	int j;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		int16x8_t x = vld1q_s16(samples + i);
+
+		sum = vpadalq_u32(sum, vreinterpretq_u32_s32(vmull_s16(vget_low_s16(x), vget_low_s16(x))));
+		sum = vpadalq_u32(sum, vreinterpretq_u32_s32(vmull_s16(vget_high_s16(x), vget_high_s16(x))));
+		peak = vmaxq_s16(peak, vqabsq_s16(x));
+	}
+
+	vst1q_s16(peaks, peak);
+	energy->sum_squares += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+	energy->samples += i;
+	for (j = 0; j < 8; j++) {
+		energy->peak = MAX(energy->peak, (unsigned int) peaks[j]);
+	}
+	audiosocket_energy_scalar(samples + i, count - i, energy);
+}
+
+static void audiosocket_mix_neon(int16_t *dst, const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+	}
+	audiosocket_mix_scalar(dst + i, src + i, count - i);
+}
+
+static void audiosocket_swap_neon(int16_t *dst, const int16_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		uint8x16_t x = vld1q_u8((const uint8_t *) (src + i));
+
+		vst1q_u8((uint8_t *) (dst + i), vrev16q_u8(x));
+	}
+	audiosocket_swap_scalar(dst + i, src + i, count - i);
+}
+
+static void audiosocket_interleave_neon(int16_t *dst, const int16_t *left,
+	const int16_t *right, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		int16x8x2_t x = { { vld1q_s16(left + i), vld1q_s16(right + i) } };
+
+		vst2q_s16(dst + 2 * i, x);
+	}
+	audiosocket_interleave_scalar(dst + 2 * i, left + i, right + i, count - i);
+}
+
+static const struct audiosocket_kernels audiosocket_kernels_neon = {
+	.name = "NEON",
+	.gain = audiosocket_gain_neon,
+	.energy = audiosocket_energy_neon,
+	.mix = audiosocket_mix_neon,
+	.swap = audiosocket_swap_neon,
+	.interleave = audiosocket_interleave_neon,
+};
+#endif /* AUDIOSOCKET_KERNELS_NEON */
+
+/*! \brief The sample kernels in use, chosen for the processor at load */
+static const struct audiosocket_kernels *audiosocket_kernels = &audiosocket_kernels_scalar;
+
+/*!
+ * \internal
+ * \brief Choose the fastest sample kernels which the processor supports
+ */
+static void audiosocket_kernels_select(void)
+{
+#ifdef AUDIOSOCKET_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		audiosocket_kernels = &audiosocket_kernels_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		audiosocket_kernels = &audiosocket_kernels_sse2;
+	}
+#elif defined(AUDIOSOCKET_KERNELS_NEON)
+	audiosocket_kernels = &audiosocket_kernels_neon;
+#endif
+
+	ast_debug(1, "Using %s AudioSocket sample kernels\n", audiosocket_kernels->name);
+}
+
+void ast_audiosocket_slin_gain(int16_t *samples, const size_t count, const unsigned int gain)
+{
+	audiosocket_kernels->gain(samples, count, MIN(gain, INT16_MAX));
+}
+
+void ast_audiosocket_slin_energy(const int16_t *samples, const size_t count,
+	struct ast_audiosocket_energy *energy)
+{
+	audiosocket_kernels->energy(samples, count, energy);
+}
+
+const unsigned int ast_audiosocket_energy_rms(const struct ast_audiosocket_energy *energy)
+{
+	if (!energy->samples) {
+		return 0;
+	}
+
+	return sqrt((double) energy->sum_squares / energy->samples);
+}
+
+void ast_audiosocket_slin_mix(int16_t *dst, const int16_t *src, const size_t count)
+{
+	audiosocket_kernels->mix(dst, src, count);
+}
+
+void ast_audiosocket_slin_swap(int16_t *dst, const int16_t *src, const size_t count)
+{
+	audiosocket_kernels->swap(dst, src, count);
+}
+
+void ast_audiosocket_slin_interleave(int16_t *dst, const int16_t *left, const int16_t *right,
+	const size_t count)
+{
+	audiosocket_kernels->interleave(dst, left, right, count);
+}
+
+/*! \brief Mapping between the audio message kinds and their Asterisk formats */
+static const struct {
+	enum ast_audiosocket_msg_kind kind;
+	struct ast_format **format;
+	unsigned int slin_rate;	/* The sample rate of signed linear formats, otherwise 0 */
+} audiosocket_audio_kinds[] = {
+	{ AST_AUDIOSOCKET_KIND_AUDIO, &ast_format_slin, 8000 },
+	{ AST_AUDIOSOCKET_KIND_AUDIO_SLIN16, &ast_format_slin16, 16000 },
+	{ AST_AUDIOSOCKET_KIND_AUDIO_SLIN24, &ast_format_slin24, 24000 },
+	{ AST_AUDIOSOCKET_KIND_AUDIO_SLIN48, &ast_format_slin48, 48000 },
+	{ AST_AUDIOSOCKET_KIND_AUDIO_ULAW, &ast_format_ulaw, 0 },
+	{ AST_AUDIOSOCKET_KIND_AUDIO_ALAW, &ast_format_alaw, 0 },
+	{ AST_AUDIOSOCKET_KIND_AUDIO_OPUS, &ast_format_opus, 0 },
+};
+
+const int ast_audiosocket_kind_from_format(const struct ast_format *format)
+{
+	int i;
+
+	if (!format) {
+		return -1;
+	}
+	for (i = 0; i < ARRAY_LEN(audiosocket_audio_kinds); i++) {
+		if (ast_format_cmp(format, *audiosocket_audio_kinds[i].format) == AST_FORMAT_CMP_EQUAL) {
+			return audiosocket_audio_kinds[i].kind;
+		}
+	}
+
+	return -1;
+}
+
+struct ast_format *ast_audiosocket_format_from_kind(const uint8_t kind)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(audiosocket_audio_kinds); i++) {
+		if (audiosocket_audio_kinds[i].kind == kind) {
+			return *audiosocket_audio_kinds[i].format;
+		}
+	}
+
+	return NULL;
+}
+
+struct ast_format *ast_audiosocket_slin_format(const unsigned int rate)
+{
+	struct ast_format *format = ast_format_slin;
+	unsigned int best = 0;
+	int i;
+
+	/* Use the highest rate which does not exceed the requested one */
+	for (i = 0; i < ARRAY_LEN(audiosocket_audio_kinds); i++) {
+		if (audiosocket_audio_kinds[i].slin_rate > best
+			&& audiosocket_audio_kinds[i].slin_rate <= rate) {
+			best = audiosocket_audio_kinds[i].slin_rate;
+			format = *audiosocket_audio_kinds[i].format;
+		}
+	}
+
+	return format;
+}
+
+/*!
+ * \internal
+ * \brief Determine whether a message kind carries audio, which a connection may
+ * drop when its server falls behind
+ */
+static int audiosocket_kind_is_audio(const int kind)
+{
+	int i;
+
+	if (kind == AST_AUDIOSOCKET_KIND_SILENCE || kind == AST_AUDIOSOCKET_KIND_AUDIO_STEREO) {
+		return 1;
+	}
+	for (i = 0; i < ARRAY_LEN(audiosocket_audio_kinds); i++) {
+		if (audiosocket_audio_kinds[i].kind == kind) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Determine whether the payload of a message kind is signed linear audio
+ */
+static int audiosocket_kind_is_slin(const int kind)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(audiosocket_audio_kinds); i++) {
+		if (audiosocket_audio_kinds[i].kind == kind) {
+			return audiosocket_audio_kinds[i].slin_rate != 0;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Copy a payload between the byte order of the wire and that of the host
+ *
+ * Signed linear audio is little-endian on the wire, so on big-endian hosts its
+ * samples are swapped.  Any other payload is copied as it is.
+ *
+ * \param kind The message kind of the payload.
+ * \param dst Where the payload is copied to.  This may be the same as src.
+ * \param src The payload.
+ * \param len The length of the payload.
+ */
+static void audiosocket_payload_swap(const int kind, void *dst, const void *src, const size_t len)
+{
+	if (AUDIOSOCKET_SLIN_SWAP && audiosocket_kind_is_slin(kind)) {
+		ast_audiosocket_slin_swap(dst, src, len / sizeof(int16_t));
+		if (len % sizeof(int16_t)) {
+			((uint8_t *) dst)[len - 1] = ((const uint8_t *) src)[len - 1];
+		}
+	} else if (dst != src) {
+		memcpy(dst, src, len);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Write a complete message to the socket from a set of buffers
+ *
+ * A short write carries on from the first unsent byte, waiting for the socket
+ * to become writable if necessary, so that the message is never left
+ * partially sent.
+ *
+ * \param svc The file descriptor of the network socket.
+ * \param iov The buffers which make up the message.  These are modified.
+ * \param iovcnt The number of buffers.
+ * \param cs The counters of the connection, or NULL to count only in the totals.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_writev(const int svc, struct iovec *iov, int iovcnt,
+	struct audiosocket_conn_stats *cs)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		n = writev(svc, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				AUDIOSOCKET_STATS_ADD(cs, write_waits, 1);
+				if (ast_wait_for_output(svc, MAX_WRITE_TIMEOUT_MSEC) > 0) {
+					continue;
+				}
+			}
+			return -1;
+		}
+
+		/* Skip past whatever has been written */
+		while (iovcnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Remove a message from a write queue
+ *
+ * The messages before it move up a place, so that the ring stays in order and
+ * the storage of the removed message is left in the slot freed at the head.
+ *
+ * \param q The write queue.
+ * \param i The position of the message in the queue, which must not be the
+ * oldest if that has been partly written.
+ */
+static void audiosocket_txq_remove(struct audiosocket_txq *q, unsigned int i)
+{
+	struct audiosocket_txq_msg removed = q->msgs[(q->head + i) % q->size];
+
+	for (; i > 0; i--) {
+		q->msgs[(q->head + i) % q->size] = q->msgs[(q->head + i - 1) % q->size];
+	}
+	q->msgs[q->head] = removed;
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	if (!q->count || !i) {
+		q->sent = 0;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Free the messages of a write queue
+ */
+static void audiosocket_txq_free(struct audiosocket_txq *q)
+{
+	unsigned int i;
+
+	if (!q->msgs) {
+		return;
+	}
+	for (i = 0; i < q->size; i++) {
+		ast_free(q->msgs[i].data);
+	}
+	ast_free(q->msgs);
+}
+
+/*!
+ * \internal
+ * \brief Add the unwritten part of a message to the end of a write queue
+ *
+ * \param q The write queue, which must not be full.
+ * \param iov The buffers which make up the message.
+ * \param iovcnt The number of buffers.
+ * \param skip The number of bytes of the message which have already been written.
+ * \param droppable Set if the message may be dropped to make room for others.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_txq_push(struct audiosocket_txq *q, const struct iovec *iov,
+	const int iovcnt, size_t skip, const int droppable)
+{
+	struct audiosocket_txq_msg *msg;
+	size_t len = 0;
+	int i;
+
+	if (!q->msgs && !(q->msgs = ast_calloc(q->size, sizeof(*q->msgs)))) {
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	len -= skip;
+
+	msg = &q->msgs[(q->head + q->count) % q->size];
+	if (msg->size < len) {
+		uint8_t *data = ast_realloc(msg->data, len);
+
+		if (!data) {
+			return -1;
+		}
+		msg->data = data;
+		msg->size = len;
+	}
+
+	msg->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		size_t n = iov[i].iov_len;
+
+		if (skip >= n) {
+			skip -= n;
+			continue;
+		}
+		memcpy(msg->data + msg->len, (uint8_t *) iov[i].iov_base + skip, n - skip);
+		msg->len += n - skip;
+		skip = 0;
+	}
+	msg->queued = ast_tvnow();
+	msg->droppable = droppable;
+	q->count++;
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Write as much of a write queue as the socket will take without waiting
+ *
+ * \retval 0 on success, including when messages are left in the queue
+ * \retval -1 on error
+ */
+static int audiosocket_txq_drain(const int svc, struct audiosocket_txq *q)
+{
+	struct iovec iov[AUDIOSOCKET_TXQ_IOV];
+	size_t total, left;
+	ssize_t n;
+	int iovcnt;
+
+	q->tried = ast_tvnow();
+	while (q->count) {
+		total = 0;
+		for (iovcnt = 0; iovcnt < MIN(q->count, AUDIOSOCKET_TXQ_IOV); iovcnt++) {
+			struct audiosocket_txq_msg *msg = &q->msgs[(q->head + iovcnt) % q->size];
+			size_t skip = iovcnt ? 0 : q->sent;
+
+			iov[iovcnt].iov_base = msg->data + skip;
+			iov[iovcnt].iov_len = msg->len - skip;
+			total += msg->len - skip;
+		}
+
+		n = writev(svc, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+
+		/* Release whatever has been written */
+		for (left = n; left && left >= q->msgs[q->head].len - q->sent; ) {
+			left -= q->msgs[q->head].len - q->sent;
+			audiosocket_txq_remove(q, 0);
+		}
+		q->sent += left;
+
+		if ((size_t) n < total) {
+			/* The socket is full */
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Write what the socket of a connection will take of its write queue,
+ * and enforce the policy of the queue on what is left
+ *
+ * \retval 0 on success, including when messages are left in the queue
+ * \retval -1 if the socket failed, or the oldest message has waited too long
+ * under AUDIOSOCKET_TXQ_FAIL
+ */
+static int audiosocket_txq_flush(struct ast_audiosocket_conn *sock)
+{
+	struct audiosocket_txq *q = &sock->txq;
+
+	if (!q->count) {
+		return 0;
+	}
+	if (audiosocket_txq_drain(sock->svc, q)) {
+		return -1;
+	}
+
+	if (q->count && q->policy == AUDIOSOCKET_TXQ_FAIL
+		&& ast_tvdiff_ms(ast_tvnow(), q->msgs[q->head].queued) >= q->fail_ms) {
+		ast_log(LOG_WARNING, "AudioSocket server has taken nothing for %u ms\n", q->fail_ms);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Get the time until a write queue should be offered to its socket again
+ *
+ * \retval The number of milliseconds until the next try
+ * \retval 0 if it is due now
+ * \retval -1 if the queue is empty
+ */
+static int audiosocket_txq_timeout(const struct audiosocket_txq *q)
+{
+	int64_t elapsed;
+
+	if (!q->count) {
+		return -1;
+	}
+
+	elapsed = ast_tvdiff_ms(ast_tvnow(), q->tried);
+	if (elapsed >= AUDIOSOCKET_TXQ_RETRY_MSEC) {
+		return 0;
+	}
+
+	return AUDIOSOCKET_TXQ_RETRY_MSEC - elapsed;
+}
+
+/*!
+ * \internal
+ * \brief Give the server of a connection which is closing the time it may
+ * still be allowed to take what is queued for it, such as a hangup
+ */
+static void audiosocket_txq_linger(const int svc, struct audiosocket_txq *q)
+{
+	struct timeval start = ast_tvnow();
+	int ms;
+
+	while (!audiosocket_txq_drain(svc, q) && q->count) {
+		ms = ast_remaining_ms(start, MAX_WRITE_TIMEOUT_MSEC);
+		if (!ms || ast_wait_for_output(svc, ms) <= 0) {
+			break;
+		}
+	}
+	if (q->count) {
+		ast_debug(1, "Closing AudioSocket with %u messages unsent\n", q->count);
+	}
+}
+
+static void audiosocket_reactor_watch_output(struct ast_audiosocket_conn *conn, const int watch);
+
+/*!
+ * \internal
+ * \brief Add the unwritten part of a message to the write queue of a connection,
+ * and have a reactor thread watch for the socket to take it
+ */
+static int audiosocket_txq_queue(struct ast_audiosocket_conn *sock, const struct iovec *iov,
+	const int iovcnt, size_t skip, const int droppable)
+{
+	if (audiosocket_txq_push(&sock->txq, iov, iovcnt, skip, droppable)) {
+		return -1;
+	}
+	if (sock->txq.count == 1) {
+		audiosocket_reactor_watch_output(sock, 1);
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Write a message to the socket of a connection without waiting, queueing
+ * whatever the socket can not take
+ *
+ * Messages are queued behind any already waiting, which are written first.
+ * When the queue is full, its policy decides whether audio is dropped or the
+ * write fails; other messages are never dropped.  A connection without a queue
+ * waits for the socket instead.  Must be called with the queue locked: by the
+ * connection itself, or by the lock of the multiplexed connection it is.
+ *
+ * \param sock The connection which owns the socket and the queue.
+ * \param iov The buffers which make up the message.  These may be modified.
+ * \param iovcnt The number of buffers.
+ * \param droppable Set if the message is audio which may be dropped.
+ * \param cs The counters of the connection sending the message, or NULL.
+ *
+ * \retval 0 on success, including when the message was queued or dropped
+ * \retval -1 on error
+ */
+static int audiosocket_txq_write(struct ast_audiosocket_conn *sock, struct iovec *iov,
+	const int iovcnt, const int droppable, struct audiosocket_conn_stats *cs)
+{
+	struct audiosocket_txq *q = &sock->txq;
+	size_t total = 0;
+	unsigned int i;
+	ssize_t n;
+	int j;
+
+	if (!q->size) {
+		return audiosocket_writev(sock->svc, iov, iovcnt, cs);
+	}
+
+	if (q->count && audiosocket_txq_flush(sock)) {
+		return -1;
+	}
+
+	if (!q->count) {
+		for (j = 0; j < iovcnt; j++) {
+			total += iov[j].iov_len;
+		}
+		while ((n = writev(sock->svc, iov, iovcnt)) < 0 && errno == EINTR) {
+		}
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+			n = 0;
+		}
+		if ((size_t) n == total) {
+			return 0;
+		}
+
+		AUDIOSOCKET_STATS_ADD(cs, write_queued, 1);
+		/* The rest of a message which has been started can not be dropped */
+		return audiosocket_txq_queue(sock, iov, iovcnt, n, n ? 0 : droppable);
+	}
+
+	if (q->count == q->size) {
+		if (droppable && q->policy == AUDIOSOCKET_TXQ_DROP_NEWEST) {
+			AUDIOSOCKET_STATS_ADD(cs, write_dropped, 1);
+			return 0;
+		}
+
+		/* Make room by dropping the oldest audio which has not been started */
+		for (i = q->sent ? 1 : 0; i < q->count; i++) {
+			if (q->msgs[(q->head + i) % q->size].droppable) {
+				break;
+			}
+		}
+		if (q->policy == AUDIOSOCKET_TXQ_FAIL || i == q->count) {
+			ast_log(LOG_WARNING, "AudioSocket write queue of %u messages is full\n", q->size);
+			return -1;
+		}
+		audiosocket_txq_remove(q, i);
+		AUDIOSOCKET_STATS_ADD(cs, write_dropped, 1);
+	}
+
+	AUDIOSOCKET_STATS_ADD(cs, write_queued, 1);
+
+	return audiosocket_txq_queue(sock, iov, iovcnt, 0, droppable);
+}
+
+/*!
+ * \internal
+ * \brief Send a message over the datagram transport
+ *
+ * A datagram of audio which the socket has no room for is dropped rather than
+ * waited for, as it would be on the network.  Any other datagram is waited for,
+ * up to MAX_WRITE_TIMEOUT_MSEC.
+ *
+ * \param conn The AudioSocket connection.
+ * \param msg The message.
+ * \param msgcnt The number of buffers of the message.
+ * \param droppable Non-zero if the datagram may be dropped.
+ *
+ * \retval 0 on success, including when the datagram was dropped
+ * \retval -1 on error
+ */
+static int audiosocket_datagram_write(struct ast_audiosocket_conn *conn,
+	const struct iovec *msg, const int msgcnt, const int droppable)
+{
+	uint8_t prefix[AUDIOSOCKET_DATAGRAM_PREFIX_LEN];
+	struct iovec iov[3];
+	struct timeval start = { 0, };
+	uint32_t ts;
+	int i, err, remaining;
+
+	if (!conn->tx_seq && ast_tvzero(conn->tx_start)) {
+		conn->tx_start = ast_tvnow();
+	}
+	ts = ast_tvdiff_ms(ast_tvnow(), conn->tx_start);
+
+	prefix[0] = conn->tx_seq >> 8;
+	prefix[1] = conn->tx_seq & 0xff;
+	prefix[2] = ts >> 24;
+	prefix[3] = (ts >> 16) & 0xff;
+	prefix[4] = (ts >> 8) & 0xff;
+	prefix[5] = ts & 0xff;
+	conn->tx_seq++;
+
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = sizeof(prefix);
+	for (i = 0; i < msgcnt; i++) {
+		iov[i + 1] = msg[i];
+	}
+
+	while (writev(conn->svc, iov, msgcnt + 1) < 0) {
+		err = errno;
+		if (err == EINTR) {
+			continue;
+		}
+		if (err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS) {
+			return -1;
+		}
+		if (droppable) {
+			/* Sending it late would only delay what follows */
+			return 0;
+		}
+
+		if (ast_tvzero(start)) {
+			start = ast_tvnow();
+		}
+		remaining = ast_remaining_ms(start, MAX_WRITE_TIMEOUT_MSEC);
+		if (!remaining) {
+			return -1;
+		}
+		if (err == ENOBUFS) {
+			/* The socket itself has room, so there is nothing to wait for */
+			usleep(1000);
+		} else {
+			ast_wait_for_output(conn->svc, remaining);
+		}
+	}
+
+	return 0;
+}
+
+static int audiosocket_conn_write_one(struct ast_audiosocket_conn *conn, const uint8_t kind,
+	const void *payload, const size_t len);
+
+/*!
+ * \internal
+ * \brief Send the ID of a call over the datagram transport again
+ *
+ * A datagram may be lost, and the server does not know the call without its
+ * ID, so the ID and any offer of the extended header are sent again ahead of
+ * each datagram until the server is heard from, or until
+ * AUDIOSOCKET_DATAGRAM_ID_REPEATS datagrams have gone out.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_datagram_repeat_id(struct ast_audiosocket_conn *conn)
+{
+	static const uint8_t offer = AUDIOSOCKET_ID_FLAG_EXTENDED;
+
+	if (__atomic_load_n(&conn->rx_started, __ATOMIC_RELAXED)) {
+		conn->id_repeats = 0;
+		return 0;
+	}
+	conn->id_repeats--;
+
+	if (audiosocket_conn_write_one(conn, AST_AUDIOSOCKET_KIND_UUID, conn->id, sizeof(conn->id))) {
+		return -1;
+	}
+	if (conn->extended
+		&& audiosocket_conn_write_one(conn, AST_AUDIOSOCKET_KIND_UUID, &offer, sizeof(offer))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Fill in the sequence number and timestamp which extend the header of
+ * the next message sent
+ */
+static void audiosocket_extended_put(struct ast_audiosocket_conn *conn, uint8_t *buf)
+{
+	uint32_t ts;
+
+	if (!conn->ext_seq && ast_tvzero(conn->ext_start)) {
+		conn->ext_start = ast_tvnow();
+	}
+	ts = ast_tvdiff_ms(ast_tvnow(), conn->ext_start);
+
+	buf[0] = conn->ext_seq >> 8;
+	buf[1] = conn->ext_seq & 0xff;
+	buf[2] = ts >> 24;
+	buf[3] = (ts >> 16) & 0xff;
+	buf[4] = (ts >> 8) & 0xff;
+	buf[5] = ts & 0xff;
+	conn->ext_seq++;
+}
+
+/*!
+ * \internal
+ * \brief Write a complete message over an AudioSocket connection
+ *
+ * Once the server has accepted the extended header, every message but an ID or
+ * an error starts with one.  A message of a multiplexed stream is wrapped in an
+ * envelope and written to the shared connection.  A message of the datagram
+ * transport is sent in a datagram of its own, after a sequence number and
+ * timestamp.  Otherwise, a message which the socket can not take at once waits
+ * in the write queue of the connection, or of the shared connection.
+ *
+ * \param conn The AudioSocket connection.
+ * \param kind The \ref ast_audiosocket_msg_kind of the message.
+ * \param payload The payload of the message.
+ * \param len The length of the payload.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_conn_write_one(struct ast_audiosocket_conn *conn, const uint8_t kind,
+	const void *payload, const size_t len)
+{
+	uint8_t hdr[AUDIOSOCKET_MUX_PREFIX_LEN + AUDIOSOCKET_HEADER_LEN + AUDIOSOCKET_EXTENDED_LEN];
+	const int extended = conn->extended
+		&& (conn->stream ? conn->stream->ext_accepted : conn->ext_accepted)
+		&& kind != AST_AUDIOSOCKET_KIND_UUID && kind != AST_AUDIOSOCKET_KIND_ERROR;
+	const size_t inner = AUDIOSOCKET_HEADER_LEN + (extended ? AUDIOSOCKET_EXTENDED_LEN : 0);
+	struct iovec iov[2];
+	size_t hdrlen = 0;
+	int res;
+
+	if (conn->mux) {
+		size_t envlen = AUDIOSOCKET_MUX_ID_LEN + inner + len;
+
+		hdr[0] = AST_AUDIOSOCKET_KIND_MUX;
+		hdr[1] = envlen >> 8;
+		hdr[2] = envlen & 0xff;
+		hdr[3] = conn->stream->id >> 8;
+		hdr[4] = conn->stream->id & 0xff;
+		hdrlen = AUDIOSOCKET_MUX_PREFIX_LEN;
+	}
+	hdr[hdrlen] = extended ? kind | AST_AUDIOSOCKET_KIND_EXTENDED : kind;
+	hdr[hdrlen + 1] = len >> 8;
+	hdr[hdrlen + 2] = len & 0xff;
+	if (extended) {
+		audiosocket_extended_put(conn, hdr + hdrlen + AUDIOSOCKET_HEADER_LEN);
+	}
+	hdrlen += inner;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdrlen;
+	iov[1].iov_base = (void *) payload;
+	iov[1].iov_len = len;
+	AUDIOSOCKET_STATS_ADD(conn->stats, bytes_out, len);
+
+	if (conn->datagram) {
+		if (conn->id_repeats && kind != AST_AUDIOSOCKET_KIND_UUID
+			&& audiosocket_datagram_repeat_id(conn)) {
+			return -1;
+		}
+		return audiosocket_datagram_write(conn, iov, len ? 2 : 1,
+			audiosocket_kind_is_audio(kind));
+	}
+	if (!conn->mux) {
+		/* A reactor thread may be writing out the queue */
+		ao2_lock(conn);
+		res = audiosocket_txq_write(conn, iov, len ? 2 : 1, audiosocket_kind_is_audio(kind),
+			conn->stats);
+		ao2_unlock(conn);
+		return res;
+	}
+
+	ast_mutex_lock(&conn->mux->lock);
+	res = conn->mux->dead ? -1 : audiosocket_txq_write(conn->mux->conn, iov, len ? 2 : 1,
+		audiosocket_kind_is_audio(kind), conn->stats);
+	ast_mutex_unlock(&conn->mux->lock);
+
+	return res;
+}
+
+/*!
+ * \internal
+ * \brief Write a complete message over an AudioSocket connection and to each
+ * connection which is sent a copy of it
+ *
+ * Every copy is written from the same payload.  A copy which can not be
+ * written is no longer sent anything, without failing the write.
+ *
+ * \see audiosocket_conn_write_one
+ */
+static int audiosocket_conn_write(struct ast_audiosocket_conn *conn, const uint8_t kind,
+	const void *payload, const size_t len)
+{
+	unsigned int i = 0;
+	int res;
+
+	res = audiosocket_conn_write_one(conn, kind, payload, len);
+
+	while (i < conn->tee_count) {
+		if (audiosocket_conn_write_one(conn->tees[i], kind, payload, len)) {
+			ast_log(LOG_WARNING, "Failed to write data to AudioSocket copy; no longer sending to it\n");
+			ast_audiosocket_conn_untee(conn, conn->tees[i]);
+			continue;
+		}
+		i++;
+	}
+
+	return res;
+}
+
+/*!
+ * \internal
+ * \brief Get the message kind for a frame, checking that it can be sent
+ *
+ * \param f The Asterisk audio frame.
+ * \param max_len The largest payload which the connection can carry.
+ *
+ * \retval The \ref ast_audiosocket_msg_kind of the frame
+ * \retval -1 if it can not be sent
+ */
+static int audiosocket_frame_kind(const struct ast_frame *f, const size_t max_len)
+{
+	int kind;
+
+	kind = ast_audiosocket_kind_from_format(f->subclass.format);
+	if (kind < 0) {
+		ast_log(LOG_WARNING, "Format %s can not be sent over AudioSocket\n",
+			ast_format_get_name(f->subclass.format));
+		return -1;
+	}
+	if (f->datalen > max_len) {
+		ast_log(LOG_WARNING, "Frame of %d bytes is too large for AudioSocket\n", f->datalen);
+		return -1;
+	}
+
+	return kind;
+}
+
+const int ast_audiosocket_init(const int svc, const char *id)
+{
+	uuid_t uu;
+	int ret = 0;
+	uint8_t buf[3 + 16];
+	struct iovec iov;
+
+	if (ast_strlen_zero(id)) {
+		ast_log(LOG_ERROR, "No UUID for AudioSocket\n");
+		return -1;
+	}
+
+	if (uuid_parse(id, uu)) {
+		ast_log(LOG_ERROR, "Failed to parse UUID '%s'\n", id);
+		return -1;
+	}
+
+	buf[0] = AST_AUDIOSOCKET_KIND_UUID;
+	buf[1] = 0x00;
+	buf[2] = 0x10;
+	memcpy(buf + 3, uu, 16);
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+
+	if (audiosocket_writev(svc, &iov, 1, NULL)) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+const int ast_audiosocket_send_frame(const int svc, const struct ast_frame *f)
+{
+	int ret = 0;
+	int kind;
+	uint8_t hdr[AUDIOSOCKET_HEADER_LEN];
+	uint8_t *swapped = NULL;
+	struct iovec iov[2];
+
+	kind = audiosocket_frame_kind(f, UINT16_MAX);
+	if (kind < 0) {
+		return -1;
+	}
+
+	if (AUDIOSOCKET_SLIN_SWAP && audiosocket_kind_is_slin(kind) && f->datalen) {
+		if (!(swapped = ast_malloc(f->datalen))) {
+			ast_log(LOG_ERROR, "Failed to allocate for data to AudioSocket\n");
+			return -1;
+		}
+		audiosocket_payload_swap(kind, swapped, f->data.ptr, f->datalen);
+	}
+
+	hdr[0] = kind;
+	hdr[1] = f->datalen >> 8;
+	hdr[2] = f->datalen & 0xff;
+
+	/* The payload is sent straight from the frame */
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = swapped ? swapped : f->data.ptr;
+	iov[1].iov_len = f->datalen;
+
+	if (audiosocket_writev(svc, iov, f->datalen ? 2 : 1, NULL)) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		ret = -1;
+	} else if (f->frametype == AST_FRAME_VOICE) {
+		ast_atomic_fetch_add(&audiosocket_stats.frames_out, 1, __ATOMIC_RELAXED);
+		ast_atomic_fetch_add(&audiosocket_stats.bytes_out, f->datalen, __ATOMIC_RELAXED);
+	}
+	ast_free(swapped);
+
+	return ret;
+}
+
+struct ast_frame *ast_audiosocket_receive_frame(const int svc)
+{
+
+	int i = 0, n = 0, ret = 0, not_audio = 0, remaining;
+	struct timeval start = { 0, };
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "AudioSocket",
+		.mallocd = AST_MALLOCD_DATA,
+	};
+	uint8_t kind;
+	uint8_t len_high;
+	uint8_t len_low;
+	uint16_t len = 0;
+	uint8_t *data;
+
+	n = read(svc, &kind, 1);
+	if (n < 0 && errno == EAGAIN) {
+		return &ast_null_frame;
+	}
+	if (n == 0) {
+		return &ast_null_frame;
+	}
+	if (n != 1) {
+		ast_log(LOG_WARNING, "Failed to read type header from AudioSocket\n");
+		return NULL;
+	}
+	if (kind == AST_AUDIOSOCKET_KIND_HANGUP) {
+		/* AudioSocket ended by remote */
+		return NULL;
+	}
+	f.subclass.format = ast_audiosocket_format_from_kind(kind);
+	if (!f.subclass.format) {
+		/* read but ignore non-audio message */
+		ast_log(LOG_WARNING, "Received non-audio AudioSocket message\n");
+		not_audio = 1;
+	}
+
+	n = read(svc, &len_high, 1);
+	if (n != 1) {
+		ast_log(LOG_WARNING, "Failed to read data length from AudioSocket\n");
+		return NULL;
+	}
+	len += len_high * 256;
+	n = read(svc, &len_low, 1);
+	if (n != 1) {
+		ast_log(LOG_WARNING, "Failed to read data length from AudioSocket\n");
+		return NULL;
+	}
+	len += len_low;
+
+	if (len < 1) {
+		return &ast_null_frame;
+	}
+
+	data = ast_malloc(len);
+	if (!data) {
+		ast_log(LOG_ERROR, "Failed to allocate for data from AudioSocket\n");
+		return NULL;
+	}
+
+	ret = 0;
+	n = 0;
+	i = 0;
+	while (i < len) {
+		n = read(svc, data + i, len - i);
+		if (n < 0) {
+			/* The rest of the payload has not arrived yet.  This function
+			 * cannot resume a message, so wait for it, but for no more than
+			 * LEGACY_PAYLOAD_TIMEOUT_MSEC in all, however slowly it trickles in.
+			 */
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				ast_atomic_fetch_add(&audiosocket_stats.short_reads, 1, __ATOMIC_RELAXED);
+				if (ast_tvzero(start)) {
+					start = ast_tvnow();
+				}
+				remaining = ast_remaining_ms(start, LEGACY_PAYLOAD_TIMEOUT_MSEC);
+				if (remaining > 0 && ast_wait_for_input(svc, remaining) > 0) {
+					continue;
+				}
+			}
+			ast_log(LOG_ERROR, "Failed to read data from AudioSocket\n");
+			ret = n;
+			break;
+		}
+		if (n == 0) {
+			ast_log(LOG_ERROR, "Insufficient data read from AudioSocket\n");
+			ret = -1;
+			break;
+		}
+		i += n;
+	}
+
+	if (ret != 0) {
+		ast_free(data);
+		return NULL;
+	}
+
+	if (not_audio) {
+		ast_free(data);
+		return &ast_null_frame;
+	}
+	audiosocket_payload_swap(kind, data, data, len);
+
+	f.data.ptr = data;
+	f.datalen = len;
+	f.samples = ast_codec_samples_count(&f);
+	ast_atomic_fetch_add(&audiosocket_stats.frames_in, 1, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&audiosocket_stats.bytes_in, len, __ATOMIC_RELAXED);
+
+	/* The frame steals data, so it doesn't need to be freed here */
+	return ast_frisolate(&f);
+}
+
+static void audiosocket_conn_destructor(void *obj)
+{
+	struct ast_audiosocket_conn *conn = obj;
+
+	if (conn->mux) {
+		/* End the stream; the shared connection stays open for others */
+		ao2_unlink(conn->mux->streams, conn->stream);
+		audiosocket_conn_write_one(conn, AST_AUDIOSOCKET_KIND_HANGUP, NULL, 0);
+		ao2_ref(conn->stream, -1);
+		ao2_ref(conn->mux, -1);
+	}
+	if (conn->datagram && conn->svc >= 0) {
+		/* Nothing else tells the server that the call has ended */
+		audiosocket_conn_write_one(conn, AST_AUDIOSOCKET_KIND_HANGUP, NULL, 0);
+	}
+	while (conn->tee_count) {
+		ao2_ref(conn->tees[--conn->tee_count], -1);
+	}
+	ast_free(conn->tees);
+	if (conn->svc >= 0) {
+		/* Give the server what it will still take in time, such as a hangup */
+		audiosocket_txq_linger(conn->svc, &conn->txq);
+		close(conn->svc);
+	}
+	audiosocket_txq_free(&conn->txq);
+	ast_free(conn->rxbuf);
+	ast_free(conn->rx_large);
+	ast_free(conn->pool);
+	ast_free(conn->txbuf);
+	ao2_cleanup(conn->attachment);
+	audiosocket_stats_closed(conn->stats);
+	audiosocket_conn_stats_release(conn->stats);
+}
+
+struct ast_audiosocket_conn *ast_audiosocket_conn_alloc(const int svc)
+{
+	struct ast_audiosocket_conn *conn;
+
+	conn = ao2_alloc(sizeof(*conn), audiosocket_conn_destructor);
+	if (!conn) {
+		ast_log(LOG_ERROR, "Failed to allocate AudioSocket connection state\n");
+		return NULL;
+	}
+	conn->svc = -1;
+
+	conn->rxbuf = ast_malloc(AUDIOSOCKET_RX_BUFFER_SIZE);
+	if (!conn->rxbuf) {
+		ast_log(LOG_ERROR, "Failed to allocate AudioSocket receive buffer\n");
+		ao2_ref(conn, -1);
+		return NULL;
+	}
+
+	conn->pool = ast_calloc(AUDIOSOCKET_POOL_SIZE, sizeof(*conn->pool));
+	if (!conn->pool) {
+		ast_log(LOG_ERROR, "Failed to allocate AudioSocket frame pool\n");
+		ao2_ref(conn, -1);
+		return NULL;
+	}
+	conn->stats = audiosocket_conn_stats_alloc();
+	conn->txq.size = audiosocket_txq_size;
+	conn->txq.policy = audiosocket_txq_policy;
+	conn->txq.fail_ms = audiosocket_txq_fail_ms;
+	conn->svc = svc;
+
+	return conn;
+}
+
+const int ast_audiosocket_conn_fd(const struct ast_audiosocket_conn *conn)
+{
+	if (conn->stream) {
+		return ast_alertpipe_readfd(conn->stream->alert_pipe);
+	}
+
+	return conn->svc;
+}
+
+const int ast_audiosocket_conn_init(struct ast_audiosocket_conn *conn, const char *id)
+{
+	uuid_t uu;
+	unsigned int i;
+
+	if (ast_strlen_zero(id)) {
+		ast_log(LOG_ERROR, "No UUID for AudioSocket\n");
+		return -1;
+	}
+
+	if (uuid_parse(id, uu)) {
+		ast_log(LOG_ERROR, "Failed to parse UUID '%s'\n", id);
+		return -1;
+	}
+
+	if (audiosocket_conn_write(conn, AST_AUDIOSOCKET_KIND_UUID, uu, sizeof(uu))) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		return -1;
+	}
+
+	if (conn->extended) {
+		static const uint8_t offer = AUDIOSOCKET_ID_FLAG_EXTENDED;
+
+		/* The offer is a message of its own, so that the ID stays as it always
+		 * was, and nothing is extended until the server has accepted it. */
+		if (audiosocket_conn_write(conn, AST_AUDIOSOCKET_KIND_UUID, &offer, sizeof(offer))) {
+			ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+			return -1;
+		}
+	}
+
+	/* A datagram carrying the ID may be lost */
+	for (i = 0; i <= conn->tee_count; i++) {
+		struct ast_audiosocket_conn *c = i ? conn->tees[i - 1] : conn;
+
+		if (c->datagram) {
+			uuid_copy(c->id, uu);
+			c->id_repeats = AUDIOSOCKET_DATAGRAM_ID_REPEATS;
+		}
+	}
+
+	return 0;
+}
+
+void ast_audiosocket_conn_set_extended(struct ast_audiosocket_conn *conn, const int enabled)
+{
+	unsigned int i;
+
+	conn->extended = enabled ? 1 : 0;
+	for (i = 0; i < conn->tee_count; i++) {
+		conn->tees[i]->extended = conn->extended;
+	}
+}
+
+const int ast_audiosocket_conn_tee(struct ast_audiosocket_conn *conn,
+	struct ast_audiosocket_conn *tee)
+{
+	struct ast_audiosocket_conn **tees;
+
+	if (tee == conn || tee->tee_count) {
+		ast_log(LOG_ERROR, "An AudioSocket connection can not be sent copies of itself\n");
+		return -1;
+	}
+	if (conn->tee_count >= AUDIOSOCKET_MAX_TEES) {
+		ast_log(LOG_ERROR, "An AudioSocket connection can be copied to at most %d others\n",
+			AUDIOSOCKET_MAX_TEES);
+		return -1;
+	}
+
+	if (!(tees = ast_realloc(conn->tees, (conn->tee_count + 1) * sizeof(*tees)))) {
+		return -1;
+	}
+	conn->tees = tees;
+	conn->tees[conn->tee_count++] = ao2_bump(tee);
+	/* The copy is sent the same ID message, and so the same offer */
+	tee->extended = conn->extended;
+
+	return 0;
+}
+
+void ast_audiosocket_conn_untee(struct ast_audiosocket_conn *conn,
+	struct ast_audiosocket_conn *tee)
+{
+	unsigned int i;
+
+	for (i = 0; i < conn->tee_count; i++) {
+		if (conn->tees[i] == tee) {
+			conn->tee_count--;
+			memmove(&conn->tees[i], &conn->tees[i + 1],
+				(conn->tee_count - i) * sizeof(*conn->tees));
+			ao2_ref(tee, -1);
+			return;
+		}
+	}
+}
+
+/*!
+ * \internal
+ * \brief Get the largest payload which a connection, and each connection sent
+ * a copy of what it sends, can carry in one message
+ */
+static size_t audiosocket_conn_max_payload(const struct ast_audiosocket_conn *conn)
+{
+	size_t max = conn->mux ? AUDIOSOCKET_MUX_MAX_PAYLOAD : UINT16_MAX;
+	unsigned int i;
+
+	if (conn->datagram) {
+		max = AUDIOSOCKET_DATAGRAM_MAX - AUDIOSOCKET_DATAGRAM_PREFIX_LEN - AUDIOSOCKET_HEADER_LEN;
+	}
+	if (conn->extended && (conn->mux || conn->datagram)) {
+		/* The extended header takes room in the envelope or the datagram too */
+		max -= AUDIOSOCKET_EXTENDED_LEN;
+	}
+	for (i = 0; i < conn->tee_count; i++) {
+		max = MIN(max, audiosocket_conn_max_payload(conn->tees[i]));
+	}
+
+	return max;
+}
+
+/*!
+ * \internal
+ * \brief Make sure that the batch buffer of a connection holds at least size bytes
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_conn_reserve(struct ast_audiosocket_conn *conn, const size_t size)
+{
+	uint8_t *buf;
+
+	if (conn->txsize >= size) {
+		return 0;
+	}
+
+	if (!(buf = ast_realloc(conn->txbuf, size))) {
+		ast_log(LOG_ERROR, "Failed to allocate AudioSocket batch buffer\n");
+		return -1;
+	}
+	conn->txbuf = buf;
+	conn->txsize = size;
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Send an Asterisk audio frame alone over an AudioSocket connection
+ */
+static int audiosocket_conn_send(struct ast_audiosocket_conn *conn, const struct ast_frame *f)
+{
+	const void *payload = f->data.ptr;
+	int kind;
+
+	kind = audiosocket_frame_kind(f, audiosocket_conn_max_payload(conn));
+	if (kind < 0) {
+		return -1;
+	}
+
+	if (AUDIOSOCKET_SLIN_SWAP && audiosocket_kind_is_slin(kind)) {
+		/* No batch is pending when a frame is sent alone, so its buffer is free */
+		if (audiosocket_conn_reserve(conn, f->datalen)) {
+			return -1;
+		}
+		audiosocket_payload_swap(kind, conn->txbuf, f->data.ptr, f->datalen);
+		payload = conn->txbuf;
+	}
+
+	if (audiosocket_conn_write(conn, kind, payload, f->datalen)) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void ast_audiosocket_conn_set_batch(struct ast_audiosocket_conn *conn,
+	const unsigned int frames, const unsigned int max_delay_ms)
+{
+	conn->batch_frames = frames;
+	conn->batch_max_ms = max_delay_ms;
+}
+
+void ast_audiosocket_conn_set_silence(struct ast_audiosocket_conn *conn,
+	const unsigned int threshold)
+{
+	conn->silence_threshold = threshold;
+	conn->silence_run_ms = 0;
+}
+
+/*!
+ * \internal
+ * \brief Measure the energy of a voice frame
+ *
+ * \retval 0 on success
+ * \retval -1 if the energy of the frame's format can not be measured
+ */
+static int audiosocket_frame_energy(const struct ast_frame *f, const int kind,
+	struct ast_audiosocket_energy *energy)
+{
+	int16_t decoded[AUDIOSOCKET_G711_CHUNK];
+	const uint8_t *data = f->data.ptr;
+	int i, j, n;
+
+	memset(energy, 0, sizeof(*energy));
+
+	switch (kind) {
+	case AST_AUDIOSOCKET_KIND_AUDIO_ULAW:
+	case AST_AUDIOSOCKET_KIND_AUDIO_ALAW:
+		for (i = 0; i < f->datalen; i += n) {
+			n = MIN(f->datalen - i, AUDIOSOCKET_G711_CHUNK);
+			for (j = 0; j < n; j++) {
+				decoded[j] = kind == AST_AUDIOSOCKET_KIND_AUDIO_ULAW
+					? AST_MULAW(data[i + j]) : AST_ALAW(data[i + j]);
+			}
+			ast_audiosocket_slin_energy(decoded, n, energy);
+		}
+		return 0;
+	case AST_AUDIOSOCKET_KIND_AUDIO_OPUS:
+		/* The energy of an Opus packet can not be measured without decoding it */
+		return -1;
+	default:
+		if (kind < 0) {
+			return -1;
+		}
+		ast_audiosocket_slin_energy(f->data.ptr, f->datalen / sizeof(int16_t), energy);
+		return 0;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Decide whether an outgoing voice frame is sent as silence
+ *
+ * \retval 0 if the frame is sent as audio
+ * \return the duration of the frame, in milliseconds, if it is sent as silence
+ */
+static unsigned int audiosocket_conn_silence(struct ast_audiosocket_conn *conn,
+	const struct ast_frame *f)
+{
+	struct ast_audiosocket_energy energy;
+	unsigned int ms;
+
+	if (!conn->silence_threshold || f->frametype != AST_FRAME_VOICE || f->samples <= 0
+		|| audiosocket_frame_energy(f, ast_audiosocket_kind_from_format(f->subclass.format),
+			&energy)) {
+		return 0;
+	}
+
+	if (ast_audiosocket_energy_rms(&energy) >= conn->silence_threshold) {
+		conn->silence_run_ms = 0;
+		return 0;
+	}
+
+	ms = MAX(1, (unsigned int) f->samples * 1000 / ast_format_get_sample_rate(f->subclass.format));
+	conn->silence_run_ms = MIN(conn->silence_run_ms + ms, UINT_MAX / 2);
+	if (conn->silence_run_ms < AUDIOSOCKET_SILENCE_HANGOVER_MSEC) {
+		return 0;
+	}
+
+	return ms;
+}
+
+/*!
+ * \internal
+ * \brief Send a silence message of the given duration
+ */
+static int audiosocket_conn_write_silence(struct ast_audiosocket_conn *conn, unsigned int ms)
+{
+	uint8_t payload[AUDIOSOCKET_SILENCE_LEN];
+
+	ms = MIN(ms, UINT16_MAX);
+	payload[0] = ms >> 8;
+	payload[1] = ms & 0xff;
+
+	if (audiosocket_conn_write(conn, AST_AUDIOSOCKET_KIND_SILENCE, payload, sizeof(payload))) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Get the time until a partial batch of frames must be sent
+ *
+ * \retval The number of milliseconds until the batch is due
+ * \retval 0 if it is due now
+ * \retval -1 if no frames are pending
+ */
+static int audiosocket_conn_batch_timeout(const struct ast_audiosocket_conn *conn)
+{
+	int64_t elapsed;
+
+	if (!conn->batch_count) {
+		return -1;
+	}
+
+	elapsed = ast_tvdiff_ms(ast_tvnow(), conn->batch_start);
+	if (elapsed >= conn->batch_max_ms) {
+		return 0;
+	}
+
+	return conn->batch_max_ms - elapsed;
+}
+
+/*!
+ * \internal
+ * \brief Send a silent voice frame as silence, subject to batching
+ *
+ * Consecutive silent frames of a batch are combined into one silence message
+ * of their total duration.
+ */
+static int audiosocket_conn_send_silence(struct ast_audiosocket_conn *conn, const unsigned int ms)
+{
+	if (conn->batch_frames < 2) {
+		if (ast_audiosocket_conn_flush(conn)) {
+			return -1;
+		}
+		return audiosocket_conn_write_silence(conn, ms);
+	}
+
+	/* Audio, or more silence than one message can carry, ends the pending batch */
+	if (conn->batch_count && (conn->batch_kind != AST_AUDIOSOCKET_KIND_SILENCE
+		|| conn->silence_ms + ms > UINT16_MAX)) {
+		if (ast_audiosocket_conn_flush(conn)) {
+			return -1;
+		}
+	}
+
+	if (!conn->batch_count) {
+		conn->batch_kind = AST_AUDIOSOCKET_KIND_SILENCE;
+		conn->batch_start = ast_tvnow();
+		conn->silence_ms = 0;
+	}
+	conn->silence_ms += ms;
+	conn->batch_count++;
+
+	if (conn->batch_count >= conn->batch_frames || !audiosocket_conn_batch_timeout(conn)) {
+		return ast_audiosocket_conn_flush(conn);
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Write what the socket will now take of the write queue which a
+ * connection sends through
+ */
+static int audiosocket_conn_txq_flush(struct ast_audiosocket_conn *conn)
+{
+	int res;
+
+	if (conn->datagram) {
+		return 0;
+	}
+	if (!conn->mux) {
+		ao2_lock(conn);
+		res = audiosocket_txq_flush(conn);
+		ao2_unlock(conn);
+		return res;
+	}
+
+	ast_mutex_lock(&conn->mux->lock);
+	res = conn->mux->dead ? -1 : audiosocket_txq_flush(conn->mux->conn);
+	ast_mutex_unlock(&conn->mux->lock);
+
+	return res;
+}
+
+/*!
+ * \internal
+ * \brief Get the time until the write queue which a connection sends through
+ * should be offered to its socket again, as \ref audiosocket_txq_timeout
+ */
+static int audiosocket_conn_txq_timeout(const struct ast_audiosocket_conn *conn)
+{
+	int res;
+
+	if (conn->datagram) {
+		return -1;
+	}
+	if (!conn->mux) {
+		ao2_lock((void *) conn);
+		res = audiosocket_txq_timeout(&conn->txq);
+		ao2_unlock((void *) conn);
+		return res;
+	}
+
+	ast_mutex_lock(&conn->mux->lock);
+	res = conn->mux->dead ? -1 : audiosocket_txq_timeout(&conn->mux->conn->txq);
+	ast_mutex_unlock(&conn->mux->lock);
+
+	return res;
+}
+
+const int ast_audiosocket_conn_flush(struct ast_audiosocket_conn *conn)
+{
+	size_t len = conn->txlen;
+
+	if (conn->batch_count) {
+		conn->batch_count = 0;
+		conn->txlen = 0;
+
+		if (conn->batch_kind == AST_AUDIOSOCKET_KIND_SILENCE) {
+			return audiosocket_conn_write_silence(conn, conn->silence_ms);
+		}
+		if (audiosocket_conn_write(conn, conn->batch_kind, conn->txbuf, len)) {
+			ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+			return -1;
+		}
+		/* The write has offered the socket the queue ahead of the batch */
+		return 0;
+	}
+
+	return audiosocket_conn_txq_flush(conn);
+}
+
+const int ast_audiosocket_conn_send_dtmf(struct ast_audiosocket_conn *conn, const char digit,
+	const int end)
+{
+	/* Keep the digit in order with the audio before it */
+	if (ast_audiosocket_conn_flush(conn)) {
+		return -1;
+	}
+
+	if (audiosocket_conn_write(conn,
+			end ? AST_AUDIOSOCKET_KIND_DTMF : AST_AUDIOSOCKET_KIND_DTMF_BEGIN, &digit, 1)) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+const int ast_audiosocket_conn_send_control(struct ast_audiosocket_conn *conn, const int control)
+{
+	uint8_t payload;
+
+	switch (control) {
+	case AST_CONTROL_ANSWER:
+		payload = AST_AUDIOSOCKET_CONTROL_ANSWER;
+		break;
+	case AST_CONTROL_HOLD:
+		payload = AST_AUDIOSOCKET_CONTROL_HOLD;
+		break;
+	case AST_CONTROL_UNHOLD:
+		payload = AST_AUDIOSOCKET_CONTROL_UNHOLD;
+		break;
+	default:
+		return 1;
+	}
+
+	if (ast_audiosocket_conn_flush(conn)) {
+		return -1;
+	}
+	if (audiosocket_conn_write(conn, AST_AUDIOSOCKET_KIND_CONTROL, &payload, sizeof(payload))) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+const int ast_audiosocket_conn_flush_timeout(const struct ast_audiosocket_conn *conn)
+{
+	int batch = audiosocket_conn_batch_timeout(conn);
+	int queued = audiosocket_conn_txq_timeout(conn);
+
+	if (queued >= 0 && (batch < 0 || queued < batch)) {
+		return queued;
+	}
+
+	return batch;
+}
+
+const int ast_audiosocket_conn_send_frame(struct ast_audiosocket_conn *conn,
+	const struct ast_frame *f)
+{
+	size_t max_len = audiosocket_conn_max_payload(conn);
+	unsigned int silence;
+	int kind;
+
+	if (f->frametype == AST_FRAME_VOICE) {
+		AUDIOSOCKET_STATS_ADD(conn->stats, frames_out, 1);
+	}
+	if ((silence = audiosocket_conn_silence(conn, f))) {
+		return audiosocket_conn_send_silence(conn, silence);
+	}
+
+	if (conn->batch_frames < 2) {
+		/* Batching may have just been turned off */
+		if (ast_audiosocket_conn_flush(conn)) {
+			return -1;
+		}
+		return audiosocket_conn_send(conn, f);
+	}
+
+	kind = ast_audiosocket_kind_from_format(f->subclass.format);
+
+	/* A frame which can not join the pending batch ends it */
+	if (conn->batch_count && (kind != conn->batch_kind
+		|| conn->txlen + f->datalen > max_len)) {
+		if (ast_audiosocket_conn_flush(conn)) {
+			return -1;
+		}
+	}
+
+	/* Opus packets can not be concatenated, so they are always sent alone */
+	if (kind < 0 || kind == AST_AUDIOSOCKET_KIND_AUDIO_OPUS
+		|| f->datalen > max_len) {
+		return audiosocket_conn_send(conn, f);
+	}
+
+	if (conn->txsize < conn->txlen + f->datalen) {
+		/* Size the buffer for a full batch of frames like this one */
+		size_t size = (size_t) f->datalen * conn->batch_frames;
+
+		if (audiosocket_conn_reserve(conn, MIN(MAX(size, conn->txlen + f->datalen), max_len))) {
+			return -1;
+		}
+	}
+
+	if (!conn->batch_count) {
+		conn->batch_kind = kind;
+		conn->batch_start = ast_tvnow();
+	}
+	audiosocket_payload_swap(kind, conn->txbuf + conn->txlen, f->data.ptr, f->datalen);
+	conn->txlen += f->datalen;
+	conn->batch_count++;
+
+	if (conn->batch_count >= conn->batch_frames || !audiosocket_conn_batch_timeout(conn)) {
+		return ast_audiosocket_conn_flush(conn);
+	}
+
+	return 0;
+}
+
+const int ast_audiosocket_conn_send_stereo(struct ast_audiosocket_conn *conn,
+	const int16_t *left, const int16_t *right, const size_t samples)
+{
+	size_t len = samples * 2 * sizeof(int16_t);
+
+	if (len > audiosocket_conn_max_payload(conn)) {
+		ast_log(LOG_WARNING, "Stereo audio of %zu samples is too long for AudioSocket\n", samples);
+		return -1;
+	}
+
+	AUDIOSOCKET_STATS_ADD(conn->stats, frames_out, 1);
+	/* Flushing leaves the batch buffer free */
+	if (ast_audiosocket_conn_flush(conn) || audiosocket_conn_reserve(conn, len)) {
+		return -1;
+	}
+
+	ast_audiosocket_slin_interleave((int16_t *) conn->txbuf, left, right, samples);
+	if (AUDIOSOCKET_SLIN_SWAP) {
+		ast_audiosocket_slin_swap((int16_t *) conn->txbuf, (int16_t *) conn->txbuf, samples * 2);
+	}
+
+	if (audiosocket_conn_write(conn, AST_AUDIOSOCKET_KIND_AUDIO_STEREO, conn->txbuf, len)) {
+		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Append a frame to the end of a frame list
+ *
+ * \param head The first frame of the list, or NULL if the list is empty.
+ * \param tail The last frame of the list.
+ * \param f The frame to append.
+ */
+static void audiosocket_frame_append(struct ast_frame **head, struct ast_frame **tail,
+	struct ast_frame *f)
+{
+	if (!*head) {
+		*head = f;
+	} else {
+		AST_LIST_NEXT(*tail, frame_list) = f;
+	}
+	*tail = f;
+}
+
+/*!
+ * \internal
+ * \brief End a list of received frames with a hangup
+ */
+static void audiosocket_hangup_append(struct ast_audiosocket_conn *conn,
+	struct ast_frame **head, struct ast_frame **tail)
+{
+	memset(&conn->hangup_frame, 0, sizeof(conn->hangup_frame));
+	conn->hangup_frame.frametype = AST_FRAME_CONTROL;
+	conn->hangup_frame.subclass.integer = AST_CONTROL_HANGUP;
+	conn->hangup_frame.src = "AudioSocket";
+	audiosocket_frame_append(head, tail, &conn->hangup_frame);
+}
+
+static void audiosocket_mux_dispatch(struct audiosocket_mux *mux,
+	const uint8_t *payload, const size_t len);
+static struct ast_frame *audiosocket_mux_receive(struct ast_audiosocket_conn *conn);
+
+/*!
+ * \internal
+ * \brief Get the length of the header of a message from its first byte
+ */
+static size_t audiosocket_header_len(const uint8_t kind)
+{
+	if ((kind & AST_AUDIOSOCKET_KIND_EXTENDED) && kind != AST_AUDIOSOCKET_KIND_ERROR) {
+		return AUDIOSOCKET_HEADER_LEN + AUDIOSOCKET_EXTENDED_LEN;
+	}
+
+	return AUDIOSOCKET_HEADER_LEN;
+}
+
+/*!
+ * \internal
+ * \brief Take the kind and length of the message in progress from its header,
+ * and count what an extended header says about the server
+ *
+ * \param conn The AudioSocket connection.
+ * \param hdr The complete header, of the length given by
+ * \ref audiosocket_header_len.
+ */
+static void audiosocket_header_received(struct ast_audiosocket_conn *conn, const uint8_t *hdr)
+{
+	const uint8_t *ext = hdr + AUDIOSOCKET_HEADER_LEN;
+	uint16_t seq;
+	uint32_t echo;
+
+	conn->rx_kind = hdr[0];
+	conn->rx_len = (hdr[1] << 8) | hdr[2];
+	conn->rx_ext = audiosocket_header_len(hdr[0]) > AUDIOSOCKET_HEADER_LEN;
+	if (!conn->rx_ext) {
+		return;
+	}
+	conn->rx_kind &= ~AST_AUDIOSOCKET_KIND_EXTENDED;
+
+	seq = (ext[0] << 8) | ext[1];
+	echo = ((uint32_t) ext[2] << 24) | (ext[3] << 16) | (ext[4] << 8) | ext[5];
+	if (conn->rx_ext_started && seq != (uint16_t) (conn->rx_ext_seq + 1)) {
+		AUDIOSOCKET_STATS_ADD(conn->stats, seq_gaps, 1);
+	}
+	conn->rx_ext_seq = seq;
+	conn->rx_ext_started = 1;
+	/* A server which extends its own messages understands ours */
+	conn->ext_accepted = 1;
+
+	/* Only the first reply to echo a timestamp measures its round trip */
+	if (echo && echo != conn->rx_echo && !ast_tvzero(conn->ext_start)) {
+		AUDIOSOCKET_STATS_TIME(conn->stats, rtt,
+			ast_tvdiff_us(ast_tvnow(), conn->ext_start) - (int64_t) echo * 1000);
+	}
+	conn->rx_echo = echo;
+}
+
+/*!
+ * \internal
+ * \brief Determine whether an ID message from the server accepts the extended
+ * header
+ */
+static int audiosocket_id_accepts(const uint8_t *payload, const size_t len)
+{
+	return len == AUDIOSOCKET_ID_FLAGS_LEN && (payload[0] & AUDIOSOCKET_ID_FLAG_EXTENDED);
+}
+
+/*!
+ * \internal
+ * \brief Fill in the frame of a DTMF or control message
+ *
+ * \param kind The kind of the message.
+ * \param payload The payload of the message.
+ * \param len The length of the payload.
+ * \param fr The frame to fill in.
+ *
+ * \retval 1 if the message is a DTMF or control event
+ * \retval 0 if it is of another kind
+ * \retval -1 if it is an event which is malformed or not known, and is ignored
+ */
+static int audiosocket_event_frame(const uint8_t kind, const uint8_t *payload,
+	const size_t len, struct ast_frame *fr)
+{
+	if (kind == AST_AUDIOSOCKET_KIND_DTMF || kind == AST_AUDIOSOCKET_KIND_DTMF_BEGIN) {
+		if (len < 1) {
+			ast_log(LOG_WARNING, "Received malformed AudioSocket DTMF message\n");
+			return -1;
+		}
+		fr->frametype = kind == AST_AUDIOSOCKET_KIND_DTMF
+			? AST_FRAME_DTMF_END : AST_FRAME_DTMF_BEGIN;
+		fr->subclass.integer = payload[0];
+		return 1;
+	}
+	if (kind != AST_AUDIOSOCKET_KIND_CONTROL) {
+		return 0;
+	}
+
+	fr->frametype = AST_FRAME_CONTROL;
+	switch (len ? payload[0] : 0) {
+	case AST_AUDIOSOCKET_CONTROL_ANSWER:
+		fr->subclass.integer = AST_CONTROL_ANSWER;
+		return 1;
+	case AST_AUDIOSOCKET_CONTROL_HOLD:
+		fr->subclass.integer = AST_CONTROL_HOLD;
+		return 1;
+	case AST_AUDIOSOCKET_CONTROL_UNHOLD:
+		fr->subclass.integer = AST_CONTROL_UNHOLD;
+		return 1;
+	}
+
+	ast_debug(3, "Ignoring unknown AudioSocket control message\n");
+	return -1;
+}
+
+/*!
+ * \internal
+ * \brief Convert a complete AudioSocket message into a frame
+ *
+ * \param conn The AudioSocket connection.
+ * \param payload The payload of the message.
+ * \param mallocd Non-zero if the payload was allocated for this message, in
+ * which case ownership passes to this function.
+ * \param f Set to the resulting frame, or NULL if the message produces none.
+ *
+ * \retval 0 on success
+ * \retval 1 if the message is a hangup
+ * \retval -1 on error
+ */
+static int audiosocket_message_frame(struct ast_audiosocket_conn *conn,
+	uint8_t *payload, int mallocd, struct ast_frame **f)
+{
+	struct ast_frame fr = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "AudioSocket",
+		.seqno = conn->rx_ext ? conn->rx_ext_seq : 0,
+	};
+	int res;
+
+	*f = NULL;
+
+	if (conn->rx_kind == AST_AUDIOSOCKET_KIND_MUX && conn->demux) {
+		audiosocket_mux_dispatch(conn->demux, payload, conn->rx_len);
+		if (mallocd) {
+			ast_free(payload);
+		}
+		return 0;
+	}
+	if (conn->rx_kind == AST_AUDIOSOCKET_KIND_HANGUP) {
+		/* AudioSocket ended by remote */
+		if (mallocd) {
+			ast_free(payload);
+		}
+		return 1;
+	}
+	if (conn->rx_kind == AST_AUDIOSOCKET_KIND_UUID) {
+		if (conn->extended && audiosocket_id_accepts(payload, conn->rx_len)) {
+			conn->ext_accepted = 1;
+		}
+		if (mallocd) {
+			ast_free(payload);
+		}
+		return 0;
+	}
+	res = audiosocket_event_frame(conn->rx_kind, payload, conn->rx_len, &fr);
+	if (res) {
+		if (mallocd) {
+			ast_free(payload);
+		}
+		if (res < 0) {
+			return 0;
+		}
+		/* The frame carries no data, so nothing of the payload is kept */
+		*f = ast_frisolate(&fr);
+		if (!*f) {
+			ast_log(LOG_ERROR, "Failed to allocate for data from AudioSocket\n");
+			return -1;
+		}
+		return 0;
+	}
+	fr.subclass.format = ast_audiosocket_format_from_kind(conn->rx_kind);
+	if (!fr.subclass.format || conn->rx_len < 1) {
+		if (!fr.subclass.format) {
+			/* read but ignore non-audio message */
+			ast_log(LOG_WARNING, "Received non-audio AudioSocket message\n");
+		}
+		if (mallocd) {
+			ast_free(payload);
+		}
+		return 0;
+	}
+
+	audiosocket_payload_swap(conn->rx_kind, payload, payload, conn->rx_len);
+	fr.data.ptr = payload;
+	fr.datalen = conn->rx_len;
+	fr.samples = ast_codec_samples_count(&fr);
+
+	if (!mallocd && conn->rx_len <= AUDIOSOCKET_POOL_PAYLOAD_SIZE
+		&& conn->pool_used < AUDIOSOCKET_POOL_SIZE) {
+		struct audiosocket_pooled_frame *pf = &conn->pool[conn->pool_used++];
+
+		/* The pooled frame is not mallocd, so freeing it is a no-op and it is
+		 * simply reused by the next receive.
+		 */
+		pf->fr = fr;
+		AST_FRAME_SET_BUFFER(&pf->fr, pf->buf, AST_FRIENDLY_OFFSET, conn->rx_len);
+		memcpy(pf->fr.data.ptr, payload, conn->rx_len);
+		*f = &pf->fr;
+		return 0;
+	}
+
+	if (mallocd) {
+		/* The frame steals the payload */
+		fr.mallocd = AST_MALLOCD_DATA;
+	}
+
+	/* A payload in the receive buffer is copied, since the buffer is reused */
+	*f = ast_frisolate(&fr);
+	if (!*f) {
+		ast_log(LOG_ERROR, "Failed to allocate for data from AudioSocket\n");
+		if (mallocd) {
+			ast_free(payload);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Read from the socket into the buffer of the message in progress
+ *
+ * \retval The number of bytes read
+ * \retval 0 if nothing could be read without blocking
+ * \retval -1 on error or end of stream
+ */
+static ssize_t audiosocket_read(struct ast_audiosocket_conn *conn, void *buf, size_t len)
+{
+	ssize_t n;
+
+	n = read(conn->svc, buf, len);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		ast_log(LOG_WARNING, "Failed to read from AudioSocket: %s\n", strerror(errno));
+		return -1;
+	}
+	if (n == 0) {
+		/* AudioSocket closed by remote */
+		return -1;
+	}
+
+	return n;
+}
+
+/*!
+ * \internal
+ * \brief Receive the datagrams which are waiting on a connection
+ *
+ * A datagram which arrives after a newer one has already been received is
+ * dropped, rather than being delivered late.
+ */
+static struct ast_frame *audiosocket_datagram_receive(struct ast_audiosocket_conn *conn)
+{
+	struct ast_frame *head = NULL, *tail = NULL, *f;
+	size_t hdrlen;
+	uint16_t seq;
+	uint32_t ts;
+	ssize_t n;
+	int i, res = 0;
+
+	/* Frames handed out by the previous call have been consumed */
+	conn->pool_used = 0;
+
+	for (i = 0; i < AUDIOSOCKET_DATAGRAM_BURST && !res; i++) {
+		n = recv(conn->svc, conn->rxbuf, AUDIOSOCKET_DATAGRAM_MAX, MSG_TRUNC);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+			ast_log(LOG_WARNING, "Failed to read from AudioSocket: %s\n", strerror(errno));
+			res = -1;
+			break;
+		}
+		if (n < AUDIOSOCKET_DATAGRAM_PREFIX_LEN + AUDIOSOCKET_HEADER_LEN
+			|| n > AUDIOSOCKET_DATAGRAM_MAX) {
+			ast_debug(3, "Ignoring AudioSocket datagram of %zd bytes\n", n);
+			continue;
+		}
+		hdrlen = AUDIOSOCKET_DATAGRAM_PREFIX_LEN
+			+ audiosocket_header_len(conn->rxbuf[AUDIOSOCKET_DATAGRAM_PREFIX_LEN]);
+		if (n < hdrlen) {
+			ast_debug(3, "Ignoring AudioSocket datagram of %zd bytes\n", n);
+			continue;
+		}
+		audiosocket_header_received(conn, conn->rxbuf + AUDIOSOCKET_DATAGRAM_PREFIX_LEN);
+		if (hdrlen + conn->rx_len != n) {
+			ast_debug(3, "Ignoring malformed AudioSocket datagram\n");
+			continue;
+		}
+
+		seq = (conn->rxbuf[0] << 8) | conn->rxbuf[1];
+		ts = ((uint32_t) conn->rxbuf[2] << 24) | (conn->rxbuf[3] << 16)
+			| (conn->rxbuf[4] << 8) | conn->rxbuf[5];
+		if (conn->rx_started && (int16_t) (seq - conn->rx_seq) <= 0
+			&& (int16_t) (seq - conn->rx_seq) > -AUDIOSOCKET_DATAGRAM_LATE_WINDOW) {
+			/* Playing it now would only delay what has already arrived */
+			conn->rx_late++;
+			continue;
+		}
+		conn->rx_seq = seq;
+		if (!conn->rx_started) {
+			/* The server has the ID, so it need not be sent again */
+			__atomic_store_n(&conn->rx_started, 1, __ATOMIC_RELAXED);
+		}
+
+		res = audiosocket_message_frame(conn, conn->rxbuf + hdrlen, 0, &f);
+		if (f) {
+			/* Let a jitter buffer place the frame */
+			ast_set_flag(f, AST_FRFLAG_HAS_TIMING_INFO);
+			f->ts = ts;
+			f->seqno = seq;
+			f->len = ast_format_determine_length(f->subclass.format, f->samples);
+			audiosocket_frame_append(&head, &tail, f);
+		}
+	}
+
+	if (res < 0) {
+		ast_frfree(head);
+		return NULL;
+	}
+	if (res > 0) {
+		if (!head) {
+			return NULL;
+		}
+		audiosocket_hangup_append(conn, &head, &tail);
+	}
+
+	return head ? head : &ast_null_frame;
+}
+
+/*!
+ * \internal
+ * \brief Receive whatever is waiting on an AudioSocket connection
+ *
+ * \see ast_audiosocket_conn_receive_frame
+ */
+static struct ast_frame *audiosocket_conn_receive(struct ast_audiosocket_conn *conn)
+{
+	struct ast_frame *head = NULL, *tail = NULL, *f;
+	size_t pos = 0;
+	ssize_t n;
+	int res = 0;
+
+	if (conn->stream) {
+		return audiosocket_mux_receive(conn);
+	}
+	if (conn->datagram) {
+		return audiosocket_datagram_receive(conn);
+	}
+
+	/* Frames handed out by the previous call have been consumed */
+	conn->pool_used = 0;
+
+	if (conn->rx_large) {
+		/* Continue a large payload straight into its own buffer */
+		n = audiosocket_read(conn, conn->rx_large + conn->rx_have, conn->rx_len - conn->rx_have);
+		if (n < 0) {
+			return NULL;
+		}
+		conn->rx_have += n;
+		if (conn->rx_have < conn->rx_len) {
+			AUDIOSOCKET_STATS_ADD(conn->stats, short_reads, 1);
+			return &ast_null_frame;
+		}
+
+		res = audiosocket_message_frame(conn, conn->rx_large, 1, &f);
+		conn->rx_large = NULL;
+		conn->rx_state = AUDIOSOCKET_RX_HEADER;
+		if (res) {
+			return NULL;
+		}
+		return f ? f : &ast_null_frame;
+	}
+
+	n = audiosocket_read(conn, conn->rxbuf + conn->rxlen, AUDIOSOCKET_RX_BUFFER_SIZE - conn->rxlen);
+	if (n < 0) {
+		return NULL;
+	}
+	conn->rxlen += n;
+
+	/* Parse every complete message which is held in the buffer */
+	while (!res) {
+		if (conn->rx_state == AUDIOSOCKET_RX_HEADER) {
+			if (conn->rxlen - pos < AUDIOSOCKET_HEADER_LEN
+				|| conn->rxlen - pos < audiosocket_header_len(conn->rxbuf[pos])) {
+				break;
+			}
+			audiosocket_header_received(conn, conn->rxbuf + pos);
+			conn->rx_state = AUDIOSOCKET_RX_PAYLOAD;
+			pos += audiosocket_header_len(conn->rxbuf[pos]);
+		}
+
+		if (conn->rx_len > AUDIOSOCKET_RX_BUFFER_SIZE) {
+			/* Move what we have of a large payload to its own buffer */
+			conn->rx_have = MIN(conn->rxlen - pos, conn->rx_len);
+			conn->rx_large = ast_malloc(conn->rx_len);
+			if (!conn->rx_large) {
+				ast_log(LOG_ERROR, "Failed to allocate for data from AudioSocket\n");
+				res = -1;
+				break;
+			}
+			memcpy(conn->rx_large, conn->rxbuf + pos, conn->rx_have);
+			pos += conn->rx_have;
+			if (conn->rx_have < conn->rx_len) {
+				break;
+			}
+			res = audiosocket_message_frame(conn, conn->rx_large, 1, &f);
+			conn->rx_large = NULL;
+		} else {
+			if (conn->rxlen - pos < conn->rx_len) {
+				break;
+			}
+			res = audiosocket_message_frame(conn, conn->rxbuf + pos, 0, &f);
+			pos += conn->rx_len;
+		}
+		conn->rx_state = AUDIOSOCKET_RX_HEADER;
+
+		if (f) {
+			audiosocket_frame_append(&head, &tail, f);
+		}
+	}
+
+	/* Carry any partial message over to the next call */
+	if (pos) {
+		conn->rxlen -= pos;
+		memmove(conn->rxbuf, conn->rxbuf + pos, conn->rxlen);
+	}
+	if (conn->rxlen || conn->rx_large) {
+		AUDIOSOCKET_STATS_ADD(conn->stats, short_reads, 1);
+	}
+
+	if (res < 0) {
+		ast_frfree(head);
+		return NULL;
+	}
+	if (res > 0) {
+		if (!head) {
+			return NULL;
+		}
+
+		/* Deliver the audio which preceded the hangup before ending the call */
+		audiosocket_hangup_append(conn, &head, &tail);
+	}
+
+	return head ? head : &ast_null_frame;
+}
+
+struct ast_frame *ast_audiosocket_conn_receive_frame(struct ast_audiosocket_conn *conn)
+{
+	struct timeval now = ast_tvnow();
+	struct ast_frame *f;
+
+	f = audiosocket_conn_receive(conn);
+	audiosocket_stats_received(conn, f, now);
+
+	return f;
+}
+
+/*!
+ * \internal
+ * \brief Signal the reader of a stream that something is waiting
+ *
+ * The stream must be locked.
+ */
+static void audiosocket_mux_stream_alert(struct audiosocket_mux_stream *stream)
+{
+	if (!stream->alerted) {
+		if (ast_alertpipe_write(stream->alert_pipe)) {
+			ast_log(LOG_WARNING, "Failed to signal multiplexed AudioSocket stream %u\n",
+				stream->id);
+			return;
+		}
+		stream->alerted = 1;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Deliver an envelope received on a multiplexed connection to its stream
+ *
+ * \param mux The multiplexed connection.
+ * \param payload The payload of the envelope.
+ * \param len The length of the payload.
+ */
+static void audiosocket_mux_dispatch(struct audiosocket_mux *mux,
+	const uint8_t *payload, const size_t len)
+{
+	struct audiosocket_mux_stream *stream;
+	struct ast_frame fr = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "AudioSocket",
+	};
+	struct ast_frame *f = NULL;
+	uint16_t id;
+	uint8_t kind;
+	size_t hdrlen, inner_len;
+	int event = 0;
+
+	if (len < AUDIOSOCKET_MUX_ID_LEN + AUDIOSOCKET_HEADER_LEN
+		|| len < AUDIOSOCKET_MUX_ID_LEN + audiosocket_header_len(payload[2])) {
+		ast_log(LOG_WARNING, "Received truncated multiplexed AudioSocket message\n");
+		return;
+	}
+	id = (payload[0] << 8) | payload[1];
+	kind = payload[2];
+	hdrlen = audiosocket_header_len(kind);
+	inner_len = (payload[3] << 8) | payload[4];
+	if (hdrlen > AUDIOSOCKET_HEADER_LEN) {
+		/* The stream's sequence number is passed on, but its round trip is not measured */
+		kind &= ~AST_AUDIOSOCKET_KIND_EXTENDED;
+		fr.seqno = (payload[AUDIOSOCKET_MUX_ID_LEN + AUDIOSOCKET_HEADER_LEN] << 8)
+			| payload[AUDIOSOCKET_MUX_ID_LEN + AUDIOSOCKET_HEADER_LEN + 1];
+	}
+	if (inner_len != len - AUDIOSOCKET_MUX_ID_LEN - hdrlen) {
+		ast_log(LOG_WARNING, "Received malformed multiplexed AudioSocket message\n");
+		return;
+	}
+
+	stream = ao2_find(mux->streams, &id, OBJ_SEARCH_KEY);
+	if (!stream) {
+		/* The stream has already ended */
+		return;
+	}
+
+	if (hdrlen > AUDIOSOCKET_HEADER_LEN
+		|| (kind == AST_AUDIOSOCKET_KIND_UUID
+			&& audiosocket_id_accepts(payload + AUDIOSOCKET_MUX_ID_LEN + hdrlen, inner_len))) {
+		stream->ext_accepted = 1;
+	}
+	if (kind == AST_AUDIOSOCKET_KIND_UUID) {
+		ao2_ref(stream, -1);
+		return;
+	}
+
+	if (kind != AST_AUDIOSOCKET_KIND_HANGUP) {
+		event = audiosocket_event_frame(kind, payload + AUDIOSOCKET_MUX_ID_LEN + hdrlen,
+			inner_len, &fr);
+	}
+	if (event < 0) {
+		ao2_ref(stream, -1);
+		return;
+	}
+	if (kind != AST_AUDIOSOCKET_KIND_HANGUP && !event) {
+		fr.subclass.format = ast_audiosocket_format_from_kind(kind);
+		if (!fr.subclass.format || !inner_len) {
+			ao2_ref(stream, -1);
+			return;
+		}
+		fr.data.ptr = (void *) (payload + AUDIOSOCKET_MUX_ID_LEN + hdrlen);
+		fr.datalen = inner_len;
+		fr.samples = ast_codec_samples_count(&fr);
+	}
+
+	ao2_lock(stream);
+	if (kind == AST_AUDIOSOCKET_KIND_HANGUP) {
+		stream->hangup = 1;
+		audiosocket_mux_stream_alert(stream);
+	} else if (stream->queued >= AUDIOSOCKET_MUX_MAX_QUEUE) {
+		ast_debug(3, "Dropping frame for stalled multiplexed AudioSocket stream %u\n", id);
+	} else if ((f = ast_frisolate(&fr))) {
+		/* The payload is in the receive buffer, so it was copied */
+		audiosocket_payload_swap(kind, f->data.ptr, f->data.ptr, f->datalen);
+		AST_LIST_INSERT_TAIL(&stream->frames, f, frame_list);
+		stream->queued++;
+		audiosocket_mux_stream_alert(stream);
+	} else {
+		ast_log(LOG_ERROR, "Failed to allocate for data from AudioSocket\n");
+	}
+	ao2_unlock(stream);
+	ao2_ref(stream, -1);
+}
+
+/*!
+ * \internal
+ * \brief Receive the frames waiting for a multiplexed stream
+ */
+static struct ast_frame *audiosocket_mux_receive(struct ast_audiosocket_conn *conn)
+{
+	struct audiosocket_mux_stream *stream = conn->stream;
+	struct ast_frame *head, *tail = NULL, *f;
+	int hangup;
+
+	ao2_lock(stream);
+	if (stream->alerted) {
+		ast_alertpipe_read(stream->alert_pipe);
+		stream->alerted = 0;
+	}
+	head = AST_LIST_FIRST(&stream->frames);
+	AST_LIST_HEAD_INIT_NOLOCK(&stream->frames);
+	stream->queued = 0;
+	hangup = stream->hangup;
+	ao2_unlock(stream);
+
+	if (!hangup) {
+		return head ? head : &ast_null_frame;
+	}
+	if (!head) {
+		return NULL;
+	}
+
+	/* Deliver the audio which preceded the hangup before ending the call */
+	for (f = head; f; f = AST_LIST_NEXT(f, frame_list)) {
+		tail = f;
+	}
+	audiosocket_hangup_append(conn, &head, &tail);
+
+	return head;
+}
+
+/*!
+ * \internal
+ * \brief End a stream whose multiplexed connection has failed
+ */
+static int audiosocket_mux_stream_hangup(void *obj, void *arg, int flags)
+{
+	struct audiosocket_mux_stream *stream = obj;
+
+	ao2_lock(stream);
+	stream->hangup = 1;
+	audiosocket_mux_stream_alert(stream);
+	ao2_unlock(stream);
+
+	return CMP_MATCH;
+}
+
+/*!
+ * \internal
+ * \brief Read a multiplexed connection, delivering each envelope to its stream
+ */
+static void *audiosocket_mux_reader(void *data)
+{
+	struct audiosocket_mux *mux = data;
+	struct ast_frame *f;
+	int res;
+
+	while (!mux->stop) {
+		res = ast_wait_for_input(ast_audiosocket_conn_fd(mux->conn), AUDIOSOCKET_MUX_POLL_MSEC);
+		if (res < 0 && errno != EINTR) {
+			ast_log(LOG_WARNING, "Failed to poll multiplexed AudioSocket connection to '%s': %s\n",
+				mux->server, strerror(errno));
+			break;
+		}
+		if (res <= 0) {
+			continue;
+		}
+
+		/* Envelopes are delivered while the messages are parsed, so any
+		 * frame here was sent outside of a stream and has no destination.
+		 */
+		f = audiosocket_conn_receive(mux->conn);
+		if (!f) {
+			ast_log(LOG_WARNING, "Multiplexed AudioSocket connection to '%s' closed\n",
+				mux->server);
+			break;
+		}
+		ast_frfree(f);
+	}
+
+	ast_mutex_lock(&mux->lock);
+	mux->dead = 1;
+	ast_mutex_unlock(&mux->lock);
+
+	ao2_callback(mux->streams, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK,
+		audiosocket_mux_stream_hangup, NULL);
+
+	return NULL;
+}
+
+static int audiosocket_mux_stream_hash(const void *obj, const int flags)
+{
+	const struct audiosocket_mux_stream *stream;
+	const uint16_t *id;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		id = obj;
+		return *id;
+	case OBJ_SEARCH_OBJECT:
+		stream = obj;
+		return stream->id;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+}
+
+static int audiosocket_mux_stream_cmp(void *obj, void *arg, int flags)
+{
+	const struct audiosocket_mux_stream *stream = obj;
+	const struct audiosocket_mux_stream *other;
+	const uint16_t *id;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		id = arg;
+		return stream->id == *id ? CMP_MATCH : 0;
+	case OBJ_SEARCH_OBJECT:
+		other = arg;
+		return stream->id == other->id ? CMP_MATCH : 0;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+}
+
+static void audiosocket_mux_stream_destructor(void *obj)
+{
+	struct audiosocket_mux_stream *stream = obj;
+
+	ast_frfree(AST_LIST_FIRST(&stream->frames));
+	ast_alertpipe_close(stream->alert_pipe);
+}
+
+static void audiosocket_mux_destructor(void *obj)
+{
+	struct audiosocket_mux *mux = obj;
+
+	ao2_cleanup(mux->conn);
+	ao2_cleanup(mux->streams);
+	ast_mutex_destroy(&mux->lock);
+}
+
+/*!
+ * \internal
+ * \brief Stop the reader of a multiplexed connection and release it
+ *
+ * The connection must already have been removed from the list.
+ */
+static void audiosocket_mux_release(struct audiosocket_mux *mux)
+{
+	mux->stop = 1;
+	if (mux->thread != AST_PTHREADT_NULL) {
+		pthread_join(mux->thread, NULL);
+	}
+	ao2_ref(mux, -1);
+}
+
+/*!
+ * \internal
+ * \brief Open a new multiplexed connection to a server
+ */
+static struct audiosocket_mux *audiosocket_mux_alloc(const char *server,
+	struct ast_channel *chan)
+{
+	struct audiosocket_mux *mux;
+	int svc;
+
+	mux = ao2_alloc(sizeof(*mux) + strlen(server) + 1, audiosocket_mux_destructor);
+	if (!mux) {
+		ast_log(LOG_ERROR, "Failed to allocate multiplexed AudioSocket connection\n");
+		return NULL;
+	}
+	ast_mutex_init(&mux->lock);
+	strcpy(mux->server, server); /* Safe */
+	mux->thread = AST_PTHREADT_NULL;
+	mux->next_id = 1;
+
+	mux->streams = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0,
+		AUDIOSOCKET_MUX_MAX_STREAMS / 4 + 1, audiosocket_mux_stream_hash, NULL,
+		audiosocket_mux_stream_cmp);
+	if (!mux->streams) {
+		ast_log(LOG_ERROR, "Failed to allocate multiplexed AudioSocket streams\n");
+		ao2_ref(mux, -1);
+		return NULL;
+	}
+
+	if ((svc = ast_audiosocket_connect(server, chan)) < 0) {
+		ao2_ref(mux, -1);
+		return NULL;
+	}
+	if (!(mux->conn = ast_audiosocket_conn_alloc(svc))) {
+		close(svc);
+		ao2_ref(mux, -1);
+		return NULL;
+	}
+	mux->conn->demux = mux;
+
+	/* The shared connection is counted through the streams it carries */
+	audiosocket_conn_stats_release(mux->conn->stats);
+	mux->conn->stats = NULL;
+
+	if (ast_pthread_create_background(&mux->thread, NULL, audiosocket_mux_reader, mux)) {
+		ast_log(LOG_ERROR, "Failed to start reader for multiplexed AudioSocket connection\n");
+		mux->thread = AST_PTHREADT_NULL;
+		ao2_ref(mux, -1);
+		return NULL;
+	}
+
+	return mux;
+}
+
+/*!
+ * \internal
+ * \brief Get a multiplexed connection to a server with room for another stream
+ *
+ * \retval A referenced \ref audiosocket_mux on success
+ * \retval NULL on error
+ */
+static struct audiosocket_mux *audiosocket_mux_get(const char *server,
+	struct ast_channel *chan)
+{
+	struct audiosocket_mux *mux, *found = NULL;
+
+	AST_LIST_LOCK(&audiosocket_muxes);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&audiosocket_muxes, mux, list) {
+		if (mux->dead) {
+			/* Its streams have all been ended, so it is only waiting to be reaped */
+			AST_LIST_REMOVE_CURRENT(list);
+			audiosocket_mux_release(mux);
+			continue;
+		}
+		if (!strcmp(mux->server, server)
+			&& ao2_container_count(mux->streams) < AUDIOSOCKET_MUX_MAX_STREAMS) {
+			found = ao2_bump(mux);
+			break;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	AST_LIST_UNLOCK(&audiosocket_muxes);
+
+	if (found) {
+		return found;
+	}
+
+	/* The list is not held while connecting, so that a slow server does not
+	 * hold up sessions to the others.
+	 */
+	if (!(found = audiosocket_mux_alloc(server, chan))) {
+		return NULL;
+	}
+
+	/* The list keeps its own reference */
+	ao2_ref(found, +1);
+	AST_LIST_LOCK(&audiosocket_muxes);
+	AST_LIST_INSERT_HEAD(&audiosocket_muxes, found, list);
+	AST_LIST_UNLOCK(&audiosocket_muxes);
+
+	return found;
+}
+
+/*!
+ * \internal
+ * \brief Open a stream on a multiplexed connection to a server
+ */
+static struct ast_audiosocket_conn *audiosocket_mux_open(const char *server,
+	struct ast_channel *chan)
+{
+	struct audiosocket_mux *mux;
+	struct audiosocket_mux_stream *stream, *existing;
+	struct ast_audiosocket_conn *conn;
+
+	if (ast_strlen_zero(server)) {
+		ast_log(LOG_ERROR, "No AudioSocket server provided\n");
+		return NULL;
+	}
+
+	stream = ao2_alloc(sizeof(*stream), audiosocket_mux_stream_destructor);
+	if (!stream) {
+		ast_log(LOG_ERROR, "Failed to allocate multiplexed AudioSocket stream\n");
+		return NULL;
+	}
+	ast_alertpipe_clear(stream->alert_pipe);
+	AST_LIST_HEAD_INIT_NOLOCK(&stream->frames);
+	if (ast_alertpipe_init(stream->alert_pipe)) {
+		ast_log(LOG_ERROR, "Failed to create alert pipe for multiplexed AudioSocket stream\n");
+		ao2_ref(stream, -1);
+		return NULL;
+	}
+
+	if (!(conn = ast_audiosocket_conn_alloc(-1))) {
+		ao2_ref(stream, -1);
+		return NULL;
+	}
+	if (!(mux = audiosocket_mux_get(server, chan))) {
+		ao2_ref(stream, -1);
+		ao2_ref(conn, -1);
+		return NULL;
+	}
+
+	/* Stream ID 0 is never used, and an ID is only reused once its stream has ended */
+	ao2_lock(mux->streams);
+	for (;;) {
+		stream->id = mux->next_id++;
+		if (!stream->id) {
+			continue;
+		}
+		existing = ao2_find(mux->streams, &stream->id, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+		if (!existing) {
+			break;
+		}
+		ao2_ref(existing, -1);
+	}
+	ao2_link_flags(mux->streams, stream, OBJ_NOLOCK);
+	ao2_unlock(mux->streams);
+
+	if (mux->dead) {
+		/* The connection failed before the stream could be ended with the others */
+		audiosocket_mux_stream_hangup(stream, NULL, 0);
+	}
+
+	/* The connection takes both references */
+	conn->mux = mux;
+	conn->stream = stream;
+
+	return conn;
+}
+
+/*!
+ * \internal
+ * \brief Open an AudioSocket connection to a server
+ *
+ * \see ast_audiosocket_conn_connect
+ */
+static struct ast_audiosocket_conn *audiosocket_conn_open(const char *server,
+	struct ast_channel *chan, const unsigned int flags)
+{
+	struct ast_audiosocket_conn *conn;
+	int svc;
+
+	if (flags & AST_AUDIOSOCKET_CONN_DATAGRAM) {
+		if (flags & AST_AUDIOSOCKET_CONN_MULTIPLEX) {
+			ast_log(LOG_ERROR, "AudioSocket datagrams can not be multiplexed\n");
+			return NULL;
+		}
+		if ((svc = audiosocket_datagram_connect(server, chan)) < 0) {
+			return NULL;
+		}
+		if (!(conn = ast_audiosocket_conn_alloc(svc))) {
+			close(svc);
+			return NULL;
+		}
+		conn->datagram = 1;
+		return conn;
+	}
+	if (flags & AST_AUDIOSOCKET_CONN_MULTIPLEX) {
+		return audiosocket_mux_open(server, chan);
+	}
+
+	if ((svc = ast_audiosocket_connect(server, chan)) < 0) {
+		return NULL;
+	}
+	if (!(conn = ast_audiosocket_conn_alloc(svc))) {
+		close(svc);
+		return NULL;
+	}
+
+	return conn;
+}
+
+struct ast_audiosocket_conn *ast_audiosocket_conn_connect(const char *server,
+	struct ast_channel *chan, const unsigned int flags)
+{
+	struct timeval start = ast_tvnow();
+	struct ast_audiosocket_conn *conn;
+
+	conn = audiosocket_conn_open(server, chan, flags);
+	audiosocket_stats_connected(conn, server, chan, start);
+
+	return conn;
+}
+
+/*! \brief A buffer which plays out the frames received from a server in real time */
+struct ast_audiosocket_jb {
+	AST_LIST_HEAD_NOLOCK(, ast_frame) frames;	/* Waiting to be played, oldest first */
+	unsigned int min;	/* Shallowest target depth, in ms */
+	unsigned int max;	/* Deepest the buffer may become, in ms */
+	unsigned int target;	/* Depth buffered before playout starts, in ms */
+	unsigned int depth;	/* Audio currently buffered, in ms */
+	unsigned int burst;	/* Most audio added by one put, so that a read has room */
+	int playing;	/* Set once the target has been reached, until an underrun */
+	int draining;	/* Set once a hangup has been put, so what is left plays out */
+	struct timeval next;	/* When the next frame is due */
+	struct timeval steady;	/* When the target was last raised or lowered */
+	struct ast_audiosocket_jb_stats stats;
+};
+
+/*!
+ * \internal
+ * \brief Get the time covered by a frame which the buffer holds, in ms
+ */
+static unsigned int audiosocket_jb_frame_ms(const struct ast_frame *f)
+{
+	unsigned int rate;
+
+	if (f->frametype != AST_FRAME_VOICE) {
+		return 0;
+	}
+	rate = ast_format_get_sample_rate(f->subclass.format);
+	if (!rate || f->samples <= 0) {
+		return AUDIOSOCKET_JB_DEFAULT_FRAME_MSEC;
+	}
+
+	return MAX(1, f->samples * 1000 / rate);
+}
+
+static void audiosocket_jb_destructor(void *obj)
+{
+	struct ast_audiosocket_jb *jb = obj;
+	struct ast_frame *f;
+
+	while ((f = AST_LIST_REMOVE_HEAD(&jb->frames, frame_list))) {
+		ast_frfree(f);
+	}
+}
+
+struct ast_audiosocket_jb *ast_audiosocket_jb_alloc(const unsigned int min_ms,
+	const unsigned int max_ms)
+{
+	struct ast_audiosocket_jb *jb;
+
+	jb = ao2_alloc_options(sizeof(*jb), audiosocket_jb_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!jb) {
+		ast_log(LOG_ERROR, "Failed to allocate AudioSocket jitter buffer\n");
+		return NULL;
+	}
+	jb->min = min_ms;
+	jb->max = MAX(min_ms, max_ms);
+	jb->target = jb->min;
+	jb->steady = ast_tvnow();
+
+	return jb;
+}
+
+/*!
+ * \internal
+ * \brief Copy a frame to the end of a buffer
+ *
+ * \return The time the copy covers, in ms
+ */
+static unsigned int audiosocket_jb_queue(struct ast_audiosocket_jb *jb,
+	const struct ast_frame *f)
+{
+	struct ast_frame *dup;
+	unsigned int ms;
+
+	if (!(dup = ast_frdup(f))) {
+		return 0;
+	}
+	AST_LIST_NEXT(dup, frame_list) = NULL;
+	AST_LIST_INSERT_TAIL(&jb->frames, dup, frame_list);
+
+	ms = audiosocket_jb_frame_ms(dup);
+	jb->depth += ms;
+	if (ms) {
+		jb->stats.frames_in++;
+	}
+
+	return ms;
+}
+
+/*!
+ * \internal
+ * \brief Copy a voice frame longer than a buffer may hold to it in pieces
+ *
+ * Only frames with a whole number of bytes per sample can be split.  Others,
+ * such as Opus, are dropped, as the buffer could never play them out.
+ *
+ * \return The time the pieces cover, in ms
+ */
+static unsigned int audiosocket_jb_queue_split(struct ast_audiosocket_jb *jb,
+	const struct ast_frame *f)
+{
+	struct ast_frame piece = *f;
+	unsigned int rate, width, samples, added = 0;
+	int offset;
+
+	rate = ast_format_get_sample_rate(f->subclass.format);
+	if (f->datalen <= 0 || f->datalen % f->samples) {
+		ast_debug(3, "Dropping %d ms %s frame which an AudioSocket jitter buffer of "
+			"%u ms can not hold\n", f->samples * 1000 / (int) rate,
+			ast_format_get_name(f->subclass.format), jb->max);
+		jb->stats.dropped++;
+		return 0;
+	}
+	width = f->datalen / f->samples;
+	samples = MAX(1, rate * MIN(jb->max, AUDIOSOCKET_JB_DEFAULT_FRAME_MSEC) / 1000);
+
+	piece.mallocd = 0;
+	ast_clear_flag(&piece, AST_FRFLAG_HAS_TIMING_INFO);
+	AST_LIST_NEXT(&piece, frame_list) = NULL;
+	for (offset = 0; offset < f->datalen; offset += piece.datalen) {
+		piece.data.ptr = (char *) f->data.ptr + offset;
+		piece.datalen = MIN(samples * width, f->datalen - offset);
+		piece.samples = piece.datalen / width;
+		added += audiosocket_jb_queue(jb, &piece);
+	}
+
+	return added;
+}
+
+void ast_audiosocket_jb_put(struct ast_audiosocket_jb *jb, const struct ast_frame *f)
+{
+	struct ast_frame *old;
+	unsigned int added = 0, rate;
+
+	for (; f; f = AST_LIST_NEXT(f, frame_list)) {
+		if (f->frametype == AST_FRAME_CONTROL && f->subclass.integer == AST_CONTROL_HANGUP) {
+			/* Nothing follows, so play out whatever is left */
+			jb->draining = 1;
+		} else if (f->frametype != AST_FRAME_VOICE && f->frametype != AST_FRAME_CONTROL
+			&& f->frametype != AST_FRAME_DTMF_BEGIN && f->frametype != AST_FRAME_DTMF_END) {
+			continue;
+		}
+		rate = f->frametype == AST_FRAME_VOICE
+			? ast_format_get_sample_rate(f->subclass.format) : 0;
+		if (rate && f->samples > 0 && audiosocket_jb_frame_ms(f) > jb->max) {
+			added += audiosocket_jb_queue_split(jb, f);
+		} else {
+			added += audiosocket_jb_queue(jb, f);
+		}
+	}
+	/* A put may never leave the buffer full once it has drained */
+	jb->burst = MIN(MAX(jb->burst, added), jb->max);
+	jb->stats.peak = MAX(jb->stats.peak, jb->depth);
+
+	/* A server which does not honor the full buffer loses its oldest audio */
+	while (jb->depth > jb->max && (old = AST_LIST_FIRST(&jb->frames))
+		&& old->frametype == AST_FRAME_VOICE) {
+		AST_LIST_REMOVE_HEAD(&jb->frames, frame_list);
+		jb->depth -= audiosocket_jb_frame_ms(old);
+		jb->stats.dropped++;
+		ast_frfree(old);
+	}
+}
+
+const int ast_audiosocket_jb_full(const struct ast_audiosocket_jb *jb)
+{
+	/* Until playout starts nothing drains the buffer, so keep reading */
+	return jb->playing && jb->depth + jb->burst > jb->max;
+}
+
+/*!
+ * \internal
+ * \brief Adjust the playout state of a buffer to the current time
+ */
+static void audiosocket_jb_update(struct ast_audiosocket_jb *jb, const struct timeval now)
+{
+	if (!jb->playing) {
+		if (jb->depth >= jb->target || (jb->draining && !AST_LIST_EMPTY(&jb->frames))) {
+			jb->playing = 1;
+			jb->next = now;
+		}
+		return;
+	}
+
+	if (AST_LIST_EMPTY(&jb->frames) && !jb->draining && ast_tvdiff_ms(now, jb->next) >= 0) {
+		/* A frame is due and there is none, so buffer deeper before resuming */
+		jb->playing = 0;
+		jb->stats.underruns++;
+		jb->target = MIN(jb->target + AUDIOSOCKET_JB_DEFAULT_FRAME_MSEC, jb->max);
+		jb->steady = now;
+		return;
+	}
+
+	if (jb->target > jb->min && ast_tvdiff_ms(now, jb->steady) >= AUDIOSOCKET_JB_SHRINK_MSEC) {
+		/* The server has kept up for a while, so the next wait may be shorter */
+		jb->target = MAX(jb->target - AUDIOSOCKET_JB_DEFAULT_FRAME_MSEC, jb->min);
+		jb->steady = now;
+	}
+}
+
+struct ast_frame *ast_audiosocket_jb_get(struct ast_audiosocket_jb *jb)
+{
+	struct timeval now = ast_tvnow();
+	struct ast_frame *f;
+	unsigned int ms;
+
+	audiosocket_jb_update(jb, now);
+	if (!jb->playing || !(f = AST_LIST_FIRST(&jb->frames))) {
+		return NULL;
+	}
+
+	ms = audiosocket_jb_frame_ms(f);
+	if (ms) {
+		if (ast_tvdiff_ms(jb->next, now) > 0) {
+			return NULL;
+		}
+		if (ast_tvdiff_ms(now, jb->next) > ms) {
+			/* The caller fell behind, so keep time from now rather than catch up */
+			jb->next = now;
+		}
+		jb->next = ast_tvadd(jb->next, ast_samp2tv(ms, 1000));
+		jb->depth -= ms;
+		jb->stats.frames_out++;
+		if (!jb->depth) {
+			/* Measure bursts afresh, so that one large read is soon forgotten */
+			jb->burst = 0;
+		}
+	}
+	AST_LIST_REMOVE_HEAD(&jb->frames, frame_list);
+	AST_LIST_NEXT(f, frame_list) = NULL;
+
+	return f;
+}
+
+const int ast_audiosocket_jb_wait(struct ast_audiosocket_jb *jb)
+{
+	struct timeval now = ast_tvnow();
+	struct ast_frame *f;
+	int64_t ms;
+
+	audiosocket_jb_update(jb, now);
+	if (!jb->playing) {
+		return -1;
+	}
+	f = AST_LIST_FIRST(&jb->frames);
+	if (f && !audiosocket_jb_frame_ms(f)) {
+		return 0;
+	}
+
+	/* With nothing buffered, wake when the next frame is due to notice an underrun */
+	ms = ast_tvdiff_ms(jb->next, now);
+
+	return ms > 0 ? ms : 0;
+}
+
+void ast_audiosocket_jb_stats(const struct ast_audiosocket_jb *jb,
+	struct ast_audiosocket_jb_stats *stats)
+{
+	*stats = jb->stats;
+	stats->depth = jb->depth;
+	stats->target = jb->target;
+}
+
+#ifdef __linux__
+/*!
+ * \internal
+ * \brief Release what an attachment holds for receiving
+ *
+ * Called once the attachment has been detached and nothing more will be
+ * received for it.
+ */
+static void audiosocket_attachment_release(struct audiosocket_attachment *attachment)
+{
+	attachment->chan = ast_channel_unref(attachment->chan);
+	ao2_ref(attachment->conn, -1);
+	attachment->conn = NULL;
+}
+
+/*!
+ * \internal
+ * \brief Hand received frames to the channel of an attachment
+ *
+ * \param attachment The attachment.
+ * \param f The frames received, which are freed, or NULL if the connection failed.
+ *
+ * \retval 0 if more may be received
+ * \retval 1 if the connection has ended, in which case the channel has been told
+ */
+static int audiosocket_reactor_deliver(struct audiosocket_attachment *attachment,
+	struct ast_frame *f)
+{
+	struct ast_frame *cur;
+	int ended = 0;
+
+	if (!f) {
+		ast_log(LOG_ERROR, "Failed to receive frame from AudioSocket message for "
+			"channel %s\n", ast_channel_name(attachment->chan));
+		ended = 1;
+	} else if (!(attachment->flags & AST_AUDIOSOCKET_ATTACH_WRITE)) {
+		/* The channel's own read returns the frames, ending with any hangup */
+		for (cur = f; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+			if (cur->frametype == AST_FRAME_CONTROL
+				&& cur->subclass.integer == AST_CONTROL_HANGUP) {
+				ended = 1;
+			}
+		}
+		ast_queue_frame(attachment->chan, f);
+		ast_frfree(f);
+		ast_audiosocket_conn_written(attachment->conn);
+		attachment->ended = ended;
+		return ended;
+	} else {
+		for (cur = f; cur && !ended; cur = AST_LIST_NEXT(cur, frame_list)) {
+			if (cur->frametype == AST_FRAME_CONTROL
+				&& cur->subclass.integer == AST_CONTROL_HANGUP) {
+				/* AudioSocket ended by remote after sending its last audio */
+				ended = 1;
+			} else if (cur->frametype == AST_FRAME_CONTROL
+				&& cur->subclass.integer == AST_CONTROL_ANSWER) {
+				/* A channel which is written to has already been answered */
+				continue;
+			} else if (ast_write(attachment->chan, cur)) {
+				ast_log(LOG_WARNING, "Failed to forward frame to channel %s\n",
+					ast_channel_name(attachment->chan));
+				ended = 1;
+			}
+		}
+		ast_frfree(f);
+		ast_audiosocket_conn_written(attachment->conn);
+	}
+
+	if (ended) {
+		ast_queue_hangup(attachment->chan);
+	}
+	attachment->ended = ended;
+
+	return ended;
+}
+
+/*!
+ * \internal
+ * \brief Release the connections which have been detached from a reactor
+ */
+static void audiosocket_reactor_reap(struct audiosocket_reactor *reactor)
+{
+	struct audiosocket_attachment *attachment;
+	int drop;
+
+	ast_mutex_lock(&reactor->lock);
+	while ((attachment = AST_LIST_REMOVE_HEAD(&reactor->detached, list))) {
+		ast_mutex_unlock(&reactor->lock);
+		audiosocket_attachment_release(attachment);
+		ast_mutex_lock(&reactor->lock);
+		/* A poll of an io_uring still in flight drops it when it completes */
+		drop = !attachment->polls;
+		ast_mutex_unlock(&reactor->lock);
+		if (drop) {
+			/* The reference held by the epoll set or the io_uring */
+			ao2_ref(attachment, -1);
+		}
+		ast_mutex_lock(&reactor->lock);
+	}
+	ast_mutex_unlock(&reactor->lock);
+}
+
+/*!
+ * \internal
+ * \brief Stop watching a connection which has ended
+ */
+static void audiosocket_reactor_unwatch(struct audiosocket_reactor *reactor,
+	struct audiosocket_attachment *attachment)
+{
+	/* The polls of an io_uring are not made again once it has ended */
+	if (!reactor->uring) {
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, attachment->fd, NULL);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Receive on a connection which a reactor found readable
+ */
+static void audiosocket_reactor_receive(struct audiosocket_reactor *reactor,
+	struct audiosocket_attachment *attachment)
+{
+	struct ast_frame *f;
+
+	if (attachment->detached || attachment->ended) {
+		return;
+	}
+
+	f = ast_audiosocket_conn_receive_frame(attachment->conn);
+	if (f == &ast_null_frame) {
+		return;
+	}
+	if (audiosocket_reactor_deliver(attachment, f)) {
+		/* Nothing more is read from the connection */
+		audiosocket_reactor_unwatch(reactor, attachment);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Write out the queue of a connection which a reactor found writable
+ */
+static void audiosocket_reactor_send(struct audiosocket_reactor *reactor,
+	struct audiosocket_attachment *attachment)
+{
+	struct ast_audiosocket_conn *conn = attachment->conn;
+	int res;
+
+	if (attachment->detached || attachment->ended) {
+		return;
+	}
+
+	ao2_lock(conn);
+	res = audiosocket_txq_flush(conn);
+	if (!res) {
+		audiosocket_reactor_watch_output(conn, conn->txq.count != 0);
+	}
+	ao2_unlock(conn);
+
+	if (res) {
+		ast_log(LOG_ERROR, "Failed to send queued AudioSocket messages for channel %s\n",
+			ast_channel_name(attachment->chan));
+		ast_queue_hangup(attachment->chan);
+		attachment->ended = 1;
+		audiosocket_reactor_unwatch(reactor, attachment);
+	}
+}
+
+#ifdef AUDIOSOCKET_HAVE_URING
+static int audiosocket_uring_enter(struct audiosocket_uring *ring, const unsigned int to_submit,
+	const unsigned int min_complete, const unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void audiosocket_uring_destroy(struct audiosocket_uring *ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	}
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	}
+	close(ring->fd);
+}
+
+/*!
+ * \internal
+ * \brief Set up an io_uring and map its rings
+ *
+ * \retval 0 on success
+ * \retval -1 if io_uring can not be used
+ */
+static int audiosocket_uring_setup(struct audiosocket_uring *ring)
+{
+	struct io_uring_params p;
+	void *map;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = syscall(__NR_io_uring_setup, AUDIOSOCKET_URING_ENTRIES, &p)) < 0) {
+		ast_debug(1, "AudioSocket reactor can not set up io_uring: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		/* An older kernel drops completions when its ring is full, which would
+		 * leave connections unwatched */
+		ast_debug(1, "AudioSocket reactor needs an io_uring which keeps every completion\n");
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_len = ring->cq_ring_len = MAX(ring->sq_ring_len, ring->cq_ring_len);
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	map = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED) {
+		goto failed;
+	}
+	ring->sq_ring = map;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		map = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED) {
+			goto failed;
+		}
+		ring->cq_ring = map;
+	}
+	map = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (map == MAP_FAILED) {
+		goto failed;
+	}
+	ring->sqes = map;
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = (unsigned int *) ((uint8_t *) ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((uint8_t *) ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((uint8_t *) ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((uint8_t *) ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned int *) ((uint8_t *) ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((uint8_t *) ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((uint8_t *) ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((uint8_t *) ring->cq_ring + p.cq_off.cqes);
+
+	return 0;
+
+failed:
+	ast_log(LOG_ERROR, "Failed to map AudioSocket reactor io_uring: %s\n", strerror(errno));
+	audiosocket_uring_destroy(ring);
+	return -1;
+}
+
+/*!
+ * \internal
+ * \brief Add a request to the submission queue of a reactor's io_uring
+ *
+ * Must be called with the reactor locked.  The request is submitted by the
+ * reactor thread before it next waits, or by \ref audiosocket_uring_kick.
+ *
+ * \retval 0 on success
+ * \retval -1 if the queue is full and the kernel takes nothing from it
+ */
+static int audiosocket_uring_add(struct audiosocket_reactor *reactor, const uint8_t opcode,
+	const int fd, const uint64_t addr, const unsigned int events, const uint64_t data)
+{
+	struct audiosocket_uring *ring = &reactor->ring;
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+		/* Make room by handing the kernel what is queued */
+		audiosocket_uring_enter(ring, ring->sq_entries, 0, 0);
+		if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+			return -1;
+		}
+	}
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->poll_events = events;
+	sqe->user_data = data;
+	ring->sq_array[index] = index;
+	/* The entry must be complete before the kernel can see it */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Watch a file descriptor once with a reactor's io_uring
+ *
+ * Must be called with the reactor locked.
+ */
+static int audiosocket_uring_poll(struct audiosocket_reactor *reactor, const int fd,
+	const unsigned int events, const uint64_t data)
+{
+	return audiosocket_uring_add(reactor, IORING_OP_POLL_ADD, fd, 0, events, data);
+}
+
+/*!
+ * \internal
+ * \brief Submit the requests added to a reactor's io_uring, unless the reactor
+ * thread is awake and will do so before it next waits
+ *
+ * Must be called with the reactor locked.
+ */
+static void audiosocket_uring_kick(struct audiosocket_reactor *reactor)
+{
+	if (reactor->waiting) {
+		audiosocket_uring_enter(&reactor->ring, reactor->ring.sq_entries, 0, 0);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Watch an attached connection for the socket to take more
+ *
+ * Must be called with the connection locked.
+ */
+static void audiosocket_uring_watch_output(struct audiosocket_attachment *attachment)
+{
+	struct audiosocket_reactor *reactor = attachment->reactor;
+
+	ast_mutex_lock(&reactor->lock);
+	if (!attachment->polling_out && !attachment->detached && !attachment->ended
+		&& !audiosocket_uring_poll(reactor, attachment->fd, POLLOUT,
+			(uintptr_t) attachment | AUDIOSOCKET_URING_OUT)) {
+		attachment->polling_out = 1;
+		attachment->polls++;
+		audiosocket_uring_kick(reactor);
+	}
+	ast_mutex_unlock(&reactor->lock);
+}
+
+/*!
+ * \internal
+ * \brief Cancel the polls in flight for a connection being detached
+ *
+ * Must be called with the reactor locked.  They then complete as cancelled.
+ */
+static void audiosocket_uring_cancel(struct audiosocket_attachment *attachment)
+{
+	struct audiosocket_reactor *reactor = attachment->reactor;
+
+	if (attachment->polls > attachment->polling_out) {
+		audiosocket_uring_add(reactor, IORING_OP_POLL_REMOVE, -1, (uintptr_t) attachment, 0,
+			AUDIOSOCKET_URING_IGNORE);
+	}
+	if (attachment->polling_out) {
+		audiosocket_uring_add(reactor, IORING_OP_POLL_REMOVE, -1,
+			(uintptr_t) attachment | AUDIOSOCKET_URING_OUT, 0, AUDIOSOCKET_URING_IGNORE);
+	}
+	audiosocket_uring_kick(reactor);
+}
+
+/*!
+ * \internal
+ * \brief Handle the completion of a poll made by a reactor's io_uring
+ */
+static void audiosocket_uring_complete(struct audiosocket_reactor *reactor, const uint64_t data,
+	const int res)
+{
+	struct audiosocket_attachment *attachment;
+	int out = data & AUDIOSOCKET_URING_OUT;
+	int drop, rearmed;
+
+	if (data == AUDIOSOCKET_URING_IGNORE) {
+		return;
+	}
+	if (!data) {
+		/* The alert pipe, which is watched again at once */
+		ast_alertpipe_read(reactor->alert_pipe);
+		ast_mutex_lock(&reactor->lock);
+		audiosocket_uring_poll(reactor, ast_alertpipe_readfd(reactor->alert_pipe), POLLIN, 0);
+		ast_mutex_unlock(&reactor->lock);
+		return;
+	}
+
+	attachment = (struct audiosocket_attachment *) (uintptr_t)
+		(data & ~(uint64_t) AUDIOSOCKET_URING_OUT);
+	ast_mutex_lock(&reactor->lock);
+	attachment->polls--;
+	if (out) {
+		attachment->polling_out = 0;
+	}
+	ast_mutex_unlock(&reactor->lock);
+
+	if (res > 0 && out) {
+		audiosocket_reactor_send(reactor, attachment);
+	} else if (res > 0) {
+		audiosocket_reactor_receive(reactor, attachment);
+		/* A poll ends with its completion, so the socket is watched again */
+		ast_mutex_lock(&reactor->lock);
+		if (attachment->detached || attachment->ended) {
+			rearmed = 1;
+		} else if ((rearmed = !audiosocket_uring_poll(reactor, attachment->fd, POLLIN,
+			(uintptr_t) attachment))) {
+			attachment->polls++;
+		}
+		ast_mutex_unlock(&reactor->lock);
+		if (!rearmed) {
+			/* Rather than stop receiving without a word */
+			audiosocket_reactor_deliver(attachment, NULL);
+		}
+	} else if (!out && res != -ECANCELED && !attachment->detached && !attachment->ended) {
+		audiosocket_reactor_deliver(attachment, NULL);
+	}
+
+	/* Once a detached connection has been released, the last poll to complete
+	 * drops the reference of the io_uring */
+	ast_mutex_lock(&reactor->lock);
+	drop = attachment->detached && !attachment->conn && !attachment->polls;
+	ast_mutex_unlock(&reactor->lock);
+	if (drop) {
+		ao2_ref(attachment, -1);
+	}
+}
+
+static void *audiosocket_uring_run(struct audiosocket_reactor *reactor)
+{
+	struct audiosocket_uring *ring = &reactor->ring;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	uint64_t data;
+	int res;
 
-#define	MODULE_DESCRIPTION	"AudioSocket support functions for Asterisk"
+	while (!audiosocket_reactor_stop) {
+		audiosocket_reactor_reap(reactor);
 
-#define MAX_CONNECT_TIMEOUT_MSEC 2000
+		/* What was added while handling the last completions is submitted
+		 * by the same call which waits for the next */
+		ast_mutex_lock(&reactor->lock);
+		reactor->waiting = 1;
+		ast_mutex_unlock(&reactor->lock);
+		res = audiosocket_uring_enter(ring, ring->sq_entries, 1, IORING_ENTER_GETEVENTS);
+		ast_mutex_lock(&reactor->lock);
+		reactor->waiting = 0;
+		ast_mutex_unlock(&reactor->lock);
+		if (res < 0 && errno != EINTR && errno != EBUSY) {
+			ast_log(LOG_ERROR, "AudioSocket reactor failed to wait: %s\n", strerror(errno));
+			break;
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			data = cqe->user_data;
+			res = cqe->res;
+			/* The entry is freed first, since the kernel will not take more
+			 * requests while completions wait for room */
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+			audiosocket_uring_complete(reactor, data, res);
+		}
+	}
+
+	return NULL;
+}
+#endif /* AUDIOSOCKET_HAVE_URING */
 
 /*!
  * \internal
- * \brief Attempt to complete the audiosocket connection.
- *
- * \param server Url that we are trying to connect to.
- * \param addr Address that host was resolved to.
- * \param netsockfd File descriptor of socket.
+ * \brief Have the reactor thread of a connection watch for its socket to take
+ * what is in its write queue, or stop watching once the queue is empty
  *
- * \retval 0 when connection is succesful.
- * \retval 1 when there is an error.
+ * Must be called with the connection locked.
  */
-static int handle_audiosocket_connection(const char *server,
-	const struct ast_sockaddr addr, const int netsockfd)
+static void audiosocket_reactor_watch_output(struct ast_audiosocket_conn *conn, const int watch)
 {
-	struct pollfd pfds[1];
-	int res, conresult;
-	socklen_t reslen;
+	struct audiosocket_attachment *attachment = conn->attachment;
+	struct epoll_event ev = { .events = watch ? EPOLLIN | EPOLLOUT : EPOLLIN, };
+
+	if (!attachment || attachment->detached || attachment->ended) {
+		return;
+	}
+#ifdef AUDIOSOCKET_HAVE_URING
+	if (attachment->reactor->uring) {
+		/* A poll for output ends with its completion, so there is none to stop */
+		if (watch) {
+			audiosocket_uring_watch_output(attachment);
+		}
+		return;
+	}
+#endif
+	/* Once the connection has left the epoll set, this fails harmlessly */
+	ev.data.ptr = attachment;
+	epoll_ctl(attachment->reactor->epfd, EPOLL_CTL_MOD, attachment->fd, &ev);
+}
 
-	reslen = sizeof(conresult);
+static void *audiosocket_reactor_run(void *data)
+{
+	struct audiosocket_reactor *reactor = data;
+	struct epoll_event events[AUDIOSOCKET_REACTOR_EVENTS];
+	int i, res;
+
+#ifdef AUDIOSOCKET_HAVE_URING
+	if (reactor->uring) {
+		return audiosocket_uring_run(reactor);
+	}
+#endif
 
-	pfds[0].fd = netsockfd;
-	pfds[0].events = POLLOUT;
+	while (!audiosocket_reactor_stop) {
+		/* Connections detached while handling the previous events are no
+		 * longer referenced by them */
+		audiosocket_reactor_reap(reactor);
 
-	while ((res = ast_poll(pfds, 1, MAX_CONNECT_TIMEOUT_MSEC)) != 1) {
-		if (errno != EINTR) {
-			if (!res) {
-				ast_log(LOG_WARNING, "AudioSocket connection to '%s' timed"
-					"out after MAX_CONNECT_TIMEOUT_MSEC (%d) milliseconds.\n",
-					server, MAX_CONNECT_TIMEOUT_MSEC);
-			} else {
-				ast_log(LOG_WARNING, "Connect to '%s' failed: %s\n", server,
-					strerror(errno));
+		if ((res = epoll_wait(reactor->epfd, events, ARRAY_LEN(events), -1)) < 0) {
+			if (errno != EINTR) {
+				ast_log(LOG_ERROR, "AudioSocket reactor failed to wait: %s\n", strerror(errno));
+				break;
 			}
+			continue;
+		}
 
-			return -1;
+		for (i = 0; i < res; i++) {
+			if (!events[i].data.ptr) {
+				ast_alertpipe_read(reactor->alert_pipe);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT) {
+				audiosocket_reactor_send(reactor, events[i].data.ptr);
+			}
+			if (events[i].events & ~EPOLLOUT) {
+				audiosocket_reactor_receive(reactor, events[i].data.ptr);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \internal
+ * \brief Set up the io_uring of a reactor, if it is to have one
+ *
+ * \retval 0 if the reactor uses io_uring
+ * \retval -1 if it is to use epoll
+ */
+static int audiosocket_reactor_init_uring(struct audiosocket_reactor *reactor)
+{
+	if (audiosocket_reactor_backend == AUDIOSOCKET_REACTOR_EPOLL) {
+		return -1;
+	}
+#ifdef AUDIOSOCKET_HAVE_URING
+	if (!audiosocket_uring_setup(&reactor->ring)) {
+		if (!audiosocket_uring_poll(reactor, ast_alertpipe_readfd(reactor->alert_pipe), POLLIN, 0)) {
+			reactor->uring = 1;
+			return 0;
 		}
+		audiosocket_uring_destroy(&reactor->ring);
+	}
+#endif
+	if (audiosocket_reactor_backend == AUDIOSOCKET_REACTOR_URING) {
+		ast_log(LOG_WARNING, "io_uring is not available to the AudioSocket reactor; "
+			"using epoll\n");
 	}
 
-	if (getsockopt(pfds[0].fd, SOL_SOCKET, SO_ERROR, &conresult, &reslen) < 0) {
-		ast_log(LOG_WARNING, "Connection to %s failed with error: %s\n",
-			ast_sockaddr_stringify(&addr), strerror(errno));
+	return -1;
+}
+
+/*!
+ * \internal
+ * \brief Set up a reactor
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_reactor_init(struct audiosocket_reactor *reactor)
+{
+	struct epoll_event ev = { .events = EPOLLIN, };
+
+	if (ast_alertpipe_init(reactor->alert_pipe)) {
 		return -1;
 	}
+	if (!audiosocket_reactor_init_uring(reactor)) {
+		return 0;
+	}
 
-	if (conresult) {
-		ast_log(LOG_WARNING, "Connecting to '%s' failed for url '%s': %s\n",
-			ast_sockaddr_stringify(&addr), server, strerror(conresult));
+	if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		ast_log(LOG_ERROR, "Failed to create AudioSocket reactor: %s\n", strerror(errno));
+		ast_alertpipe_close(reactor->alert_pipe);
+		return -1;
+	}
+	ev.data.ptr = NULL;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, ast_alertpipe_readfd(reactor->alert_pipe), &ev)) {
+		ast_log(LOG_ERROR, "Failed to create AudioSocket reactor: %s\n", strerror(errno));
+		ast_alertpipe_close(reactor->alert_pipe);
+		close(reactor->epfd);
 		return -1;
 	}
 
 	return 0;
 }
 
-const int ast_audiosocket_connect(const char *server, struct ast_channel *chan)
+static void audiosocket_reactor_destroy(struct audiosocket_reactor *reactor)
 {
-	int s = -1;
-	struct ast_sockaddr *addrs;
-	int num_addrs = 0, i = 0;
+	audiosocket_reactor_reap(reactor);
+	if (reactor->uring) {
+#ifdef AUDIOSOCKET_HAVE_URING
+		audiosocket_uring_destroy(&reactor->ring);
+#endif
+	} else {
+		close(reactor->epfd);
+	}
+	ast_alertpipe_close(reactor->alert_pipe);
+}
 
-	if (chan && ast_autoservice_start(chan) < 0) {
-		ast_log(LOG_WARNING, "Failed to start autoservice for channel "
-			"%s\n", ast_channel_name(chan));
-		goto end;
+/*!
+ * \internal
+ * \brief Start the reactor threads, if they are not running yet
+ *
+ * Must be called with audiosocket_reactor_lock held.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int audiosocket_reactor_start(void)
+{
+	struct audiosocket_reactor *reactor;
+	long threads = audiosocket_reactor_threads;
+
+	if (audiosocket_reactor_count) {
+		return 0;
 	}
+	if (!threads && (threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		threads = 1;
+	}
+	threads = MIN(threads, AUDIOSOCKET_REACTOR_MAX_THREADS);
 
-	if (ast_strlen_zero(server)) {
-		ast_log(LOG_ERROR, "No AudioSocket server provided\n");
-		goto end;
+	while (audiosocket_reactor_count < threads) {
+		reactor = &audiosocket_reactors[audiosocket_reactor_count];
+		memset(reactor, 0, sizeof(*reactor));
+		ast_mutex_init(&reactor->lock);
+		if (audiosocket_reactor_init(reactor)) {
+			ast_mutex_destroy(&reactor->lock);
+			break;
+		}
+		if (ast_pthread_create_background(&reactor->thread, NULL, audiosocket_reactor_run,
+			reactor)) {
+			ast_log(LOG_ERROR, "Failed to start AudioSocket reactor thread\n");
+			audiosocket_reactor_destroy(reactor);
+			ast_mutex_destroy(&reactor->lock);
+			break;
+		}
+		audiosocket_reactor_count++;
 	}
 
-	if (!(num_addrs = ast_sockaddr_resolve(&addrs, server, PARSE_PORT_REQUIRE,
-		AST_AF_UNSPEC))) {
-		ast_log(LOG_ERROR, "Failed to resolve AudioSocket service using %s - "
-			"requires a valid hostname and port\n", server);
-		goto end;
+	if (!audiosocket_reactor_count) {
+		return -1;
 	}
+	ast_verb(3, "Started %d AudioSocket reactor threads using %s\n", audiosocket_reactor_count,
+		audiosocket_reactors[0].uring ? "io_uring" : "epoll");
 
-	/* Connect to AudioSocket service */
-	for (i = 0; i < num_addrs; i++) {
+	return 0;
+}
 
-		if (!ast_sockaddr_port(&addrs[i])) {
-			/* If there's no port, other addresses should have the
-			 * same problem. Stop here.
-			 */
-			ast_log(LOG_ERROR, "No port provided for %s\n",
-				ast_sockaddr_stringify(&addrs[i]));
-			s = -1;
-			goto end;
-		}
+/*!
+ * \internal
+ * \brief Stop the reactor threads and release what they hold
+ */
+static void audiosocket_reactor_shutdown(void)
+{
+	struct audiosocket_reactor *reactor;
+	int i;
 
-		if ((s = ast_socket_nonblock(addrs[i].ss.ss_family, SOCK_STREAM,
-			IPPROTO_TCP)) < 0) {
-			ast_log(LOG_WARNING, "Unable to create socket: %s\n", strerror(errno));
-			continue;
-		}
+	ast_mutex_lock(&audiosocket_reactor_lock);
+	audiosocket_reactor_stop = 1;
+	for (i = 0; i < audiosocket_reactor_count; i++) {
+		reactor = &audiosocket_reactors[i];
+		ast_alertpipe_write(reactor->alert_pipe);
+	}
+	for (i = 0; i < audiosocket_reactor_count; i++) {
+		reactor = &audiosocket_reactors[i];
+		pthread_join(reactor->thread, NULL);
+		audiosocket_reactor_destroy(reactor);
+		ast_mutex_destroy(&reactor->lock);
+	}
+	audiosocket_reactor_count = 0;
+	ast_mutex_unlock(&audiosocket_reactor_lock);
+}
 
-		if (ast_connect(s, &addrs[i]) && errno == EINPROGRESS) {
+const int ast_audiosocket_conn_attach(struct ast_audiosocket_conn *conn,
+	struct ast_channel *chan, const unsigned int flags)
+{
+	struct audiosocket_attachment *attachment;
+	struct audiosocket_reactor *reactor = NULL;
+	struct epoll_event ev = { .events = EPOLLIN, };
+	int i, res = -1;
 
-			if (handle_audiosocket_connection(server, addrs[i], s)) {
-				close(s);
-				continue;
-			}
+	if (!conn || !chan || conn->attachment) {
+		return -1;
+	}
 
-		} else {
-			ast_log(LOG_ERROR, "Connection to %s failed with unexpected error: %s\n",
-				ast_sockaddr_stringify(&addrs[i]), strerror(errno));
+	ast_mutex_lock(&audiosocket_reactor_lock);
+	if (!audiosocket_reactor_enabled || audiosocket_reactor_stop
+		|| audiosocket_reactor_start()) {
+		ast_mutex_unlock(&audiosocket_reactor_lock);
+		return -1;
+	}
+	/* Balance the connections across the threads */
+	for (i = 0; i < audiosocket_reactor_count; i++) {
+		if (!reactor || audiosocket_reactors[i].attached < reactor->attached) {
+			reactor = &audiosocket_reactors[i];
 		}
-
-		break;
 	}
 
-end:
-	if (addrs) {
-		ast_free(addrs);
+	if (!(attachment = ao2_alloc(sizeof(*attachment), NULL))) {
+		ast_mutex_unlock(&audiosocket_reactor_lock);
+		return -1;
 	}
+	attachment->conn = ao2_bump(conn);
+	attachment->chan = ast_channel_ref(chan);
+	attachment->flags = flags;
+	attachment->fd = ast_audiosocket_conn_fd(conn);
+	attachment->reactor = reactor;
 
-	if (chan && ast_autoservice_stop(chan) < 0) {
-		ast_log(LOG_WARNING, "Failed to stop autoservice for channel %s\n",
-		ast_channel_name(chan));
+	/* The epoll set or the io_uring holds a reference until the attachment is reaped */
+	ao2_ref(attachment, +1);
+	ast_mutex_lock(&reactor->lock);
+	if (reactor->uring) {
+#ifdef AUDIOSOCKET_HAVE_URING
+		if (!(res = audiosocket_uring_poll(reactor, attachment->fd, POLLIN,
+			(uintptr_t) attachment))) {
+			attachment->polls = 1;
+			audiosocket_uring_kick(reactor);
+		}
+#endif
+	} else {
+		ev.data.ptr = attachment;
+		res = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, attachment->fd, &ev);
+	}
+	if (res) {
+		ast_mutex_unlock(&reactor->lock);
+		ast_log(LOG_WARNING, "Failed to attach AudioSocket to reactor for channel %s: %s\n",
+			ast_channel_name(chan), strerror(errno));
+		ast_mutex_unlock(&audiosocket_reactor_lock);
+		audiosocket_attachment_release(attachment);
+		ao2_ref(attachment, -2);
 		return -1;
 	}
+	reactor->attached++;
+	ast_mutex_unlock(&reactor->lock);
+	ast_mutex_unlock(&audiosocket_reactor_lock);
 
-	if (i == num_addrs) {
-		ast_log(LOG_ERROR, "Failed to connect to AudioSocket service\n");
-		return -1;
+	/* The connection keeps the attachment until it is destroyed, for sending */
+	ao2_lock(conn);
+	conn->attachment = attachment;
+	if (conn->txq.count) {
+		audiosocket_reactor_watch_output(conn, 1);
 	}
+	ao2_unlock(conn);
 
-	return s;
+	return 0;
 }
 
-const int ast_audiosocket_init(const int svc, const char *id)
+void ast_audiosocket_conn_detach(struct ast_audiosocket_conn *conn)
 {
-	uuid_t uu;
-	int ret = 0;
-	uint8_t buf[3 + 16];
+	struct audiosocket_attachment *attachment;
+	struct audiosocket_reactor *reactor;
 
-	if (ast_strlen_zero(id)) {
-		ast_log(LOG_ERROR, "No UUID for AudioSocket\n");
-		return -1;
+	if (!conn || !(attachment = conn->attachment) || attachment->detached) {
+		return;
 	}
+	reactor = attachment->reactor;
 
-	if (uuid_parse(id, uu)) {
-		ast_log(LOG_ERROR, "Failed to parse UUID '%s'\n", id);
-		return -1;
+	ast_mutex_lock(&reactor->lock);
+	reactor->attached--;
+	attachment->detached = 1;
+	if (reactor->uring) {
+#ifdef AUDIOSOCKET_HAVE_URING
+		audiosocket_uring_cancel(attachment);
+#endif
+	} else {
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, attachment->fd, NULL);
 	}
 
-	buf[0] = 0x01;
-	buf[1] = 0x00;
-	buf[2] = 0x10;
-	memcpy(buf + 3, uu, 16);
+	/* The reactor thread may still be handling an event for it, so it is
+	 * left to that thread to release */
+	AST_LIST_INSERT_TAIL(&reactor->detached, attachment, list);
+	ast_mutex_unlock(&reactor->lock);
+	ast_alertpipe_write(reactor->alert_pipe);
+}
+#else /* !__linux__ */
 
-	if (write(svc, buf, 3 + 16) != 3 + 16) {
-		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
-		ret = -1;
-	}
+static void audiosocket_reactor_watch_output(struct ast_audiosocket_conn *conn, const int watch)
+{
+}
 
-	return ret;
+static void audiosocket_reactor_shutdown(void)
+{
 }
 
-const int ast_audiosocket_send_frame(const int svc, const struct ast_frame *f)
+const int ast_audiosocket_conn_attach(struct ast_audiosocket_conn *conn,
+	struct ast_channel *chan, const unsigned int flags)
 {
-	int ret = 0;
-	uint8_t kind = 0x10;	/* always 16-bit, 8kHz signed linear mono, for now */
-	uint8_t *p;
-	uint8_t buf[3 + f->datalen];
+	/* Without epoll, every caller waits on its own connection */
+	return -1;
+}
+
+void ast_audiosocket_conn_detach(struct ast_audiosocket_conn *conn)
+{
+}
+#endif /* __linux__ */
 
-	p = buf;
+static void audiosocket_cli_histograms(const int fd, struct audiosocket_stats *stats)
+{
+	const struct {
+		const char *title;
+		const char *field;
+		const struct audiosocket_histogram *h;
+	} histograms[] = AUDIOSOCKET_STATS_HISTOGRAMS(stats);
+	int i;
 
-	*(p++) = kind;
-	*(p++) = f->datalen >> 8;
-	*(p++) = f->datalen & 0xff;
-	memcpy(p, f->data.ptr, f->datalen);
+	ast_cli(fd, "%-22s %10s %10s %10s %10s %10s\n", "Time (ms)", "Samples", "Mean",
+		"p50 <=", "p90 <=", "p99 <=");
+	for (i = 0; i < ARRAY_LEN(histograms); i++) {
+		const struct audiosocket_histogram *h = histograms[i].h;
 
-	if (write(svc, buf, 3 + f->datalen) != 3 + f->datalen) {
-		ast_log(LOG_WARNING, "Failed to write data to AudioSocket\n");
-		ret = -1;
+		ast_cli(fd, "%-22s %10u %10.3f %10.3f %10.3f %10.3f\n", histograms[i].title, h->count,
+			h->count ? h->total_us / 1000.0 / h->count : 0.0,
+			audiosocket_histogram_percentile(h, 50) / 1000.0,
+			audiosocket_histogram_percentile(h, 90) / 1000.0,
+			audiosocket_histogram_percentile(h, 99) / 1000.0);
 	}
-
-	return ret;
 }
 
-struct ast_frame *ast_audiosocket_receive_frame(const int svc)
+static char *handle_cli_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
+	struct ao2_container *conns;
+	struct ao2_iterator it;
+	struct audiosocket_conn_stats *cs;
+	struct audiosocket_stats stats;
+	struct timeval now = ast_tvnow();
 
-	int i = 0, n = 0, ret = 0, not_audio = 0;
-	struct ast_frame f = {
-		.frametype = AST_FRAME_VOICE,
-		.subclass.format = ast_format_slin,
-		.src = "AudioSocket",
-		.mallocd = AST_MALLOCD_DATA,
-	};
-	uint8_t kind;
-	uint8_t len_high;
-	uint8_t len_low;
-	uint16_t len = 0;
-	uint8_t *data;
-	uint8_t retry = 3;
-
-	n = read(svc, &kind, 1);
-	if (n < 0 && errno == EAGAIN) {
-		return &ast_null_frame;
-	}
-	if (n == 0) {
-		return &ast_null_frame;
-	}
-	if (n != 1) {
-		ast_log(LOG_WARNING, "Failed to read type header from AudioSocket\n");
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "audiosocket show stats";
+		e->usage =
+			"Usage: audiosocket show stats\n"
+			"       Show the traffic and latency counters of all AudioSocket\n"
+			"       connections since the module loaded, and of each open one.\n"
+			"       Times are shown as the upper bounds of their percentiles.\n";
 		return NULL;
-	}
-	if (kind == 0x00) {
-		/* AudioSocket ended by remote */
+	case CLI_GENERATE:
 		return NULL;
 	}
-	if (kind != 0x10) {
-		/* read but ignore non-audio message */
-		ast_log(LOG_WARNING, "Received non-audio AudioSocket message\n");
-		not_audio = 1;
-	}
 
-	n = read(svc, &len_high, 1);
-	if (n != 1) {
-		ast_log(LOG_WARNING, "Failed to read data length from AudioSocket\n");
-		return NULL;
-	}
-	len += len_high * 256;
-	n = read(svc, &len_low, 1);
-	if (n != 1) {
-		ast_log(LOG_WARNING, "Failed to read data length from AudioSocket\n");
-		return NULL;
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
 	}
-	len += len_low;
 
-	if (len < 1) {
-		return &ast_null_frame;
-	}
+	conns = ao2_global_obj_ref(audiosocket_conn_stats);
+	audiosocket_stats_total(&stats, conns);
 
-	data = ast_malloc(len);
-	if (!data) {
-		ast_log(LOG_ERROR, "Failed to allocate for data from AudioSocket\n");
-		return NULL;
+	ast_cli(a->fd, "Connections: %u opened, %u failed, %d open\n",
+		ast_atomic_fetch_add(&audiosocket_stats_connects, 0, __ATOMIC_RELAXED),
+		ast_atomic_fetch_add(&audiosocket_stats_connect_failures, 0, __ATOMIC_RELAXED),
+		conns ? ao2_container_count(conns) : 0);
+	ast_cli(a->fd, "Frames in: %" PRIu64 " (%" PRIu64 " bytes), out: %" PRIu64 " (%" PRIu64 " bytes)\n",
+		stats.frames_in, stats.bytes_in, stats.frames_out, stats.bytes_out);
+	ast_cli(a->fd, "Short reads: %u, write waits: %u, queued: %u, dropped: %u, sequence gaps: %u\n\n",
+		stats.short_reads, stats.write_waits, stats.write_queued, stats.write_dropped,
+		stats.seq_gaps);
+	audiosocket_cli_histograms(a->fd, &stats);
+
+	if (!conns || !ao2_container_count(conns)) {
+		ao2_cleanup(conns);
+		return CLI_SUCCESS;
 	}
 
-	ret = 0;
-	n = 0;
-	i = 0;
-	retry = 3;
-	while (i < len) {
-		n = read(svc, data + i, len - i);
-		if (n < 0) {
-			// Sometimes there is something to read but it's not ready
-			// i don't knnow if it's better to sleep for 5ms
-			if (retry > 0) {
-				ast_log(LOG_WARNING, "Failed to read data retry\n");
-				usleep(5000);
-				retry--;
-				continue;
-			}
-			ast_log(LOG_ERROR, "Failed to read data from AudioSocket\n");
-			ret = n;
-			break;
-		}
-		if (n == 0) {
-			ast_log(LOG_ERROR, "Insufficient data read from AudioSocket\n");
-			ret = -1;
-			break;
-		}
-		i += n;
+	ast_cli(a->fd, "\n%-24s %-30s %8s %10s %10s %8s %10s %10s %10s\n", "Server", "Channel", "Age (s)",
+		"Frames in", "Frames out", "Dropped", "Jitter p99", "Delay p99", "RTT p99");
+	it = ao2_iterator_init(conns, 0);
+	while ((cs = ao2_iterator_next(&it))) {
+		audiosocket_stats_copy(&stats, &cs->stats);
+		ao2_lock(cs);
+		ast_cli(a->fd, "%-24.24s %-30.30s %8" PRId64 " %10" PRIu64 " %10" PRIu64 " %8u %10.3f %10.3f %10.3f\n",
+			S_OR(cs->server, "(accepted)"), S_OR(cs->channel, "(none)"),
+			ast_tvdiff_ms(now, cs->created) / 1000, stats.frames_in, stats.frames_out,
+			stats.write_dropped,
+			audiosocket_histogram_percentile(&stats.jitter, 99) / 1000.0,
+			audiosocket_histogram_percentile(&stats.latency, 99) / 1000.0,
+			audiosocket_histogram_percentile(&stats.rtt, 99) / 1000.0);
+		ao2_unlock(cs);
+		ao2_ref(cs, -1);
 	}
+	ao2_iterator_destroy(&it);
+	ao2_ref(conns, -1);
 
-	if (ret != 0) {
-		ast_free(data);
-		return NULL;
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry audiosocket_cli[] = {
+	AST_CLI_DEFINE(handle_cli_show_stats, "Show AudioSocket traffic and latency counters"),
+};
+
+static int manager_audiosocket_stats(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	char id_text[256] = "";
+	struct ao2_container *conns;
+	struct ao2_iterator it;
+	struct audiosocket_conn_stats *cs;
+	struct audiosocket_stats stats;
+	struct ast_str *buf;
+	struct timeval now = ast_tvnow();
+	int count = 1;
+
+	if (!(buf = ast_str_create(512))) {
+		astman_send_error(s, m, "Allocation failure");
+		return 0;
+	}
+	if (!ast_strlen_zero(id)) {
+		snprintf(id_text, sizeof(id_text), "ActionID: %s\r\n", id);
 	}
 
-	if (not_audio) {
-		ast_free(data);
-		return &ast_null_frame;
+	astman_send_listack(s, m, "AudioSocket statistics will follow", "start");
+
+	conns = ao2_global_obj_ref(audiosocket_conn_stats);
+	audiosocket_stats_total(&stats, conns);
+	audiosocket_stats_fields(&buf, &stats);
+	astman_append(s,
+		"Event: AudioSocketStats\r\n"
+		"%s"
+		"Connects: %u\r\n"
+		"ConnectFailures: %u\r\n"
+		"Open: %d\r\n"
+		"%s"
+		"\r\n",
+		id_text, ast_atomic_fetch_add(&audiosocket_stats_connects, 0, __ATOMIC_RELAXED),
+		ast_atomic_fetch_add(&audiosocket_stats_connect_failures, 0, __ATOMIC_RELAXED),
+		conns ? ao2_container_count(conns) : 0, ast_str_buffer(buf));
+
+	if (conns) {
+		it = ao2_iterator_init(conns, 0);
+		while ((cs = ao2_iterator_next(&it))) {
+			audiosocket_stats_copy(&stats, &cs->stats);
+			ast_str_reset(buf);
+			audiosocket_stats_fields(&buf, &stats);
+			ao2_lock(cs);
+			astman_append(s,
+				"Event: AudioSocketConnectionStats\r\n"
+				"%s"
+				"Server: %s\r\n"
+				"Channel: %s\r\n"
+				"Duration: %" PRId64 "\r\n"
+				"%s"
+				"\r\n",
+				id_text, cs->server, cs->channel, ast_tvdiff_ms(now, cs->created) / 1000,
+				ast_str_buffer(buf));
+			ao2_unlock(cs);
+			ao2_ref(cs, -1);
+			count++;
+		}
+		ao2_iterator_destroy(&it);
+		ao2_ref(conns, -1);
 	}
+	ast_free(buf);
 
-	f.data.ptr = data;
-	f.datalen = len;
-	f.samples = len / 2;
+	astman_send_list_complete_start(s, m, "AudioSocketStatsComplete", count);
+	astman_send_list_complete_end(s);
 
-	/* The frame steals data, so it doesn't need to be freed here */
-	return ast_frisolate(&f);
+	return 0;
 }
 
 static int load_module(void)
 {
+	struct ao2_container *cache, *conns;
+
 	ast_verb(1, "Loading AudioSocket Support module\n");
+
+	if (audiosocket_load_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	audiosocket_kernels_select();
+
+	cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 17,
+		audiosocket_dns_entry_hash_fn, NULL, audiosocket_dns_entry_cmp_fn);
+	if (cache) {
+		ao2_global_obj_replace_unref(audiosocket_dns_cache, cache);
+		ao2_ref(cache, -1);
+	} else {
+		/* Every connection resolves its server itself */
+		ast_log(LOG_WARNING, "Failed to allocate AudioSocket DNS cache\n");
+	}
+
+	conns = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (conns) {
+		ao2_global_obj_replace_unref(audiosocket_conn_stats, conns);
+		ao2_ref(conns, -1);
+	} else {
+		/* Only the totals are counted */
+		ast_log(LOG_WARNING, "Failed to allocate AudioSocket connection statistics\n");
+	}
+
+	ast_cond_init(&audiosocket_pool_cond, NULL);
+	if (ast_pthread_create_background(&audiosocket_pool_thread, NULL, audiosocket_pool_run, NULL)) {
+		ast_log(LOG_ERROR, "Failed to start AudioSocket connection pool thread\n");
+		audiosocket_pool_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&audiosocket_pool_cond);
+		ao2_global_obj_release(audiosocket_pools);
+		ao2_global_obj_release(audiosocket_dns_cache);
+		ao2_global_obj_release(audiosocket_conn_stats);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	ast_cli_register_multiple(audiosocket_cli, ARRAY_LEN(audiosocket_cli));
+	ast_manager_register_xml("AudioSocketStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING,
+		manager_audiosocket_stats);
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
+static int reload_module(void)
+{
+	return audiosocket_load_config(1);
+}
+
 static int unload_module(void)
 {
+	struct audiosocket_mux *mux;
+
 	ast_verb(1, "Unloading AudioSocket Support module\n");
+
+	ast_cli_unregister_multiple(audiosocket_cli, ARRAY_LEN(audiosocket_cli));
+	ast_manager_unregister("AudioSocketStats");
+
+	AST_LIST_LOCK(&audiosocket_muxes);
+	while ((mux = AST_LIST_REMOVE_HEAD(&audiosocket_muxes, list))) {
+		audiosocket_mux_release(mux);
+	}
+	AST_LIST_UNLOCK(&audiosocket_muxes);
+
+	audiosocket_reactor_shutdown();
+
+	if (audiosocket_pool_thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&audiosocket_pool_lock);
+		audiosocket_pool_stop = 1;
+		ast_cond_signal(&audiosocket_pool_cond);
+		ast_mutex_unlock(&audiosocket_pool_lock);
+		pthread_join(audiosocket_pool_thread, NULL);
+		audiosocket_pool_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&audiosocket_pool_cond);
+	}
+	ao2_global_obj_release(audiosocket_pools);
+	ao2_global_obj_release(audiosocket_dns_cache);
+	ao2_global_obj_release(audiosocket_conn_stats);
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
@@ -347,5 +6445,6 @@ AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS | AST_MODFLAG_LOAD_
 	.support_level = AST_MODULE_SUPPORT_EXTENDED,
 	.load = load_module,
 	.unload = unload_module,
+	.reload = reload_module,
 	.load_pri = AST_MODPRI_CHANNEL_DEPEND,
 );
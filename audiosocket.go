@@ -3,6 +3,7 @@ package audiosocket
 import (
 	"encoding/binary"
 	"io"
+	"time"
 
 	"github.com/gofrs/uuid"
 	"github.com/pkg/errors"
@@ -21,16 +22,63 @@ const (
 	// KindID indicates the message contains the unique identifier of the call
 	KindID = 0x01
 
-	// KindSilence indicates the presence of silence on the line
+	// KindSilence indicates the presence of silence on the line, for the duration
+	// in milliseconds which the payload contains
 	KindSilence = 0x02
 
+	// KindDTMF indicates the end of a DTMF digit; see DTMFMessage
+	KindDTMF = 0x03
+
+	// KindControl indicates a call event, such as hold; see ControlMessage
+	KindControl = 0x04
+
+	// KindDTMFBegin indicates the start of a DTMF digit; see DTMFBeginMessage
+	KindDTMFBegin = 0x05
+
 	// KindSlin indicates the message contains signed-linear audio data
 	KindSlin = 0x10
 
+	// KindSlin16 indicates the message contains signed-linear audio data sampled at 16kHz
+	KindSlin16 = 0x12
+
+	// KindSlin24 indicates the message contains signed-linear audio data sampled at 24kHz
+	KindSlin24 = 0x13
+
+	// KindSlin48 indicates the message contains signed-linear audio data sampled at 48kHz
+	KindSlin48 = 0x16
+
+	// KindUlaw indicates the message contains 8kHz G.711 mu-law audio data
+	KindUlaw = 0x20
+
+	// KindAlaw indicates the message contains 8kHz G.711 A-law audio data
+	KindAlaw = 0x21
+
+	// KindOpus indicates the message contains a single Opus packet
+	KindOpus = 0x22
+
+	// KindMux indicates the message is an envelope carrying a message of one of
+	// the streams of a multiplexed connection
+	KindMux = 0x30
+
+	// KindSlinStereo indicates the message contains two channels of 8kHz
+	// signed-linear audio data, with their samples alternating.  Asterisk sends
+	// the audio read from the channel first and the audio written to it second.
+	KindSlinStereo = 0x40
+
+	// KindExtended is set in the type byte of a message whose three-byte
+	// header is followed by a 16-bit sequence number and a 32-bit timestamp,
+	// both big endian.  Kind reports the type without it.  It is never set in
+	// an error message.
+	KindExtended = 0x80
+
 	// KindError indicates the message contains an error code
 	KindError = 0xff
 )
 
+// maxSlinPayload is the largest whole number of 16-bit samples which fits in the
+// payload of one message
+const maxSlinPayload = 65534
+
 // ErrorCode indicates an error, if present
 type ErrorCode byte
 
@@ -60,14 +108,114 @@ func (m Message) ContentLength() uint16 {
 	return binary.BigEndian.Uint16(m[1:3])
 }
 
-// Kind returns the type of the message
+// Kind returns the type of the message, without KindExtended
 func (m Message) Kind() Kind {
 	if len(m) < 1 {
 		return KindError
 	}
+	if m.Extended() {
+		return Kind(m[0] &^ KindExtended)
+	}
 	return Kind(m[0])
 }
 
+// SampleRate returns the sample rate, in Hz, of the signed-linear audio in the
+// message, or 0 if the message does not contain signed-linear audio
+func (m Message) SampleRate() int {
+	switch m.Kind() {
+	case KindSlin, KindSlinStereo:
+		return 8000
+	case KindSlin16:
+		return 16000
+	case KindSlin24:
+		return 24000
+	case KindSlin48:
+		return 48000
+	default:
+		return 0
+	}
+}
+
+// IsAudio indicates whether the message contains audio data, in any of the
+// supported codecs
+func (m Message) IsAudio() bool {
+	switch m.Kind() {
+	case KindSlin, KindSlinStereo, KindSlin16, KindSlin24, KindSlin48, KindUlaw, KindAlaw, KindOpus:
+		return true
+	default:
+		return false
+	}
+}
+
+// Channels returns the number of channels of the audio in the message, or 0 if
+// the message does not contain audio
+func (m Message) Channels() int {
+	switch {
+	case m.Kind() == KindSlinStereo:
+		return 2
+	case m.IsAudio():
+		return 1
+	default:
+		return 0
+	}
+}
+
+// ClockRate returns the clock rate, in Hz, of the audio in the message, in any
+// of the supported codecs, or 0 if the message does not contain audio
+func (m Message) ClockRate() int {
+	switch m.Kind() {
+	case KindUlaw, KindAlaw:
+		return 8000
+	case KindOpus:
+		return 48000
+	default:
+		return m.SampleRate()
+	}
+}
+
+// Duration returns the length of the silence which a KindSilence message stands
+// for, or 0 for any other message
+func (m Message) Duration() time.Duration {
+	p := m.Payload()
+	if m.Kind() != KindSilence || len(p) < 2 {
+		return 0
+	}
+
+	return time.Duration(binary.BigEndian.Uint16(p)) * time.Millisecond
+}
+
+// Silence expands a KindSilence message into the zeroed signed linear audio,
+// sampled at the given rate in Hz, which it stands for.  Silence longer than
+// one message can hold is split over several.  It returns nil for any other
+// message.
+func (m Message) Silence(rate int) ([]Message, error) {
+	kind, err := SlinKind(rate)
+	if err != nil {
+		return nil, err
+	}
+	if m.Kind() != KindSilence {
+		return nil, nil
+	}
+
+	remaining := 2 * rate * int(m.Duration()/time.Millisecond) / 1000
+	size := remaining
+	if size > maxSlinPayload {
+		size = maxSlinPayload
+	}
+	zeros := make([]byte, size)
+
+	var out []Message
+	for remaining > 0 {
+		n := size
+		if n > remaining {
+			n = remaining
+		}
+		out = append(out, newMessage(kind, zeros[:n]))
+		remaining -= n
+	}
+	return out, nil
+}
+
 // ErrorCode returns the coded error of the message, if present
 func (m Message) ErrorCode() ErrorCode {
 	if m.Kind() != KindError {
@@ -84,11 +232,11 @@ func (m Message) ErrorCode() ErrorCode {
 // Payload returns the data of the payload of the message
 func (m Message) Payload() []byte {
 	sz := m.ContentLength()
-	if sz == 0 {
+	if sz == 0 || len(m) < m.headerLen() {
 		return nil
 	}
 
-	return m[3:]
+	return m[m.headerLen():]
 }
 
 // ID returns the session's unique ID if and only if the Message is the initial
@@ -123,6 +271,13 @@ func NextMessage(r io.Reader) (Message, error) {
 	if n != 3 {
 		return nil, errors.Wrapf(err, "read wrong number of bytes (%d) for header", n)
 	}
+	if Message(hdr).Extended() {
+		ext := make([]byte, extendedLen)
+		if _, err = io.ReadFull(r, ext); err != nil {
+			return nil, errors.Wrap(err, "failed to read extended header")
+		}
+		hdr = append(hdr, ext...)
+	}
 
 	payloadLen := binary.BigEndian.Uint16(hdr[1:])
 	if payloadLen < 1 {
@@ -150,26 +305,138 @@ func MessageFromData(in []byte) Message {
 
 // HangupMessage creates a new Message indicating a hangup
 func HangupMessage() Message {
-	return []byte{KindHangup, 0x00, 0x00}
+	return AppendHangup(make([]byte, 0, 3))
 }
 
 // IDMessage creates a new Message
 func IDMessage(id uuid.UUID) Message {
-	out := make([]byte, 3, 3+16)
-	out[0] = KindID
-	binary.BigEndian.PutUint16(out[1:], 16)
-	return append(out, id.Bytes()...)
+	return AppendID(make([]byte, 0, 3+16), id)
+}
+
+// SilenceMessage creates a new Message indicating silence on the line for the
+// given duration, which is truncated to whole milliseconds and may be at most
+// 65535 milliseconds
+func SilenceMessage(d time.Duration) Message {
+	return AppendSilence(make([]byte, 0, 5), d)
 }
 
 // SlinMessage creates a new Message from signed linear audio data
 func SlinMessage(in []byte) Message {
-	if len(in) > 65535 {
+	return newMessage(KindSlin, in)
+}
+
+// SlinRateMessage creates a new Message from signed linear audio data sampled
+// at the given rate, in Hz.  The supported rates are 8000, 16000, 24000, and
+// 48000.
+func SlinRateMessage(rate int, in []byte) (Message, error) {
+	kind, err := SlinKind(rate)
+	if err != nil {
+		return nil, err
+	}
+	return newMessage(kind, in), nil
+}
+
+// SlinStereoMessage creates a new Message from two channels of interleaved 8kHz
+// signed linear audio data
+func SlinStereoMessage(in []byte) Message {
+	return newMessage(KindSlinStereo, in)
+}
+
+// UlawMessage creates a new Message from G.711 mu-law audio data
+func UlawMessage(in []byte) Message {
+	return newMessage(KindUlaw, in)
+}
+
+// AlawMessage creates a new Message from G.711 A-law audio data
+func AlawMessage(in []byte) Message {
+	return newMessage(KindAlaw, in)
+}
+
+// OpusMessage creates a new Message from a single Opus packet
+func OpusMessage(packet []byte) Message {
+	return newMessage(KindOpus, packet)
+}
+
+// SlinKind returns the message Kind which carries signed linear audio data
+// sampled at the given rate, in Hz
+func SlinKind(rate int) (Kind, error) {
+	switch rate {
+	case 8000:
+		return KindSlin, nil
+	case 16000:
+		return KindSlin16, nil
+	case 24000:
+		return KindSlin24, nil
+	case 48000:
+		return KindSlin48, nil
+	default:
+		return KindError, errors.Errorf("unsupported signed linear sample rate %d", rate)
+	}
+}
+
+func newMessage(kind Kind, in []byte) Message {
+	return AppendMessage(make([]byte, 0, 3+len(in)), kind, in)
+}
+
+// AppendMessage appends a message of the given kind and payload to dst and
+// returns the extended buffer, which is only reallocated if dst is too small.
+// The payload may be at most 65535 bytes.
+func AppendMessage(dst []byte, kind Kind, payload []byte) []byte {
+	if len(payload) > 65535 {
 		panic("audiosocket: message too large")
 	}
 
-	out := make([]byte, 3, 3+len(in))
-	out[0] = KindSlin
-	binary.BigEndian.PutUint16(out[1:], uint16(len(in)))
-	out = append(out, in...)
-	return out
+	dst = append(dst, byte(kind), byte(len(payload)>>8), byte(len(payload)))
+	return append(dst, payload...)
+}
+
+// AppendHangup appends a message indicating a hangup to dst
+func AppendHangup(dst []byte) []byte {
+	return append(dst, KindHangup, 0x00, 0x00)
+}
+
+// AppendID appends an ID message to dst
+func AppendID(dst []byte, id uuid.UUID) []byte {
+	return AppendMessage(dst, KindID, id.Bytes())
+}
+
+// AppendSilence appends a message indicating silence on the line to dst, as
+// SilenceMessage creates
+func AppendSilence(dst []byte, d time.Duration) []byte {
+	ms := d / time.Millisecond
+	if ms > 65535 {
+		ms = 65535
+	}
+
+	return append(dst, KindSilence, 0x00, 0x02, byte(ms>>8), byte(ms))
+}
+
+// AppendSlin appends a message of signed linear audio data to dst
+func AppendSlin(dst, pcm []byte) []byte {
+	return AppendMessage(dst, KindSlin, pcm)
+}
+
+// AppendSlinRate appends a message of signed linear audio data sampled at the
+// given rate, in Hz, to dst.  The supported rates are those of SlinRateMessage.
+func AppendSlinRate(dst []byte, rate int, pcm []byte) ([]byte, error) {
+	kind, err := SlinKind(rate)
+	if err != nil {
+		return dst, err
+	}
+	return AppendMessage(dst, kind, pcm), nil
+}
+
+// AppendUlaw appends a message of G.711 mu-law audio data to dst
+func AppendUlaw(dst, in []byte) []byte {
+	return AppendMessage(dst, KindUlaw, in)
+}
+
+// AppendAlaw appends a message of G.711 A-law audio data to dst
+func AppendAlaw(dst, in []byte) []byte {
+	return AppendMessage(dst, KindAlaw, in)
+}
+
+// AppendOpus appends a message of a single Opus packet to dst
+func AppendOpus(dst, packet []byte) []byte {
+	return AppendMessage(dst, KindOpus, packet)
 }
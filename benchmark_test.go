@@ -0,0 +1,195 @@
+package audiosocket
+
+import (
+	"bytes"
+	"io"
+	"io/ioutil"
+	"net"
+	"testing"
+)
+
+// frameSize is the payload of one 20ms slin message at 8kHz
+const frameSize = DefaultSlinChunkSize
+
+// repeatReader reads the same bytes over and over
+type repeatReader struct {
+	data []byte
+	r    *bytes.Reader
+}
+
+func newRepeatReader(data []byte) *repeatReader {
+	return &repeatReader{data: data, r: bytes.NewReader(data)}
+}
+
+func (r *repeatReader) Read(p []byte) (int, error) {
+	if r.r.Len() == 0 {
+		r.r.Reset(r.data)
+	}
+	return r.r.Read(p)
+}
+
+// slinStream returns a run of 20ms slin messages to be read
+func slinStream() *repeatReader {
+	var stream []byte
+	for i := 0; i < 64; i++ {
+		stream = append(stream, SlinMessage(make([]byte, frameSize))...)
+	}
+	return newRepeatReader(stream)
+}
+
+func BenchmarkNextMessage(b *testing.B) {
+	r := slinStream()
+
+	b.SetBytes(3 + frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := NextMessage(r); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkReaderReadMessage(b *testing.B) {
+	r := NewReader(slinStream())
+
+	b.SetBytes(3 + frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := r.ReadMessage(); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkReaderReadMessageInto(b *testing.B) {
+	r := NewReader(slinStream())
+	var m Message
+	var err error
+
+	b.SetBytes(3 + frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if m, err = r.ReadMessageInto(m); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkStereoDeinterleave(b *testing.B) {
+	m := SlinStereoMessage(make([]byte, 2*frameSize))
+	left, right := make([]byte, frameSize), make([]byte, frameSize)
+
+	b.SetBytes(2 * frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		m.Stereo().Deinterleave(left, right)
+	}
+}
+
+func BenchmarkSlinMessage(b *testing.B) {
+	data := make([]byte, frameSize)
+
+	b.SetBytes(frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		SlinMessage(data)
+	}
+}
+
+func BenchmarkAppendSlin(b *testing.B) {
+	data := make([]byte, frameSize)
+	buf := make([]byte, 0, 3+frameSize)
+
+	b.SetBytes(frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		buf = AppendSlin(buf[:0], data)
+	}
+}
+
+// BenchmarkWriterAppendSlin gathers messages into a Writer, which writes them
+// out sixteen at a time
+func BenchmarkWriterAppendSlin(b *testing.B) {
+	data := make([]byte, frameSize)
+	w := NewWriter(ioutil.Discard, 0, 0)
+
+	b.SetBytes(frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := w.AppendSlin(data); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// BenchmarkSendSlinChunks sends one chunk per operation, which is due straight
+// away, so it measures the cost of setting up a send
+func BenchmarkSendSlinChunks(b *testing.B) {
+	data := make([]byte, frameSize)
+	var w io.Writer = ioutil.Discard
+
+	b.SetBytes(frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := SendSlinChunks(w, frameSize, data); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// benchmarkChunkSender sends one chunk per operation with pacing turned off, so
+// that it measures the cost of writing each chunk
+func benchmarkChunkSender(b *testing.B, w io.Writer) {
+	s, err := NewChunkSender(KindSlin, frameSize)
+	if err != nil {
+		b.Fatal(err)
+	}
+	s.Interval = 0
+	data := make([]byte, frameSize)
+
+	b.SetBytes(frameSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := s.Send(w, data); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkChunkSenderUnpaced(b *testing.B) {
+	benchmarkChunkSender(b, ioutil.Discard)
+}
+
+func BenchmarkChunkSenderUnpacedTCP(b *testing.B) {
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer l.Close() // nolint: errcheck
+
+	go func() {
+		c, err := l.Accept()
+		if err != nil {
+			return
+		}
+		io.Copy(ioutil.Discard, c) // nolint: errcheck
+		c.Close()                  // nolint: errcheck
+	}()
+
+	c, err := net.Dial("tcp", l.Addr().String())
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer c.Close() // nolint: errcheck
+
+	benchmarkChunkSender(b, c)
+}
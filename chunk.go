@@ -1,7 +1,9 @@
 package audiosocket
 
 import (
+	"encoding/binary"
 	"io"
+	"net"
 	"time"
 
 	"github.com/pkg/errors"
@@ -12,29 +14,175 @@ import (
 // transmission of the AudioSocket.
 const DefaultSlinChunkSize = 320 // 8000Hz * 20ms * 2 bytes
 
+// DefaultMaxLate is how far a ChunkSender may fall behind its schedule before
+// it gives up on catching up and starts a new schedule from the current time
+const DefaultMaxLate = 200 * time.Millisecond
+
 // SendSlinChunks takes signed linear data and sends it over an AudioSocket connection in chunks of the given size.
 func SendSlinChunks(w io.Writer, chunkSize int, input []byte) error {
-	var chunks int
-
 	if chunkSize < 1 {
 		chunkSize = DefaultSlinChunkSize
 	}
 
-	t := time.NewTicker(20 * time.Millisecond)
-	defer t.Stop()
+	s, err := NewChunkSender(KindSlin, chunkSize)
+	if err != nil {
+		return err
+	}
+	s.Interval = 20 * time.Millisecond
+
+	return s.Send(w, input)
+}
+
+// ChunkSender sends audio over an AudioSocket connection in chunks, at the pace
+// at which it is played.  Each chunk is written straight from the input, with
+// its header gathered in front of it by a single writev on a TCP or Unix
+// socket.  Chunks are due at fixed offsets from the start of the audio, so the
+// lateness of one wakeup is not carried over to the next.
+//
+// A ChunkSender may be reused, but only for one stream at a time.
+type ChunkSender struct {
+	// Interval is the duration of the audio of each chunk
+	Interval time.Duration
 
-	for i := 0; i < len(input); {
-		<-t.C
-		chunkLen := chunkSize
-		if i+chunkSize > len(input) {
-			chunkLen = len(input) - i
+	// Lead is the number of chunks sent straight away at the start, ahead of
+	// the pace of the audio, so that the queue of Asterisk never runs dry
+	// when a later chunk is sent late
+	Lead int
+
+	// MaxLate is how far the sender may fall behind its schedule before it
+	// starts a new one from the current time, rather than sending the chunks
+	// it missed in a burst.  Zero means DefaultMaxLate.
+	MaxLate time.Duration
+
+	// Sendfile, if set, has SendPrompt send from the framed copy of the prompt
+	// on disk with sendfile, where the writer is a TCP connection
+	Sendfile bool
+
+	kind      Kind
+	chunkSize int
+
+	hdr     [3]byte
+	vec     [2][]byte
+	bufs    net.Buffers
+	scratch []byte
+	timer   *time.Timer
+}
+
+// NewChunkSender creates a ChunkSender for audio of the given kind, sent in
+// chunks of the given number of bytes.  The Interval of each chunk is set from
+// its size and the clock rate of the kind, which must be one of the signed
+// linear or G.711 kinds.
+func NewChunkSender(kind Kind, chunkSize int) (*ChunkSender, error) {
+	if chunkSize < 1 || chunkSize > 65535 {
+		return nil, errors.Errorf("invalid chunk size %d", chunkSize)
+	}
+
+	bps, err := bytesPerSecond(kind)
+	if err != nil {
+		return nil, err
+	}
+
+	return &ChunkSender{
+		Interval:  time.Duration(chunkSize) * time.Second / time.Duration(bps),
+		kind:      kind,
+		chunkSize: chunkSize,
+	}, nil
+}
+
+// bytesPerSecond returns the number of bytes of audio of the given kind which
+// are played each second, for the kinds which may be cut into chunks anywhere
+func bytesPerSecond(kind Kind) (int, error) {
+	switch kind {
+	case KindUlaw, KindAlaw:
+		return 8000, nil
+	default:
+		m := Message{byte(kind)}
+		if m.SampleRate() == 0 {
+			return 0, errors.Errorf("audio of message type %d can not be chunked", kind)
 		}
-		if _, err := w.Write(SlinMessage(input[i : i+chunkLen])); err != nil {
+		return 2 * m.Channels() * m.SampleRate(), nil
+	}
+}
+
+// Send sends the input in chunks, returning once the last one has been written
+func (s *ChunkSender) Send(w io.Writer, input []byte) error {
+	gather := gathers(w)
+	count := (len(input) + s.chunkSize - 1) / s.chunkSize
+
+	return s.pace(count, s.Interval, func(int) error {
+		n := s.chunkSize
+		if n > len(input) {
+			n = len(input)
+		}
+		if err := s.write(w, input[:n], gather); err != nil {
 			return errors.Wrap(err, "failed to write chunk to AudioSocket")
 		}
-		chunks++
-		i += chunkLen
+		input = input[n:]
+		return nil
+	})
+}
+
+// pace calls send for each of the given number of chunks when it is due,
+// returning the first error
+func (s *ChunkSender) pace(count int, interval time.Duration, send func(k int) error) error {
+	maxLate := s.MaxLate
+	if maxLate <= 0 {
+		maxLate = DefaultMaxLate
+	}
+
+	start := time.Now()
+	for k := 0; k < count; k++ {
+		if k >= s.Lead {
+			due := start.Add(time.Duration(k-s.Lead) * interval)
+			if wait := time.Until(due); wait > 0 {
+				s.sleep(wait)
+			} else if -wait > maxLate {
+				// Too far behind to catch up unheard; play on from here
+				start = start.Add(-wait)
+			}
+		}
+
+		if err := send(k); err != nil {
+			return err
+		}
 	}
 
 	return nil
 }
+
+func (s *ChunkSender) sleep(d time.Duration) {
+	if s.timer == nil {
+		s.timer = time.NewTimer(d)
+	} else {
+		s.timer.Reset(d)
+	}
+	<-s.timer.C
+}
+
+func (s *ChunkSender) write(w io.Writer, chunk []byte, gather bool) error {
+	s.hdr[0] = byte(s.kind)
+	binary.BigEndian.PutUint16(s.hdr[1:], uint16(len(chunk)))
+
+	if gather {
+		s.vec[0], s.vec[1] = s.hdr[:], chunk
+		s.bufs = s.vec[:]
+		_, err := s.bufs.WriteTo(w)
+		return err
+	}
+
+	// Anything else may need each message in a single write
+	s.scratch = append(append(s.scratch[:0], s.hdr[:]...), chunk...)
+	_, err := w.Write(s.scratch)
+	return err
+}
+
+// gathers reports whether the writer sends a net.Buffers with one system call,
+// rather than as a separate write for each buffer
+func gathers(w io.Writer) bool {
+	switch w.(type) {
+	case *net.TCPConn, *net.UnixConn:
+		return true
+	default:
+		return false
+	}
+}
@@ -0,0 +1,376 @@
+package audiosocket
+
+import (
+	"bytes"
+	"encoding/binary"
+	"io"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/pkg/errors"
+)
+
+// MaxDatagramSize is the largest datagram of the datagram transport, including
+// its prefix, which Asterisk sends or accepts
+const MaxDatagramSize = 4096
+
+// datagramPrefixLen is the length of the sequence number and timestamp which
+// start every datagram
+const datagramPrefixLen = 6
+
+// datagramLateWindow is how far behind the newest datagram one may be and
+// still be dropped as late, rather than taken as the sender having started its
+// sequence again
+const datagramLateWindow = 1000
+
+// Packet is a message received over the datagram transport
+type Packet struct {
+	// Seq is the sequence number of the datagram
+	Seq uint16
+
+	// Timestamp is the time at which the datagram was sent, in milliseconds since
+	// the sender's first datagram
+	Timestamp uint32
+
+	// Message is the message which the datagram carried
+	Message Message
+}
+
+// PacketConn exchanges the messages of one call over the datagram transport,
+// which Asterisk uses when the AudioSocket `u` option is given.  Each message
+// travels in a UDP datagram of its own, after a two-byte sequence number and a
+// four-byte timestamp.  A datagram which arrives after a newer one is dropped
+// instead of being delivered late.
+//
+// A PacketConn is also an io.ReadWriter of whole messages, so GetID,
+// NextMessage and SendSlinChunks may be used with it unchanged.
+type PacketConn struct {
+	pc   net.PacketConn
+	peer net.Addr
+
+	// in carries the datagrams of the peer when a PacketListener reads the
+	// socket; otherwise the PacketConn reads it itself
+	in     chan []byte
+	l      *PacketListener
+	closed chan struct{}
+	once   sync.Once
+
+	rbuf    []byte
+	buf     []byte
+	seq     uint16
+	started bool
+	ended   bool
+	late    uint64
+	ids     []Message
+
+	wmu   sync.Mutex
+	wseq  uint16
+	start time.Time
+}
+
+// NewPacketConn exchanges the messages of a single call over the given socket.
+// If peer is nil, it is taken from the first datagram received, which Asterisk
+// makes the ID message of the call.  Datagrams from any other address are
+// ignored.  Use a PacketListener to take many calls on one socket.
+func NewPacketConn(pc net.PacketConn, peer net.Addr) *PacketConn {
+	return &PacketConn{
+		pc:     pc,
+		peer:   peer,
+		closed: make(chan struct{}),
+	}
+}
+
+// Peer returns the address of the other end of the call, or nil if nothing has
+// been received from it yet
+func (c *PacketConn) Peer() net.Addr {
+	return c.peer
+}
+
+// Late returns the number of datagrams which were dropped because a newer one
+// had already been received
+func (c *PacketConn) Late() uint64 {
+	return atomic.LoadUint64(&c.late)
+}
+
+// NextPacket reads the next message, along with the sequence number and
+// timestamp of its datagram.  It returns io.EOF once a hangup has been read or
+// the PacketConn has been closed.
+func (c *PacketConn) NextPacket() (*Packet, error) {
+	for {
+		if c.ended {
+			return nil, io.EOF
+		}
+		d, err := c.readDatagram()
+		if err != nil {
+			return nil, err
+		}
+		if len(d) < datagramPrefixLen+3 {
+			continue
+		}
+		m := Message(d[datagramPrefixLen:])
+		if len(m) < m.headerLen() || int(m.ContentLength()) != len(m)-m.headerLen() {
+			// The datagram was truncated or is not an audiosocket message
+			continue
+		}
+
+		seq := binary.BigEndian.Uint16(d)
+		if c.started && int16(seq-c.seq) <= 0 && int16(seq-c.seq) > -datagramLateWindow {
+			atomic.AddUint64(&c.late, 1)
+			continue
+		}
+		c.seq = seq
+		c.started = true
+		if m.Kind() == KindID && c.repeated(m) {
+			continue
+		}
+		if m.Kind() == KindHangup {
+			c.ended = true
+		}
+
+		return &Packet{
+			Seq:       seq,
+			Timestamp: binary.BigEndian.Uint32(d[2:]),
+			Message:   append(Message(nil), m...),
+		}, nil
+	}
+}
+
+// repeated reports whether an ID message has already been read.  Asterisk sends
+// the ID, and its offer of the extended header, again ahead of its first
+// datagrams in case the first was lost.
+func (c *PacketConn) repeated(m Message) bool {
+	for _, id := range c.ids {
+		if bytes.Equal(id, m) {
+			return true
+		}
+	}
+	c.ids = append(c.ids, append(Message(nil), m...))
+	return false
+}
+
+func (c *PacketConn) readDatagram() ([]byte, error) {
+	if c.in != nil {
+		select {
+		case d, ok := <-c.in:
+			if ok {
+				return d, nil
+			}
+		case <-c.closed:
+		}
+		return nil, io.EOF
+	}
+
+	if c.rbuf == nil {
+		c.rbuf = make([]byte, MaxDatagramSize)
+	}
+	for {
+		n, addr, err := c.pc.ReadFrom(c.rbuf)
+		if err != nil {
+			select {
+			case <-c.closed:
+				return nil, io.EOF
+			default:
+				return nil, errors.Wrap(err, "failed to read datagram")
+			}
+		}
+		if c.peer == nil {
+			c.peer = addr
+		} else if addr.String() != c.peer.String() {
+			continue
+		}
+		return c.rbuf[:n], nil
+	}
+}
+
+// Read reads the messages of the call
+func (c *PacketConn) Read(p []byte) (int, error) {
+	if len(c.buf) == 0 {
+		pkt, err := c.NextPacket()
+		if err != nil {
+			return 0, err
+		}
+		c.buf = pkt.Message
+	}
+
+	n := copy(p, c.buf)
+	c.buf = c.buf[n:]
+	return n, nil
+}
+
+// WriteMessage sends a message to the peer in a datagram of its own
+func (c *PacketConn) WriteMessage(m Message) error {
+	if c.peer == nil {
+		return errors.New("no datagram received from the peer yet")
+	}
+	if datagramPrefixLen+len(m) > MaxDatagramSize {
+		return errors.Errorf("message of %d bytes is too large for a datagram", len(m))
+	}
+
+	c.wmu.Lock()
+	defer c.wmu.Unlock()
+
+	if c.wseq == 0 && c.start.IsZero() {
+		c.start = time.Now()
+	}
+	d := make([]byte, datagramPrefixLen, datagramPrefixLen+len(m))
+	binary.BigEndian.PutUint16(d, c.wseq)
+	binary.BigEndian.PutUint32(d[2:], uint32(time.Since(c.start)/time.Millisecond))
+	c.wseq++
+
+	if _, err := c.pc.WriteTo(append(d, m...), c.peer); err != nil {
+		return errors.Wrap(err, "failed to write datagram")
+	}
+	return nil
+}
+
+// Write sends one or more whole messages, each in a datagram of its own
+func (c *PacketConn) Write(p []byte) (int, error) {
+	for off := 0; off < len(p); {
+		m := Message(p[off:])
+		n := m.headerLen()
+		if len(m) >= n {
+			n += int(m.ContentLength())
+		}
+		if len(m) < n {
+			return off, errors.New("partial message written to datagram connection")
+		}
+		if err := c.WriteMessage(m[:n]); err != nil {
+			return off, err
+		}
+		off += n
+	}
+	return len(p), nil
+}
+
+// Close ends the call, sending a hangup to Asterisk.  The socket is closed
+// unless it belongs to a PacketListener.
+func (c *PacketConn) Close() (err error) {
+	c.once.Do(func() {
+		close(c.closed)
+		if c.peer != nil && !c.ended {
+			err = c.WriteMessage(HangupMessage())
+		}
+		if c.l != nil {
+			c.l.remove(c)
+			return
+		}
+		if cerr := c.pc.Close(); err == nil {
+			err = cerr
+		}
+	})
+	return err
+}
+
+// PacketListener takes the calls which Asterisk sends to one UDP socket over
+// the datagram transport, telling them apart by their source address, and
+// hands each new one out through Accept
+type PacketListener struct {
+	pc net.PacketConn
+
+	mu    sync.Mutex
+	conns map[string]*PacketConn
+	err   error
+
+	accept chan *PacketConn
+	done   chan struct{}
+}
+
+// NewPacketListener starts reading datagrams from the given socket
+func NewPacketListener(pc net.PacketConn) *PacketListener {
+	l := &PacketListener{
+		pc:     pc,
+		conns:  make(map[string]*PacketConn),
+		accept: make(chan *PacketConn, 16),
+		done:   make(chan struct{}),
+	}
+	go l.run()
+	return l
+}
+
+// Accept waits for and returns the next call.  It returns an error once the
+// socket has failed or been closed.
+func (l *PacketListener) Accept() (*PacketConn, error) {
+	select {
+	case c := <-l.accept:
+		return c, nil
+	case <-l.done:
+		return nil, l.err
+	}
+}
+
+// Close closes the socket, ending all of its calls
+func (l *PacketListener) Close() error {
+	return l.pc.Close()
+}
+
+func (l *PacketListener) run() {
+	buf := make([]byte, MaxDatagramSize)
+	for {
+		n, addr, err := l.pc.ReadFrom(buf)
+		if err != nil {
+			l.fail(err)
+			return
+		}
+		if n < datagramPrefixLen+3 {
+			continue
+		}
+		l.dispatch(addr, append([]byte(nil), buf[:n]...))
+	}
+}
+
+func (l *PacketListener) dispatch(addr net.Addr, d []byte) {
+	key := addr.String()
+
+	l.mu.Lock()
+	c, ok := l.conns[key]
+	if !ok {
+		if Message(d[datagramPrefixLen:]).Kind() != KindID {
+			// The call has already ended, or its ID was lost, in which case
+			// Asterisk sends it again
+			l.mu.Unlock()
+			return
+		}
+		c = NewPacketConn(l.pc, addr)
+		c.in = make(chan []byte, streamQueueSize)
+		c.l = l
+		l.conns[key] = c
+	}
+	l.mu.Unlock()
+
+	if !ok {
+		select {
+		case l.accept <- c:
+		case <-l.done:
+			return
+		}
+	}
+
+	select {
+	case c.in <- d:
+	default:
+		// The call is not being read quickly enough, so this is already late
+		atomic.AddUint64(&c.late, 1)
+	}
+}
+
+func (l *PacketListener) remove(c *PacketConn) {
+	l.mu.Lock()
+	if l.conns[c.peer.String()] == c {
+		delete(l.conns, c.peer.String())
+	}
+	l.mu.Unlock()
+}
+
+func (l *PacketListener) fail(err error) {
+	l.mu.Lock()
+	l.err = errors.Wrap(err, "datagram socket failed")
+	for key, c := range l.conns {
+		delete(l.conns, key)
+		close(c.in)
+	}
+	l.mu.Unlock()
+
+	close(l.done)
+}
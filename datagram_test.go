@@ -0,0 +1,366 @@
+package audiosocket
+
+import (
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+	"sync"
+	"testing"
+	"time"
+)
+
+// fakeAddr is the address of a fake datagram peer
+type fakeAddr string
+
+func (a fakeAddr) Network() string { return "udp" }
+func (a fakeAddr) String() string  { return string(a) }
+
+// fakeDatagram is a datagram carried by a fakePacketConn
+type fakeDatagram struct {
+	addr net.Addr
+	data []byte
+}
+
+// fakePacketConn is a net.PacketConn which reads the datagrams queued on in
+// and queues those written on out, so that their order is exact
+type fakePacketConn struct {
+	in     chan fakeDatagram
+	out    chan fakeDatagram
+	closed chan struct{}
+	once   sync.Once
+}
+
+func newFakePacketConn() *fakePacketConn {
+	return &fakePacketConn{
+		in:     make(chan fakeDatagram, 64),
+		out:    make(chan fakeDatagram, 64),
+		closed: make(chan struct{}),
+	}
+}
+
+func (c *fakePacketConn) ReadFrom(p []byte) (int, net.Addr, error) {
+	// Whatever was queued is read before the close is noticed
+	select {
+	case d := <-c.in:
+		return copy(p, d.data), d.addr, nil
+	default:
+	}
+	select {
+	case d := <-c.in:
+		return copy(p, d.data), d.addr, nil
+	case <-c.closed:
+		return 0, nil, errors.New("use of closed connection")
+	}
+}
+
+func (c *fakePacketConn) WriteTo(p []byte, addr net.Addr) (int, error) {
+	select {
+	case <-c.closed:
+		return 0, errors.New("use of closed connection")
+	default:
+	}
+	c.out <- fakeDatagram{addr, append([]byte(nil), p...)}
+	return len(p), nil
+}
+
+func (c *fakePacketConn) Close() error {
+	c.once.Do(func() {
+		close(c.closed)
+	})
+	return nil
+}
+
+func (c *fakePacketConn) LocalAddr() net.Addr                { return fakeAddr("local") }
+func (c *fakePacketConn) SetDeadline(t time.Time) error      { return nil }
+func (c *fakePacketConn) SetReadDeadline(t time.Time) error  { return nil }
+func (c *fakePacketConn) SetWriteDeadline(t time.Time) error { return nil }
+
+func (c *fakePacketConn) send(from string, seq uint16, m Message) {
+	c.in <- fakeDatagram{fakeAddr(from), datagram(seq, 0, m)}
+}
+
+func (c *fakePacketConn) written(t *testing.T) fakeDatagram {
+	select {
+	case d := <-c.out:
+		return d
+	case <-time.After(testTimeout):
+		t.Fatal("nothing written")
+	}
+	return fakeDatagram{}
+}
+
+// datagram builds a datagram of the datagram transport
+func datagram(seq uint16, ts uint32, m Message) []byte {
+	d := make([]byte, datagramPrefixLen, datagramPrefixLen+len(m))
+	binary.BigEndian.PutUint16(d, seq)
+	binary.BigEndian.PutUint32(d[2:], ts)
+	return append(d, m...)
+}
+
+func TestPacketConnSequence(t *testing.T) {
+	tests := []struct {
+		name string
+		seqs []uint16
+		want []uint16
+		late uint64
+	}{
+		{"in order", []uint16{1, 2, 3}, []uint16{1, 2, 3}, 0},
+		{"late", []uint16{5, 3, 6}, []uint16{5, 6}, 1},
+		{"duplicate", []uint16{5, 5, 6}, []uint16{5, 6}, 1},
+		{"gap", []uint16{5, 9, 7, 10}, []uint16{5, 9, 10}, 1},
+		{"wrap", []uint16{65534, 65535, 0, 1}, []uint16{65534, 65535, 0, 1}, 0},
+		{"late across wrap", []uint16{0, 65535, 1}, []uint16{0, 1}, 1},
+		{"restart", []uint16{5000, 2, 3}, []uint16{5000, 2, 3}, 0},
+	}
+	for _, tt := range tests {
+		pc := newFakePacketConn()
+		c := NewPacketConn(pc, fakeAddr("asterisk"))
+		for _, seq := range tt.seqs {
+			pc.send("asterisk", seq, SlinMessage([]byte{byte(seq), byte(seq >> 8)}))
+		}
+		pc.Close() // nolint: errcheck
+
+		var got []uint16
+		for {
+			pkt, err := c.NextPacket()
+			if err != nil {
+				break
+			}
+			if want := []byte{byte(pkt.Seq), byte(pkt.Seq >> 8)}; !bytes.Equal(pkt.Message.Payload(), want) {
+				t.Errorf("%s: datagram %d carried %x", tt.name, pkt.Seq, pkt.Message.Payload())
+			}
+			got = append(got, pkt.Seq)
+		}
+		if len(got) != len(tt.want) {
+			t.Errorf("%s: got %v, want %v", tt.name, got, tt.want)
+		} else {
+			for i := range got {
+				if got[i] != tt.want[i] {
+					t.Errorf("%s: got %v, want %v", tt.name, got, tt.want)
+					break
+				}
+			}
+		}
+		if c.Late() != tt.late {
+			t.Errorf("%s: %d late, want %d", tt.name, c.Late(), tt.late)
+		}
+	}
+}
+
+func TestPacketConnRead(t *testing.T) {
+	pc := newFakePacketConn()
+	c := NewPacketConn(pc, nil)
+
+	if err := c.WriteMessage(HangupMessage()); err == nil {
+		t.Error("write succeeded before anything was received from the peer")
+	}
+
+	pc.in <- fakeDatagram{fakeAddr("asterisk"), datagram(0, 7, IDMessage(testID))}
+	// From another address, truncated, and too short to hold a message
+	pc.send("stranger", 1, SlinMessage([]byte{9, 9}))
+	pc.send("asterisk", 1, SlinMessage([]byte{9, 9})[:4])
+	pc.in <- fakeDatagram{fakeAddr("asterisk"), []byte{0, 1, 0, 0, 0, 0, KindSlin}}
+	pc.send("asterisk", 2, SlinMessage([]byte{1, 2}))
+	pc.send("asterisk", 3, HangupMessage())
+	pc.send("asterisk", 4, SlinMessage([]byte{3, 4}))
+
+	pkt, err := c.NextPacket()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if pkt.Seq != 0 || pkt.Timestamp != 7 {
+		t.Errorf("got sequence %d timestamp %d, want 0 and 7", pkt.Seq, pkt.Timestamp)
+	}
+	if id, err := pkt.Message.ID(); err != nil || id != testID {
+		t.Errorf("got ID %v, %v", id, err)
+	}
+	if c.Peer() == nil || c.Peer().String() != "asterisk" {
+		t.Errorf("peer is %v, want the sender of the first datagram", c.Peer())
+	}
+
+	m, err := NextMessage(c)
+	if err != nil || !bytes.Equal(m, SlinMessage([]byte{1, 2})) {
+		t.Fatalf("got %x, %v", m, err)
+	}
+	m, err = NextMessage(c)
+	if err != nil || m.Kind() != KindHangup {
+		t.Fatalf("got %x, %v, want a hangup", m, err)
+	}
+	if _, err := c.NextPacket(); err != io.EOF {
+		t.Fatalf("got %v after the hangup, want io.EOF", err)
+	}
+}
+
+func TestPacketConnWrite(t *testing.T) {
+	pc := newFakePacketConn()
+	c := NewPacketConn(pc, fakeAddr("asterisk"))
+
+	if _, err := c.Write(append(SlinMessage([]byte{1, 2}), SlinMessage([]byte{3, 4})...)); err != nil {
+		t.Fatal(err)
+	}
+	for i, want := range []Message{SlinMessage([]byte{1, 2}), SlinMessage([]byte{3, 4})} {
+		d := pc.written(t)
+		if d.addr.String() != "asterisk" {
+			t.Errorf("datagram %d sent to %v", i, d.addr)
+		}
+		if seq := binary.BigEndian.Uint16(d.data); seq != uint16(i) {
+			t.Errorf("datagram %d has sequence %d", i, seq)
+		}
+		if !bytes.Equal(d.data[datagramPrefixLen:], want) {
+			t.Errorf("datagram %d carried %x, want %x", i, d.data[datagramPrefixLen:], want)
+		}
+	}
+
+	// The largest message which fits, and one byte more
+	payload := make([]byte, MaxDatagramSize-datagramPrefixLen-3)
+	if err := c.WriteMessage(SlinMessage(payload)); err != nil {
+		t.Errorf("failed to send a message which fits: %v", err)
+	} else if d := pc.written(t); len(d.data) != MaxDatagramSize {
+		t.Errorf("sent a datagram of %d bytes, want %d", len(d.data), MaxDatagramSize)
+	}
+	if err := c.WriteMessage(SlinMessage(append(payload, 0))); err == nil {
+		t.Error("sent a message too large for a datagram")
+	}
+	if _, err := c.Write(SlinMessage([]byte{1, 2})[:4]); err == nil {
+		t.Error("sent part of a message")
+	}
+
+	// Closing hangs up, and closes a socket of its own
+	if err := c.Close(); err != nil {
+		t.Fatal(err)
+	}
+	if d := pc.written(t); Message(d.data[datagramPrefixLen:]).Kind() != KindHangup {
+		t.Errorf("sent %x on close, want a hangup", d.data)
+	}
+	select {
+	case <-pc.closed:
+	default:
+		t.Error("socket left open")
+	}
+}
+
+func acceptPacketConn(t *testing.T, l *PacketListener) *PacketConn {
+	type result struct {
+		c   *PacketConn
+		err error
+	}
+	ch := make(chan result, 1)
+	go func() {
+		c, err := l.Accept()
+		ch <- result{c, err}
+	}()
+
+	select {
+	case r := <-ch:
+		if r.err != nil {
+			t.Fatalf("failed to accept call: %v", r.err)
+		}
+		return r.c
+	case <-time.After(testTimeout):
+		t.Fatal("no call accepted")
+	}
+	return nil
+}
+
+func TestPacketListener(t *testing.T) {
+	pc := newFakePacketConn()
+	l := NewPacketListener(pc)
+
+	pc.send("a", 0, IDMessage(testID))
+	pc.send("b", 0, IDMessage(testID))
+	// A call whose ID was lost
+	pc.send("c", 1, SlinMessage([]byte{0xc, 0xc}))
+	pc.send("a", 1, SlinMessage([]byte{0xa, 0xa}))
+	pc.send("b", 1, SlinMessage([]byte{0xb, 0xb}))
+
+	a := acceptPacketConn(t, l)
+	b := acceptPacketConn(t, l)
+	if a.Peer().String() != "a" || b.Peer().String() != "b" {
+		t.Fatalf("accepted calls from %v and %v, want a and b", a.Peer(), b.Peer())
+	}
+	for c, want := range map[*PacketConn][]byte{a: {0xa, 0xa}, b: {0xb, 0xb}} {
+		if id, err := GetID(c); err != nil || id != testID {
+			t.Fatalf("call from %v: got ID %v, %v", c.Peer(), id, err)
+		}
+		m, err := NextMessage(c)
+		if err != nil {
+			t.Fatalf("call from %v: %v", c.Peer(), err)
+		}
+		if !bytes.Equal(m.Payload(), want) {
+			t.Errorf("call from %v got payload %x, want %x", c.Peer(), m.Payload(), want)
+		}
+	}
+
+	// Closing a call hangs it up, but leaves the socket to the others
+	if err := a.Close(); err != nil {
+		t.Fatal(err)
+	}
+	if d := pc.written(t); d.addr.String() != "a" || Message(d.data[datagramPrefixLen:]).Kind() != KindHangup {
+		t.Errorf("sent %x to %v on close, want a hangup to a", d.data, d.addr)
+	}
+	select {
+	case <-pc.closed:
+		t.Fatal("socket closed with a call")
+	default:
+	}
+
+	// A new call from the same address is a call of its own
+	pc.send("a", 0, IDMessage(testID))
+	if c := acceptPacketConn(t, l); c == a {
+		t.Error("the closed call was handed out again")
+	}
+
+	if err := l.Close(); err != nil {
+		t.Fatal(err)
+	}
+	if _, err := l.Accept(); err == nil {
+		t.Error("Accept succeeded after Close")
+	}
+	if _, err := b.NextPacket(); err != io.EOF {
+		t.Errorf("got %v from a call of a closed listener, want io.EOF", err)
+	}
+}
+
+func TestPacketListenerLostID(t *testing.T) {
+	pc := newFakePacketConn()
+	l := NewPacketListener(pc)
+	defer l.Close() // nolint: errcheck
+
+	// The first ID is lost, and Asterisk repeats it, with its offer, ahead of
+	// each datagram until it hears from the server
+	pc.send("a", 2, SlinMessage([]byte{1, 1}))
+	pc.send("a", 3, IDMessage(testID))
+	pc.send("a", 4, IDFlagsMessage(IDFlagExtended))
+	pc.send("a", 5, SlinMessage([]byte{2, 2}))
+	pc.send("a", 6, IDMessage(testID))
+	pc.send("a", 7, IDFlagsMessage(IDFlagExtended))
+	pc.send("a", 8, SlinMessage([]byte{3, 3}))
+
+	c := acceptPacketConn(t, l)
+	if id, err := GetID(c); err != nil || id != testID {
+		t.Fatalf("got ID %v, %v", id, err)
+	}
+	want := []Message{IDFlagsMessage(IDFlagExtended), SlinMessage([]byte{2, 2}),
+		SlinMessage([]byte{3, 3})}
+	for i, w := range want {
+		m, err := NextMessage(c)
+		if err != nil {
+			t.Fatalf("message %d: %v", i, err)
+		}
+		if !bytes.Equal(m, w) {
+			t.Errorf("message %d: got %x, want %x", i, m, w)
+		}
+	}
+	if c.Late() != 0 {
+		t.Errorf("%d late, want none", c.Late())
+	}
+
+	// The repeats are not taken as calls of their own
+	select {
+	case c := <-l.accept:
+		t.Errorf("accepted a second call from %v", c.Peer())
+	default:
+	}
+}
@@ -0,0 +1,69 @@
+package audiosocket
+
+// Control is a call event carried by a KindControl message
+type Control byte
+
+const (
+	// ControlAnswer indicates that the call was answered
+	ControlAnswer = 0x01
+
+	// ControlHold indicates that the call was put on hold
+	ControlHold = 0x02
+
+	// ControlUnhold indicates that the call was taken off hold
+	ControlUnhold = 0x03
+)
+
+// DTMFMessage creates a new Message for the end of a DTMF digit, which is the
+// only DTMF message a server need send.  A server may send the start of the
+// digit before it, with DTMFBeginMessage, as Asterisk does.
+func DTMFMessage(digit byte) Message {
+	return AppendDTMF(make([]byte, 0, 3+1), digit)
+}
+
+// AppendDTMF appends a message for the end of a DTMF digit to dst
+func AppendDTMF(dst []byte, digit byte) []byte {
+	return append(dst, KindDTMF, 0x00, 0x01, digit)
+}
+
+// DTMFBeginMessage creates a new Message for the start of a DTMF digit
+func DTMFBeginMessage(digit byte) Message {
+	return AppendDTMFBegin(make([]byte, 0, 3+1), digit)
+}
+
+// AppendDTMFBegin appends a message for the start of a DTMF digit to dst
+func AppendDTMFBegin(dst []byte, digit byte) []byte {
+	return append(dst, KindDTMFBegin, 0x00, 0x01, digit)
+}
+
+// DTMF returns the digit of a KindDTMF or KindDTMFBegin message, or 0 for any
+// other message
+func (m Message) DTMF() byte {
+	p := m.Payload()
+	if (m.Kind() != KindDTMF && m.Kind() != KindDTMFBegin) || len(p) < 1 {
+		return 0
+	}
+
+	return p[0]
+}
+
+// ControlMessage creates a new Message for a call event
+func ControlMessage(c Control) Message {
+	return AppendControl(make([]byte, 0, 3+1), c)
+}
+
+// AppendControl appends a message for a call event to dst
+func AppendControl(dst []byte, c Control) []byte {
+	return append(dst, KindControl, 0x00, 0x01, byte(c))
+}
+
+// Control returns the event of a KindControl message, or 0 for any other
+// message
+func (m Message) Control() Control {
+	p := m.Payload()
+	if m.Kind() != KindControl || len(p) < 1 {
+		return 0
+	}
+
+	return Control(p[0])
+}
@@ -0,0 +1,11 @@
+//go:build windows
+// +build windows
+
+package main
+
+import "time"
+
+// cpuTime is not measured on this platform
+func cpuTime() time.Duration {
+	return 0
+}
@@ -0,0 +1,345 @@
+// Command loadgen opens many concurrent AudioSocket sessions to a server, in
+// the way Asterisk would, and streams real-time signed linear audio over each
+// of them while reading what the server sends back.  Every few seconds it
+// reports the frames sent and received per second, the latency of the frames
+// which the server echoes, and the CPU used by the generator itself.
+//
+// Run it with -listen to have it serve the other end instead, echoing the
+// audio of every session back to its sender.  The latency reported is then the
+// round trip through the TCP stack and the echo server.
+package main
+
+import (
+	"context"
+	"encoding/binary"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"math"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/CyCoreSystems/audiosocket"
+	"github.com/gofrs/uuid"
+	"github.com/pkg/errors"
+)
+
+// frameInterval is the duration of the audio of each frame sent
+const frameInterval = 20 * time.Millisecond
+
+// stampMagic marks a frame which carries the time at which it was sent
+const stampMagic = 0x41534c47 // "ASLG"
+
+// stampLen is the length of the magic and the send time at the start of a frame
+const stampLen = 12
+
+// latencyBucket is the resolution of the latency histogram
+const latencyBucket = 100 * time.Microsecond
+
+// latencyBuckets is the number of buckets of the latency histogram, which
+// covers latencies of up to one second
+const latencyBuckets = int(time.Second / latencyBucket)
+
+var (
+	server   = flag.String("server", "localhost:8080", "address of the AudioSocket server to load")
+	listen   = flag.String("listen", "", "serve this address, echoing the audio of every session, instead of generating load")
+	sessions = flag.Int("n", 1000, "number of concurrent sessions")
+	duration = flag.Duration("d", time.Minute, "how long to keep the sessions open")
+	ramp     = flag.Duration("ramp", 5*time.Second, "time over which to open the sessions")
+	rate     = flag.Int("rate", 8000, "sample rate of the audio sent: 8000, 16000, 24000 or 48000")
+	interval = flag.Duration("interval", 5*time.Second, "time between reports")
+)
+
+// stats are the counters of all sessions
+type stats struct {
+	open     int64
+	failed   int64
+	sent     uint64
+	received uint64
+	latency  [latencyBuckets + 1]uint64
+}
+
+func (s *stats) addLatency(d time.Duration) {
+	i := int(d / latencyBucket)
+	if i < 0 {
+		i = 0
+	}
+	if i > latencyBuckets {
+		i = latencyBuckets
+	}
+	atomic.AddUint64(&s.latency[i], 1)
+}
+
+// percentile returns the upper bound of the given percentile of the
+// latencies recorded since the histogram was last copied into prev, which it
+// is updated to
+func (s *stats) percentile(prev *[latencyBuckets + 1]uint64, percents ...int) []time.Duration {
+	var cur [latencyBuckets + 1]uint64
+	var total uint64
+	for i := range cur {
+		cur[i] = atomic.LoadUint64(&s.latency[i]) - prev[i]
+		prev[i] += cur[i]
+		total += cur[i]
+	}
+
+	out := make([]time.Duration, len(percents))
+	for j, p := range percents {
+		if total == 0 {
+			continue
+		}
+		want := (total*uint64(p) + 99) / 100
+		var seen uint64
+		for i, n := range cur {
+			seen += n
+			if seen >= want {
+				out[j] = time.Duration(i+1) * latencyBucket
+				break
+			}
+		}
+	}
+	return out
+}
+
+func main() {
+	flag.Parse()
+
+	if *listen != "" {
+		if err := serve(*listen); err != nil {
+			log.Fatalln("echo server failed:", err)
+		}
+		return
+	}
+
+	if _, err := audiosocket.SlinKind(*rate); err != nil {
+		log.Fatalln(err)
+	}
+
+	ctx, cancel := context.WithTimeout(context.Background(), *ramp+*duration)
+	defer cancel()
+
+	s := new(stats)
+	start := time.Now()
+	var wg sync.WaitGroup
+	for i := 0; i < *sessions; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+
+			// Spread the connection attempts over the ramp
+			select {
+			case <-time.After(*ramp * time.Duration(i) / time.Duration(*sessions)):
+			case <-ctx.Done():
+				return
+			}
+			if err := session(ctx, s, start); err != nil {
+				atomic.AddInt64(&s.failed, 1)
+				log.Println("session failed:", err)
+			}
+		}(i)
+	}
+
+	done := make(chan struct{})
+	go func() {
+		wg.Wait()
+		close(done)
+	}()
+	report(s, start, done)
+}
+
+// report prints the counters every interval, and all of them once the sessions
+// are done
+func report(s *stats, start time.Time, done <-chan struct{}) {
+	var prevLatency, allLatency [latencyBuckets + 1]uint64
+	var prevSent, prevReceived uint64
+	prevCPU := cpuTime()
+	prevTime := start
+
+	t := time.NewTicker(*interval)
+	defer t.Stop()
+
+	for {
+		final := false
+		select {
+		case <-t.C:
+		case <-done:
+			final = true
+		}
+
+		now := time.Now()
+		cpu := cpuTime()
+		sent, received := atomic.LoadUint64(&s.sent), atomic.LoadUint64(&s.received)
+		elapsed := now.Sub(prevTime).Seconds()
+		p := s.percentile(&prevLatency, 50, 99)
+
+		fmt.Printf("%6.0fs open %d failed %d  sent %.0f/s received %.0f/s  latency p50 %v p99 %v  cpu %.1f%%\n",
+			now.Sub(start).Seconds(), atomic.LoadInt64(&s.open), atomic.LoadInt64(&s.failed),
+			float64(sent-prevSent)/elapsed, float64(received-prevReceived)/elapsed,
+			p[0], p[1], 100*(cpu-prevCPU).Seconds()/elapsed)
+
+		prevSent, prevReceived, prevCPU, prevTime = sent, received, cpu, now
+
+		if final {
+			total := now.Sub(start).Seconds()
+			p = s.percentile(&allLatency, 50, 99)
+			fmt.Printf("total: sent %d (%.0f/s) received %d (%.0f/s)  latency p50 %v p99 %v  cpu %.1f%%  failed %d\n",
+				sent, float64(sent)/total, received, float64(received)/total,
+				p[0], p[1], 100*cpu.Seconds()/total, atomic.LoadInt64(&s.failed))
+			return
+		}
+	}
+}
+
+// tone returns one frame of a 440Hz tone at the given sample rate
+func tone(rate int) []byte {
+	samples := rate * int(frameInterval/time.Millisecond) / 1000
+	out := make([]byte, 2*samples)
+	for i := 0; i < samples; i++ {
+		v := int16(8000 * math.Sin(2*math.Pi*440*float64(i)/float64(rate)))
+		binary.LittleEndian.PutUint16(out[2*i:], uint16(v))
+	}
+	return out
+}
+
+// session acts as Asterisk for one call until the context ends
+func session(ctx context.Context, s *stats, start time.Time) error {
+	var d net.Dialer
+	c, err := d.DialContext(ctx, "tcp", *server)
+	if err != nil {
+		return errors.Wrap(err, "failed to connect")
+	}
+	defer c.Close() // nolint: errcheck
+
+	id, err := uuid.NewV4()
+	if err != nil {
+		return errors.Wrap(err, "failed to generate call ID")
+	}
+	if _, err = c.Write(audiosocket.IDMessage(id)); err != nil {
+		return errors.Wrap(err, "failed to send call ID")
+	}
+
+	atomic.AddInt64(&s.open, 1)
+	defer atomic.AddInt64(&s.open, -1)
+
+	readErr := make(chan error, 1)
+	go func() {
+		readErr <- receive(c, s, start)
+	}()
+
+	// The same message is sent each time, with a new stamp
+	m, err := audiosocket.SlinRateMessage(*rate, tone(*rate))
+	if err != nil {
+		return err
+	}
+	binary.BigEndian.PutUint32(m[3:], stampMagic)
+
+	// Keep to the pace of the audio, rather than to the ticks of a timer which
+	// may be late under load
+	next := time.Now()
+	for {
+		binary.BigEndian.PutUint64(m[7:], uint64(time.Since(start)))
+		if _, err = c.Write(m); err != nil {
+			return errors.Wrap(err, "failed to send audio")
+		}
+		atomic.AddUint64(&s.sent, 1)
+
+		next = next.Add(frameInterval)
+		if late := time.Since(next); late > frameInterval {
+			// Give up on the frames which were missed rather than bursting them
+			next = next.Add(late.Truncate(frameInterval))
+		}
+		select {
+		case <-time.After(time.Until(next)):
+		case err = <-readErr:
+			return err
+		case <-ctx.Done():
+			if _, err = c.Write(audiosocket.HangupMessage()); err != nil {
+				return errors.Wrap(err, "failed to send hangup")
+			}
+			return nil
+		}
+	}
+}
+
+// receive reads what the server sends for a session, measuring the latency of
+// the frames it echoes
+func receive(c net.Conn, s *stats, start time.Time) error {
+	r := audiosocket.NewReader(c)
+	for {
+		m, err := r.ReadMessage()
+		if err != nil {
+			if err == io.EOF {
+				return nil
+			}
+			return errors.Wrap(err, "failed to receive")
+		}
+
+		switch m.Kind() {
+		case audiosocket.KindHangup:
+			return errors.New("server hung up")
+		case audiosocket.KindError:
+			return errors.Errorf("server sent error %d", m.ErrorCode())
+		}
+		if !m.IsAudio() {
+			continue
+		}
+
+		atomic.AddUint64(&s.received, 1)
+		if p := m.Payload(); len(p) >= stampLen && binary.BigEndian.Uint32(p) == stampMagic {
+			s.addLatency(time.Since(start) - time.Duration(binary.BigEndian.Uint64(p[4:])))
+		}
+	}
+}
+
+// serve echoes the audio of every session accepted on the given address
+func serve(addr string) error {
+	l, err := net.Listen("tcp", addr)
+	if err != nil {
+		return errors.Wrapf(err, "failed to bind listener to socket %s", addr)
+	}
+	log.Println("echoing AudioSocket sessions on", addr)
+
+	for {
+		c, err := l.Accept()
+		if err != nil {
+			return errors.Wrap(err, "failed to accept new connection")
+		}
+		go echo(c)
+	}
+}
+
+func echo(c net.Conn) {
+	defer c.Close() // nolint: errcheck
+
+	r := audiosocket.NewReader(c)
+	m, err := r.ReadMessage()
+	if err == nil {
+		_, err = m.ID()
+	}
+	if err != nil {
+		log.Println("failed to get call ID:", err)
+		return
+	}
+
+	for {
+		m, err = r.ReadMessage()
+		if err != nil {
+			if err != io.EOF {
+				log.Println("failed to receive:", err)
+			}
+			return
+		}
+		if m.Kind() == audiosocket.KindHangup {
+			return
+		}
+		if !m.IsAudio() {
+			continue
+		}
+		if _, err = c.Write(m); err != nil {
+			log.Println("failed to echo audio:", err)
+			return
+		}
+	}
+}
@@ -2,15 +2,13 @@ package main
 
 import (
 	"context"
-	"io"
-	"io/ioutil"
 	"log"
-	"net"
+	"os"
+	"os/signal"
+	"syscall"
 	"time"
 
 	"github.com/CyCoreSystems/audiosocket"
-	"github.com/gofrs/uuid"
-	"github.com/pkg/errors"
 )
 
 // MaxCallDuration is the maximum amount of time to allow a call to be up before it is terminated.
@@ -28,145 +26,77 @@ const slinChunkSize = 320 // 8000Hz * 20ms * 2 bytes
 
 var fileName string
 
-var audioData []byte
-
-func init() {
-}
-
-// ErrHangup indicates that the call should be terminated or has been terminated
-var ErrHangup = errors.New("Hangup")
+var prompt *audiosocket.Prompt
 
 func main() {
 	var err error
 
-	ctx := context.Background()
-
-	// load the audio file data
+	// load the audio file data, framed once for every call
 	if fileName == "" {
 		fileName = "test.slin"
 	}
-	audioData, err = ioutil.ReadFile(fileName)
+	prompts, err := audiosocket.NewPromptCache("", audiosocket.KindSlin, slinChunkSize)
 	if err != nil {
-		log.Fatalln("failed to read audio file:", err)
-	}
-
-	log.Println("listening for AudioSocket connections on", listenAddr)
-	if err = Listen(ctx); err != nil {
-		log.Fatalln("listen failure:", err)
+		log.Fatalln("failed to create prompt cache:", err)
 	}
-	log.Println("exiting")
-}
+	defer prompts.Close() // nolint: errcheck
 
-// Listen listens for and responds to AudioSocket connections
-func Listen(ctx context.Context) error {
-	l, err := net.Listen("tcp", listenAddr)
+	prompt, err = prompts.Get(fileName)
 	if err != nil {
-		return errors.Wrapf(err, "failed to bind listener to socket %s", listenAddr)
+		log.Fatalln("failed to read audio file:", err)
 	}
 
-	for {
-		conn, err := l.Accept()
-		if err != nil {
-			log.Println("failed to accept new connection:", err)
-			continue
-		}
-
-		go Handle(ctx, conn)
+	srv := &audiosocket.Server{
+		Addr:    listenAddr,
+		Handler: audiosocket.HandlerFunc(Handle),
 	}
-}
 
-// Handle processes a call
-func Handle(pCtx context.Context, c net.Conn) {
-	ctx, cancel := context.WithTimeout(pCtx, MaxCallDuration)
-
-	defer func() {
-		cancel()
+	go func() {
+		sig := make(chan os.Signal, 1)
+		signal.Notify(sig, os.Interrupt, syscall.SIGTERM)
+		<-sig
 
-		if _, err := c.Write(audiosocket.HangupMessage()); err != nil {
-			log.Println("failed to send hangup message:", err)
+		log.Println("draining calls")
+		ctx, cancel := context.WithTimeout(context.Background(), MaxCallDuration)
+		defer cancel()
+		if err := srv.Shutdown(ctx); err != nil {
+			log.Println("hung up remaining calls:", err)
 		}
-
 	}()
 
-	id, err := audiosocket.GetID(c)
-	if err != nil {
-		log.Println("failed to get call ID:", err)
-		return
+	log.Println("listening for AudioSocket connections on", listenAddr)
+	if err = srv.ListenAndServe(); err != audiosocket.ErrServerClosed {
+		log.Fatalln("listen failure:", err)
 	}
-	log.Printf("processing call %s", id.String())
+	log.Println("exiting")
+}
 
-	go processDataFromAsterisk(ctx, cancel, c)
+// Handle processes a call
+func Handle(s *audiosocket.Session) {
+	log.Printf("processing call %s", s.ID.String())
+
+	go processDataFromAsterisk(s)
 
 	log.Println("sending audio")
-	if err = sendAudio(c, audioData); err != nil {
+	if err := audiosocket.PlayPrompt(s, prompt); err != nil {
 		log.Println("failed to send audio to Asterisk:", err)
 	}
 	log.Println("completed audio send")
-	return
-}
-
-func getCallID(c net.Conn) (uuid.UUID, error) {
-	m, err := audiosocket.NextMessage(c)
-	if err != nil {
-		return uuid.Nil, err
-	}
-
-	if m.Kind() != audiosocket.KindID {
-		return uuid.Nil, errors.Errorf("invalid message type %d getting CallID", m.Kind())
-	}
-
-	return uuid.FromBytes(m.Payload())
 }
 
-func processDataFromAsterisk(ctx context.Context, cancel context.CancelFunc, in io.Reader) {
-	var err error
-	var m audiosocket.Message
-
-	defer cancel()
-
-	for ctx.Err() == nil {
-		m, err = audiosocket.NextMessage(in)
-		if errors.Cause(err) == io.EOF {
-			log.Println("audiosocket closed")
-			return
-		}
+func processDataFromAsterisk(s *audiosocket.Session) {
+	for m := range s.Messages() {
 		switch m.Kind() {
-		case audiosocket.KindHangup:
-			log.Println("audiosocket received hangup command")
-			return
 		case audiosocket.KindError:
 			log.Println("error from audiosocket")
 		case audiosocket.KindSlin:
 			if m.ContentLength() < 1 {
 				log.Println("no audio data")
 			}
+		case audiosocket.KindDTMF:
+			log.Printf("caller pressed %c", m.DTMF())
 		default:
 		}
 	}
-}
-
-func sendAudio(w io.Writer, data []byte) error {
-
-	var i, chunks int
-
-	t := time.NewTicker(20 * time.Millisecond)
-	defer t.Stop()
-
-	for range t.C {
-		if i >= len(data) {
-			return nil
-		}
-
-		var chunkLen = slinChunkSize
-		if i+slinChunkSize > len(data) {
-			chunkLen = len(data) - i
-		}
-		if _, err := w.Write(audiosocket.SlinMessage(data[i : i+chunkLen])); err != nil {
-			return errors.Wrap(err, "failed to write chunk to audiosocket")
-		}
-		chunks++
-		i += chunkLen
-
-	}
-	return errors.New("ticker unexpectedly stopped")
+	log.Println("audiosocket closed")
 }
@@ -0,0 +1,81 @@
+package audiosocket
+
+import "encoding/binary"
+
+// extendedLen is the length of the sequence number and timestamp which follow
+// the three-byte header of an extended message
+const extendedLen = 6
+
+// IDFlagExtended is set in the flags of the ID message which Asterisk sends
+// after its UUID to offer the extended header, and in the one a server sends
+// back to accept it.  Once it has been accepted, every message Asterisk sends
+// but an ID or an error is extended, and it measures the round trip of those
+// the server sends back extended.
+const IDFlagExtended = 0x01
+
+// IDFlagsMessage creates an ID message which carries flags in place of a UUID,
+// such as the one with which a server accepts the extended header
+func IDFlagsMessage(flags byte) Message {
+	return newMessage(KindID, []byte{flags})
+}
+
+// Extended indicates whether the header of the message is extended by a
+// sequence number and a timestamp
+func (m Message) Extended() bool {
+	return len(m) > 0 && m[0] != KindError && m[0]&KindExtended != 0
+}
+
+// headerLen returns the length of the header of the message, including its
+// extension
+func (m Message) headerLen() int {
+	if m.Extended() {
+		return 3 + extendedLen
+	}
+	return 3
+}
+
+// Seq returns the sequence number of an extended message, which counts the
+// messages its sender has extended, or 0 if the message is not extended
+func (m Message) Seq() uint16 {
+	if !m.Extended() || len(m) < 3+extendedLen {
+		return 0
+	}
+	return binary.BigEndian.Uint16(m[3:5])
+}
+
+// Timestamp returns the timestamp of an extended message, or 0 if the message
+// is not extended.  In a message from Asterisk, it is the number of
+// milliseconds since Asterisk sent its first extended message for the call.
+// In a message to Asterisk, it is the timestamp of the newest message the
+// server had received when it sent the message, which Asterisk uses to measure
+// the round trip.
+func (m Message) Timestamp() uint32 {
+	if !m.Extended() || len(m) < 3+extendedLen {
+		return 0
+	}
+	return binary.BigEndian.Uint32(m[5:9])
+}
+
+// OffersExtended indicates whether the message is an ID message carrying the
+// flag with which Asterisk offers the extended header, or a server accepts it
+func (m Message) OffersExtended() bool {
+	p := m.Payload()
+	return m.Kind() == KindID && len(p) == 1 && p[0]&IDFlagExtended != 0
+}
+
+// Extend returns a copy of the message with its header extended by the given
+// sequence number and timestamp.  A message which is already extended has them
+// replaced.  An error message can not be extended and is returned as it is.
+func (m Message) Extend(seq uint16, ts uint32) Message {
+	if len(m) < 3 || m.Kind() == KindError {
+		return m
+	}
+
+	p := m.Payload()
+	out := make([]byte, 3+extendedLen, 3+extendedLen+len(p))
+	out[0] = byte(m.Kind()) | KindExtended
+	copy(out[1:3], m[1:3])
+	binary.BigEndian.PutUint16(out[3:], seq)
+	binary.BigEndian.PutUint32(out[5:], ts)
+	return append(out, p...)
+}
@@ -0,0 +1,148 @@
+package audiosocket
+
+import (
+	"bytes"
+	"io"
+	"testing"
+)
+
+func TestExtendedFraming(t *testing.T) {
+	slin := SlinMessage([]byte{1, 2, 3, 4})
+	errMsg := Message{KindError, 0x00, 0x01, ErrAstFrameForwarding}
+
+	tests := []struct {
+		name      string
+		m         Message
+		kind      Kind
+		extended  bool
+		headerLen int
+		seq       uint16
+		ts        uint32
+		payload   []byte
+	}{
+		{"plain", slin, KindSlin, false, 3, 0, 0, []byte{1, 2, 3, 4}},
+		{"extended", slin.Extend(0x0102, 0x03040506), KindSlin, true, 9, 0x0102, 0x03040506,
+			[]byte{1, 2, 3, 4}},
+		{"re-extended", slin.Extend(1, 2).Extend(3, 4), KindSlin, true, 9, 3, 4,
+			[]byte{1, 2, 3, 4}},
+		{"extended hangup", HangupMessage().Extend(9, 10), KindHangup, true, 9, 9, 10, nil},
+		{"extended stereo", SlinStereoMessage([]byte{1, 2, 3, 4}).Extend(1, 1), KindSlinStereo,
+			true, 9, 1, 1, []byte{1, 2, 3, 4}},
+		// 0xff has the extended bit set, but is an error and never extended
+		{"error", errMsg, KindError, false, 3, 0, 0, []byte{ErrAstFrameForwarding}},
+		{"error not extended", errMsg.Extend(1, 2), KindError, false, 3, 0, 0,
+			[]byte{ErrAstFrameForwarding}},
+		{"extended header cut", Message{KindSlin | KindExtended, 0, 0, 0, 1}, KindSlin, true, 9,
+			0, 0, nil},
+		{"empty", Message{}, KindError, false, 3, 0, 0, nil},
+	}
+	for _, tt := range tests {
+		if k := tt.m.Kind(); k != tt.kind {
+			t.Errorf("%s: kind %#x, want %#x", tt.name, k, tt.kind)
+		}
+		if e := tt.m.Extended(); e != tt.extended {
+			t.Errorf("%s: extended %v, want %v", tt.name, e, tt.extended)
+		}
+		if h := tt.m.headerLen(); h != tt.headerLen {
+			t.Errorf("%s: header of %d bytes, want %d", tt.name, h, tt.headerLen)
+		}
+		if s, ts := tt.m.Seq(), tt.m.Timestamp(); s != tt.seq || ts != tt.ts {
+			t.Errorf("%s: sequence %d timestamp %d, want %d and %d", tt.name, s, ts, tt.seq, tt.ts)
+		}
+		if p := tt.m.Payload(); !bytes.Equal(p, tt.payload) {
+			t.Errorf("%s: payload %x, want %x", tt.name, p, tt.payload)
+		}
+	}
+}
+
+func TestExtendedErrorCode(t *testing.T) {
+	m := Message{KindError, 0x00, 0x01, ErrAstMemory}
+	if c := m.Extend(1, 2).ErrorCode(); c != ErrAstMemory {
+		t.Errorf("error code %#x, want %#x", c, ErrAstMemory)
+	}
+	if c := slinExtended().ErrorCode(); c != ErrNone {
+		t.Errorf("extended audio has error code %#x", c)
+	}
+}
+
+func TestExtendedRead(t *testing.T) {
+	stream := append(slinExtended(), Message{KindError, 0x00, 0x01, ErrAstHangup}...)
+	stream = append(stream, HangupMessage().Extend(8, 9)...)
+
+	r := NewReader(bytes.NewReader(stream))
+	for i, want := range []Message{slinExtended(), {KindError, 0x00, 0x01, ErrAstHangup},
+		HangupMessage().Extend(8, 9)} {
+		m, err := r.ReadMessage()
+		if err != nil {
+			t.Fatalf("message %d: %v", i, err)
+		}
+		if !bytes.Equal(m, want) {
+			t.Errorf("message %d: got %x, want %x", i, m, want)
+		}
+	}
+}
+
+// chunkReader returns each of its chunks from a read of its own
+type chunkReader [][]byte
+
+func (r *chunkReader) Read(p []byte) (int, error) {
+	if len(*r) == 0 {
+		return 0, io.EOF
+	}
+	n := copy(p, (*r)[0])
+	if (*r)[0] = (*r)[0][n:]; len((*r)[0]) == 0 {
+		*r = (*r)[1:]
+	}
+	return n, nil
+}
+
+func TestNextMessageExtended(t *testing.T) {
+	m := slinExtended()
+
+	tests := []struct {
+		name   string
+		chunks [][]byte
+		ok     bool
+	}{
+		{"whole", [][]byte{m}, true},
+		{"extension in pieces", [][]byte{m[:3], m[3:4], m[4:9], m[9:]}, true},
+		{"extension cut", [][]byte{m[:3], m[3:4]}, false},
+		{"no extension", [][]byte{m[:3]}, false},
+	}
+	for _, tt := range tests {
+		r := chunkReader(tt.chunks)
+		got, err := NextMessage(&r)
+		if !tt.ok {
+			if err == nil {
+				t.Errorf("%s: got %x and no error", tt.name, got)
+			}
+			continue
+		}
+		if err != nil || !bytes.Equal(got, m) {
+			t.Errorf("%s: got %x, %v, want %x", tt.name, got, err, m)
+		}
+	}
+}
+
+func TestOffersExtended(t *testing.T) {
+	tests := []struct {
+		name string
+		m    Message
+		want bool
+	}{
+		{"offer", IDFlagsMessage(IDFlagExtended), true},
+		{"other flags", IDFlagsMessage(0x02), false},
+		{"uuid", IDMessage(testID), false},
+		{"not an ID", SlinMessage([]byte{IDFlagExtended}), false},
+	}
+	for _, tt := range tests {
+		if got := tt.m.OffersExtended(); got != tt.want {
+			t.Errorf("%s: got %v, want %v", tt.name, got, tt.want)
+		}
+	}
+}
+
+// slinExtended returns an extended slin message
+func slinExtended() Message {
+	return SlinMessage([]byte{5, 6}).Extend(7, 8)
+}
@@ -0,0 +1,289 @@
+package audiosocket
+
+import (
+	"bufio"
+	"encoding/binary"
+	"io"
+	"sync"
+	"sync/atomic"
+
+	"github.com/pkg/errors"
+)
+
+// streamQueueSize is the number of messages held for a Stream which is not
+// being read, beyond which further messages for it are dropped
+const streamQueueSize = 64
+
+// MaxMuxMessageSize is the size of the largest message, header included, which
+// fits in a multiplexed envelope
+const MaxMuxMessageSize = 65535 - 2
+
+// MuxMessage wraps a message of the given stream in a multiplexed envelope.  It
+// fails if the message is larger than MaxMuxMessageSize.
+func MuxMessage(stream uint16, m Message) (Message, error) {
+	if len(m) > MaxMuxMessageSize {
+		return nil, errors.Errorf("message of %d bytes too large for a multiplexed envelope", len(m))
+	}
+	in := make([]byte, 2, 2+len(m))
+	binary.BigEndian.PutUint16(in, stream)
+	return newMessage(KindMux, append(in, m...)), nil
+}
+
+// Unmux returns the stream ID and the enclosed message of a multiplexed
+// envelope
+func (m Message) Unmux() (uint16, Message, error) {
+	if m.Kind() != KindMux {
+		return 0, nil, errors.Errorf("wrong message type %d", m.Kind())
+	}
+	p := m.Payload()
+	if len(p) < 5 || len(p) < 2+Message(p[2:]).headerLen() ||
+		int(binary.BigEndian.Uint16(p[3:5])) != len(p)-2-Message(p[2:]).headerLen() {
+		return 0, nil, errors.New("malformed multiplexed message")
+	}
+	return binary.BigEndian.Uint16(p), Message(p[2:]), nil
+}
+
+// Demuxer separates a multiplexed audiosocket connection into its streams.
+// Asterisk opens a stream for each call which uses the multiplexing option, and
+// the Demuxer hands each new one out through Accept.
+type Demuxer struct {
+	conn io.ReadWriteCloser
+	r    *bufio.Reader
+
+	wmu sync.Mutex
+
+	mu      sync.Mutex
+	streams map[uint16]*Stream
+	err     error
+
+	accept chan *Stream
+	done   chan struct{}
+}
+
+// NewDemuxer starts reading a multiplexed audiosocket connection.  A connection
+// is multiplexed if its first message is of KindMux.
+func NewDemuxer(conn io.ReadWriteCloser) *Demuxer {
+	d := &Demuxer{
+		conn:    conn,
+		r:       bufio.NewReader(conn),
+		streams: make(map[uint16]*Stream),
+		accept:  make(chan *Stream, 16),
+		done:    make(chan struct{}),
+	}
+	go d.run()
+	return d
+}
+
+// Accept waits for and returns the next stream opened on the connection.  It
+// returns an error once the connection has failed or been closed.
+func (d *Demuxer) Accept() (*Stream, error) {
+	select {
+	case s := <-d.accept:
+		return s, nil
+	case <-d.done:
+		return nil, d.err
+	}
+}
+
+// Close closes the connection, ending all of its streams
+func (d *Demuxer) Close() error {
+	return d.conn.Close()
+}
+
+func (d *Demuxer) run() {
+	for {
+		m, err := readFullMessage(d.r)
+		if err != nil {
+			d.fail(err)
+			return
+		}
+		if m.Kind() != KindMux {
+			// Messages outside of a stream have no destination
+			continue
+		}
+		id, inner, err := m.Unmux()
+		if err != nil {
+			continue
+		}
+		d.dispatch(id, inner)
+	}
+}
+
+func (d *Demuxer) dispatch(id uint16, m Message) {
+	d.mu.Lock()
+	s, ok := d.streams[id]
+	if !ok {
+		if m.Kind() != KindID {
+			// The stream has already ended
+			d.mu.Unlock()
+			return
+		}
+		s = &Stream{
+			id:     id,
+			d:      d,
+			in:     make(chan Message, streamQueueSize),
+			closed: make(chan struct{}),
+		}
+		d.streams[id] = s
+	}
+	if m.Kind() == KindHangup {
+		delete(d.streams, id)
+	}
+	d.mu.Unlock()
+
+	if !ok {
+		select {
+		case d.accept <- s:
+		case <-d.done:
+			return
+		}
+	}
+
+	select {
+	case s.in <- m:
+	default:
+		atomic.AddUint64(&s.dropped, 1)
+	}
+	if m.Kind() == KindHangup {
+		close(s.in)
+	}
+}
+
+func (d *Demuxer) fail(err error) {
+	d.mu.Lock()
+	d.err = errors.Wrap(err, "multiplexed connection failed")
+	// The streams find done closed once their queues are, so that they
+	// return the error rather than io.EOF
+	close(d.done)
+	for id, s := range d.streams {
+		delete(d.streams, id)
+		close(s.in)
+	}
+	d.mu.Unlock()
+}
+
+func (d *Demuxer) write(m Message) error {
+	d.wmu.Lock()
+	defer d.wmu.Unlock()
+
+	_, err := d.conn.Write(m)
+	return err
+}
+
+// Stream is a single call carried by a multiplexed connection.  It reads and
+// writes the messages of the call just as a plain connection would, so GetID,
+// NextMessage and SendSlinChunks may be used with it unchanged.  Each write
+// must contain whole messages.
+type Stream struct {
+	id uint16
+	d  *Demuxer
+
+	in      chan Message
+	buf     []byte
+	dropped uint64
+
+	closed    chan struct{}
+	closeOnce sync.Once
+}
+
+// ID returns the stream ID, which identifies the stream within its connection
+func (s *Stream) ID() uint16 {
+	return s.id
+}
+
+// Dropped returns the number of messages for the stream which were discarded
+// because it was not read quickly enough
+func (s *Stream) Dropped() uint64 {
+	return atomic.LoadUint64(&s.dropped)
+}
+
+// Read reads the messages of the stream.  It returns io.EOF once the stream
+// has been ended by either side.
+func (s *Stream) Read(p []byte) (int, error) {
+	select {
+	case <-s.closed:
+		return 0, io.EOF
+	default:
+	}
+
+	if len(s.buf) == 0 {
+		var m Message
+		var ok bool
+		select {
+		case m, ok = <-s.in:
+		case <-s.closed:
+		}
+		if !ok {
+			select {
+			case <-s.d.done:
+				return 0, s.d.err
+			default:
+				return 0, io.EOF
+			}
+		}
+		s.buf = m
+	}
+
+	n := copy(p, s.buf)
+	s.buf = s.buf[n:]
+	return n, nil
+}
+
+// Write sends one or more whole messages over the stream
+func (s *Stream) Write(p []byte) (int, error) {
+	for off := 0; off < len(p); {
+		m := Message(p[off:])
+		n := m.headerLen()
+		if len(m) >= n {
+			n += int(m.ContentLength())
+		}
+		if len(m) < n {
+			return off, errors.New("partial message written to stream")
+		}
+		env, err := MuxMessage(s.id, m[:n])
+		if err != nil {
+			return off, err
+		}
+		if err := s.d.write(env); err != nil {
+			return off, errors.Wrap(err, "failed to write to multiplexed connection")
+		}
+		off += n
+	}
+	return len(p), nil
+}
+
+// Close ends the stream, sending a hangup to Asterisk if it has not already
+// ended it.  The connection stays open for the other streams.
+func (s *Stream) Close() (err error) {
+	s.closeOnce.Do(func() {
+		close(s.closed)
+
+		s.d.mu.Lock()
+		open := s.d.streams[s.id] == s
+		if open {
+			delete(s.d.streams, s.id)
+		}
+		s.d.mu.Unlock()
+
+		if open {
+			env, _ := MuxMessage(s.id, HangupMessage()) // a hangup always fits
+			err = s.d.write(env)
+		}
+	})
+	return err
+}
+
+// readFullMessage reads the next message, waiting for all of it to arrive
+func readFullMessage(r io.Reader) (Message, error) {
+	hdr := make([]byte, 3)
+	if _, err := io.ReadFull(r, hdr); err != nil {
+		return nil, errors.Wrap(err, "failed to read header")
+	}
+
+	m := make([]byte, Message(hdr).headerLen()+int(binary.BigEndian.Uint16(hdr[1:])))
+	copy(m, hdr)
+	if _, err := io.ReadFull(r, m[3:]); err != nil {
+		return nil, errors.Wrap(err, "failed to read payload")
+	}
+	return m, nil
+}
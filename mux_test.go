@@ -0,0 +1,268 @@
+package audiosocket
+
+import (
+	"bytes"
+	"io"
+	"net"
+	"testing"
+	"time"
+
+	"github.com/gofrs/uuid"
+)
+
+// testID is the call ID sent by the tests
+var testID = uuid.UUID{0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10}
+
+// testTimeout is how long a test waits for something which should happen at once
+const testTimeout = 5 * time.Second
+
+func TestUnmux(t *testing.T) {
+	slin := SlinMessage([]byte{1, 2, 3, 4})
+
+	tests := []struct {
+		name   string
+		m      Message
+		stream uint16
+		inner  Message
+		ok     bool
+	}{
+		{"slin", muxMessage(7, slin), 7, slin, true},
+		{"hangup", muxMessage(0xffff, HangupMessage()), 0xffff, HangupMessage(), true},
+		{"extended", muxMessage(1, slin.Extend(3, 4)), 1, slin.Extend(3, 4), true},
+		{"not an envelope", slin, 0, nil, false},
+		{"no inner header", newMessage(KindMux, []byte{0, 1, KindSlin}), 0, nil, false},
+		{"inner too long", newMessage(KindMux, []byte{0, 1, KindSlin, 0, 2, 1}), 0, nil, false},
+		{"inner too short", newMessage(KindMux, []byte{0, 1, KindSlin, 0, 1, 1, 2}), 0, nil, false},
+		{"extended header cut", newMessage(KindMux, []byte{0, 1, KindSlin | KindExtended, 0, 0, 1}), 0, nil, false},
+	}
+	for _, tt := range tests {
+		stream, inner, err := tt.m.Unmux()
+		if (err == nil) != tt.ok {
+			t.Errorf("%s: got error %v, want ok %v", tt.name, err, tt.ok)
+			continue
+		}
+		if stream != tt.stream || !bytes.Equal(inner, tt.inner) {
+			t.Errorf("%s: got stream %d message %x, want %d %x", tt.name, stream, inner,
+				tt.stream, tt.inner)
+		}
+	}
+}
+
+func TestMuxMessageSize(t *testing.T) {
+	tests := []struct {
+		name string
+		size int
+		ok   bool
+	}{
+		{"largest", MaxMuxMessageSize, true},
+		{"one byte over", MaxMuxMessageSize + 1, false},
+		{"largest plain", 3 + 65535, false},
+	}
+	for _, tt := range tests {
+		m := SlinMessage(make([]byte, tt.size-3))
+		env, err := MuxMessage(1, m)
+		if (err == nil) != tt.ok {
+			t.Errorf("%s: got error %v, want ok %v", tt.name, err, tt.ok)
+			continue
+		}
+		if err == nil && len(env) != 3+2+tt.size {
+			t.Errorf("%s: envelope of %d bytes, want %d", tt.name, len(env), 3+2+tt.size)
+		}
+	}
+}
+
+// muxMessage wraps a message which is known to fit in an envelope
+func muxMessage(stream uint16, m Message) Message {
+	env, err := MuxMessage(stream, m)
+	if err != nil {
+		panic(err)
+	}
+	return env
+}
+
+// muxPeer is the Asterisk end of a multiplexed connection
+type muxPeer struct {
+	t    *testing.T
+	conn net.Conn
+}
+
+func newMuxPair(t *testing.T) (*Demuxer, *muxPeer) {
+	a, b := net.Pipe()
+	return NewDemuxer(a), &muxPeer{t: t, conn: b}
+}
+
+func (p *muxPeer) send(stream uint16, m Message) {
+	if _, err := p.conn.Write(muxMessage(stream, m)); err != nil {
+		p.t.Fatalf("failed to send envelope: %v", err)
+	}
+}
+
+func (p *muxPeer) receive() (uint16, Message) {
+	p.conn.SetReadDeadline(time.Now().Add(testTimeout)) // nolint: errcheck
+	m, err := readFullMessage(p.conn)
+	if err != nil {
+		p.t.Fatalf("failed to receive envelope: %v", err)
+	}
+	stream, inner, err := m.Unmux()
+	if err != nil {
+		p.t.Fatalf("received a bad envelope: %v", err)
+	}
+	return stream, inner
+}
+
+func acceptStream(t *testing.T, d *Demuxer) *Stream {
+	type result struct {
+		s   *Stream
+		err error
+	}
+	ch := make(chan result, 1)
+	go func() {
+		s, err := d.Accept()
+		ch <- result{s, err}
+	}()
+
+	select {
+	case r := <-ch:
+		if r.err != nil {
+			t.Fatalf("failed to accept stream: %v", r.err)
+		}
+		return r.s
+	case <-time.After(testTimeout):
+		t.Fatal("no stream accepted")
+	}
+	return nil
+}
+
+func TestDemuxerDispatch(t *testing.T) {
+	d, peer := newMuxPair(t)
+	defer d.Close() // nolint: errcheck
+
+	// Audio for a stream which has not been opened has nowhere to go
+	peer.send(9, SlinMessage([]byte{9, 9}))
+	peer.send(1, IDMessage(testID))
+	peer.send(2, IDMessage(testID))
+	peer.send(1, SlinMessage([]byte{1, 1}))
+	peer.send(2, SlinMessage([]byte{2, 2}))
+
+	s1 := acceptStream(t, d)
+	s2 := acceptStream(t, d)
+	if s1.ID() != 1 || s2.ID() != 2 {
+		t.Fatalf("accepted streams %d and %d, want 1 and 2", s1.ID(), s2.ID())
+	}
+
+	for _, s := range []*Stream{s1, s2} {
+		id, err := GetID(s)
+		if err != nil || id != testID {
+			t.Fatalf("stream %d: got ID %v, %v", s.ID(), id, err)
+		}
+		m, err := NextMessage(s)
+		if err != nil {
+			t.Fatalf("stream %d: failed to read message: %v", s.ID(), err)
+		}
+		if want := []byte{byte(s.ID()), byte(s.ID())}; !bytes.Equal(m.Payload(), want) {
+			t.Errorf("stream %d: got payload %x, want %x", s.ID(), m.Payload(), want)
+		}
+	}
+
+	// What a stream writes is wrapped in its envelope
+	go s2.Write(SlinMessage([]byte{5, 6})) // nolint: errcheck
+	if stream, m := peer.receive(); stream != 2 || !bytes.Equal(m, SlinMessage([]byte{5, 6})) {
+		t.Errorf("got stream %d message %x", stream, m)
+	}
+
+	// A message which fits a plain connection, but not an envelope, fails
+	if _, err := s2.Write(SlinMessage(make([]byte, 65534))); err == nil {
+		t.Error("wrote a message too large for an envelope")
+	}
+}
+
+func TestDemuxerHangup(t *testing.T) {
+	d, peer := newMuxPair(t)
+	defer d.Close() // nolint: errcheck
+
+	peer.send(1, IDMessage(testID))
+	s := acceptStream(t, d)
+	if _, err := GetID(s); err != nil {
+		t.Fatal(err)
+	}
+
+	// A hangup from Asterisk is read, and then the stream ends
+	peer.send(1, HangupMessage())
+	m, err := NextMessage(s)
+	if err != nil || m.Kind() != KindHangup {
+		t.Fatalf("got message %x, %v, want a hangup", m, err)
+	}
+	if _, err := s.Read(make([]byte, 3)); err != io.EOF {
+		t.Fatalf("got %v after the hangup, want io.EOF", err)
+	}
+
+	// The stream has already ended, so closing it sends nothing
+	if err := s.Close(); err != nil {
+		t.Fatal(err)
+	}
+
+	// Closing a stream which Asterisk has not ended hangs it up
+	peer.send(2, IDMessage(testID))
+	s = acceptStream(t, d)
+	errs := make(chan error, 1)
+	go func() {
+		errs <- s.Close()
+	}()
+	if stream, m := peer.receive(); stream != 2 || m.Kind() != KindHangup {
+		t.Errorf("got stream %d message %x, want a hangup of stream 2", stream, m)
+	}
+	if err := <-errs; err != nil {
+		t.Fatal(err)
+	}
+	if _, err := s.Read(make([]byte, 3)); err != io.EOF {
+		t.Fatalf("got %v from a closed stream, want io.EOF", err)
+	}
+}
+
+func TestDemuxerClose(t *testing.T) {
+	d, peer := newMuxPair(t)
+
+	peer.send(1, IDMessage(testID))
+	s := acceptStream(t, d)
+	if _, err := GetID(s); err != nil {
+		t.Fatal(err)
+	}
+
+	if err := d.Close(); err != nil {
+		t.Fatal(err)
+	}
+	if _, err := d.Accept(); err == nil {
+		t.Error("Accept succeeded after Close")
+	}
+	if _, err := s.Read(make([]byte, 3)); err == nil || err == io.EOF {
+		t.Errorf("got %v from a stream of a closed connection, want its error", err)
+	}
+}
+
+func TestDemuxerFail(t *testing.T) {
+	d, peer := newMuxPair(t)
+	defer d.Close() // nolint: errcheck
+
+	peer.send(1, IDMessage(testID))
+	s := acceptStream(t, d)
+	if _, err := GetID(s); err != nil {
+		t.Fatal(err)
+	}
+
+	// Asterisk goes away part of the way through a message
+	if _, err := peer.conn.Write([]byte{KindMux, 0, 10, 0}); err != nil {
+		t.Fatal(err)
+	}
+	peer.conn.Close() // nolint: errcheck
+
+	if _, err := d.Accept(); err == nil {
+		t.Error("Accept succeeded after the connection failed")
+	}
+	if _, err := s.Read(make([]byte, 3)); err == nil || err == io.EOF {
+		t.Errorf("got %v from a stream of a failed connection, want its error", err)
+	}
+	if _, err := s.Write(SlinMessage([]byte{1, 2})); err == nil {
+		t.Error("write to a stream of a failed connection succeeded")
+	}
+}
@@ -0,0 +1,311 @@
+package audiosocket
+
+import (
+	"io"
+	"runtime"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/pkg/errors"
+)
+
+// DefaultPacerInterval is the duration of the audio which a Pacer sends for
+// each stream on every tick
+const DefaultPacerInterval = 20 * time.Millisecond
+
+// ErrPacerClosed is returned for the streams which were still playing when
+// their Pacer was closed
+var ErrPacerClosed = errors.New("pacer closed")
+
+// ErrStopped is returned for a stream which was stopped before all of its
+// audio had been sent
+var ErrStopped = errors.New("stream stopped")
+
+// Pacer sends the audio of many streams at the pace at which it is played,
+// from one timer per processor rather than one per stream.  Every stream gets
+// its next chunk on the same tick, so the frame boundaries of all of them are
+// aligned.
+//
+// The chunks of a processor's streams are written one after another, so a
+// writer which blocks delays the others.  A writer with a SetWriteDeadline
+// method, such as a net.Conn, is given one interval to take each chunk, and
+// its stream fails if it does not.  It is left with no deadline afterwards.
+type Pacer struct {
+	interval time.Duration
+	epoch    time.Time
+	shards   []*pacerShard
+	next     uint32
+
+	done      chan struct{}
+	closeOnce sync.Once
+	wg        sync.WaitGroup
+}
+
+// pacerShard is the timer of one processor and the streams it drives
+type pacerShard struct {
+	p *Pacer
+
+	mu      sync.Mutex
+	streams []*PacedStream
+	batch   []*PacedStream
+	wake    chan struct{}
+	timer   *time.Timer
+}
+
+// PacedStream is audio being played out by a Pacer
+type PacedStream struct {
+	w      io.Writer
+	input  []byte
+	sender ChunkSender
+	gather bool
+
+	start   int64 // The tick on which the first chunk was sent
+	sent    int64 // Number of chunks sent
+	stopped int32
+
+	done chan struct{}
+	err  error
+}
+
+// NewPacer starts a Pacer which sends the given duration of audio for each
+// stream on every tick.  An interval of 0 means DefaultPacerInterval.
+func NewPacer(interval time.Duration) *Pacer {
+	if interval <= 0 {
+		interval = DefaultPacerInterval
+	}
+
+	p := &Pacer{
+		interval: interval,
+		epoch:    time.Now(),
+		shards:   make([]*pacerShard, runtime.GOMAXPROCS(0)),
+		done:     make(chan struct{}),
+	}
+	for i := range p.shards {
+		p.shards[i] = &pacerShard{
+			p:    p,
+			wake: make(chan struct{}, 1),
+		}
+		p.wg.Add(1)
+		go p.shards[i].run()
+	}
+	return p
+}
+
+// Play sends the input over w as messages of the given kind, each holding one
+// interval of audio, starting on the next tick.  The kind must be one of the
+// signed linear or G.711 kinds.
+func (p *Pacer) Play(w io.Writer, kind Kind, input []byte) (*PacedStream, error) {
+	bps, err := bytesPerSecond(kind)
+	if err != nil {
+		return nil, err
+	}
+	chunkSize := int(int64(bps) * int64(p.interval) / int64(time.Second))
+	if chunkSize < 1 || chunkSize > 65535 {
+		return nil, errors.Errorf("interval %v does not fit in a message", p.interval)
+	}
+
+	s := &PacedStream{
+		w:      w,
+		input:  input,
+		gather: gathers(w),
+		start:  -1,
+		done:   make(chan struct{}),
+	}
+	s.sender.kind = kind
+	s.sender.chunkSize = chunkSize
+
+	sh := p.shards[atomic.AddUint32(&p.next, 1)%uint32(len(p.shards))]
+	sh.mu.Lock()
+	select {
+	case <-p.done:
+		sh.mu.Unlock()
+		return nil, ErrPacerClosed
+	default:
+	}
+	sh.streams = append(sh.streams, s)
+	sh.mu.Unlock()
+
+	select {
+	case sh.wake <- struct{}{}:
+	default:
+	}
+	return s, nil
+}
+
+// Close stops the Pacer, ending the streams which are still playing with
+// ErrPacerClosed
+func (p *Pacer) Close() error {
+	p.closeOnce.Do(func() {
+		for _, sh := range p.shards {
+			sh.mu.Lock()
+		}
+		close(p.done)
+		for _, sh := range p.shards {
+			sh.mu.Unlock()
+		}
+		p.wg.Wait()
+	})
+	return nil
+}
+
+func (sh *pacerShard) run() {
+	p := sh.p
+	defer p.wg.Done()
+
+	maxBehind := int64(DefaultMaxLate / p.interval)
+	for {
+		sh.mu.Lock()
+		idle := len(sh.streams) == 0
+		sh.mu.Unlock()
+		if idle {
+			select {
+			case <-sh.wake:
+			case <-p.done:
+				sh.finish()
+				return
+			}
+		}
+
+		// Wait for the next tick shared by all shards
+		tick := int64(time.Since(p.epoch)/p.interval) + 1
+		if !sh.sleep(p.epoch.Add(time.Duration(tick) * p.interval)) {
+			sh.finish()
+			return
+		}
+
+		sh.mu.Lock()
+		sh.batch = append(sh.batch[:0], sh.streams...)
+		sh.mu.Unlock()
+
+		ended := 0
+		for _, s := range sh.batch {
+			if s.step(tick, maxBehind, p.interval) {
+				ended++
+			}
+		}
+		if ended > 0 {
+			sh.remove()
+		}
+	}
+}
+
+// sleep waits until the given time, reporting false if the Pacer was closed
+// first
+func (sh *pacerShard) sleep(until time.Time) bool {
+	d := time.Until(until)
+	if sh.timer == nil {
+		sh.timer = time.NewTimer(d)
+	} else {
+		sh.timer.Reset(d)
+	}
+
+	select {
+	case <-sh.timer.C:
+		return true
+	case <-sh.p.done:
+		if !sh.timer.Stop() {
+			<-sh.timer.C
+		}
+		return false
+	}
+}
+
+// remove drops the streams which have ended
+func (sh *pacerShard) remove() {
+	sh.mu.Lock()
+	kept := sh.streams[:0]
+	for _, s := range sh.streams {
+		select {
+		case <-s.done:
+		default:
+			kept = append(kept, s)
+		}
+	}
+	for i := len(kept); i < len(sh.streams); i++ {
+		sh.streams[i] = nil
+	}
+	sh.streams = kept
+	sh.mu.Unlock()
+}
+
+// finish ends the streams of a closed Pacer
+func (sh *pacerShard) finish() {
+	sh.mu.Lock()
+	for _, s := range sh.streams {
+		s.end(ErrPacerClosed)
+	}
+	sh.streams = nil
+	sh.mu.Unlock()
+}
+
+// step sends the chunks of the stream which are due by the given tick,
+// reporting whether the stream has ended.  Chunks missed by falling no more
+// than maxBehind ticks behind are sent now; beyond that they are given up on.
+func (s *PacedStream) step(tick, maxBehind int64, interval time.Duration) bool {
+	if atomic.LoadInt32(&s.stopped) != 0 {
+		s.end(ErrStopped)
+		return true
+	}
+	if s.start < 0 {
+		s.start = tick
+	}
+
+	due := tick - s.start + 1
+	if due-s.sent > maxBehind+1 {
+		s.start += due - s.sent - 1
+		due = s.sent + 1
+	}
+
+	dl, _ := s.w.(interface {
+		SetWriteDeadline(time.Time) error
+	})
+	for ; s.sent < due && len(s.input) > 0; s.sent++ {
+		n := s.sender.chunkSize
+		if n > len(s.input) {
+			n = len(s.input)
+		}
+		if dl != nil {
+			dl.SetWriteDeadline(time.Now().Add(interval)) // nolint: errcheck
+		}
+		if err := s.sender.write(s.w, s.input[:n], s.gather); err != nil {
+			s.end(errors.Wrap(err, "failed to write chunk to AudioSocket"))
+			return true
+		}
+		s.input = s.input[n:]
+	}
+	if dl != nil {
+		dl.SetWriteDeadline(time.Time{}) // nolint: errcheck
+	}
+
+	if len(s.input) == 0 {
+		s.end(nil)
+		return true
+	}
+	return false
+}
+
+func (s *PacedStream) end(err error) {
+	s.err = err
+	s.input = nil
+	close(s.done)
+}
+
+// Stop ends the stream before the rest of its audio is sent.  The chunk being
+// written, if any, is completed.
+func (s *PacedStream) Stop() {
+	atomic.StoreInt32(&s.stopped, 1)
+}
+
+// Done returns a channel which is closed once the stream has ended
+func (s *PacedStream) Done() <-chan struct{} {
+	return s.done
+}
+
+// Wait waits for the stream to end.  It returns nil once all of the audio has
+// been sent, ErrStopped if the stream was stopped first, or the error which
+// ended it.
+func (s *PacedStream) Wait() error {
+	<-s.done
+	return s.err
+}
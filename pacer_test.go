@@ -0,0 +1,302 @@
+package audiosocket
+
+import (
+	"errors"
+	"sync"
+	"testing"
+	"time"
+)
+
+// pacedWriter records when each message is written to it, and the last write
+// deadline it was given
+type pacedWriter struct {
+	mu       sync.Mutex
+	msgs     []Message
+	times    []time.Time
+	deadline time.Time
+
+	stall time.Duration // How long the first write blocks
+	err   error
+}
+
+func (w *pacedWriter) Write(p []byte) (int, error) {
+	w.mu.Lock()
+	stall := w.stall
+	w.stall = 0
+	w.mu.Unlock()
+	time.Sleep(stall)
+
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	if w.err != nil {
+		return 0, w.err
+	}
+	w.msgs = append(w.msgs, append(Message(nil), p...))
+	w.times = append(w.times, time.Now())
+	return len(p), nil
+}
+
+func (w *pacedWriter) SetWriteDeadline(t time.Time) error {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	w.deadline = t
+	return nil
+}
+
+func (w *pacedWriter) written() ([]Message, []time.Time) {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	return append([]Message(nil), w.msgs...), append([]time.Time(nil), w.times...)
+}
+
+func (w *pacedWriter) lastDeadline() time.Time {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	return w.deadline
+}
+
+// audio returns n bytes of audio which differ from one byte to the next
+func audio(n int) []byte {
+	b := make([]byte, n)
+	for i := range b {
+		b[i] = byte(i)
+	}
+	return b
+}
+
+func TestPacerPlay(t *testing.T) {
+	const interval = 10 * time.Millisecond
+
+	tests := []struct {
+		name  string
+		kind  Kind
+		input int
+		sizes []int
+	}{
+		{"slin", KindSlin, 400, []int{160, 160, 80}},
+		{"whole chunks", KindSlin, 320, []int{160, 160}},
+		{"slin16", KindSlin16, 700, []int{320, 320, 60}},
+		{"ulaw", KindUlaw, 200, []int{80, 80, 40}},
+		{"one byte", KindAlaw, 1, []int{1}},
+	}
+
+	p := NewPacer(interval)
+	defer p.Close() // nolint: errcheck
+
+	for _, tt := range tests {
+		w := &pacedWriter{}
+		input := audio(tt.input)
+		start := time.Now()
+		s, err := p.Play(w, tt.kind, input)
+		if err != nil {
+			t.Fatalf("%s: %v", tt.name, err)
+		}
+		if err := s.Wait(); err != nil {
+			t.Fatalf("%s: %v", tt.name, err)
+		}
+
+		msgs, times := w.written()
+		if len(msgs) != len(tt.sizes) {
+			t.Fatalf("%s: %d messages, want %d", tt.name, len(msgs), len(tt.sizes))
+		}
+		off := 0
+		for i, m := range msgs {
+			want := AppendMessage(nil, tt.kind, input[off:off+tt.sizes[i]])
+			if string(m) != string(want) {
+				t.Errorf("%s: message %d is %x, want %x", tt.name, i, m, want)
+			}
+			off += tt.sizes[i]
+		}
+
+		// One chunk on each tick, never ahead of it
+		if d := times[len(times)-1].Sub(start); d < time.Duration(len(times)-1)*interval {
+			t.Errorf("%s: %d messages sent in %v", tt.name, len(times), d)
+		}
+		if !w.lastDeadline().IsZero() {
+			t.Errorf("%s: write deadline left at %v", tt.name, w.lastDeadline())
+		}
+	}
+
+	if _, err := p.Play(&pacedWriter{}, KindMux, audio(10)); err == nil {
+		t.Error("played audio of a kind which can not be chunked")
+	}
+	if _, err := p.Play(&pacedWriter{}, KindSlin48, audio(10)); err != nil {
+		t.Errorf("failed to play audio whose chunk fits a message: %v", err)
+	}
+	slow := NewPacer(time.Second)
+	defer slow.Close() // nolint: errcheck
+	if _, err := slow.Play(&pacedWriter{}, KindSlin48, audio(10)); err == nil {
+		t.Error("played audio whose chunk does not fit a message")
+	}
+}
+
+func TestPacerStreams(t *testing.T) {
+	const streams, chunks = 32, 5
+
+	p := NewPacer(5 * time.Millisecond)
+	defer p.Close() // nolint: errcheck
+
+	ws := make([]*pacedWriter, streams)
+	ss := make([]*PacedStream, streams)
+	for i := range ws {
+		ws[i] = &pacedWriter{}
+		var err error
+		if ss[i], err = p.Play(ws[i], KindSlin, audio(chunks*80)); err != nil {
+			t.Fatal(err)
+		}
+	}
+	for i, s := range ss {
+		if err := s.Wait(); err != nil {
+			t.Fatalf("stream %d: %v", i, err)
+		}
+		if msgs, _ := ws[i].written(); len(msgs) != chunks {
+			t.Errorf("stream %d: %d messages, want %d", i, len(msgs), chunks)
+		}
+	}
+
+	// A Pacer left idle plays the next stream as well
+	s, err := p.Play(&pacedWriter{}, KindSlin, audio(80))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := s.Wait(); err != nil {
+		t.Fatal(err)
+	}
+}
+
+func TestPacerStop(t *testing.T) {
+	p := NewPacer(5 * time.Millisecond)
+	defer p.Close() // nolint: errcheck
+
+	w := &pacedWriter{}
+	s, err := p.Play(w, KindSlin, audio(1000*80))
+	if err != nil {
+		t.Fatal(err)
+	}
+	waitFor(t, "the first chunk", func() bool {
+		msgs, _ := w.written()
+		return len(msgs) > 0
+	})
+
+	s.Stop()
+	select {
+	case <-s.Done():
+	case <-time.After(testTimeout):
+		t.Fatal("stream not ended after Stop")
+	}
+	if err := s.Wait(); err != ErrStopped {
+		t.Errorf("got %v, want ErrStopped", err)
+	}
+	sent, _ := w.written()
+	time.Sleep(20 * time.Millisecond)
+	if msgs, _ := w.written(); len(msgs) != len(sent) || len(msgs) == 1000 {
+		t.Errorf("%d messages sent, then %d after Stop", len(sent), len(msgs))
+	}
+}
+
+func TestPacerWriteError(t *testing.T) {
+	p := NewPacer(5 * time.Millisecond)
+	defer p.Close() // nolint: errcheck
+
+	failed := errors.New("broken")
+	s, err := p.Play(&pacedWriter{err: failed}, KindSlin, audio(800))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := s.Wait(); err == nil || err == ErrStopped {
+		t.Errorf("got %v, want the write error", err)
+	}
+}
+
+func TestPacerClose(t *testing.T) {
+	p := NewPacer(5 * time.Millisecond)
+
+	// Calls started while the Pacer closes either fail or end
+	var wg sync.WaitGroup
+	errs := make(chan error, 64)
+	for i := 0; i < 8; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for j := 0; j < 8; j++ {
+				s, err := p.Play(&pacedWriter{}, KindSlin, audio(100*80))
+				if err == nil {
+					err = s.Wait()
+				}
+				errs <- err
+			}
+		}()
+	}
+	time.Sleep(10 * time.Millisecond)
+
+	closed := make(chan struct{})
+	go func() {
+		p.Close() // nolint: errcheck
+		close(closed)
+	}()
+	select {
+	case <-closed:
+	case <-time.After(testTimeout):
+		t.Fatal("Close did not return")
+	}
+	wg.Wait()
+	close(errs)
+
+	for err := range errs {
+		if err != ErrPacerClosed {
+			t.Errorf("got %v from a stream of a closed Pacer, want ErrPacerClosed", err)
+		}
+	}
+	if _, err := p.Play(&pacedWriter{}, KindSlin, audio(80)); err != ErrPacerClosed {
+		t.Errorf("Play returned %v after Close, want ErrPacerClosed", err)
+	}
+	p.Close() // nolint: errcheck
+}
+
+func TestPacerResync(t *testing.T) {
+	const interval = 10 * time.Millisecond
+	maxBehind := int(DefaultMaxLate / interval)
+
+	tests := []struct {
+		name     string
+		stall    int // Ticks for which the first write blocks
+		minBurst int
+		maxBurst int
+	}{
+		// Missed chunks are caught up on at once
+		{"catch up", 4, 3, maxBehind + 1},
+		// Too far behind, the stream plays on from where it is
+		{"resync", 2 * maxBehind, 1, 1},
+	}
+	for _, tt := range tests {
+		p := NewPacer(interval)
+
+		w := &pacedWriter{stall: time.Duration(tt.stall)*interval + interval/2}
+		s, err := p.Play(w, KindSlin, audio(160*(tt.stall+maxBehind+4)))
+		if err != nil {
+			t.Fatal(err)
+		}
+		waitFor(t, "the stream to catch up", func() bool {
+			_, times := w.written()
+			return len(times) > 1
+		})
+		s.Stop()
+		s.Wait()  // nolint: errcheck
+		p.Close() // nolint: errcheck
+
+		// The chunks sent on the first tick after the stall
+		_, times := w.written()
+		burst := 1
+		for burst < len(times)-1 && times[burst+1].Sub(times[1]) < interval/2 {
+			burst++
+		}
+		if burst < tt.minBurst || burst > tt.maxBurst {
+			t.Errorf("%s: %d chunks sent together after the stall, want %d to %d", tt.name,
+				burst, tt.minBurst, tt.maxBurst)
+		}
+	}
+}
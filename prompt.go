@@ -0,0 +1,268 @@
+package audiosocket
+
+import (
+	"encoding/binary"
+	"fmt"
+	"hash/fnv"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"path/filepath"
+	"sync"
+	"time"
+
+	"github.com/pkg/errors"
+)
+
+// framedSuffix ends the name of the framed copy of a prompt
+const framedSuffix = ".audiosocket"
+
+// Prompt is a recording which has been cut into AudioSocket messages ahead of
+// time, so that it may be played to any number of calls at once without being
+// copied or framed again.  The messages are kept in a file beside the
+// recording, or in the directory of the PromptCache, which is mapped into
+// memory read-only and so is shared by every process which plays it.
+type Prompt struct {
+	path     string // The framed copy
+	data     []byte // The messages, one after another
+	msgSize  int    // Length of every message but the last
+	count    int
+	interval time.Duration
+}
+
+// Len returns the number of messages of the prompt
+func (p *Prompt) Len() int {
+	return p.count
+}
+
+// Duration returns the length of the audio of the prompt
+func (p *Prompt) Duration() time.Duration {
+	audio := len(p.data) - 3*p.count
+	return time.Duration(audio) * p.interval / time.Duration(p.msgSize-3)
+}
+
+// Interval returns the duration of the audio of each message of the prompt
+func (p *Prompt) Interval() time.Duration {
+	return p.interval
+}
+
+// Message returns the i'th message of the prompt.  It shares the memory of the
+// prompt, which must not be modified.
+func (p *Prompt) Message(i int) Message {
+	off := i * p.msgSize
+	end := off + p.msgSize
+	if end > len(p.data) {
+		end = len(p.data)
+	}
+	return Message(p.data[off:end:end])
+}
+
+// Bytes returns all of the messages of the prompt, one after another.  It
+// shares the memory of the prompt, which must not be modified.
+func (p *Prompt) Bytes() []byte {
+	return p.data
+}
+
+// PlayPrompt sends the messages of a prompt over an AudioSocket connection at
+// the pace at which they are played
+func PlayPrompt(w io.Writer, p *Prompt) error {
+	var s ChunkSender
+	return s.SendPrompt(w, p)
+}
+
+// SendPrompt sends the messages of a prompt at the pace at which they are
+// played, observing the Lead and MaxLate of the sender but the interval of the
+// prompt.  Each message is a single write straight from the memory of the
+// prompt.  If Sendfile is set and w is a TCP connection, each message is
+// instead sent with sendfile from the framed copy on disk.
+func (s *ChunkSender) SendPrompt(w io.Writer, p *Prompt) error {
+	if tcp, ok := w.(*net.TCPConn); ok && s.Sendfile {
+		return s.sendPromptFile(tcp, p)
+	}
+
+	return s.pace(p.count, p.interval, func(k int) error {
+		if _, err := w.Write(p.Message(k)); err != nil {
+			return errors.Wrap(err, "failed to write prompt to AudioSocket")
+		}
+		return nil
+	})
+}
+
+func (s *ChunkSender) sendPromptFile(w *net.TCPConn, p *Prompt) error {
+	// The offset of the file is what sendfile reads from, so each playback
+	// needs its own
+	f, err := os.Open(p.path)
+	if err != nil {
+		return errors.Wrap(err, "failed to open framed prompt")
+	}
+	defer f.Close() // nolint: errcheck
+
+	lr := &io.LimitedReader{R: f}
+	return s.pace(p.count, p.interval, func(k int) error {
+		lr.N = int64(len(p.Message(k)))
+		if _, err := w.ReadFrom(lr); err != nil {
+			return errors.Wrap(err, "failed to send prompt to AudioSocket")
+		}
+		return nil
+	})
+}
+
+// PromptCache loads prompts for playback, framing each recording once and
+// sharing it between all of the calls which play it
+type PromptCache struct {
+	dir       string
+	kind      Kind
+	chunkSize int
+	interval  time.Duration
+
+	mu      sync.Mutex
+	prompts map[string]*Prompt
+}
+
+// NewPromptCache creates a cache of prompts recorded as raw audio of the given
+// kind, which must be one of the signed linear or G.711 kinds, cut into
+// messages of chunkSize bytes.  The framed copy of each prompt is kept in dir,
+// or beside the recording if dir is empty.
+func NewPromptCache(dir string, kind Kind, chunkSize int) (*PromptCache, error) {
+	if chunkSize < 1 || chunkSize > 65535 {
+		return nil, errors.Errorf("invalid chunk size %d", chunkSize)
+	}
+	bps, err := bytesPerSecond(kind)
+	if err != nil {
+		return nil, err
+	}
+
+	return &PromptCache{
+		dir:       dir,
+		kind:      kind,
+		chunkSize: chunkSize,
+		interval:  time.Duration(chunkSize) * time.Second / time.Duration(bps),
+		prompts:   make(map[string]*Prompt),
+	}, nil
+}
+
+// Get returns the prompt of the recording at the given path, loading it if it
+// is not already cached.  The framed copy is made again if the recording has
+// changed since it was made.
+func (c *PromptCache) Get(path string) (*Prompt, error) {
+	abs, err := filepath.Abs(path)
+	if err != nil {
+		return nil, errors.Wrapf(err, "failed to resolve prompt %s", path)
+	}
+
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if p, ok := c.prompts[abs]; ok {
+		return p, nil
+	}
+
+	p, err := c.load(abs)
+	if err != nil {
+		return nil, err
+	}
+	c.prompts[abs] = p
+	return p, nil
+}
+
+// Close releases the memory of every prompt of the cache.  No prompt may be
+// played once it has been called.
+func (c *PromptCache) Close() error {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	var err error
+	for path, p := range c.prompts {
+		if uerr := unmapPrompt(p.data); uerr != nil && err == nil {
+			err = errors.Wrapf(uerr, "failed to release prompt %s", path)
+		}
+		delete(c.prompts, path)
+	}
+	return err
+}
+
+// framedPath returns where the framed copy of a recording is kept
+func (c *PromptCache) framedPath(abs string) string {
+	name := fmt.Sprintf("%s.%02x-%d%s", filepath.Base(abs), byte(c.kind), c.chunkSize, framedSuffix)
+	if c.dir == "" {
+		return filepath.Join(filepath.Dir(abs), name)
+	}
+
+	// Recordings of the same name may come from different directories
+	h := fnv.New64a()
+	h.Write([]byte(abs)) // nolint: errcheck
+	return filepath.Join(c.dir, fmt.Sprintf("%016x-%s", h.Sum64(), name))
+}
+
+func (c *PromptCache) load(abs string) (*Prompt, error) {
+	src, err := os.Stat(abs)
+	if err != nil {
+		return nil, errors.Wrapf(err, "failed to find prompt %s", abs)
+	}
+
+	path := c.framedPath(abs)
+	if fi, err := os.Stat(path); err != nil || fi.ModTime().Before(src.ModTime()) {
+		if err = c.frame(abs, path); err != nil {
+			return nil, err
+		}
+	}
+
+	data, err := mapPrompt(path)
+	if err != nil {
+		return nil, errors.Wrapf(err, "failed to map prompt %s", path)
+	}
+
+	p := &Prompt{
+		path:     path,
+		data:     data,
+		msgSize:  3 + c.chunkSize,
+		interval: c.interval,
+	}
+	if p.count = (len(data) + p.msgSize - 1) / p.msgSize; len(data) != p.count*3+int(src.Size()) {
+		unmapPrompt(data) // nolint: errcheck
+		return nil, errors.Errorf("framed prompt %s does not match its recording", path)
+	}
+	return p, nil
+}
+
+// frame writes the framed copy of a recording, replacing any older one in a
+// single step so that other processes never map half of it
+func (c *PromptCache) frame(abs, path string) error {
+	audio, err := ioutil.ReadFile(abs)
+	if err != nil {
+		return errors.Wrapf(err, "failed to read prompt %s", abs)
+	}
+
+	out := make([]byte, 0, len(audio)+3*((len(audio)+c.chunkSize-1)/c.chunkSize))
+	for len(audio) > 0 {
+		n := c.chunkSize
+		if n > len(audio) {
+			n = len(audio)
+		}
+		var hdr [3]byte
+		hdr[0] = byte(c.kind)
+		binary.BigEndian.PutUint16(hdr[1:], uint16(n))
+		out = append(append(out, hdr[:]...), audio[:n]...)
+		audio = audio[n:]
+	}
+
+	tmp, err := ioutil.TempFile(filepath.Dir(path), filepath.Base(path)+".*")
+	if err != nil {
+		return errors.Wrap(err, "failed to create framed prompt")
+	}
+	defer os.Remove(tmp.Name()) // nolint: errcheck
+
+	if _, err = tmp.Write(out); err == nil {
+		err = tmp.Close()
+	} else {
+		tmp.Close() // nolint: errcheck
+	}
+	if err != nil {
+		return errors.Wrap(err, "failed to write framed prompt")
+	}
+	if err = os.Rename(tmp.Name(), path); err != nil {
+		return errors.Wrap(err, "failed to store framed prompt")
+	}
+	return nil
+}
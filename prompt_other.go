@@ -0,0 +1,16 @@
+//go:build windows
+// +build windows
+
+package audiosocket
+
+import "io/ioutil"
+
+// mapPrompt reads the framed copy of a prompt into memory, where it can not
+// be mapped
+func mapPrompt(path string) ([]byte, error) {
+	return ioutil.ReadFile(path)
+}
+
+func unmapPrompt(data []byte) error {
+	return nil
+}
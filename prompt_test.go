@@ -0,0 +1,328 @@
+package audiosocket
+
+import (
+	"bytes"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+)
+
+// tempDir creates a directory for a test, removed by the function returned
+func tempDir(t *testing.T) (string, func()) {
+	dir, err := ioutil.TempDir("", "audiosocket-test")
+	if err != nil {
+		t.Fatal(err)
+	}
+	return dir, func() {
+		os.RemoveAll(dir) // nolint: errcheck
+	}
+}
+
+// writeRecording writes a recording and sets its modification time
+func writeRecording(t *testing.T, path string, data []byte, mtime time.Time) {
+	if err := ioutil.WriteFile(path, data, 0644); err != nil {
+		t.Fatal(err)
+	}
+	if err := os.Chtimes(path, mtime, mtime); err != nil {
+		t.Fatal(err)
+	}
+}
+
+func TestPromptFraming(t *testing.T) {
+	dir, cleanup := tempDir(t)
+	defer cleanup()
+
+	tests := []struct {
+		name      string
+		kind      Kind
+		chunkSize int
+		length    int
+		count     int
+		interval  time.Duration
+		duration  time.Duration
+	}{
+		{"slin", KindSlin, 320, 1000, 4, 20 * time.Millisecond, 62500 * time.Microsecond},
+		{"whole chunks", KindSlin, 320, 960, 3, 20 * time.Millisecond, 60 * time.Millisecond},
+		{"slin16", KindSlin16, 640, 640, 1, 20 * time.Millisecond, 20 * time.Millisecond},
+		{"ulaw", KindUlaw, 160, 200, 2, 20 * time.Millisecond, 25 * time.Millisecond},
+		{"empty", KindSlin, 320, 0, 0, 20 * time.Millisecond, 0},
+	}
+	for _, tt := range tests {
+		path := filepath.Join(dir, tt.name+".raw")
+		recording := audio(tt.length)
+		writeRecording(t, path, recording, time.Now())
+
+		c, err := NewPromptCache("", tt.kind, tt.chunkSize)
+		if err != nil {
+			t.Fatal(err)
+		}
+		p, err := c.Get(path)
+		if err != nil {
+			t.Fatalf("%s: %v", tt.name, err)
+		}
+
+		if p.Len() != tt.count || p.Interval() != tt.interval || p.Duration() != tt.duration {
+			t.Errorf("%s: %d messages of %v lasting %v, want %d of %v lasting %v", tt.name,
+				p.Len(), p.Interval(), p.Duration(), tt.count, tt.interval, tt.duration)
+		}
+		var all []byte
+		for i := 0; i < p.Len(); i++ {
+			m := p.Message(i)
+			if m.Kind() != tt.kind || int(m.ContentLength()) != len(m.Payload()) {
+				t.Errorf("%s: message %d is malformed: %x", tt.name, i, m[:3])
+			}
+			all = append(all, m.Payload()...)
+		}
+		if !bytes.Equal(all, recording) {
+			t.Errorf("%s: the messages do not carry the recording", tt.name)
+		}
+		if len(p.Bytes()) != len(recording)+3*tt.count {
+			t.Errorf("%s: %d bytes framed, want %d", tt.name, len(p.Bytes()), len(recording)+3*tt.count)
+		}
+
+		// The framed copy is kept beside the recording, and loaded only once
+		if _, err := os.Stat(p.path); err != nil || filepath.Dir(p.path) != dir ||
+			!strings.HasSuffix(p.path, framedSuffix) {
+			t.Errorf("%s: framed copy at %s: %v", tt.name, p.path, err)
+		}
+		if again, err := c.Get(path); err != nil || again != p {
+			t.Errorf("%s: loaded again: %v", tt.name, err)
+		}
+		if err := c.Close(); err != nil {
+			t.Errorf("%s: %v", tt.name, err)
+		}
+	}
+}
+
+func TestPromptCacheDir(t *testing.T) {
+	dir, cleanup := tempDir(t)
+	defer cleanup()
+	cacheDir := filepath.Join(dir, "cache")
+	if err := os.Mkdir(cacheDir, 0755); err != nil {
+		t.Fatal(err)
+	}
+
+	// Recordings of the same name in different directories stay apart
+	var paths []string
+	for i, sub := range []string{"a", "b"} {
+		if err := os.Mkdir(filepath.Join(dir, sub), 0755); err != nil {
+			t.Fatal(err)
+		}
+		path := filepath.Join(dir, sub, "hello.raw")
+		writeRecording(t, path, bytes.Repeat([]byte{byte(i)}, 500), time.Now())
+		paths = append(paths, path)
+	}
+
+	c, err := NewPromptCache(cacheDir, KindSlin, 320)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close() // nolint: errcheck
+
+	var framed []string
+	for i, path := range paths {
+		p, err := c.Get(path)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if filepath.Dir(p.path) != cacheDir {
+			t.Errorf("framed copy of %s kept at %s", path, p.path)
+		}
+		if pl := p.Message(0).Payload(); pl[0] != byte(i) {
+			t.Errorf("prompt %s plays the other recording", path)
+		}
+		framed = append(framed, p.path)
+	}
+	if framed[0] == framed[1] {
+		t.Errorf("both recordings framed to %s", framed[0])
+	}
+}
+
+func TestPromptCacheStale(t *testing.T) {
+	dir, cleanup := tempDir(t)
+	defer cleanup()
+
+	path := filepath.Join(dir, "prompt.raw")
+	then := time.Now().Add(-time.Hour)
+	writeRecording(t, path, bytes.Repeat([]byte{1}, 640), then)
+
+	load := func() (*Prompt, *PromptCache, error) {
+		c, err := NewPromptCache("", KindSlin, 320)
+		if err != nil {
+			t.Fatal(err)
+		}
+		p, err := c.Get(path)
+		return p, c, err
+	}
+
+	p, c, err := load()
+	if err != nil {
+		t.Fatal(err)
+	}
+	framed := p.path
+	c.Close() // nolint: errcheck
+
+	// A recording changed since it was framed is framed again
+	writeRecording(t, path, bytes.Repeat([]byte{2}, 960), time.Now().Add(time.Minute))
+	if p, c, err = load(); err != nil {
+		t.Fatal(err)
+	}
+	if p.Len() != 3 || p.Message(0).Payload()[0] != 2 {
+		t.Errorf("played the stale copy: %d messages of %x", p.Len(), p.Message(0).Payload()[0])
+	}
+	c.Close() // nolint: errcheck
+
+	// A framed copy newer than its recording is used as it is, so one which
+	// does not match it is refused
+	future := time.Now().Add(time.Hour)
+	if err := ioutil.WriteFile(framed, SlinMessage([]byte{1, 2}), 0644); err != nil {
+		t.Fatal(err)
+	}
+	if err := os.Chtimes(framed, future, future); err != nil {
+		t.Fatal(err)
+	}
+	if _, c, err = load(); err == nil || !strings.Contains(err.Error(), "does not match") {
+		t.Errorf("got %v, want the mismatch reported", err)
+	}
+	c.Close() // nolint: errcheck
+}
+
+func TestPromptCacheErrors(t *testing.T) {
+	dir, cleanup := tempDir(t)
+	defer cleanup()
+
+	for _, size := range []int{0, 65536} {
+		if _, err := NewPromptCache("", KindSlin, size); err == nil {
+			t.Errorf("created a cache of chunks of %d bytes", size)
+		}
+	}
+	if _, err := NewPromptCache("", KindMux, 320); err == nil {
+		t.Error("created a cache of a kind which can not be chunked")
+	}
+
+	c, err := NewPromptCache("", KindSlin, 320)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close() // nolint: errcheck
+	if _, err := c.Get(filepath.Join(dir, "missing.raw")); err == nil {
+		t.Error("loaded a prompt which does not exist")
+	}
+}
+
+func TestPlayPrompt(t *testing.T) {
+	dir, cleanup := tempDir(t)
+	defer cleanup()
+
+	path := filepath.Join(dir, "prompt.raw")
+	writeRecording(t, path, audio(1000), time.Now())
+	c, err := NewPromptCache("", KindSlin, 80)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close() // nolint: errcheck
+	p, err := c.Get(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// Each message is a write of its own, one interval after the last
+	rec := &recordWriter{}
+	start := time.Now()
+	if err := PlayPrompt(rec, p); err != nil {
+		t.Fatal(err)
+	}
+	if d := time.Since(start); d < time.Duration(p.Len()-1)*p.Interval() {
+		t.Errorf("%d messages played in %v", p.Len(), d)
+	}
+	writes := rec.get()
+	if len(writes) != p.Len() {
+		t.Fatalf("%d writes, want %d", len(writes), p.Len())
+	}
+	for i, w := range writes {
+		if !bytes.Equal(w, p.Message(i)) {
+			t.Errorf("write %d is %x, want %x", i, w, p.Message(i))
+		}
+	}
+}
+
+func TestSendPromptFile(t *testing.T) {
+	dir, cleanup := tempDir(t)
+	defer cleanup()
+
+	path := filepath.Join(dir, "prompt.raw")
+	writeRecording(t, path, audio(5000), time.Now())
+	c, err := NewPromptCache("", KindSlin, 320)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close() // nolint: errcheck
+	p, err := c.Get(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer l.Close() // nolint: errcheck
+	received := make(chan []byte, 1)
+	go func() {
+		conn, err := l.Accept()
+		if err != nil {
+			received <- nil
+			return
+		}
+		defer conn.Close() // nolint: errcheck
+		b, _ := ioutil.ReadAll(conn)
+		received <- b
+	}()
+
+	conn, err := net.Dial("tcp", l.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	s := ChunkSender{Sendfile: true, Lead: p.Len()}
+	if err := s.SendPrompt(conn, p); err != nil {
+		t.Fatal(err)
+	}
+	conn.Close() // nolint: errcheck
+
+	select {
+	case b := <-received:
+		if !bytes.Equal(b, p.Bytes()) {
+			t.Errorf("received %d bytes which do not match the %d of the prompt", len(b), len(p.Bytes()))
+		}
+		// Every message is read from the file, whole, in turn
+		r := NewReader(bytes.NewReader(b))
+		for i := 0; i < p.Len(); i++ {
+			if _, err := r.ReadMessage(); err != nil {
+				t.Fatalf("message %d: %v", i, err)
+			}
+		}
+		if _, err := r.ReadMessage(); err != io.EOF {
+			t.Errorf("got %v after the prompt, want io.EOF", err)
+		}
+	case <-time.After(testTimeout):
+		t.Fatal("prompt not received")
+	}
+
+	// The framed copy has to exist to be sent from
+	if err := os.Remove(p.path); err != nil {
+		t.Fatal(err)
+	}
+	conn, err = net.Dial("tcp", l.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close() // nolint: errcheck
+	if err := s.SendPrompt(conn, p); err == nil {
+		t.Error("sent a prompt whose framed copy is gone")
+	}
+}
@@ -0,0 +1,82 @@
+package audiosocket
+
+import (
+	"bufio"
+	"encoding/binary"
+	"io"
+
+	"github.com/pkg/errors"
+)
+
+// Reader reads the messages of an audiosocket connection through a buffer,
+// reusing the memory of each message for the next rather than allocating for
+// every one as NextMessage does
+type Reader struct {
+	r   *bufio.Reader
+	buf []byte
+}
+
+// NewReader creates a Reader for the given connection.  If it is already a
+// *bufio.Reader, it is read directly.
+func NewReader(r io.Reader) *Reader {
+	br, ok := r.(*bufio.Reader)
+	if !ok {
+		br = bufio.NewReader(r)
+	}
+	return &Reader{
+		r:   br,
+		buf: make([]byte, 0, 3+DefaultSlinChunkSize),
+	}
+}
+
+// ReadMessage reads the next message.  The Message returned shares the memory
+// of the Reader and is only valid until the next call; copy it to keep it for
+// longer.  It returns io.EOF if the connection ends between messages.
+func (r *Reader) ReadMessage() (Message, error) {
+	m, err := r.ReadMessageInto(r.buf)
+	if cap(m) > cap(r.buf) {
+		r.buf = m[:0]
+	}
+	return m, err
+}
+
+// ReadMessageInto reads the next message into dst, overwriting what it held,
+// and returns it.  A new buffer is allocated only if dst is too small, so the
+// caller may keep the Message for as long as it likes and pass it back in to
+// be reused.  It returns io.EOF if the connection ends between messages.
+func (r *Reader) ReadMessageInto(dst []byte) (Message, error) {
+	if cap(dst) < 3 {
+		dst = make([]byte, 3, 3+DefaultSlinChunkSize)
+	}
+	dst = dst[:3]
+
+	if _, err := io.ReadFull(r.r, dst); err != nil {
+		if err == io.EOF {
+			return nil, io.EOF
+		}
+		return nil, errors.Wrap(err, "failed to read header")
+	}
+
+	h := Message(dst).headerLen()
+	n := h + int(binary.BigEndian.Uint16(dst[1:]))
+	if cap(dst) < n {
+		grown := make([]byte, n)
+		copy(grown, dst)
+		dst = grown
+	}
+	dst = dst[:n]
+
+	if _, err := io.ReadFull(r.r, dst[3:]); err != nil {
+		if err == io.EOF {
+			err = io.ErrUnexpectedEOF
+		}
+		return nil, errors.Wrap(err, "failed to read payload")
+	}
+	return dst, nil
+}
+
+// Read reads bytes from the connection through the buffer of the Reader, so
+// that GetID and NextMessage may be used with it as well
+func (r *Reader) Read(p []byte) (int, error) {
+	return r.r.Read(p)
+}
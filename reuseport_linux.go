@@ -0,0 +1,24 @@
+//go:build linux && !mips && !mipsle && !mips64 && !mips64le
+// +build linux,!mips,!mipsle,!mips64,!mips64le
+
+package audiosocket
+
+import "syscall"
+
+// soReusePort is SO_REUSEPORT, which the syscall package does not define for
+// Linux
+const soReusePort = 0xf
+
+// reusePortSupported indicates whether several listeners may share an address
+const reusePortSupported = true
+
+// reusePort sets SO_REUSEPORT on a listening socket before it is bound
+func reusePort(network, address string, c syscall.RawConn) error {
+	var serr error
+	if err := c.Control(func(fd uintptr) {
+		serr = syscall.SetsockoptInt(int(fd), syscall.SOL_SOCKET, soReusePort, 1)
+	}); err != nil {
+		return err
+	}
+	return serr
+}
@@ -0,0 +1,546 @@
+package audiosocket
+
+import (
+	"context"
+	"net"
+	"runtime"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/gofrs/uuid"
+	"github.com/pkg/errors"
+)
+
+// DefaultSessionQueueSize is the number of messages held in each direction for
+// a session which is not keeping up: one second of 20ms frames
+const DefaultSessionQueueSize = 50
+
+// DefaultIDTimeout is a suitable IDTimeout for a Server whose callers do not
+// keep idle connections open to it
+const DefaultIDTimeout = 5 * time.Second
+
+// sessionFlushTimeout is how long the messages still queued for a session are
+// given to be written once it ends
+const sessionFlushTimeout = time.Second
+
+// ErrServerClosed is returned by the Serve methods of a Server once it has been
+// shut down or closed
+var ErrServerClosed = errors.New("audiosocket: server closed")
+
+// ErrSessionEnded is returned when sending on a session which has ended
+var ErrSessionEnded = errors.New("audiosocket: session ended")
+
+// Handler handles the calls accepted by a Server.  ServeAudioSocket is called
+// in a goroutine of its own for each call, which ends when it returns.
+type Handler interface {
+	ServeAudioSocket(s *Session)
+}
+
+// HandlerFunc allows an ordinary function to be used as a Handler
+type HandlerFunc func(s *Session)
+
+// ServeAudioSocket calls f(s)
+func (f HandlerFunc) ServeAudioSocket(s *Session) {
+	f(s)
+}
+
+// Server accepts AudioSocket calls from Asterisk and hands each to its Handler
+// as a Session.  The messages of a session travel through bounded queues in
+// both directions, so that neither a slow handler nor a slow connection holds
+// up the other side: when a queue is full, its oldest message is dropped to
+// make room.
+type Server struct {
+	// Addr is the TCP address to listen on with ListenAndServe
+	Addr string
+
+	// Handler handles each call
+	Handler Handler
+
+	// MaxSessions is the number of calls which may be in progress at once.
+	// A call beyond it is hung up as soon as it is accepted, so that Asterisk
+	// fails it rather than waiting.  Zero means no limit.
+	MaxSessions int
+
+	// QueueSize is the number of messages held in each direction for each
+	// session.  Zero means DefaultSessionQueueSize.
+	QueueSize int
+
+	// Listeners is the number of sockets ListenAndServe listens on, sharing
+	// the address with SO_REUSEPORT so that the kernel spreads the calls
+	// between them.  Zero means one for each processor where SO_REUSEPORT is
+	// supported, and one elsewhere.
+	Listeners int
+
+	// IDTimeout is how long a new call may take to send its ID.  Zero means
+	// no limit.  A connection from the pool which res_audiosocket keeps with
+	// pool_size sends nothing until a call uses it, which may be long after
+	// it was opened, so a limit should only be set when no pool is kept.
+	IDTimeout time.Duration
+
+	mu        sync.Mutex
+	listeners map[net.Listener]struct{}
+	pending   map[net.Conn]struct{}
+	sessions  map[*Session]struct{}
+	closed    bool
+	active    int64
+	rejected  uint64
+	wg        sync.WaitGroup
+}
+
+// Session is one call accepted by a Server
+type Session struct {
+	// ID is the unique identifier of the call, from its ID message
+	ID uuid.UUID
+
+	conn net.Conn
+	r    *Reader
+
+	in  chan Message
+	out chan Message
+
+	droppedIn  uint64
+	droppedOut uint64
+
+	ctx    context.Context
+	cancel context.CancelFunc
+
+	remoteEnded int32
+	extended    int32
+	stop        chan struct{}
+	stopOnce    sync.Once
+	writerDone  chan struct{}
+	readerDone  chan struct{}
+}
+
+// ListenAndServe listens on the Addr of the server and serves the calls it
+// accepts until the server is shut down, when it returns ErrServerClosed
+func (srv *Server) ListenAndServe() error {
+	n := srv.Listeners
+	if n <= 0 {
+		n = 1
+		if reusePortSupported {
+			n = runtime.GOMAXPROCS(0)
+		}
+	}
+
+	lc := net.ListenConfig{}
+	if n > 1 {
+		if !reusePortSupported {
+			return errors.New("multiple listeners need SO_REUSEPORT, which is not supported here")
+		}
+		lc.Control = reusePort
+	}
+
+	ls := make([]net.Listener, 0, n)
+	for i := 0; i < n; i++ {
+		l, err := lc.Listen(context.Background(), "tcp", srv.Addr)
+		if err != nil {
+			for _, l := range ls {
+				l.Close() // nolint: errcheck
+			}
+			return errors.Wrapf(err, "failed to bind listener to socket %s", srv.Addr)
+		}
+		ls = append(ls, l)
+	}
+
+	errs := make(chan error, n)
+	for _, l := range ls {
+		go func(l net.Listener) {
+			errs <- srv.Serve(l)
+		}(l)
+	}
+
+	// The first listener to fail takes the others down with it
+	err := <-errs
+	for _, l := range ls {
+		l.Close() // nolint: errcheck
+	}
+	for i := 1; i < n; i++ {
+		<-errs
+	}
+	return err
+}
+
+// Serve accepts calls on the listener until it fails or the server is shut
+// down, when it returns ErrServerClosed
+func (srv *Server) Serve(l net.Listener) error {
+	if !srv.track(l, true) {
+		l.Close() // nolint: errcheck
+		return ErrServerClosed
+	}
+	defer srv.track(l, false)
+
+	for {
+		c, err := l.Accept()
+		if err != nil {
+			if srv.isClosed() {
+				return ErrServerClosed
+			}
+			if ne, ok := err.(net.Error); ok && ne.Temporary() {
+				time.Sleep(5 * time.Millisecond)
+				continue
+			}
+			return errors.Wrap(err, "failed to accept new connection")
+		}
+
+		if n := atomic.AddInt64(&srv.active, 1); srv.MaxSessions > 0 && n > int64(srv.MaxSessions) {
+			atomic.AddInt64(&srv.active, -1)
+			atomic.AddUint64(&srv.rejected, 1)
+			go reject(c)
+			continue
+		}
+
+		srv.wg.Add(1)
+		go srv.serveConn(c)
+	}
+}
+
+// reject hangs up a call which there is no room for
+func reject(c net.Conn) {
+	c.SetWriteDeadline(time.Now().Add(time.Second)) // nolint: errcheck
+	c.Write(HangupMessage())                        // nolint: errcheck
+	c.Close()                                       // nolint: errcheck
+}
+
+// Sessions returns the number of calls in progress
+func (srv *Server) Sessions() int {
+	return int(atomic.LoadInt64(&srv.active))
+}
+
+// Rejected returns the number of calls which were hung up because MaxSessions
+// were already in progress
+func (srv *Server) Rejected() uint64 {
+	return atomic.LoadUint64(&srv.rejected)
+}
+
+// Shutdown stops the server accepting calls, closes the connections which have
+// not yet sent an ID, and waits for the calls in progress to end.  If the
+// context ends first, the remaining calls are hung up and its error is
+// returned.
+func (srv *Server) Shutdown(ctx context.Context) error {
+	srv.closeListeners()
+
+	done := make(chan struct{})
+	go func() {
+		srv.wg.Wait()
+		close(done)
+	}()
+
+	select {
+	case <-done:
+		return nil
+	case <-ctx.Done():
+		srv.hangupAll()
+		return ctx.Err()
+	}
+}
+
+// Close stops the server accepting calls, closes the connections which have
+// not yet sent an ID, and hangs up the calls in progress
+func (srv *Server) Close() error {
+	srv.closeListeners()
+	srv.hangupAll()
+	return nil
+}
+
+func (srv *Server) isClosed() bool {
+	srv.mu.Lock()
+	defer srv.mu.Unlock()
+	return srv.closed
+}
+
+func (srv *Server) closeListeners() {
+	srv.mu.Lock()
+	defer srv.mu.Unlock()
+
+	srv.closed = true
+	for l := range srv.listeners {
+		l.Close() // nolint: errcheck
+	}
+
+	// An idle connection from a pool may wait for its ID indefinitely
+	for c := range srv.pending {
+		c.Close() // nolint: errcheck
+	}
+}
+
+func (srv *Server) hangupAll() {
+	srv.mu.Lock()
+	defer srv.mu.Unlock()
+
+	for s := range srv.sessions {
+		s.Hangup()
+	}
+}
+
+func (srv *Server) track(l net.Listener, add bool) bool {
+	srv.mu.Lock()
+	defer srv.mu.Unlock()
+
+	if !add {
+		delete(srv.listeners, l)
+		return true
+	}
+	if srv.closed {
+		return false
+	}
+	if srv.listeners == nil {
+		srv.listeners = make(map[net.Listener]struct{})
+	}
+	srv.listeners[l] = struct{}{}
+	return true
+}
+
+func (srv *Server) trackConn(c net.Conn, add bool) bool {
+	srv.mu.Lock()
+	defer srv.mu.Unlock()
+
+	if !add {
+		delete(srv.pending, c)
+		return true
+	}
+	if srv.closed {
+		return false
+	}
+	if srv.pending == nil {
+		srv.pending = make(map[net.Conn]struct{})
+	}
+	srv.pending[c] = struct{}{}
+	return true
+}
+
+func (srv *Server) trackSession(s *Session, add bool) {
+	srv.mu.Lock()
+	defer srv.mu.Unlock()
+
+	if !add {
+		delete(srv.sessions, s)
+		return
+	}
+	delete(srv.pending, s.conn)
+	if srv.sessions == nil {
+		srv.sessions = make(map[*Session]struct{})
+	}
+	srv.sessions[s] = struct{}{}
+	if srv.closed {
+		// Close raced with the accept of this call
+		s.Hangup()
+	}
+}
+
+func (srv *Server) serveConn(c net.Conn) {
+	defer srv.wg.Done()
+	defer atomic.AddInt64(&srv.active, -1)
+
+	queueSize := srv.QueueSize
+	if queueSize <= 0 {
+		queueSize = DefaultSessionQueueSize
+	}
+
+	if !srv.trackConn(c, true) {
+		// Close raced with the accept of this connection
+		c.Close() // nolint: errcheck
+		return
+	}
+
+	r := NewReader(c)
+	if srv.IDTimeout > 0 {
+		c.SetReadDeadline(time.Now().Add(srv.IDTimeout)) // nolint: errcheck
+	}
+	m, err := r.ReadMessage()
+	var id uuid.UUID
+	if err == nil {
+		id, err = m.ID()
+	}
+	if err != nil {
+		srv.trackConn(c, false)
+		c.Close() // nolint: errcheck
+		return
+	}
+	if srv.IDTimeout > 0 {
+		c.SetReadDeadline(time.Time{}) // nolint: errcheck
+	}
+
+	s := &Session{
+		ID:         id,
+		conn:       c,
+		r:          r,
+		in:         make(chan Message, queueSize),
+		out:        make(chan Message, queueSize),
+		stop:       make(chan struct{}),
+		writerDone: make(chan struct{}),
+		readerDone: make(chan struct{}),
+	}
+	s.ctx, s.cancel = context.WithCancel(context.Background())
+
+	srv.trackSession(s, true)
+	defer srv.trackSession(s, false)
+
+	go s.readLoop()
+	go s.writeLoop()
+
+	srv.Handler.ServeAudioSocket(s)
+	s.finish()
+}
+
+// Messages returns the channel of the messages received for the call.  It is
+// closed once Asterisk hangs up or the connection fails.  If the handler falls
+// more than the queue size behind, the oldest messages are dropped.
+func (s *Session) Messages() <-chan Message {
+	return s.in
+}
+
+// Send queues a message to be sent to Asterisk.  If the connection has fallen
+// more than the queue size behind, the oldest queued message is dropped to
+// make room.  The message must not be modified after it has been queued.
+func (s *Session) Send(m Message) error {
+	select {
+	case <-s.ctx.Done():
+		return ErrSessionEnded
+	default:
+	}
+
+	pushDropOldest(s.out, m, &s.droppedOut)
+	return nil
+}
+
+// Write queues a copy of each of the whole messages in p to be sent to
+// Asterisk, as Send does, so that a Session may be used as the writer of
+// SendSlinChunks, a ChunkSender or PlayPrompt
+func (s *Session) Write(p []byte) (int, error) {
+	for off := 0; off < len(p); {
+		m := Message(p[off:])
+		n := m.headerLen()
+		if len(m) >= n {
+			n += int(m.ContentLength())
+		}
+		if len(m) < n {
+			return off, errors.New("partial message written to session")
+		}
+		if err := s.Send(append(Message(nil), m[:n]...)); err != nil {
+			return off, err
+		}
+		off += n
+	}
+	return len(p), nil
+}
+
+// Context returns a context which is done once the call has ended, whether
+// Asterisk hung up, the connection failed, or the server hung it up
+func (s *Session) Context() context.Context {
+	return s.ctx
+}
+
+// RemoteAddr returns the address of Asterisk
+func (s *Session) RemoteAddr() net.Addr {
+	return s.conn.RemoteAddr()
+}
+
+// Dropped returns the number of messages which were dropped because the handler
+// or the connection did not keep up
+func (s *Session) Dropped() (in, out uint64) {
+	return atomic.LoadUint64(&s.droppedIn), atomic.LoadUint64(&s.droppedOut)
+}
+
+// Extended indicates whether Asterisk has offered the extended header, which
+// the Session accepts, so that the messages received after the offer carry a
+// Seq and Timestamp.  The offer follows the ID message, so it is not known
+// before the first messages have been received.
+func (s *Session) Extended() bool {
+	return atomic.LoadInt32(&s.extended) != 0
+}
+
+// Hangup ends the call, closing its connection.  The handler should return
+// once its Context is done.
+func (s *Session) Hangup() {
+	s.cancel()
+	s.conn.Close() // nolint: errcheck
+}
+
+func (s *Session) readLoop() {
+	defer close(s.readerDone)
+	defer close(s.in)
+	defer s.cancel()
+
+	for {
+		m, err := s.r.ReadMessage()
+		if err != nil {
+			return
+		}
+		if m.Kind() == KindHangup {
+			atomic.StoreInt32(&s.remoteEnded, 1)
+			return
+		}
+		if m.OffersExtended() {
+			// Accepting is left to the Session rather than its handler
+			if atomic.CompareAndSwapInt32(&s.extended, 0, 1) {
+				s.Send(IDFlagsMessage(IDFlagExtended)) // nolint: errcheck
+			}
+			continue
+		}
+
+		// The Reader reuses its buffer, so the queued message needs its own
+		pushDropOldest(s.in, append(Message(nil), m...), &s.droppedIn)
+	}
+}
+
+func (s *Session) writeLoop() {
+	defer close(s.writerDone)
+
+	for {
+		select {
+		case m := <-s.out:
+			if _, err := s.conn.Write(m); err != nil {
+				s.cancel()
+				return
+			}
+		case <-s.stop:
+			// Give what is left a moment to go out
+			s.conn.SetWriteDeadline(time.Now().Add(sessionFlushTimeout)) // nolint: errcheck
+			for {
+				select {
+				case m := <-s.out:
+					if _, err := s.conn.Write(m); err != nil {
+						return
+					}
+				default:
+					return
+				}
+			}
+		}
+	}
+}
+
+// finish ends the call once its handler has returned
+func (s *Session) finish() {
+	if atomic.LoadInt32(&s.remoteEnded) == 0 && s.ctx.Err() == nil {
+		pushDropOldest(s.out, HangupMessage(), &s.droppedOut)
+	}
+	s.cancel()
+	s.stopOnce.Do(func() {
+		close(s.stop)
+	})
+	<-s.writerDone
+
+	s.conn.Close() // nolint: errcheck
+	<-s.readerDone
+}
+
+// pushDropOldest queues a message, dropping the oldest queued message if there
+// is no room
+func pushDropOldest(q chan Message, m Message, dropped *uint64) {
+	for {
+		select {
+		case q <- m:
+			return
+		default:
+		}
+
+		select {
+		case <-q:
+			atomic.AddUint64(dropped, 1)
+		default:
+		}
+	}
+}
@@ -0,0 +1,382 @@
+package audiosocket
+
+import (
+	"bytes"
+	"context"
+	"io"
+	"net"
+	"testing"
+	"time"
+)
+
+func TestPushDropOldest(t *testing.T) {
+	tests := []struct {
+		name    string
+		size    int
+		pushed  int
+		kept    []byte
+		dropped uint64
+	}{
+		{"room", 3, 2, []byte{0, 1}, 0},
+		{"full", 3, 3, []byte{0, 1, 2}, 0},
+		{"over", 3, 5, []byte{2, 3, 4}, 2},
+		{"one", 1, 4, []byte{3}, 3},
+	}
+	for _, tt := range tests {
+		q := make(chan Message, tt.size)
+		var dropped uint64
+		for i := 0; i < tt.pushed; i++ {
+			pushDropOldest(q, SlinMessage([]byte{byte(i)}), &dropped)
+		}
+		close(q)
+
+		var kept []byte
+		for m := range q {
+			kept = append(kept, m.Payload()...)
+		}
+		if !bytes.Equal(kept, tt.kept) || dropped != tt.dropped {
+			t.Errorf("%s: kept %v and dropped %d, want %v and %d", tt.name, kept, dropped,
+				tt.kept, tt.dropped)
+		}
+	}
+}
+
+// testServer is a Server listening on a loopback address, whose handler hands
+// each session to the test and returns once the test says so
+type testServer struct {
+	*Server
+	t        *testing.T
+	l        net.Listener
+	sessions chan *Session
+	release  chan struct{}
+	served   chan error
+}
+
+func newTestServer(t *testing.T, srv *Server) *testServer {
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	ts := &testServer{
+		Server:   srv,
+		t:        t,
+		l:        l,
+		sessions: make(chan *Session, 16),
+		release:  make(chan struct{}),
+		served:   make(chan error, 1),
+	}
+	srv.Handler = HandlerFunc(func(s *Session) {
+		ts.sessions <- s
+		select {
+		case <-ts.release:
+		case <-s.Context().Done():
+		}
+	})
+	go func() {
+		ts.served <- srv.Serve(l)
+	}()
+	return ts
+}
+
+// call connects to the server as Asterisk does, sending the ID of the call
+func (ts *testServer) call() net.Conn {
+	c, err := net.Dial("tcp", ts.l.Addr().String())
+	if err != nil {
+		ts.t.Fatal(err)
+	}
+	if _, err := c.Write(IDMessage(testID)); err != nil {
+		ts.t.Fatal(err)
+	}
+	return c
+}
+
+func (ts *testServer) session() *Session {
+	select {
+	case s := <-ts.sessions:
+		return s
+	case <-time.After(testTimeout):
+		ts.t.Fatal("no session started")
+	}
+	return nil
+}
+
+func (ts *testServer) close() {
+	ts.Close() // nolint: errcheck
+	if err := <-ts.served; err != ErrServerClosed {
+		ts.t.Errorf("Serve returned %v, want ErrServerClosed", err)
+	}
+}
+
+// receive reads the next message which the server sent.  It returns io.EOF if
+// the server closes the connection between messages.
+func receive(c net.Conn) (Message, error) {
+	c.SetReadDeadline(time.Now().Add(testTimeout)) // nolint: errcheck
+	hdr := make([]byte, 3)
+	if _, err := io.ReadFull(c, hdr); err != nil {
+		return nil, err
+	}
+	m := make([]byte, Message(hdr).headerLen()+int(Message(hdr).ContentLength()))
+	copy(m, hdr)
+	if _, err := io.ReadFull(c, m[3:]); err != nil {
+		return nil, err
+	}
+	return m, nil
+}
+
+// waitFor polls until cond holds
+func waitFor(t *testing.T, what string, cond func() bool) {
+	deadline := time.Now().Add(testTimeout)
+	for !cond() {
+		if time.Now().After(deadline) {
+			t.Fatalf("timed out waiting for %s", what)
+		}
+		time.Sleep(time.Millisecond)
+	}
+}
+
+func TestSessionMessages(t *testing.T) {
+	ts := newTestServer(t, &Server{})
+	defer ts.close()
+
+	c := ts.call()
+	defer c.Close() // nolint: errcheck
+	s := ts.session()
+	if s.ID != testID {
+		t.Errorf("session has ID %v, want %v", s.ID, testID)
+	}
+
+	if _, err := c.Write(SlinMessage([]byte{1, 2})); err != nil {
+		t.Fatal(err)
+	}
+	select {
+	case m := <-s.Messages():
+		if !bytes.Equal(m, SlinMessage([]byte{1, 2})) {
+			t.Errorf("received %x", m)
+		}
+	case <-time.After(testTimeout):
+		t.Fatal("nothing received")
+	}
+
+	if _, err := s.Write(append(SlinMessage([]byte{3, 4}), SilenceMessage(time.Second)...)); err != nil {
+		t.Fatal(err)
+	}
+	for _, want := range []Message{SlinMessage([]byte{3, 4}), SilenceMessage(time.Second)} {
+		if m, err := receive(c); err != nil || !bytes.Equal(m, want) {
+			t.Fatalf("got %x, %v, want %x", m, err, want)
+		}
+	}
+	if _, err := s.Write(SlinMessage([]byte{3, 4})[:4]); err == nil {
+		t.Error("queued part of a message")
+	}
+
+	// Asterisk offers the extended header, which the session accepts
+	if _, err := c.Write(IDFlagsMessage(IDFlagExtended)); err != nil {
+		t.Fatal(err)
+	}
+	if m, err := receive(c); err != nil || !m.OffersExtended() {
+		t.Fatalf("got %x, %v, want the extended header accepted", m, err)
+	}
+	if !s.Extended() {
+		t.Error("session does not report the extended header")
+	}
+}
+
+func TestSessionDropOldest(t *testing.T) {
+	const queueSize, sent = 4, 10
+
+	ts := newTestServer(t, &Server{QueueSize: queueSize})
+	defer ts.close()
+
+	c := ts.call()
+	defer c.Close() // nolint: errcheck
+	s := ts.session()
+
+	// The handler does not read until everything has arrived
+	for i := 0; i < sent; i++ {
+		if _, err := c.Write(SlinMessage([]byte{byte(i)})); err != nil {
+			t.Fatal(err)
+		}
+	}
+	waitFor(t, "messages to be dropped", func() bool {
+		in, _ := s.Dropped()
+		return in == sent-queueSize
+	})
+
+	for i := sent - queueSize; i < sent; i++ {
+		m := <-s.Messages()
+		if p := m.Payload(); len(p) != 1 || p[0] != byte(i) {
+			t.Fatalf("received %x, want message %d", m, i)
+		}
+	}
+}
+
+func TestSessionRemoteHangup(t *testing.T) {
+	ts := newTestServer(t, &Server{})
+	defer ts.close()
+
+	c := ts.call()
+	defer c.Close() // nolint: errcheck
+	s := ts.session()
+
+	if _, err := c.Write(HangupMessage()); err != nil {
+		t.Fatal(err)
+	}
+	select {
+	case _, ok := <-s.Messages():
+		if ok {
+			t.Error("the hangup was handed to the handler")
+		}
+	case <-time.After(testTimeout):
+		t.Fatal("messages not closed after the hangup")
+	}
+	select {
+	case <-s.Context().Done():
+	case <-time.After(testTimeout):
+		t.Fatal("context not done after the hangup")
+	}
+	if err := s.Send(SlinMessage([]byte{1, 2})); err != ErrSessionEnded {
+		t.Errorf("Send returned %v after the hangup, want ErrSessionEnded", err)
+	}
+
+	// Asterisk hung up, so it is not sent a hangup back
+	if m, err := receive(c); err != io.EOF {
+		t.Errorf("got %x, %v, want the connection closed", m, err)
+	}
+	waitFor(t, "the session to end", func() bool {
+		return ts.Sessions() == 0
+	})
+}
+
+func TestSessionFinish(t *testing.T) {
+	ts := newTestServer(t, &Server{})
+	defer ts.close()
+
+	c := ts.call()
+	defer c.Close() // nolint: errcheck
+	s := ts.session()
+
+	// What is still queued goes out ahead of the hangup once the handler returns
+	if err := s.Send(SlinMessage([]byte{1, 2})); err != nil {
+		t.Fatal(err)
+	}
+	close(ts.release)
+	for _, kind := range []Kind{KindSlin, KindHangup} {
+		if m, err := receive(c); err != nil || m.Kind() != kind {
+			t.Fatalf("got %x, %v, want a message of kind %#x", m, err, kind)
+		}
+	}
+	if m, err := receive(c); err != io.EOF {
+		t.Errorf("got %x, %v, want the connection closed", m, err)
+	}
+}
+
+func TestSessionHangup(t *testing.T) {
+	ts := newTestServer(t, &Server{})
+	defer ts.close()
+
+	c := ts.call()
+	defer c.Close() // nolint: errcheck
+	s := ts.session()
+
+	s.Hangup()
+	if m, err := receive(c); err != io.EOF {
+		t.Errorf("got %x, %v, want the connection closed", m, err)
+	}
+	waitFor(t, "the session to end", func() bool {
+		return ts.Sessions() == 0
+	})
+}
+
+func TestServerMaxSessions(t *testing.T) {
+	ts := newTestServer(t, &Server{MaxSessions: 1})
+	defer ts.close()
+
+	c := ts.call()
+	defer c.Close() // nolint: errcheck
+	ts.session()
+
+	// A call beyond the limit is hung up at once
+	c2 := ts.call()
+	defer c2.Close() // nolint: errcheck
+	if m, err := receive(c2); err != nil || m.Kind() != KindHangup {
+		t.Fatalf("got %x, %v, want a hangup", m, err)
+	}
+	if ts.Rejected() != 1 || ts.Sessions() != 1 {
+		t.Errorf("%d rejected and %d in progress, want 1 and 1", ts.Rejected(), ts.Sessions())
+	}
+}
+
+func TestServerIDTimeout(t *testing.T) {
+	tests := []struct {
+		name    string
+		timeout time.Duration
+		closed  bool
+	}{
+		// A pooled connection waits for its call for as long as it takes
+		{"none", 0, false},
+		{"set", 10 * time.Millisecond, true},
+	}
+	for _, tt := range tests {
+		ts := newTestServer(t, &Server{IDTimeout: tt.timeout})
+
+		c, err := net.Dial("tcp", ts.l.Addr().String())
+		if err != nil {
+			t.Fatal(err)
+		}
+		c.SetReadDeadline(time.Now().Add(200 * time.Millisecond)) // nolint: errcheck
+		_, err = c.Read(make([]byte, 1))
+		ne, ok := err.(net.Error)
+		if closed := !ok || !ne.Timeout(); closed != tt.closed {
+			t.Errorf("%s: got %v, want closed %v", tt.name, err, tt.closed)
+		}
+
+		if !tt.closed {
+			// The ID still starts the call
+			if _, err := c.Write(IDMessage(testID)); err != nil {
+				t.Fatal(err)
+			}
+			ts.session()
+		}
+		c.Close() // nolint: errcheck
+		ts.close()
+	}
+}
+
+func TestServerCloseIdle(t *testing.T) {
+	tests := []struct {
+		name  string
+		close bool
+	}{
+		{"close", true},
+		{"shutdown", false},
+	}
+	for _, tt := range tests {
+		ts := newTestServer(t, &Server{})
+
+		// A connection from a pool, which has not sent an ID
+		c, err := net.Dial("tcp", ts.l.Addr().String())
+		if err != nil {
+			t.Fatal(err)
+		}
+		waitFor(t, "the connection to be accepted", func() bool {
+			return ts.Sessions() == 1
+		})
+
+		if tt.close {
+			ts.Close() // nolint: errcheck
+		}
+		ctx, cancel := context.WithTimeout(context.Background(), testTimeout)
+		if err := ts.Shutdown(ctx); err != nil {
+			t.Errorf("%s: Shutdown returned %v", tt.name, err)
+		}
+		cancel()
+		if n := ts.Sessions(); n != 0 {
+			t.Errorf("%s: %d connections left open", tt.name, n)
+		}
+		if m, err := receive(c); err != io.EOF {
+			t.Errorf("%s: got %x, %v, want the connection closed", tt.name, m, err)
+		}
+		c.Close() // nolint: errcheck
+		ts.close()
+	}
+}
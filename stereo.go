@@ -0,0 +1,66 @@
+package audiosocket
+
+import "encoding/binary"
+
+// Stereo is the payload of a KindSlinStereo message: two channels of 8kHz
+// signed linear audio, whose 16-bit little-endian samples alternate, starting
+// with the first channel
+type Stereo []byte
+
+// Stereo returns the payload of a KindSlinStereo message, without copying it,
+// or nil if the message is of another kind
+func (m Message) Stereo() Stereo {
+	if m.Kind() != KindSlinStereo {
+		return nil
+	}
+	return Stereo(m.Payload())
+}
+
+// Samples returns the number of samples of each channel
+func (s Stereo) Samples() int {
+	return len(s) / 4
+}
+
+// Left returns the i'th sample of the first channel, which Asterisk fills with
+// the audio read from the channel
+func (s Stereo) Left(i int) int16 {
+	return int16(binary.LittleEndian.Uint16(s[4*i:]))
+}
+
+// Right returns the i'th sample of the second channel, which Asterisk fills
+// with the audio written to the channel
+func (s Stereo) Right(i int) int16 {
+	return int16(binary.LittleEndian.Uint16(s[4*i+2:]))
+}
+
+// Deinterleave copies the two channels into left and right as mono signed
+// linear audio, such as the payload of a KindSlin message, and returns the
+// number of samples of each copied.  Either may be nil to skip its channel.
+// Nothing is allocated, so that the same buffers may be reused for every
+// message; only as many samples as fit in both are copied.
+func (s Stereo) Deinterleave(left, right []byte) int {
+	n := s.Samples()
+	if left != nil && len(left)/2 < n {
+		n = len(left) / 2
+	}
+	if right != nil && len(right)/2 < n {
+		n = len(right) / 2
+	}
+
+	switch {
+	case left != nil && right != nil:
+		for i := 0; i < n; i++ {
+			left[2*i], left[2*i+1] = s[4*i], s[4*i+1]
+			right[2*i], right[2*i+1] = s[4*i+2], s[4*i+3]
+		}
+	case left != nil:
+		for i := 0; i < n; i++ {
+			left[2*i], left[2*i+1] = s[4*i], s[4*i+1]
+		}
+	case right != nil:
+		for i := 0; i < n; i++ {
+			right[2*i], right[2*i+1] = s[4*i+2], s[4*i+3]
+		}
+	}
+	return n
+}
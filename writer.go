@@ -0,0 +1,163 @@
+package audiosocket
+
+import (
+	"io"
+	"sync"
+	"time"
+
+	"github.com/pkg/errors"
+)
+
+// DefaultWriterSize is the number of bytes a Writer gathers before it writes
+// them out: sixteen 20ms slin messages
+const DefaultWriterSize = 16 * (3 + DefaultSlinChunkSize)
+
+// Writer gathers messages into a buffer and writes them to an audiosocket
+// connection together, so that many small messages cost a single write.  The
+// gathered messages are written when Flush is called, once they reach the size
+// of the Writer, and once the oldest of them has waited for its delay.  The
+// buffer is reused for every write, and messages added with Append are built
+// straight into it, so that nothing is allocated once it has grown.
+//
+// A Writer is safe for concurrent use.  After a write fails, every later call
+// returns the same error.
+type Writer struct {
+	w     io.Writer
+	size  int
+	delay time.Duration
+
+	mu    sync.Mutex
+	buf   []byte
+	since time.Time
+	timer *time.Timer
+	err   error
+}
+
+// NewWriter creates a Writer for the given connection, which writes once size
+// bytes are gathered, or DefaultWriterSize if size is 0 or less, and once the
+// oldest message has waited for delay.  A delay of 0 or less holds messages
+// until Flush is called or the size is reached.
+func NewWriter(w io.Writer, size int, delay time.Duration) *Writer {
+	if size <= 0 {
+		size = DefaultWriterSize
+	}
+	return &Writer{
+		w:     w,
+		size:  size,
+		delay: delay,
+		buf:   make([]byte, 0, size+3+DefaultSlinChunkSize),
+	}
+}
+
+// WriteMessage adds a message
+func (w *Writer) WriteMessage(m Message) error {
+	_, err := w.Write(m)
+	return err
+}
+
+// Write adds p, which should hold whole messages, so that the Writer may be
+// used in place of the connection by SendSlinChunks, ChunkSender or
+// PlayPrompt.  If it holds part of a message, the messages which other
+// goroutines add may come between its parts.
+func (w *Writer) Write(p []byte) (int, error) {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	if w.err != nil {
+		return 0, w.err
+	}
+	w.buf = append(w.buf, p...)
+	return len(p), w.added()
+}
+
+// Append adds a message of the given kind and payload, building it in the
+// buffer of the Writer rather than in a Message of its own
+func (w *Writer) Append(kind Kind, payload []byte) error {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	if w.err != nil {
+		return w.err
+	}
+	w.buf = AppendMessage(w.buf, kind, payload)
+	return w.added()
+}
+
+// AppendSlin adds a message of signed linear audio data, as Append does
+func (w *Writer) AppendSlin(pcm []byte) error {
+	return w.Append(KindSlin, pcm)
+}
+
+// Flush writes whatever messages have been gathered
+func (w *Writer) Flush() error {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	if w.err != nil {
+		return w.err
+	}
+	return w.flush()
+}
+
+// Buffered returns the number of bytes gathered and not yet written
+func (w *Writer) Buffered() int {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	return len(w.buf)
+}
+
+// added writes the buffer if it has reached the size of the Writer, or else
+// makes sure that it is written once the oldest message has waited for the
+// delay.  The lock must be held.
+func (w *Writer) added() error {
+	if len(w.buf) >= w.size {
+		return w.flush()
+	}
+	if w.delay <= 0 || !w.since.IsZero() {
+		return nil
+	}
+
+	w.since = time.Now()
+	if w.timer == nil {
+		w.timer = time.AfterFunc(w.delay, w.expire)
+	} else {
+		w.timer.Reset(w.delay)
+	}
+	return nil
+}
+
+// expire writes the buffer once the oldest message has waited for the delay
+func (w *Writer) expire() {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	if w.since.IsZero() || w.err != nil {
+		// Written since the timer was set
+		return
+	}
+	if wait := w.delay - time.Since(w.since); wait > 0 {
+		// The timer was set for an earlier batch
+		w.timer.Reset(wait)
+		return
+	}
+	w.flush() // nolint: errcheck
+}
+
+// flush writes the buffer.  The lock must be held.
+func (w *Writer) flush() error {
+	w.since = time.Time{}
+	if w.timer != nil {
+		w.timer.Stop()
+	}
+	if len(w.buf) == 0 {
+		return nil
+	}
+
+	_, err := w.w.Write(w.buf)
+	w.buf = w.buf[:0]
+	if err != nil {
+		w.err = errors.Wrap(err, "failed to write messages")
+	}
+	return w.err
+}
@@ -0,0 +1,191 @@
+package audiosocket
+
+import (
+	"bytes"
+	"errors"
+	"sync"
+	"testing"
+	"time"
+)
+
+// recordWriter records each write made to it
+type recordWriter struct {
+	mu     sync.Mutex
+	writes [][]byte
+	err    error
+}
+
+func (w *recordWriter) Write(p []byte) (int, error) {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	if w.err != nil {
+		return 0, w.err
+	}
+	w.writes = append(w.writes, append([]byte(nil), p...))
+	return len(p), nil
+}
+
+func (w *recordWriter) get() [][]byte {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+
+	return append([][]byte(nil), w.writes...)
+}
+
+func TestWriterSize(t *testing.T) {
+	a, b, c := SlinMessage([]byte{1, 2}), SlinMessage([]byte{3, 4}), HangupMessage()
+
+	rec := &recordWriter{}
+	w := NewWriter(rec, len(a)+len(b), 0)
+
+	if err := w.AppendSlin([]byte{1, 2}); err != nil {
+		t.Fatal(err)
+	}
+	if n := len(rec.get()); n != 0 || w.Buffered() != len(a) {
+		t.Fatalf("%d writes and %d bytes held before the size was reached", n, w.Buffered())
+	}
+	if err := w.WriteMessage(b); err != nil {
+		t.Fatal(err)
+	}
+	writes := rec.get()
+	if len(writes) != 1 || !bytes.Equal(writes[0], append(append(Message(nil), a...), b...)) {
+		t.Fatalf("got writes %x, want one of both messages", writes)
+	}
+	if w.Buffered() != 0 {
+		t.Errorf("%d bytes held after writing", w.Buffered())
+	}
+
+	// Without a delay, what is left waits for Flush
+	if _, err := w.Write(c); err != nil {
+		t.Fatal(err)
+	}
+	time.Sleep(10 * time.Millisecond)
+	if n := len(rec.get()); n != 1 {
+		t.Fatalf("%d writes before Flush, want 1", n)
+	}
+	if err := w.Flush(); err != nil {
+		t.Fatal(err)
+	}
+	if err := w.Flush(); err != nil {
+		t.Fatal(err)
+	}
+	if writes = rec.get(); len(writes) != 2 || !bytes.Equal(writes[1], c) {
+		t.Fatalf("got writes %x, want the hangup written once", writes)
+	}
+}
+
+func TestWriterDelay(t *testing.T) {
+	const delay = 20 * time.Millisecond
+
+	rec := &recordWriter{}
+	w := NewWriter(rec, 0, delay)
+
+	for batch := 1; batch <= 2; batch++ {
+		start := time.Now()
+		if err := w.AppendSlin([]byte{byte(batch)}); err != nil {
+			t.Fatal(err)
+		}
+		if err := w.AppendSlin([]byte{byte(batch)}); err != nil {
+			t.Fatal(err)
+		}
+		if n := len(rec.get()); n != batch-1 {
+			t.Fatalf("batch %d: %d writes before the delay", batch, n)
+		}
+
+		waitFor(t, "the delay to pass", func() bool {
+			return len(rec.get()) == batch
+		})
+		if waited := time.Since(start); waited < delay {
+			t.Errorf("batch %d: written after %v, want at least %v", batch, waited, delay)
+		}
+		m := SlinMessage([]byte{byte(batch)})
+		if got := rec.get()[batch-1]; !bytes.Equal(got, append(append(Message(nil), m...), m...)) {
+			t.Errorf("batch %d: wrote %x", batch, got)
+		}
+	}
+
+	// A batch written by Flush is not written again when its timer fires
+	if err := w.AppendSlin([]byte{3}); err != nil {
+		t.Fatal(err)
+	}
+	if err := w.Flush(); err != nil {
+		t.Fatal(err)
+	}
+	time.Sleep(2 * delay)
+	if n := len(rec.get()); n != 3 {
+		t.Errorf("%d writes, want 3", n)
+	}
+}
+
+func TestWriterError(t *testing.T) {
+	failed := errors.New("broken")
+	rec := &recordWriter{err: failed}
+	w := NewWriter(rec, 0, 0)
+
+	if err := w.AppendSlin([]byte{1, 2}); err != nil {
+		t.Fatal(err)
+	}
+	if err := w.Flush(); err == nil {
+		t.Fatal("Flush succeeded on a broken connection")
+	}
+
+	// Every later call fails the same way, without writing
+	rec.err = nil
+	if err := w.AppendSlin([]byte{1, 2}); err == nil {
+		t.Error("Append succeeded after a write failed")
+	}
+	if _, err := w.Write(HangupMessage()); err == nil {
+		t.Error("Write succeeded after a write failed")
+	}
+	if err := w.Flush(); err == nil {
+		t.Error("Flush succeeded after a write failed")
+	}
+	if n := len(rec.get()); n != 0 {
+		t.Errorf("%d writes after a write failed", n)
+	}
+}
+
+func TestWriterConcurrent(t *testing.T) {
+	const writers, messages = 8, 100
+
+	rec := &recordWriter{}
+	w := NewWriter(rec, 0, time.Millisecond)
+
+	var wg sync.WaitGroup
+	for i := 0; i < writers; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			for j := 0; j < messages; j++ {
+				w.Append(KindSlin, []byte{byte(i), byte(j)}) // nolint: errcheck
+			}
+		}(i)
+	}
+	wg.Wait()
+	if err := w.Flush(); err != nil {
+		t.Fatal(err)
+	}
+
+	// Every message arrives whole, and each writer's in order
+	var all []byte
+	for _, p := range rec.get() {
+		all = append(all, p...)
+	}
+	r := NewReader(bytes.NewReader(all))
+	next := make([]int, writers)
+	for n := 0; n < writers*messages; n++ {
+		m, err := r.ReadMessage()
+		if err != nil {
+			t.Fatalf("message %d: %v", n, err)
+		}
+		p := m.Payload()
+		if len(p) != 2 || int(p[0]) >= writers || int(p[1]) != next[p[0]] {
+			t.Fatalf("message %d: unexpected %x", n, m)
+		}
+		next[p[0]]++
+	}
+	if _, err := r.ReadMessage(); err == nil {
+		t.Error("more was written than was added")
+	}
+}